@@ -0,0 +1,71 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Benchmarks of the DNS MX answer parser.
+ *
+ * The answers are canned so no network access is required. The number
+ * of records goes from one (a small domain) to ten (a large provider).
+ */
+
+// self
+//
+#include    "fixtures.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/dns_resolver.h>
+
+
+// benchmark
+//
+#include    <benchmark/benchmark.h>
+
+
+
+namespace
+{
+
+
+
+void dns_parse_mx_response(benchmark::State & state)
+{
+    std::uint16_t const id(0x1234);
+    std::string const answer(bench::make_mx_response(id, "mail.example.com", state.range(0)));
+    std::uint8_t const * data(reinterpret_cast<std::uint8_t const *>(answer.data()));
+    for(auto _ : state)
+    {
+        libmimemail::dns_mx_response response;
+        if(!libmimemail::dns_resolver::parse_mx_response(data, answer.length(), id, response)
+        || response.get_mail_exchangers().size() != static_cast<std::size_t>(state.range(0)))
+        {
+            state.SkipWithError("parse_mx_response() rejected the canned answer");
+            break;
+        }
+        benchmark::DoNotOptimize(response);
+    }
+    state.SetBytesProcessed(state.iterations() * answer.length());
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(dns_parse_mx_response)->Arg(1)->Arg(2)->Arg(10);
+
+
+
+} // no name namespace
+// vim: ts=4 sw=4 et
@@ -0,0 +1,359 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Benchmarks of the email object.
+ *
+ * These measure the life of an email: building it, saving it with the
+ * brs serializer and with the binary spool format, loading it back and
+ * rendering it to a sink which discards the output.
+ *
+ * Each benchmark runs against every email mix; the mix name is used as
+ * the label so the JSON output can be grouped per mix.
+ */
+
+// self
+//
+#include    "fixtures.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/binary_spool.h>
+#include    <libmimemail/blob_store.h>
+#include    <libmimemail/email_batch.h>
+
+
+// benchmark
+//
+#include    <benchmark/benchmark.h>
+
+
+// C++
+//
+#include    <atomic>
+#include    <filesystem>
+#include    <sstream>
+#include    <vector>
+
+
+// C
+//
+#include    <stdlib.h>
+
+
+
+namespace
+{
+
+
+
+bench::email_mix_t get_mix(benchmark::State const & state)
+{
+    return static_cast<bench::email_mix_t>(state.range(0));
+}
+
+
+void all_mixes(benchmark::internal::Benchmark * b)
+{
+    b->Arg(static_cast<int>(bench::email_mix_t::EMAIL_MIX_SMALL_HTML));
+    b->Arg(static_cast<int>(bench::email_mix_t::EMAIL_MIX_LARGE_HTML));
+    b->Arg(static_cast<int>(bench::email_mix_t::EMAIL_MIX_RELATED_IMAGES));
+    b->Arg(static_cast<int>(bench::email_mix_t::EMAIL_MIX_BINARY_ATTACHMENTS));
+}
+
+
+std::string brs_serialize(libmimemail::email const & e)
+{
+    std::stringstream buffer;
+    snapdev::serializer<std::stringstream> out(buffer);
+    e.serialize(out);
+    return buffer.str();
+}
+
+
+std::size_t render(libmimemail::email const & e)
+{
+    bench::null_mime_sink sink;
+    libmimemail::mime_writer writer(sink);
+    libmimemail::envelope env;
+    writer.write_email(e, env);
+    return sink.get_size();
+}
+
+
+void email_build(benchmark::State & state)
+{
+    bench::email_mix_t const mix(get_mix(state));
+    for(auto _ : state)
+    {
+        libmimemail::email e(bench::make_email(mix));
+        benchmark::DoNotOptimize(e);
+    }
+    state.SetLabel(bench::email_mix_name(mix));
+}
+BENCHMARK(email_build)->Apply(all_mixes);
+
+
+void email_brs_serialize(benchmark::State & state)
+{
+    bench::email_mix_t const mix(get_mix(state));
+    libmimemail::email const e(bench::make_email(mix));
+    std::size_t size(0);
+    for(auto _ : state)
+    {
+        std::string const data(brs_serialize(e));
+        size = data.length();
+        benchmark::DoNotOptimize(data.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetLabel(bench::email_mix_name(mix));
+}
+BENCHMARK(email_brs_serialize)->Apply(all_mixes);
+
+
+void email_brs_deserialize(benchmark::State & state)
+{
+    bench::email_mix_t const mix(get_mix(state));
+    std::string const data(brs_serialize(bench::make_email(mix)));
+    for(auto _ : state)
+    {
+        std::stringstream buffer(data);
+        snapdev::deserializer<std::stringstream> in(buffer);
+        libmimemail::email e;
+        e.deserialize(in);
+        benchmark::DoNotOptimize(e);
+    }
+    state.SetBytesProcessed(state.iterations() * data.length());
+    state.SetLabel(bench::email_mix_name(mix));
+}
+BENCHMARK(email_brs_deserialize)->Apply(all_mixes);
+
+
+void email_binary_serialize(benchmark::State & state)
+{
+    bench::email_mix_t const mix(get_mix(state));
+    libmimemail::email const e(bench::make_email(mix));
+    std::size_t size(0);
+    for(auto _ : state)
+    {
+        // the writer only references the attachment data, to_string()
+        // is where the bytes get copied, as when saving to a spool
+        //
+        libmimemail::binary_spool_writer out;
+        e.serialize(out);
+        std::string const data(out.to_string());
+        size = data.length();
+        benchmark::DoNotOptimize(data.data());
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetLabel(bench::email_mix_name(mix));
+}
+BENCHMARK(email_binary_serialize)->Apply(all_mixes);
+
+
+void email_binary_deserialize(benchmark::State & state)
+{
+    bench::email_mix_t const mix(get_mix(state));
+    bool const headers_only(state.range(1) != 0);
+    libmimemail::binary_spool_writer out;
+    bench::make_email(mix).serialize(out);
+    libmimemail::binary_spool_buffer::pointer_t buffer(
+                libmimemail::binary_spool_buffer::from_string(out.to_string()));
+    for(auto _ : state)
+    {
+        libmimemail::binary_spool_reader in(buffer);
+        libmimemail::email e;
+        if(!e.deserialize(in, headers_only))
+        {
+            state.SkipWithError("binary deserialization failed");
+            break;
+        }
+        benchmark::DoNotOptimize(e);
+    }
+    state.SetBytesProcessed(state.iterations() * buffer->get_data().length());
+    state.SetLabel(std::string(bench::email_mix_name(mix))
+                            + (headers_only ? "/headers_only" : "/full"));
+}
+BENCHMARK(email_binary_deserialize)
+    ->ArgsProduct({
+          {
+              static_cast<int>(bench::email_mix_t::EMAIL_MIX_SMALL_HTML),
+              static_cast<int>(bench::email_mix_t::EMAIL_MIX_LARGE_HTML),
+              static_cast<int>(bench::email_mix_t::EMAIL_MIX_RELATED_IMAGES),
+              static_cast<int>(bench::email_mix_t::EMAIL_MIX_BINARY_ATTACHMENTS),
+          },
+          { 0, 1 },
+      });
+
+
+// the attachments saved in a blob_store have to be found again when
+// the email was first loaded headers only and the attachments later
+//
+void email_binary_blob_headers_only(benchmark::State & state)
+{
+    char path[] = "/tmp/libmimemail_bench_blobs_XXXXXX";
+    if(mkdtemp(path) == nullptr)
+    {
+        state.SkipWithError("could not create the blob_store directory");
+        return;
+    }
+    libmimemail::blob_store::pointer_t store(std::make_shared<libmimemail::blob_store>(path));
+    if(!store->open())
+    {
+        state.SkipWithError("could not open the blob_store");
+        std::filesystem::remove_all(path);
+        return;
+    }
+
+    libmimemail::email const original(bench::make_email(bench::email_mix_t::EMAIL_MIX_BINARY_ATTACHMENTS));
+    libmimemail::binary_spool_writer out;
+    out.set_blob_store(store);
+    original.serialize(out);
+    libmimemail::binary_spool_buffer::pointer_t buffer(
+                libmimemail::binary_spool_buffer::from_string(out.to_string()));
+    if(store->get_keys().empty())
+    {
+        state.SkipWithError("no attachment was saved in the blob_store");
+    }
+
+    for(auto _ : state)
+    {
+        libmimemail::binary_spool_reader in(buffer);
+        in.set_blob_store(store);
+        libmimemail::email e;
+        if(!e.deserialize(in, true))
+        {
+            state.SkipWithError("binary deserialization failed");
+            break;
+        }
+        try
+        {
+            int const max(original.get_attachment_count());
+            bool valid(e.get_attachment_count() == max);
+            for(int idx(0); valid && idx < max; ++idx)
+            {
+                valid = e.get_attachment(idx).get_data_view()
+                            == original.get_attachment(idx).get_data_view();
+            }
+            if(!valid)
+            {
+                state.SkipWithError("the attachments loaded from the blob_store differ");
+                break;
+            }
+        }
+        catch(libmimemail::libmimemail_exception const & ex)
+        {
+            state.SkipWithError(ex.what());
+            break;
+        }
+        benchmark::DoNotOptimize(e);
+    }
+    state.SetBytesProcessed(state.iterations() * buffer->get_data().length());
+
+    std::filesystem::remove_all(path);
+}
+BENCHMARK(email_binary_blob_headers_only);
+
+
+void email_render(benchmark::State & state)
+{
+    bench::email_mix_t const mix(get_mix(state));
+    libmimemail::email const e(bench::make_email(mix));
+    std::size_t size(0);
+    for(auto _ : state)
+    {
+        size = render(e);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetLabel(bench::email_mix_name(mix));
+}
+BENCHMARK(email_render)->Apply(all_mixes);
+
+
+// copy_filename_to_content_type() is private to the mime_writer so it
+// gets measured by rendering an email with many named attachments
+//
+void email_render_filenames(benchmark::State & state)
+{
+    libmimemail::email const e(bench::make_email_with_filenames(state.range(0)));
+    std::size_t size(0);
+    for(auto _ : state)
+    {
+        size = render(e);
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(email_render_filenames)->Arg(1)->Arg(16)->Arg(128);
+
+
+// render_parallel() of copies of one email (they share their attachment
+// data) with a few invalid emails; this also checks that each email gets
+// rendered exactly once, build with -fsanitize=thread to check the
+// thread safety guarantees of the email class
+//
+void email_render_parallel(benchmark::State & state)
+{
+    constexpr std::size_t const count = 1000;
+    constexpr std::size_t const invalid_step = 100;
+
+    libmimemail::email const valid(bench::make_email(bench::email_mix_t::EMAIL_MIX_SMALL_HTML));
+    std::vector<libmimemail::email> emails(count, valid);
+    for(std::size_t idx(invalid_step - 1); idx < count; idx += invalid_step)
+    {
+        emails[idx] = libmimemail::email();
+    }
+
+    std::size_t size(0);
+    for(auto _ : state)
+    {
+        std::vector<std::string> messages(count);
+        std::vector<std::atomic<int>> calls(count);
+        std::vector<libmimemail::envelope> const envelopes(libmimemail::render_parallel(
+                  emails
+                , [&messages, &calls](std::size_t index)
+                {
+                    ++calls[index];
+                    return std::make_shared<libmimemail::buffer_mime_sink>(messages[index]);
+                }
+                , state.range(0)));
+
+        size = 0;
+        for(std::size_t idx(0); idx < count; ++idx)
+        {
+            bool const is_valid((idx + 1) % invalid_step != 0);
+            if(calls[idx] != 1
+            || envelopes[idx].get_recipients().empty() == is_valid
+            || (is_valid && messages[idx].empty()))
+            {
+                state.SkipWithError("render_parallel() did not render each email exactly once");
+                return;
+            }
+            size += messages[idx].length();
+        }
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    state.SetItemsProcessed(state.iterations() * count);
+}
+BENCHMARK(email_render_parallel)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->UseRealTime();
+
+
+
+} // no name namespace
+// vim: ts=4 sw=4 et
@@ -0,0 +1,195 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Benchmarks of the content transfer encodings.
+ *
+ * The quoted-printable functions run against HTML (mostly ASCII with a
+ * few UTF-8 characters and '=' signs) and the base64 functions against
+ * random binary data.
+ *
+ * The edhttp quoted-printable encoder runs on the same inputs as a
+ * baseline, and qp_identity verifies that both encoders generate the
+ * exact same output.
+ */
+
+// self
+//
+#include    "fixtures.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/base64.h>
+#include    <libmimemail/quoted_printable.h>
+
+
+// edhttp
+//
+#include    <edhttp/quoted_printable.h>
+
+
+// benchmark
+//
+#include    <benchmark/benchmark.h>
+
+
+// C++
+//
+#include    <vector>
+
+
+
+namespace
+{
+
+
+
+int const g_qp_flags[] =
+{
+    edhttp::QUOTED_PRINTABLE_FLAG_LFONLY,
+    edhttp::QUOTED_PRINTABLE_FLAG_LFONLY | edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD,
+};
+
+
+// the HTML documents used by the other benchmarks plus a plain text
+// with the cases the HTML does not have (lone periods, trailing spaces,
+// long lines, CRLF)
+//
+std::vector<std::string> make_qp_corpus()
+{
+    std::vector<std::string> corpus;
+    corpus.push_back(bench::make_html(4 * 1024));
+    corpus.push_back(bench::make_html(200 * 1024));
+    corpus.push_back(
+          "Hello,\n"
+          ".\n"
+          "A line ending with spaces   \n"
+          "A line ending with a tab\t\n"
+          "\n"
+          ". and a period at the start\n"
+          + std::string(200, 'x')
+          + "\r\n"
+            "caf\xC3\xA9 = 100%\r\n"
+            ".");
+    return corpus;
+}
+
+
+void qp_encode(benchmark::State & state)
+{
+    std::string const html(bench::make_html(state.range(0)));
+    for(auto _ : state)
+    {
+        std::string const encoded(libmimemail::quoted_printable_encode(
+                      html
+                    , edhttp::QUOTED_PRINTABLE_FLAG_LFONLY
+                    | edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD));
+        benchmark::DoNotOptimize(encoded.data());
+    }
+    state.SetBytesProcessed(state.iterations() * html.length());
+}
+BENCHMARK(qp_encode)->Arg(4 * 1024)->Arg(200 * 1024);
+
+
+void edhttp_qp_encode(benchmark::State & state)
+{
+    std::string const html(bench::make_html(state.range(0)));
+    for(auto _ : state)
+    {
+        std::string const encoded(edhttp::quoted_printable_encode(
+                      html
+                    , edhttp::QUOTED_PRINTABLE_FLAG_LFONLY
+                    | edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD));
+        benchmark::DoNotOptimize(encoded.data());
+    }
+    state.SetBytesProcessed(state.iterations() * html.length());
+}
+BENCHMARK(edhttp_qp_encode)->Arg(4 * 1024)->Arg(200 * 1024);
+
+
+void qp_identity(benchmark::State & state)
+{
+    std::vector<std::string> const corpus(make_qp_corpus());
+    std::size_t size(0);
+    for(auto _ : state)
+    {
+        for(auto const & input : corpus)
+        {
+            for(auto const flags : g_qp_flags)
+            {
+                if(libmimemail::quoted_printable_encode(input, flags)
+                        != edhttp::quoted_printable_encode(input, flags))
+                {
+                    state.SkipWithError("libmimemail and edhttp quoted-printable outputs differ");
+                    return;
+                }
+            }
+            size += input.length() * std::size(g_qp_flags);
+        }
+    }
+    state.SetBytesProcessed(size);
+}
+BENCHMARK(qp_identity);
+
+
+void qp_decode(benchmark::State & state)
+{
+    std::string const encoded(libmimemail::quoted_printable_encode(
+                  bench::make_html(state.range(0))
+                , edhttp::QUOTED_PRINTABLE_FLAG_LFONLY));
+    for(auto _ : state)
+    {
+        std::string const decoded(libmimemail::quoted_printable_decode(encoded));
+        benchmark::DoNotOptimize(decoded.data());
+    }
+    state.SetBytesProcessed(state.iterations() * encoded.length());
+}
+BENCHMARK(qp_decode)->Arg(4 * 1024)->Arg(200 * 1024);
+
+
+void base64_encode(benchmark::State & state)
+{
+    std::string const data(bench::make_binary(state.range(0)));
+    for(auto _ : state)
+    {
+        std::string const encoded(libmimemail::base64_encoder::encode(data));
+        benchmark::DoNotOptimize(encoded.data());
+    }
+    state.SetBytesProcessed(state.iterations() * data.length());
+}
+BENCHMARK(base64_encode)->Arg(24 * 1024)->Arg(1024 * 1024);
+
+
+void base64_decode(benchmark::State & state)
+{
+    std::string const encoded(libmimemail::base64_encoder::encode(
+                bench::make_binary(state.range(0))));
+    for(auto _ : state)
+    {
+        std::string const decoded(libmimemail::base64_decode(encoded));
+        benchmark::DoNotOptimize(decoded.data());
+    }
+    state.SetBytesProcessed(state.iterations() * encoded.length());
+}
+BENCHMARK(base64_decode)->Arg(24 * 1024)->Arg(1024 * 1024);
+
+
+
+} // no name namespace
+// vim: ts=4 sw=4 et
@@ -0,0 +1,357 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Fixtures shared by the libmimemail benchmarks.
+ *
+ * The emails built here try to look like what a website sends: a small
+ * newsletter, a long HTML report, an HTML message with inline images,
+ * and a short message with a few binary attachments. The content is
+ * generated with a fixed seed so each run measures the same bytes.
+ */
+
+// self
+//
+#include    "fixtures.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/dns_resolver.h>
+
+
+// C++
+//
+#include    <random>
+
+
+// C
+//
+#include    <sys/uio.h>
+
+
+
+namespace bench
+{
+
+
+
+namespace
+{
+
+
+
+char const * const g_words[] =
+{
+    "lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing",
+    "elit", "sed", "do", "eiusmod", "tempor", "incididunt", "ut", "labore",
+    "et", "dolore", "magna", "aliqua", "caf\xC3\xA9", "na\xC3\xAFve", "=",
+};
+
+
+void append_name(std::string & out, std::string const & domain)
+{
+    std::string::size_type start(0);
+    for(;;)
+    {
+        std::string::size_type const end(domain.find('.', start));
+        std::string const label(domain.substr(start, end - start));
+        out += static_cast<char>(label.length());
+        out += label;
+        if(end == std::string::npos)
+        {
+            break;
+        }
+        start = end + 1;
+    }
+    out += '\0';
+}
+
+
+void append_uint16(std::string & out, std::uint16_t value)
+{
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+
+void append_uint32(std::string & out, std::uint32_t value)
+{
+    append_uint16(out, static_cast<std::uint16_t>(value >> 16));
+    append_uint16(out, static_cast<std::uint16_t>(value));
+}
+
+
+libmimemail::attachment make_binary_attachment(
+      std::string const & filename
+    , std::string const & mime_type
+    , std::size_t size)
+{
+    libmimemail::attachment a;
+    a.base64_encode_and_set_data(make_binary(size), mime_type);
+    a.set_content_disposition(filename, 1600000000);
+    return a;
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Get the name of a mix, used as the benchmark label.
+ *
+ * \param[in] mix  The mix of which the name is wanted.
+ *
+ * \return The name of the mix.
+ */
+char const * email_mix_name(email_mix_t mix)
+{
+    switch(mix)
+    {
+    case email_mix_t::EMAIL_MIX_SMALL_HTML:
+        return "small_html";
+
+    case email_mix_t::EMAIL_MIX_LARGE_HTML:
+        return "large_html";
+
+    case email_mix_t::EMAIL_MIX_RELATED_IMAGES:
+        return "related_images";
+
+    case email_mix_t::EMAIL_MIX_BINARY_ATTACHMENTS:
+        return "binary_attachments";
+
+    }
+
+    return "unknown";
+}
+
+
+/** \brief Build one of the email mixes.
+ *
+ * \param[in] mix  The kind of email to build.
+ *
+ * \return The email, ready to be rendered or serialized.
+ */
+libmimemail::email make_email(email_mix_t mix)
+{
+    libmimemail::email e;
+    e.set_from("Newsletter <news@example.com>");
+    e.set_to("Alexis Doe <alexis@example.org>");
+    e.set_subject("Your weekly digest \xE2\x80\x94 issue #42");
+    e.add_header("Reply-To", "support@example.com");
+    e.add_header("List-Unsubscribe", "<https://example.com/unsubscribe?id=1234567890>");
+
+    libmimemail::attachment body;
+    switch(mix)
+    {
+    case email_mix_t::EMAIL_MIX_SMALL_HTML:
+        body.quoted_printable_encode_and_set_data(make_html(4 * 1024), "text/html");
+        e.set_body_attachment(body);
+        break;
+
+    case email_mix_t::EMAIL_MIX_LARGE_HTML:
+        body.quoted_printable_encode_and_set_data(make_html(200 * 1024), "text/html");
+        e.set_body_attachment(body);
+        break;
+
+    case email_mix_t::EMAIL_MIX_RELATED_IMAGES:
+        body.quoted_printable_encode_and_set_data(make_html(16 * 1024), "text/html");
+        for(int idx(0); idx < 4; ++idx)
+        {
+            libmimemail::attachment image(make_binary_attachment(
+                      "image-" + std::to_string(idx) + ".png"
+                    , "image/png"
+                    , 24 * 1024));
+            image.add_header("Content-ID", "<image-" + std::to_string(idx) + "@example.com>");
+            body.add_related(image);
+        }
+        e.set_body_attachment(body);
+        break;
+
+    case email_mix_t::EMAIL_MIX_BINARY_ATTACHMENTS:
+        body.quoted_printable_encode_and_set_data(
+                  "Hi,\n\nplease find the documents attached.\n\nThank you.\n"
+                , "text/plain");
+        e.set_body_attachment(body);
+        e.add_attachment(make_binary_attachment("invoice.pdf", "application/pdf", 180 * 1024));
+        e.add_attachment(make_binary_attachment("photo.jpg", "image/jpeg", 600 * 1024));
+        e.add_attachment(make_binary_attachment("archive.zip", "application/zip", 250 * 1024));
+        break;
+
+    }
+
+    return e;
+}
+
+
+/** \brief Build an email with many small named attachments.
+ *
+ * The mime_writer copies the filename of the Content-Disposition to the
+ * Content-Type of each attachment. This email makes that step a
+ * measurable part of the rendering.
+ *
+ * \param[in] count  The number of attachments to add.
+ *
+ * \return The email with \p count attachments.
+ */
+libmimemail::email make_email_with_filenames(std::size_t count)
+{
+    libmimemail::email e(make_email(email_mix_t::EMAIL_MIX_SMALL_HTML));
+    for(std::size_t idx(0); idx < count; ++idx)
+    {
+        e.add_attachment(make_binary_attachment(
+                  "report \"" + std::to_string(idx) + "\" r\xC3\xA9sum\xC3\xA9.txt"
+                , "text/plain; charset=utf-8"
+                , 64));
+    }
+    return e;
+}
+
+
+/** \brief Generate an HTML document of about \p size bytes.
+ *
+ * \param[in] size  The approximate size of the document.
+ *
+ * \return The HTML document.
+ */
+std::string make_html(std::size_t size)
+{
+    std::mt19937 generator(42);
+    std::uniform_int_distribution<std::size_t> word(0, std::size(g_words) - 1);
+
+    std::string html("<html><head><title>Digest</title></head><body>\n");
+    html.reserve(size + 256);
+    while(html.length() < size)
+    {
+        html += "<p>";
+        for(int idx(0); idx < 40; ++idx)
+        {
+            if(idx % 13 == 5)
+            {
+                html += "<a href=\"https://example.com/article/";
+                html += std::to_string(generator() % 10000);
+                html += "\">";
+                html += g_words[word(generator)];
+                html += "</a> ";
+            }
+            else
+            {
+                html += g_words[word(generator)];
+                html += ' ';
+            }
+        }
+        html += "</p>\n";
+    }
+    html += "</body></html>\n";
+    return html;
+}
+
+
+/** \brief Generate \p size bytes of random binary data.
+ *
+ * \param[in] size  The number of bytes to generate.
+ *
+ * \return The binary data.
+ */
+std::string make_binary(std::size_t size)
+{
+    std::mt19937 generator(static_cast<std::mt19937::result_type>(size));
+    std::string data(size, '\0');
+    for(auto & c : data)
+    {
+        c = static_cast<char>(generator());
+    }
+    return data;
+}
+
+
+/** \brief Build the wire format of a DNS MX answer.
+ *
+ * The answer has one question and \p count MX records. The exchange
+ * names use a compression pointer to the question name as a real
+ * server's answer would.
+ *
+ * \param[in] id  The identifier of the query being answered.
+ * \param[in] domain  The domain in the question.
+ * \param[in] count  The number of MX records.
+ *
+ * \return The DNS answer.
+ */
+std::string make_mx_response(
+      std::uint16_t id
+    , std::string const & domain
+    , std::size_t count)
+{
+    std::string out;
+    append_uint16(out, id);
+    append_uint16(out, 0x8180);     // QR, RD, RA, NOERROR
+    append_uint16(out, 1);
+    append_uint16(out, static_cast<std::uint16_t>(count));
+    append_uint16(out, 0);
+    append_uint16(out, 0);
+
+    append_name(out, domain);
+    append_uint16(out, libmimemail::dns_resolver::DNS_TYPE_MX);
+    append_uint16(out, 1);          // IN
+
+    for(std::size_t idx(0); idx < count; ++idx)
+    {
+        std::string const label("mx" + std::to_string(idx));
+
+        append_uint16(out, 0xC00C);     // pointer to the question name
+        append_uint16(out, libmimemail::dns_resolver::DNS_TYPE_MX);
+        append_uint16(out, 1);
+        append_uint32(out, 3600 - static_cast<std::uint32_t>(idx));
+        append_uint16(out, static_cast<std::uint16_t>(2 + 1 + label.length() + 2));
+        append_uint16(out, static_cast<std::uint16_t>(10 * (idx + 1)));
+        out += static_cast<char>(label.length());
+        out += label;
+        append_uint16(out, 0xC00C);
+    }
+
+    return out;
+}
+
+
+/** \brief Count the bytes without keeping them.
+ *
+ * \param[in] iov  The buffers to "write".
+ * \param[in] count  The number of buffers.
+ *
+ * \return Always true.
+ */
+bool null_mime_sink::write(iovec const * iov, int count)
+{
+    for(int idx(0); idx < count; ++idx)
+    {
+        f_size += iov[idx].iov_len;
+    }
+    return true;
+}
+
+
+std::size_t null_mime_sink::get_size() const
+{
+    return f_size;
+}
+
+
+
+} // namespace bench
+// vim: ts=4 sw=4 et
@@ -0,0 +1,71 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// libmimemail
+//
+#include    <libmimemail/mime_writer.h>
+
+
+// C++
+//
+#include    <string>
+
+
+
+namespace bench
+{
+
+
+
+enum class email_mix_t
+{
+    EMAIL_MIX_SMALL_HTML,           // newsletter like, HTML + text, ~4Kb
+    EMAIL_MIX_LARGE_HTML,           // long HTML body, ~200Kb
+    EMAIL_MIX_RELATED_IMAGES,       // HTML with 4 inline images
+    EMAIL_MIX_BINARY_ATTACHMENTS,   // short text with 3 binary attachments (~1Mb)
+};
+
+
+char const *                email_mix_name(email_mix_t mix);
+libmimemail::email          make_email(email_mix_t mix);
+libmimemail::email          make_email_with_filenames(std::size_t count);
+std::string                 make_html(std::size_t size);
+std::string                 make_binary(std::size_t size);
+std::string                 make_mx_response(
+                                  std::uint16_t id
+                                , std::string const & domain
+                                , std::size_t count);
+
+
+class null_mime_sink
+    : public libmimemail::mime_sink
+{
+public:
+    virtual bool            write(iovec const * iov, int count) override;
+
+    std::size_t             get_size() const;
+
+private:
+    std::size_t             f_size = 0;
+};
+
+
+
+} // namespace bench
+// vim: ts=4 sw=4 et
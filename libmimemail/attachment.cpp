@@ -21,7 +21,9 @@
 //
 #include    "libmimemail/attachment.h"
 
+#include    "libmimemail/blob_store.h"
 #include    "libmimemail/exception.h"
+#include    "libmimemail/names.h"
 
 
 // edhttp
@@ -43,6 +45,11 @@
 #include    <snaplogger/message.h>
 
 
+// C++
+//
+#include    <fstream>
+
+
 // last include
 //
 #include    <snapdev/poison.h>
@@ -53,6 +60,55 @@ namespace libmimemail
 {
 
 
+namespace
+{
+
+
+
+std::string const g_empty_data = std::string();
+
+
+/** \brief Amount of data read to determine the MIME type of a file.
+ *
+ * The magic library only needs the start of a file to determine its
+ * type so we do not read the whole file.
+ */
+constexpr std::size_t const MIME_TYPE_DETECTION_SIZE = 64 * 1024;
+
+
+/** \brief How the data of an attachment is saved in a binary spool.
+ *
+ * A stable file is saved as a reference, like with the snapdev
+ * serializer. With a blob store, large data is saved as the key of
+ * the blob holding it (since version 2).
+ */
+enum binary_attachment_t : std::uint8_t
+{
+    BINARY_ATTACHMENT_DATA = 1,
+    BINARY_ATTACHMENT_FILE = 2,
+    BINARY_ATTACHMENT_BLOB = 3
+};
+
+
+/** \brief Determine the MIME type of a file.
+ *
+ * \param[in] path  The path to the file.
+ *
+ * \return The MIME type of the file.
+ */
+std::string get_file_mime_type(std::string const & path)
+{
+    std::ifstream in(path, std::ios::binary);
+    std::string start(MIME_TYPE_DETECTION_SIZE, '\0');
+    in.read(start.data(), start.length());
+    start.resize(in.gcount());
+    return edhttp::get_mime_type(start);
+}
+
+
+
+} // no name namespace
+
 
 //////////////////////
 // EMAIL ATTACHMENT //
@@ -72,6 +128,61 @@ attachment::attachment()
 }
 
 
+/** \brief Initialize an email attachment using the specified allocator.
+ *
+ * The headers and related attachments get allocated with \p alloc.
+ * This is used to build emails in an email_arena.
+ *
+ * \param[in] alloc  The allocator used by this attachment.
+ */
+attachment::attachment(allocator_type const & alloc)
+    : f_headers(alloc)
+    , f_sub_attachments(alloc)
+{
+}
+
+
+/** \brief Copy an email attachment using the specified allocator.
+ *
+ * The std::pmr containers call this constructor when an attachment gets
+ * added to them so the copy uses the memory of the container.
+ *
+ * \param[in] rhs  The attachment to copy.
+ * \param[in] alloc  The allocator used by the copy.
+ */
+attachment::attachment(attachment const & rhs, allocator_type const & alloc)
+    : f_headers(rhs.f_headers, alloc)
+    , f_payload(rhs.f_payload)
+    , f_is_sub_attachment(rhs.f_is_sub_attachment)
+    , f_sub_attachments(rhs.f_sub_attachments, alloc)
+    , f_last_header_name(rhs.f_last_header_name)
+{
+}
+
+
+/** \brief Move an email attachment using the specified allocator.
+ *
+ * The std::pmr containers call this constructor when they grow. Since
+ * the attachments of a container share its allocator, the headers and
+ * related attachments are moved, not copied. If \p alloc is not the
+ * allocator of \p rhs, they get copied, which may throw std::bad_alloc.
+ *
+ * The containers decide whether to move or copy on growth by checking
+ * the plain move constructor, which is noexcept.
+ *
+ * \param[in] rhs  The attachment to move.
+ * \param[in] alloc  The allocator used by the new attachment.
+ */
+attachment::attachment(attachment && rhs, allocator_type const & alloc)
+    : f_headers(std::move(rhs.f_headers), alloc)
+    , f_payload(std::move(rhs.f_payload))
+    , f_is_sub_attachment(rhs.f_is_sub_attachment)
+    , f_sub_attachments(std::move(rhs.f_sub_attachments), alloc)
+    , f_last_header_name(std::move(rhs.f_last_header_name))
+{
+}
+
+
 /** \brief Clean up an email attachment.
  *
  * This function is here primarily to have a clean virtual table.
@@ -81,6 +192,16 @@ attachment::~attachment()
 }
 
 
+/** \brief Get the allocator used by this attachment.
+ *
+ * \return The allocator of the headers and related attachments.
+ */
+attachment::allocator_type attachment::get_allocator() const
+{
+    return f_headers.get_allocator();
+}
+
+
 /** \brief The content of the binary file to attach to this email.
  *
  * This function is used to attach one binary file to the email.
@@ -118,14 +239,103 @@ attachment::~attachment()
  */
 void attachment::set_data(std::string const & data, std::string mime_type)
 {
-    f_data = data;
+    set_data_buffer(std::make_shared<std::string const>(data), mime_type);
+}
+
+
+/** \brief Set the content of the attachment by moving a buffer.
+ *
+ * This function is the same as the set_data() function using a constant
+ * reference, only it avoids a copy of the data.
+ *
+ * \param[in] data  The data to attach to this email.
+ * \param[in] mime_type  The MIME type of the data if known,
+ *                       otherwise leave empty.
+ */
+void attachment::set_data(std::string && data, std::string mime_type)
+{
+    set_data_buffer(std::make_shared<std::string const>(std::move(data)), mime_type);
+}
+
+
+/** \brief Set the content of the attachment from a shared buffer.
+ *
+ * When the same file gets attached to many emails (i.e. a campaign),
+ * create the buffer once and pass it to each attachment. The data does
+ * not get copied.
+ *
+ * \exception invalid_parameter
+ * The \p data pointer cannot be null.
+ *
+ * \param[in] data  The shared data to attach to this email.
+ * \param[in] mime_type  The MIME type of the data if known,
+ *                       otherwise leave empty.
+ */
+void attachment::set_data(attachment_payload::buffer_t data, std::string mime_type)
+{
+    if(data == nullptr)
+    {
+        throw invalid_parameter("attachment::set_data(): the data buffer cannot be a null pointer.");
+    }
+
+    set_data_buffer(data, mime_type);
+}
+
+
+/** \brief Set the content of the attachment from a file.
+ *
+ * The file is not loaded in memory. It gets memory mapped when the email
+ * gets rendered and its pages stream from there to the output. This is
+ * the preferred way to attach large files, especially when the same file
+ * gets attached to many emails.
+ *
+ * The file is expected to remain unchanged until the email was sent.
+ * As long as it does not change, serializing the attachment saves a
+ * reference to the file instead of its content.
+ *
+ * If the MIME type is not specified, the beginning of the file gets
+ * read to determine it.
+ *
+ * \param[in] path  The path to the file to attach.
+ * \param[in] mime_type  The MIME type of the data if known,
+ *                       otherwise leave empty.
+ *
+ * \return true if the file exists and was attached.
+ */
+bool attachment::set_data_from_file(std::string const & path, std::string mime_type)
+{
+    attachment_payload::pointer_t payload(attachment_payload::from_file(path, get_encoding()));
+    if(payload == nullptr)
+    {
+        return false;
+    }
+
+    f_payload = payload;
+    f_headers[HEADER_ID_CONTENT_TYPE] =
+                    mime_type.empty()
+                            ? get_file_mime_type(path)
+                            : mime_type;
+
+    return true;
+}
+
+
+/** \brief Save a new payload with the specified data.
+ *
+ * \param[in] data  The data to attach to this email.
+ * \param[in] mime_type  The MIME type of the data if known,
+ *                       otherwise leave empty.
+ */
+void attachment::set_data_buffer(attachment_payload::buffer_t data, std::string mime_type)
+{
+    f_payload = attachment_payload::from_data(data, get_encoding());
 
     // if user did not define the MIME type then ask the magic library
     if(mime_type.empty())
     {
-        mime_type = edhttp::get_mime_type(f_data);
+        mime_type = edhttp::get_mime_type(*data);
     }
-    f_headers[edhttp::g_name_edhttp_field_content_type] = mime_type;
+    f_headers[HEADER_ID_CONTENT_TYPE] = mime_type;
 }
 
 
@@ -158,12 +368,88 @@ void attachment::quoted_printable_encode_and_set_data(
                           , std::string const & mime_type
                           , int flags)
 {
-    std::string const encoded_data(edhttp::quoted_printable_encode(data, flags));
+    // the encoding is done the first time get_data() gets called; that
+    // way the raw data remains available (i.e. to convert HTML to text)
+    // without having to decode it back
+    //
+    f_payload = attachment_payload::from_raw_data(
+                          std::make_shared<std::string const>(data)
+                        , content_encoding_t::CONTENT_ENCODING_QUOTED_PRINTABLE
+                        , flags);
+
+    f_headers[HEADER_ID_CONTENT_TYPE] =
+                    mime_type.empty()
+                            ? edhttp::get_mime_type(data)
+                            : mime_type;
+
+    f_headers[HEADER_ID_CONTENT_TRANSFER_ENCODING] =
+                    edhttp::g_name_edhttp_param_quoted_printable;
+}
 
-    set_data(encoded_data, mime_type);
 
-    add_header(edhttp::g_name_edhttp_field_content_transfer_encoding
-             , edhttp::g_name_edhttp_param_quoted_printable);
+/** \brief Set the email attachment using base64 encoding.
+ *
+ * Binary data such as images, PDF files, archives, etc. are best sent
+ * base64 encoded. This function saves the data and marks the attachment
+ * as using the base64 Content-Transfer-Encoding. The actual encoding
+ * happens the first time the data is needed.
+ *
+ * \param[in] data  The data of this a attachment.
+ * \param[in] mime_type  The MIME type of the data, if left empty, it will
+ *            be determined on the fly.
+ */
+void attachment::base64_encode_and_set_data(
+                            std::string const & data
+                          , std::string const & mime_type)
+{
+    f_payload = attachment_payload::from_raw_data(
+                          std::make_shared<std::string const>(data)
+                        , content_encoding_t::CONTENT_ENCODING_BASE64);
+
+    f_headers[HEADER_ID_CONTENT_TYPE] =
+                    mime_type.empty()
+                            ? edhttp::get_mime_type(data)
+                            : mime_type;
+
+    f_headers[HEADER_ID_CONTENT_TRANSFER_ENCODING] =
+                    g_name_libmimemail_email_base64;
+}
+
+
+/** \brief Attach a file using base64 encoding.
+ *
+ * This function is similar to set_data_from_file(). The file gets base64
+ * encoded while the email gets rendered so neither the file nor its
+ * encoded version need to be loaded in memory.
+ *
+ * \param[in] path  The path to the file to attach.
+ * \param[in] mime_type  The MIME type of the data if known,
+ *                       otherwise leave empty.
+ *
+ * \return true if the file exists and was attached.
+ */
+bool attachment::base64_encode_and_set_data_from_file(
+                            std::string const & path
+                          , std::string const & mime_type)
+{
+    attachment_payload::pointer_t payload(attachment_payload::from_raw_file(
+                          path
+                        , content_encoding_t::CONTENT_ENCODING_BASE64));
+    if(payload == nullptr)
+    {
+        return false;
+    }
+
+    f_payload = payload;
+    f_headers[HEADER_ID_CONTENT_TYPE] =
+                    mime_type.empty()
+                            ? get_file_mime_type(path)
+                            : mime_type;
+
+    f_headers[HEADER_ID_CONTENT_TRANSFER_ENCODING] =
+                    g_name_libmimemail_email_base64;
+
+    return true;
 }
 
 
@@ -178,17 +464,155 @@ void attachment::quoted_printable_encode_and_set_data(
  * retrieve the MIME type, use the following:
  *
  * \code
- * QString mime_type(attachment->get_header(get_name(name_t::SNAP_NAME_CORE_CONTENT_TYPE_HEADER)));
+ * std::string mime_type(attachment->get_header(edhttp::g_name_edhttp_field_content_type));
  * \endcode
  *
- * \warning
- * This funtion returns the data by copy. Use with care (not repetitively?)
+ * The data is returned encoded as it will appear in the email. If the
+ * attachment was created with quoted_printable_encode_and_set_data(),
+ * the encoding happens on the first call and is then kept.
+ *
+ * \return A reference to this attachment's data.
+ *
+ * \sa get_raw_data()
+ */
+std::string const & attachment::get_data() const
+{
+    if(f_payload == nullptr)
+    {
+        return g_empty_data;
+    }
+    return f_payload->get_data();
+}
+
+
+/** \brief The email attachment data, not encoded.
+ *
+ * This function returns the data before the Content-Transfer-Encoding
+ * gets applied. When the attachment was created with
+ * quoted_printable_encode_and_set_data(), this is the data that was
+ * passed to that function.
+ *
+ * When the data was set already encoded (i.e. set_data() followed by
+ * a Content-Transfer-Encoding header set to quoted-printable), it gets
+ * decoded on the first call and is then kept.
+ *
+ * \return A reference to this attachment's data, not encoded.
+ *
+ * \sa get_data()
+ */
+std::string const & attachment::get_raw_data() const
+{
+    if(f_payload == nullptr)
+    {
+        return g_empty_data;
+    }
+    return f_payload->get_raw_data();
+}
+
+
+/** \brief View of the email attachment data.
+ *
+ * Contrary to get_data(), this function does not load the file of an
+ * attachment created with set_data_from_file() in memory.
  *
- * \return A copy of this attachment's data.
+ * \return A view of the data as returned by get_data().
  */
-std::string attachment::get_data() const
+std::string_view attachment::get_data_view() const
 {
-    return f_data;
+    if(f_payload == nullptr)
+    {
+        return std::string_view();
+    }
+    return f_payload->get_data_view();
+}
+
+
+/** \brief View of the email attachment data, not encoded.
+ *
+ * \return A view of the data as returned by get_raw_data().
+ */
+std::string_view attachment::get_raw_data_view() const
+{
+    if(f_payload == nullptr)
+    {
+        return std::string_view();
+    }
+    return f_payload->get_raw_data_view();
+}
+
+
+/** \brief Retrieve the buffer holding the encoded data.
+ *
+ * Contrary to the reference returned by get_data(), this buffer remains
+ * valid after this attachment gets modified or destroyed.
+ *
+ * \return A shared pointer to the data, never a null pointer.
+ */
+attachment_payload::buffer_t attachment::get_data_buffer() const
+{
+    if(f_payload == nullptr)
+    {
+        return std::make_shared<std::string const>();
+    }
+    return f_payload->get_data_buffer();
+}
+
+
+/** \brief Retrieve the payload of this attachment.
+ *
+ * The payload is shared by all the copies of this attachment. It is null
+ * until data gets added to the attachment.
+ *
+ * \return A pointer to the immutable payload.
+ */
+attachment_payload::pointer_t attachment::get_payload() const
+{
+    return f_payload;
+}
+
+
+/** \brief Get the encoding of the data.
+ *
+ * The encoding is defined by the Content-Transfer-Encoding header.
+ * Encodings which do not transform the data (7bit, 8bit, binary) and
+ * unsupported encodings are viewed as CONTENT_ENCODING_NONE.
+ *
+ * \return The encoding currently defined in the headers.
+ */
+content_encoding_t attachment::get_encoding() const
+{
+    auto const it(f_headers.find(HEADER_ID_CONTENT_TRANSFER_ENCODING));
+    if(it != f_headers.end())
+    {
+        if(it->second == edhttp::g_name_edhttp_param_quoted_printable)
+        {
+            return content_encoding_t::CONTENT_ENCODING_QUOTED_PRINTABLE;
+        }
+        if(it->second == g_name_libmimemail_email_base64)
+        {
+            return content_encoding_t::CONTENT_ENCODING_BASE64;
+        }
+    }
+
+    return content_encoding_t::CONTENT_ENCODING_NONE;
+}
+
+
+/** \brief Keep the data as is when its encoding header changes.
+ *
+ * If the user changes the Content-Transfer-Encoding header, the data
+ * stays as it currently is encoded (as it was before this change)
+ * and the raw version gets recomputed from it according to the new
+ * encoding.
+ *
+ * This function must be called after the header was modified.
+ */
+void attachment::freeze_encoding()
+{
+    if(f_payload != nullptr)
+    {
+        f_payload = f_payload->with_encoding(get_encoding());
+    }
 }
 
 
@@ -212,7 +636,7 @@ std::string attachment::get_header(std::string const & name) const
         throw invalid_parameter("attachment::get_header(): Cannot retrieve a header with an empty name");
     }
 
-    auto const it(f_headers.find(snapdev::to_case_insensitive_string(name)));
+    auto const it(f_headers.find(name));
     if(it != f_headers.end())
     {
         return it->second;
@@ -222,6 +646,26 @@ std::string attachment::get_header(std::string const & name) const
 }
 
 
+/** \brief Retrieve the value of a well-known header.
+ *
+ * This is the same as get_header() with the name of that header, only
+ * faster since no names get compared.
+ *
+ * \param[in] id  The identifier of the header, one of HEADER_ID_...
+ *
+ * \return The current value of that header or an empty string if undefined.
+ */
+std::string attachment::get_header(header_id_t id) const
+{
+    auto const it(f_headers.find(id));
+    if(it != f_headers.end())
+    {
+        return it->second;
+    }
+    return std::string();
+}
+
+
 /** \brief Add the Content-Disposition field.
  *
  * Helper function to add the Content-Disposition without having to
@@ -342,7 +786,7 @@ bool attachment::has_header(std::string const & name) const
         throw invalid_parameter("attachment::has_header(): When check the presence of a header, the name cannot be empty.");
     }
 
-    return f_headers.find(snapdev::to_case_insensitive_string(name)) != f_headers.end();
+    return f_headers.find(name) != f_headers.end();
 }
 
 
@@ -390,7 +834,11 @@ void attachment::add_header(std::string const & name, std::string const & value)
         throw invalid_parameter("attachment::add_header(): When adding a header, the name cannot be empty.");
     }
 
-    f_headers[snapdev::to_case_insensitive_string(name)] = value;
+    f_headers[name] = value;
+    if(get_header_id(name) == HEADER_ID_CONTENT_TRANSFER_ENCODING)
+    {
+        freeze_encoding();
+    }
 }
 
 
@@ -404,10 +852,15 @@ void attachment::add_header(std::string const & name, std::string const & value)
  */
 void attachment::remove_header(std::string const & name)
 {
-    auto const it(f_headers.find(snapdev::to_case_insensitive_string(name)));
+    auto const it(f_headers.find(name));
     if(it != f_headers.end())
     {
+        bool const encoding(f_headers.get_id(it) == HEADER_ID_CONTENT_TRANSFER_ENCODING);
         f_headers.erase(it);
+        if(encoding)
+        {
+            freeze_encoding();
+        }
     }
 }
 
@@ -417,6 +870,9 @@ void attachment::remove_header(std::string const & name)
  * This function returns the map of the headers defined in this email
  * attachment. This can be used to quickly scan all the headers.
  *
+ * The headers are listed in the order in which they were first added,
+ * which is also the order in which they get written in the email.
+ *
  * \note
  * It is important to remember that since this function returns a reference
  * to the map of headers, it may break if you call add_header() while going
@@ -495,10 +951,11 @@ void attachment::add_related(attachment const & data)
 
     // create a copy of this attachment
     //
-    // note that we do not attempt to use the shared pointer, we make a
-    // full copy instead, this is because some people may end up wanting
-    // to modify the attachment parameter and then add anew... what will
-    // have to a be a different attachment.
+    // note that we do not attempt to use a shared pointer to the
+    // attachment, we make a copy instead, this is because some people may
+    // end up wanting to modify the attachment parameter and then add
+    // anew... what will have to a be a different attachment; the copy
+    // is cheap since the data itself is a shared payload
     //
     attachment copy(data);
 
@@ -556,13 +1013,32 @@ int attachment::get_related_count() const
  * \sa add_related()
  * \sa get_related_count()
  */
-attachment & attachment::get_related(int index) const
+attachment & attachment::get_related(int index)
+{
+    if(static_cast<std::size_t>(index) >= f_sub_attachments.size())
+    {
+        throw libmimemail_out_of_range("attachment::get_related() called with an invalid index.");
+    }
+    return f_sub_attachments[index];
+}
+
+
+/** \brief Retrieve a read-only reference to a related sub-attachment.
+ *
+ * \exception out_of_range
+ * If the index is out of range, this exception is raised.
+ *
+ * \param[in] index  The attachment index.
+ *
+ * \return A constant reference to the attachment.
+ */
+attachment const & attachment::get_related(int index) const
 {
     if(static_cast<std::size_t>(index) >= f_sub_attachments.size())
     {
         throw libmimemail_out_of_range("attachment::get_related() called with an invalid index.");
     }
-    return const_cast<attachment &>(f_sub_attachments[index]);
+    return f_sub_attachments[index];
 }
 
 
@@ -602,7 +1078,11 @@ bool attachment::process_hunk(
     {
         std::string value;
         in.read_data(value);
-        f_headers[snapdev::to_case_insensitive_string(field.f_sub_name)] = value;
+        f_headers[field.f_sub_name] = value;
+        if(get_header_id(field.f_sub_name) == HEADER_ID_CONTENT_TRANSFER_ENCODING)
+        {
+            freeze_encoding();
+        }
     }
     else if(field.f_name == "attachment")
     {
@@ -610,9 +1090,71 @@ bool attachment::process_hunk(
         a.deserialize(in, true);
         add_related(a);
     }
+    else if(field.f_name == "file")
+    {
+        std::string path;
+        off_t size(0);
+        timespec mtime = timespec();
+        int raw(0);
+        int flags(0);
+        snapdev::deserializer<std::stringstream>::process_hunk_t func(
+            [&path, &size, &mtime, &raw, &flags](
+                      snapdev::deserializer<std::stringstream> & file_in
+                    , snapdev::field_t const & file_field)
+            {
+                if(file_field.f_name == "path")
+                {
+                    file_in.read_data(path);
+                }
+                else if(file_field.f_name == "size")
+                {
+                    file_in.read_data(size);
+                }
+                else if(file_field.f_name == "mtime_sec")
+                {
+                    file_in.read_data(mtime.tv_sec);
+                }
+                else if(file_field.f_name == "mtime_nsec")
+                {
+                    file_in.read_data(mtime.tv_nsec);
+                }
+                else if(file_field.f_name == "raw")
+                {
+                    file_in.read_data(raw);
+                }
+                else if(file_field.f_name == "flags")
+                {
+                    file_in.read_data(flags);
+                }
+                return true;
+            });
+        in.deserialize(func);
+
+        f_payload = raw != 0
+                ? attachment_payload::from_raw_file(path, get_encoding(), flags)
+                : attachment_payload::from_file(path, get_encoding());
+        if(f_payload == nullptr)
+        {
+            return false;
+        }
+        if(f_payload->get_file_size() != size
+        || f_payload->get_file_mtime().tv_sec != mtime.tv_sec
+        || f_payload->get_file_mtime().tv_nsec != mtime.tv_nsec)
+        {
+            SNAP_LOG_WARNING
+                << "attachment file \""
+                << path
+                << "\" changed since the email was saved."
+                << SNAP_LOG_SEND;
+        }
+    }
     else if(field.f_name == "data")
     {
-        in.read_data(f_data);
+        std::string data;
+        in.read_data(data);
+        f_payload = attachment_payload::from_data(
+                              std::make_shared<std::string const>(std::move(data))
+                            , get_encoding());
     }
     else
     {
@@ -646,9 +1188,240 @@ void attachment::serialize(snapdev::serializer<std::stringstream> & out) const
         it.serialize(out);
     }
 
-    // note that f_data may be binary data
+    // a file which did not change since it was attached is saved as a
+    // reference, it will be read only when the email gets sent
+    //
+    if(f_payload != nullptr
+    && f_payload->is_stable())
+    {
+        snapdev::recursive file_field(out, "file");
+        out.add_value("path", f_payload->get_path());
+        out.add_value("size", f_payload->get_file_size());
+        out.add_value("mtime_sec", f_payload->get_file_mtime().tv_sec);
+        out.add_value("mtime_nsec", f_payload->get_file_mtime().tv_nsec);
+        if(f_payload->is_raw_file())
+        {
+            out.add_value("raw", static_cast<int>(1));
+            out.add_value("flags", f_payload->get_encoding_flags());
+        }
+        return;
+    }
+
+    // note that the data may be binary data
     //
-    out.add_value("data", f_data);
+    std::string_view const data(get_data_view());
+    out.add_value("data", data.data(), data.length());
+}
+
+
+/** \brief Serialize an attachment in the binary spool format.
+ *
+ * The writer keeps references to the strings of this attachment so the
+ * attachment must not be modified until the writer data was written.
+ *
+ * If the writer has a blob store, data at least as large as the store
+ * minimum size gets saved in the store, once per distinct content, and
+ * only its key is written here. If the store fails, the data gets
+ * written inline.
+ *
+ * \param[in,out] out  The writer where the data gets saved.
+ */
+void attachment::serialize(binary_spool_writer & out) const
+{
+    out.add(static_cast<std::uint32_t>(f_headers.size()));
+    for(auto const & it : f_headers)
+    {
+        out.add(std::string_view(it.first.data(), it.first.length()));
+        out.add(std::string_view(it.second));
+    }
+
+    out.add(static_cast<std::uint32_t>(f_sub_attachments.size()));
+    for(auto const & it : f_sub_attachments)
+    {
+        it.serialize(out);
+    }
+
+    if(f_payload != nullptr
+    && f_payload->is_stable())
+    {
+        out.add(static_cast<std::uint8_t>(BINARY_ATTACHMENT_FILE));
+        out.add(std::string_view(f_payload->get_path()));
+        out.add(static_cast<std::uint64_t>(f_payload->get_file_size()));
+        out.add(static_cast<std::uint64_t>(f_payload->get_file_mtime().tv_sec));
+        out.add(static_cast<std::uint64_t>(f_payload->get_file_mtime().tv_nsec));
+        out.add(static_cast<std::uint8_t>(f_payload->is_raw_file() ? 1 : 0));
+        out.add(static_cast<std::uint32_t>(f_payload->get_encoding_flags()));
+        return;
+    }
+
+    std::string_view const data(get_data_view());
+    blob_store::pointer_t const store(out.get_blob_store());
+    if(store != nullptr
+    && f_payload != nullptr
+    && data.length() >= store->get_minimum_size())
+    {
+        std::string const & key(f_payload->get_digest());
+        if(store->put(key, data))
+        {
+            out.add(static_cast<std::uint8_t>(BINARY_ATTACHMENT_BLOB));
+            out.add(std::string_view(key));
+            out.add(static_cast<std::uint64_t>(data.length()));
+            return;
+        }
+    }
+
+    out.add(static_cast<std::uint8_t>(BINARY_ATTACHMENT_DATA));
+    out.add_data(data);
+}
+
+
+/** \brief Unserialize an attachment saved in the binary spool format.
+ *
+ * The data of the attachment is not copied, the payload references the
+ * buffer of the reader and keeps it alive.
+ *
+ * \param[in,out] in  The reader with the binary data.
+ * \param[in] is_sub_attachment  Whether this is a related attachment.
+ *
+ * \return true if the attachment was read successfully.
+ */
+bool attachment::deserialize(binary_spool_reader & in, bool is_sub_attachment)
+{
+    f_is_sub_attachment = is_sub_attachment;
+
+    std::uint32_t count(0);
+    if(!in.read(count))
+    {
+        return false;
+    }
+    for(std::uint32_t idx(0); idx < count; ++idx)
+    {
+        std::string_view name;
+        std::string value;
+        if(!in.read(name)
+        || !in.read(value))
+        {
+            return false;
+        }
+        f_headers[name] = value;
+    }
+
+    if(!in.read(count))
+    {
+        return false;
+    }
+    if(count > 0
+    && f_is_sub_attachment)
+    {
+        SNAP_LOG_ERROR
+            << "binary attachment unserialization found a related attachment with related attachments."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    for(std::uint32_t idx(0); idx < count; ++idx)
+    {
+        attachment a;
+        if(!a.deserialize(in, true))
+        {
+            return false;
+        }
+        f_sub_attachments.push_back(std::move(a));
+    }
+
+    std::uint8_t kind(0);
+    if(!in.read(kind))
+    {
+        return false;
+    }
+    switch(kind)
+    {
+    case BINARY_ATTACHMENT_DATA:
+        {
+            std::string_view data;
+            if(!in.read_data(data))
+            {
+                return false;
+            }
+            f_payload = attachment_payload::from_view(
+                                  in.get_buffer()
+                                , data
+                                , get_encoding());
+        }
+        return true;
+
+    case BINARY_ATTACHMENT_FILE:
+        {
+            std::string path;
+            std::uint64_t size(0);
+            std::uint64_t mtime_sec(0);
+            std::uint64_t mtime_nsec(0);
+            std::uint8_t raw(0);
+            std::uint32_t flags(0);
+            if(!in.read(path)
+            || !in.read(size)
+            || !in.read(mtime_sec)
+            || !in.read(mtime_nsec)
+            || !in.read(raw)
+            || !in.read(flags))
+            {
+                return false;
+            }
+
+            f_payload = raw != 0
+                    ? attachment_payload::from_raw_file(path, get_encoding(), flags)
+                    : attachment_payload::from_file(path, get_encoding());
+            if(f_payload == nullptr)
+            {
+                return false;
+            }
+            if(static_cast<std::uint64_t>(f_payload->get_file_size()) != size
+            || static_cast<std::uint64_t>(f_payload->get_file_mtime().tv_sec) != mtime_sec
+            || static_cast<std::uint64_t>(f_payload->get_file_mtime().tv_nsec) != mtime_nsec)
+            {
+                SNAP_LOG_WARNING
+                    << "attachment file \""
+                    << path
+                    << "\" changed since the email was saved."
+                    << SNAP_LOG_SEND;
+            }
+        }
+        return true;
+
+    case BINARY_ATTACHMENT_BLOB:
+        {
+            std::string key;
+            std::uint64_t size(0);
+            if(in.get_version() < 2
+            || !in.read(key)
+            || !in.read(size))
+            {
+                return false;
+            }
+            blob_store::pointer_t const store(in.get_blob_store());
+            if(store == nullptr)
+            {
+                SNAP_LOG_ERROR
+                    << "binary attachment unserialization found blob \""
+                    << key
+                    << "\" but no blob store was specified."
+                    << SNAP_LOG_SEND;
+                return false;
+            }
+
+            // the blob gets loaded when the data is first needed
+            //
+            f_payload = attachment_payload::from_blob(store, key, size, get_encoding());
+        }
+        return true;
+
+    }
+
+    SNAP_LOG_ERROR
+        << "binary attachment unserialization found unknown data kind "
+        << static_cast<int>(kind)
+        << "."
+        << SNAP_LOG_SEND;
+    return false;
 }
 
 
@@ -664,7 +1437,7 @@ void attachment::serialize(snapdev::serializer<std::stringstream> & out) const
 bool attachment::operator == (attachment const & rhs) const
 {
     return f_headers           == rhs.f_headers
-        && f_data              == rhs.f_data
+        && (f_payload == rhs.f_payload || get_data_view() == rhs.get_data_view())
         && f_is_sub_attachment == rhs.f_is_sub_attachment
         && f_sub_attachments   == rhs.f_sub_attachments;
 }
@@ -19,6 +19,13 @@
 // Snap Websites Servers -- create a feed where you can write an email
 #pragma once
 
+// self
+//
+#include    <libmimemail/attachment_payload.h>
+#include    <libmimemail/binary_spool.h>
+#include    <libmimemail/header_map.h>
+
+
 // edhttp
 //
 #include    <edhttp/quoted_printable.h>
@@ -33,6 +40,8 @@
 // C++
 //
 #include    <map>
+#include    <memory_resource>
+#include    <string_view>
 
 
 
@@ -41,25 +50,59 @@ namespace libmimemail
 
 
 
-typedef std::map<snapdev::case_insensitive_string, std::string> header_map_t;
+typedef header_map header_map_t;
 
 class attachment
 {
 public:
-    typedef std::vector<attachment>         vector_t;
+    typedef std::pmr::vector<attachment>    vector_t;
+    typedef std::pmr::polymorphic_allocator<std::byte>
+                                            allocator_type;
+
+    // the smallest attachment record of the binary spool: the number of
+    // headers, the number of related attachments, the kind, and the
+    // size of empty data
+    //
+    static constexpr std::size_t const      BINARY_MINIMUM_SIZE = 4 + 4 + 1 + 8;
 
                             attachment();
+                            attachment(attachment const & rhs) = default;
+                            attachment(attachment && rhs) = default;
+    explicit                attachment(allocator_type const & alloc);
+                            attachment(attachment const & rhs, allocator_type const & alloc);
+                            attachment(attachment && rhs, allocator_type const & alloc);
     virtual                 ~attachment();
 
+    attachment &            operator = (attachment const & rhs) = default;
+    attachment &            operator = (attachment && rhs) = default;
+
+    allocator_type          get_allocator() const;
+
     // data ("matter" of this attachment)
     //
     void                    set_data(std::string const & data, std::string mime_type = std::string());
+    void                    set_data(std::string && data, std::string mime_type = std::string());
+    void                    set_data(attachment_payload::buffer_t data, std::string mime_type = std::string());
+    bool                    set_data_from_file(std::string const & path, std::string mime_type = std::string());
     void                    quoted_printable_encode_and_set_data(
                                         std::string const & data
                                       , std::string const & mime_type = std::string()
                                       , int flags = edhttp::QUOTED_PRINTABLE_FLAG_LFONLY
                                                   | edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD);
-    std::string             get_data() const;
+    void                    base64_encode_and_set_data(
+                                        std::string const & data
+                                      , std::string const & mime_type = std::string());
+    bool                    base64_encode_and_set_data_from_file(
+                                        std::string const & path
+                                      , std::string const & mime_type = std::string());
+    std::string const &     get_data() const;
+    std::string const &     get_raw_data() const;
+    std::string_view        get_data_view() const;
+    std::string_view        get_raw_data_view() const;
+    attachment_payload::buffer_t
+                            get_data_buffer() const;
+    attachment_payload::pointer_t
+                            get_payload() const;
 
     // header for this header
     //
@@ -71,18 +114,22 @@ public:
     void                    remove_header(std::string const & name);
     bool                    has_header(std::string const & name) const;
     std::string             get_header(std::string const & name) const;
+    std::string             get_header(header_id_t id) const;
     header_map_t const &    get_all_headers() const;
 
     // sub-attachment (one level available only)
     //
     void                    add_related(attachment const & a);
     int                     get_related_count() const;
-    attachment &            get_related(int index) const;
+    attachment &            get_related(int index);
+    attachment const &      get_related(int index) const;
 
     // "internal" functions used to save/restore the data in/from a buffer
     //
     void                    serialize(snapdev::serializer<std::stringstream> & out) const;
     void                    deserialize(snapdev::deserializer<std::stringstream> & in, bool is_sub_attachment);
+    void                    serialize(binary_spool_writer & out) const;
+    bool                    deserialize(binary_spool_reader & in, bool is_sub_attachment);
 
     bool                    operator == (attachment const & rhs) const;
 
@@ -90,9 +137,17 @@ private:
     bool                    process_hunk(
                                   snapdev::deserializer<std::stringstream> & in
                                 , snapdev::field_t const & field);
+    content_encoding_t      get_encoding() const;
+    void                    set_data_buffer(attachment_payload::buffer_t data, std::string mime_type);
+    void                    freeze_encoding();
 
     header_map_t            f_headers = header_map_t();
-    std::string             f_data = std::string();
+
+    // the payload is shared between copies of this attachment, it never
+    // gets modified, instead a new one is created (copy-on-write)
+    //
+    attachment_payload::pointer_t
+                            f_payload = attachment_payload::pointer_t();
     bool                    f_is_sub_attachment = false;
     vector_t                f_sub_attachments = vector_t(); // for HTML data (images, css, ...)
 
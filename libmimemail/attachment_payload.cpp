@@ -0,0 +1,838 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Shared data of an attachment.
+ *
+ * The data of an attachment can be very large (think of a PDF sent to
+ * each member of a mailing list). To avoid copying it each time an
+ * attachment or an email gets copied, the data is saved in a payload
+ * object which is immutable once created and shared between all the
+ * copies. Modifying the data of an attachment creates a new payload
+ * (copy-on-write).
+ *
+ * A payload can also reference a file. The file only gets memory mapped
+ * when its data is first needed (i.e. when the email gets rendered) so
+ * large files attached to many emails do not each reside in memory.
+ *
+ * Similarly, a payload can reference a blob of a blob_store. This is
+ * what an email loaded from a spool using a blob store gets. The blob
+ * is only loaded when its data is needed.
+ */
+
+// self
+//
+#include    "libmimemail/attachment_payload.h"
+
+#include    "libmimemail/base64.h"
+#include    "libmimemail/binary_spool.h"
+#include    "libmimemail/blob_store.h"
+#include    "libmimemail/exception.h"
+#include    "libmimemail/quoted_printable.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C
+//
+#include    <fcntl.h>
+#include    <string.h>
+#include    <sys/mman.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Initialize the payload.
+ *
+ * At most one of \p data and \p raw_data is expected to be defined. If
+ * none are, the payload is expected to be file-backed.
+ *
+ * \param[in] data  The data as it appears in the email (encoded).
+ * \param[in] raw_data  The data before encoding.
+ * \param[in] encoding  The Content-Transfer-Encoding of the data.
+ * \param[in] flags  The flags to use to encode \p raw_data.
+ */
+attachment_payload::attachment_payload(
+          buffer_t data
+        , buffer_t raw_data
+        , content_encoding_t encoding
+        , int flags)
+    : f_data(data)
+    , f_raw_data(raw_data)
+    , f_encoding(encoding)
+    , f_encoding_flags(flags)
+{
+}
+
+
+/** \brief Release the payload.
+ *
+ * If the payload is file-backed and the file was mapped, it gets
+ * unmapped here.
+ */
+attachment_payload::~attachment_payload()
+{
+    if(f_map != nullptr)
+    {
+        munmap(f_map, f_map_size);
+    }
+}
+
+
+/** \brief Create a payload from data as it appears in the email.
+ *
+ * When \p encoding is not CONTENT_ENCODING_NONE, the raw data gets
+ * computed by decoding \p data the first time it is requested.
+ * Otherwise both are the same buffer.
+ *
+ * \exception invalid_parameter
+ * The \p data pointer cannot be null.
+ *
+ * \param[in] data  The encoded data.
+ * \param[in] encoding  The encoding used by \p data.
+ *
+ * \return A pointer to the new payload.
+ */
+attachment_payload::pointer_t attachment_payload::from_data(buffer_t data, content_encoding_t encoding)
+{
+    if(data == nullptr)
+    {
+        throw invalid_parameter("attachment_payload::from_data(): the data buffer cannot be a null pointer.");
+    }
+
+    return pointer_t(new attachment_payload(
+              data
+            , buffer_t()
+            , encoding
+            , 0));
+}
+
+
+/** \brief Create a payload from data to be encoded.
+ *
+ * The encoding happens the first time get_data() gets called.
+ *
+ * \exception invalid_parameter
+ * The \p raw_data pointer cannot be null.
+ *
+ * \param[in] raw_data  The data to encode.
+ * \param[in] encoding  The encoding to apply to \p raw_data.
+ * \param[in] flags  A set of quoted_printable_encode() flags,
+ * only used with CONTENT_ENCODING_QUOTED_PRINTABLE.
+ *
+ * \return A pointer to the new payload.
+ */
+attachment_payload::pointer_t attachment_payload::from_raw_data(
+          buffer_t raw_data
+        , content_encoding_t encoding
+        , int flags)
+{
+    if(raw_data == nullptr)
+    {
+        throw invalid_parameter("attachment_payload::from_raw_data(): the raw data buffer cannot be a null pointer.");
+    }
+
+    if(encoding == content_encoding_t::CONTENT_ENCODING_NONE)
+    {
+        return from_data(raw_data, encoding);
+    }
+
+    return pointer_t(new attachment_payload(
+              buffer_t()
+            , raw_data
+            , encoding
+            , flags));
+}
+
+
+/** \brief Create a payload from a view in a buffer owned by another object.
+ *
+ * This is used to load emails from a memory mapped spool file without
+ * copying the data of each attachment. The \p owner is kept alive as
+ * long as the payload exists so \p data remains valid.
+ *
+ * \exception invalid_parameter
+ * The \p owner pointer cannot be null.
+ *
+ * \param[in] owner  The object holding the memory \p data points to.
+ * \param[in] data  The encoded data.
+ * \param[in] encoding  The encoding used by \p data.
+ *
+ * \return A pointer to the new payload.
+ */
+attachment_payload::pointer_t attachment_payload::from_view(
+          std::shared_ptr<void const> owner
+        , std::string_view const & data
+        , content_encoding_t encoding)
+{
+    if(owner == nullptr)
+    {
+        throw invalid_parameter("attachment_payload::from_view(): the owner cannot be a null pointer.");
+    }
+
+    std::shared_ptr<attachment_payload> payload(new attachment_payload(
+              buffer_t()
+            , buffer_t()
+            , encoding
+            , 0));
+    payload->f_view_owner = owner;
+    payload->f_view = data;
+    return payload;
+}
+
+
+/** \brief Create a payload referencing a file.
+ *
+ * The file content is used as is, like the data passed to from_data().
+ * The file is not read here. It gets memory mapped the first time its
+ * data is requested.
+ *
+ * The size and modification time of the file are saved so one can
+ * check whether the file changed since (see is_stable()).
+ *
+ * \param[in] path  The path to a regular file.
+ * \param[in] encoding  The encoding used by the file content.
+ *
+ * \return A pointer to the new payload or a null pointer if the file
+ * cannot be accessed.
+ */
+attachment_payload::pointer_t attachment_payload::from_file(std::string const & path, content_encoding_t encoding)
+{
+    return create_file(path, encoding, 0, false);
+}
+
+
+/** \brief Create a payload referencing a file to be encoded.
+ *
+ * This is similar to from_file(), only the file content is the raw data.
+ * It gets encoded with \p encoding when the email gets rendered. With
+ * CONTENT_ENCODING_BASE64, the mime_writer encodes the file while
+ * writing it so the encoded data never resides in memory as a whole.
+ *
+ * \param[in] path  The path to a regular file.
+ * \param[in] encoding  The encoding to apply to the file content.
+ * \param[in] flags  A set of quoted_printable_encode() flags,
+ * only used with CONTENT_ENCODING_QUOTED_PRINTABLE.
+ *
+ * \return A pointer to the new payload or a null pointer if the file
+ * cannot be accessed.
+ */
+attachment_payload::pointer_t attachment_payload::from_raw_file(
+          std::string const & path
+        , content_encoding_t encoding
+        , int flags)
+{
+    return create_file(
+              path
+            , encoding
+            , flags
+            , encoding != content_encoding_t::CONTENT_ENCODING_NONE);
+}
+
+
+/** \brief Create a file-backed payload.
+ *
+ * \param[in] path  The path to a regular file.
+ * \param[in] encoding  The encoding of the data.
+ * \param[in] flags  The quoted-printable flags.
+ * \param[in] raw  Whether the file holds the raw data.
+ *
+ * \return A pointer to the new payload or a null pointer if the file
+ * cannot be accessed.
+ */
+attachment_payload::pointer_t attachment_payload::create_file(
+          std::string const & path
+        , content_encoding_t encoding
+        , int flags
+        , bool raw)
+{
+    if(path.empty())
+    {
+        throw invalid_parameter("attachment_payload::from_file(): the path cannot be empty.");
+    }
+
+    struct stat st;
+    if(stat(path.c_str(), &st) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not access attachment file \""
+            << path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return pointer_t();
+    }
+    if(!S_ISREG(st.st_mode))
+    {
+        SNAP_LOG_ERROR
+            << "attachment file \""
+            << path
+            << "\" is not a regular file."
+            << SNAP_LOG_SEND;
+        return pointer_t();
+    }
+
+    std::shared_ptr<attachment_payload> payload(new attachment_payload(
+              buffer_t()
+            , buffer_t()
+            , encoding
+            , flags));
+    payload->f_path = path;
+    payload->f_raw_file = raw;
+    payload->f_file_size = st.st_size;
+    payload->f_file_mtime = st.st_mtim;
+    return payload;
+}
+
+
+/** \brief Create a payload with the same data and a different encoding.
+ *
+ * When the Content-Transfer-Encoding of an attachment changes, its data
+ * remains the same, only the way to compute the raw data changes.
+ *
+ * \param[in] encoding  The encoding of the data.
+ *
+ * \return A pointer to the new payload.
+ */
+attachment_payload::pointer_t attachment_payload::with_encoding(content_encoding_t encoding) const
+{
+    if(f_view_owner != nullptr)
+    {
+        return from_view(f_view_owner, f_view, encoding);
+    }
+
+    if(is_blob())
+    {
+        return from_blob(f_blob_store, f_blob_key, f_blob_size, encoding);
+    }
+
+    if(!is_file()
+    || f_raw_file)
+    {
+        return from_data(get_data_buffer(), encoding);
+    }
+
+    std::shared_ptr<attachment_payload> payload(new attachment_payload(
+              buffer_t()
+            , buffer_t()
+            , encoding
+            , 0));
+    payload->f_path = f_path;
+    payload->f_file_size = f_file_size;
+    payload->f_file_mtime = f_file_mtime;
+    return payload;
+}
+
+
+/** \brief Create a payload referencing a blob.
+ *
+ * The data is the blob as is, like the data passed to from_data(). The
+ * blob is not read here. It gets loaded the first time its data is
+ * requested.
+ *
+ * \exception invalid_parameter
+ * The \p store pointer cannot be null.
+ *
+ * \param[in] store  The store holding the blob.
+ * \param[in] key  The key of the blob.
+ * \param[in] size  The size of the blob, checked once loaded.
+ * \param[in] encoding  The encoding used by the blob data.
+ *
+ * \return A pointer to the new payload.
+ */
+attachment_payload::pointer_t attachment_payload::from_blob(
+          std::shared_ptr<blob_store> store
+        , std::string const & key
+        , std::uint64_t size
+        , content_encoding_t encoding)
+{
+    if(store == nullptr)
+    {
+        throw invalid_parameter("attachment_payload::from_blob(): the store cannot be a null pointer.");
+    }
+
+    std::shared_ptr<attachment_payload> payload(new attachment_payload(
+              buffer_t()
+            , buffer_t()
+            , encoding
+            , 0));
+    payload->f_blob_store = store;
+    payload->f_blob_key = key;
+    payload->f_blob_size = size;
+    return payload;
+}
+
+
+/** \brief Get a view of the data as it appears in the email.
+ *
+ * For a file-backed payload, this is a view of the memory mapped file
+ * so the file does not get copied in memory. If the file needs to be
+ * encoded, the encoded data gets computed and kept in memory.
+ *
+ * \exception file_unavailable
+ * The file of a file-backed payload could not be mapped.
+ *
+ * \return A view of the encoded data, valid as long as this payload exists.
+ */
+std::string_view attachment_payload::get_data_view() const
+{
+    if(f_view_owner != nullptr)
+    {
+        return f_view;
+    }
+    if(is_blob())
+    {
+        return get_blob_view();
+    }
+    if(is_file()
+    && !f_raw_file)
+    {
+        return get_file_view();
+    }
+    return *get_data_buffer();
+}
+
+
+/** \brief Get a view of the data before encoding.
+ *
+ * \return A view of the raw data, valid as long as this payload exists.
+ */
+std::string_view attachment_payload::get_raw_data_view() const
+{
+    if(f_encoding == content_encoding_t::CONTENT_ENCODING_NONE)
+    {
+        return get_data_view();
+    }
+    if(f_raw_file)
+    {
+        return get_file_view();
+    }
+    return *get_raw_data_buffer();
+}
+
+
+/** \brief Get the data as it appears in the email.
+ *
+ * \warning
+ * For a file-backed payload, this function loads the file in memory.
+ * Use get_data_view() instead whenever possible.
+ *
+ * \return A reference to the encoded data.
+ */
+std::string const & attachment_payload::get_data() const
+{
+    return *get_data_buffer();
+}
+
+
+/** \brief Get the data before encoding.
+ *
+ * \return A reference to the raw data.
+ */
+std::string const & attachment_payload::get_raw_data() const
+{
+    return *get_raw_data_buffer();
+}
+
+
+/** \brief Get the buffer holding the data as it appears in the email.
+ *
+ * The returned pointer can be kept around; the buffer remains valid
+ * even after the attachment it came from was modified or destroyed.
+ *
+ * \warning
+ * For a file-backed payload, this function loads the file in memory.
+ *
+ * \return A shared pointer to the encoded data.
+ */
+attachment_payload::buffer_t attachment_payload::get_data_buffer() const
+{
+    std::call_once(f_data_once, [this]()
+        {
+            if(f_data != nullptr)
+            {
+                return;
+            }
+            if(f_view_owner != nullptr)
+            {
+                f_data = std::make_shared<std::string const>(f_view.data(), f_view.length());
+                return;
+            }
+            if(is_blob())
+            {
+                std::string_view const data(get_blob_view());
+                f_data = std::make_shared<std::string const>(data.data(), data.length());
+                return;
+            }
+            if(is_file()
+            && !f_raw_file)
+            {
+                std::string_view const data(get_file_view());
+                f_data = std::make_shared<std::string const>(data.data(), data.length());
+                return;
+            }
+
+            std::string_view const raw_data(get_raw_data_view());
+            switch(f_encoding)
+            {
+            case content_encoding_t::CONTENT_ENCODING_QUOTED_PRINTABLE:
+                f_data = std::make_shared<std::string const>(
+                        quoted_printable_encode(raw_data, f_encoding_flags));
+                break;
+
+            case content_encoding_t::CONTENT_ENCODING_BASE64:
+                f_data = std::make_shared<std::string const>(
+                        base64_encoder::encode(raw_data));
+                break;
+
+            case content_encoding_t::CONTENT_ENCODING_NONE:
+                // this case does not happen, the raw data is the data
+                //
+                f_data = std::make_shared<std::string const>(raw_data.data(), raw_data.length());
+                break;
+
+            }
+        });
+    return f_data;
+}
+
+
+/** \brief Get the buffer holding the data before encoding.
+ *
+ * \return A shared pointer to the raw data.
+ */
+attachment_payload::buffer_t attachment_payload::get_raw_data_buffer() const
+{
+    if(f_encoding == content_encoding_t::CONTENT_ENCODING_NONE)
+    {
+        return get_data_buffer();
+    }
+
+    std::call_once(f_raw_data_once, [this]()
+        {
+            if(f_raw_data != nullptr)
+            {
+                return;
+            }
+            if(f_raw_file)
+            {
+                std::string_view const raw_data(get_file_view());
+                f_raw_data = std::make_shared<std::string const>(raw_data.data(), raw_data.length());
+                return;
+            }
+
+            std::string_view const data(get_data_view());
+            if(f_encoding == content_encoding_t::CONTENT_ENCODING_BASE64)
+            {
+                f_raw_data = std::make_shared<std::string const>(base64_decode(data));
+            }
+            else
+            {
+                f_raw_data = std::make_shared<std::string const>(
+                        quoted_printable_decode(data));
+            }
+        });
+    return f_raw_data;
+}
+
+
+/** \brief Get the Content-Transfer-Encoding of the data.
+ *
+ * \return The encoding of the data returned by get_data().
+ */
+content_encoding_t attachment_payload::get_encoding() const
+{
+    return f_encoding;
+}
+
+
+/** \brief Get the flags used to quoted-printable encode the raw data.
+ *
+ * \return The quoted-printable flags.
+ */
+int attachment_payload::get_encoding_flags() const
+{
+    return f_encoding_flags;
+}
+
+
+/** \brief Get the SHA-256 of the data.
+ *
+ * The digest is the key of the data in a blob_store. It gets computed
+ * once and is shared by all the attachments using this payload, so an
+ * attachment sent to many recipients is only hashed once.
+ *
+ * \return The digest of the data returned by get_data_view().
+ */
+std::string const & attachment_payload::get_digest() const
+{
+    if(is_blob())
+    {
+        return f_blob_key;
+    }
+
+    std::call_once(f_digest_once, [this]()
+        {
+            f_digest = blob_store::compute_key(get_data_view());
+        });
+    return f_digest;
+}
+
+
+/** \brief Check whether this payload references a file.
+ *
+ * \return true if the payload was created with from_file().
+ */
+bool attachment_payload::is_file() const
+{
+    return !f_path.empty();
+}
+
+
+/** \brief Check whether this payload references a file to be encoded.
+ *
+ * \return true if the payload was created with from_raw_file() and the
+ * file needs to be encoded.
+ */
+bool attachment_payload::is_raw_file() const
+{
+    return f_raw_file;
+}
+
+
+/** \brief Get the path of a file-backed payload.
+ *
+ * \return The path of the file or an empty string.
+ */
+std::string const & attachment_payload::get_path() const
+{
+    return f_path;
+}
+
+
+/** \brief Get the size the file had when the payload was created.
+ *
+ * \return The size of the file in bytes.
+ */
+off_t attachment_payload::get_file_size() const
+{
+    return f_file_size;
+}
+
+
+/** \brief Get the modification time the file had when the payload was created.
+ *
+ * \return The modification time of the file.
+ */
+timespec const & attachment_payload::get_file_mtime() const
+{
+    return f_file_mtime;
+}
+
+
+/** \brief Check whether the file is still the same.
+ *
+ * A file is considered stable if its size and modification time did not
+ * change since this payload was created. A stable file can be referenced
+ * by path (i.e. when serializing an email) instead of copying its data.
+ *
+ * \return true if this is a file-backed payload and the file did not change.
+ */
+bool attachment_payload::is_stable() const
+{
+    if(!is_file())
+    {
+        return false;
+    }
+
+    struct stat st;
+    if(stat(f_path.c_str(), &st) != 0)
+    {
+        return false;
+    }
+
+    return st.st_size == f_file_size
+        && st.st_mtim.tv_sec == f_file_mtime.tv_sec
+        && st.st_mtim.tv_nsec == f_file_mtime.tv_nsec;
+}
+
+
+/** \brief Check whether this payload references a blob.
+ *
+ * \return true if the payload was created with from_blob().
+ */
+bool attachment_payload::is_blob() const
+{
+    return f_blob_store != nullptr;
+}
+
+
+/** \brief Get the key of a blob-backed payload.
+ *
+ * \return The key of the blob or an empty string.
+ */
+std::string const & attachment_payload::get_blob_key() const
+{
+    return f_blob_key;
+}
+
+
+/** \brief Map the file in memory.
+ *
+ * The file gets mapped once and stays mapped until the payload gets
+ * destroyed. The pages are backed by the file so the kernel can drop
+ * them from memory at any time.
+ *
+ * \exception file_unavailable
+ * The file cannot be opened or mapped.
+ *
+ * \return A view of the file content.
+ */
+std::string_view attachment_payload::get_file_view() const
+{
+    std::call_once(f_map_once, [this]()
+        {
+            snapdev::raii_fd_t fd(open(f_path.c_str(), O_RDONLY | O_CLOEXEC));
+            if(fd.get() == -1)
+            {
+                int const e(errno);
+                throw file_unavailable(
+                          "attachment_payload::get_file_view(): could not open \""
+                        + f_path
+                        + "\" ("
+                        + strerror(e)
+                        + ").");
+            }
+
+            struct stat st;
+            if(fstat(fd.get(), &st) != 0)
+            {
+                int const e(errno);
+                throw file_unavailable(
+                          "attachment_payload::get_file_view(): could not stat \""
+                        + f_path
+                        + "\" ("
+                        + strerror(e)
+                        + ").");
+            }
+            if(st.st_size != f_file_size
+            || st.st_mtim.tv_sec != f_file_mtime.tv_sec
+            || st.st_mtim.tv_nsec != f_file_mtime.tv_nsec)
+            {
+                SNAP_LOG_WARNING
+                    << "attachment file \""
+                    << f_path
+                    << "\" changed since it was attached."
+                    << SNAP_LOG_SEND;
+            }
+
+            if(st.st_size == 0)
+            {
+                // mmap() does not accept an empty mapping
+                //
+                return;
+            }
+
+            void * ptr(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0));
+            if(ptr == MAP_FAILED)
+            {
+                int const e(errno);
+                throw file_unavailable(
+                          "attachment_payload::get_file_view(): could not map \""
+                        + f_path
+                        + "\" ("
+                        + strerror(e)
+                        + ").");
+            }
+            madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+            f_map = ptr;
+            f_map_size = st.st_size;
+        });
+
+    return std::string_view(static_cast<char const *>(f_map), f_map_size);
+}
+
+
+/** \brief Load the blob.
+ *
+ * The blob gets loaded once and stays in memory (or mapped) until the
+ * payload gets destroyed.
+ *
+ * \exception file_unavailable
+ * The blob cannot be loaded.
+ *
+ * \exception corrupted_data
+ * The blob does not have the expected size.
+ *
+ * \return A view of the blob data.
+ */
+std::string_view attachment_payload::get_blob_view() const
+{
+    std::call_once(f_blob_once, [this]()
+        {
+            binary_spool_buffer::pointer_t const blob(f_blob_store->get(f_blob_key));
+            if(blob == nullptr)
+            {
+                throw file_unavailable(
+                          "attachment_payload::get_blob_view(): could not load blob \""
+                        + f_blob_key
+                        + "\".");
+            }
+            if(blob->get_data().length() != f_blob_size)
+            {
+                throw corrupted_data(
+                          "attachment_payload::get_blob_view(): blob \""
+                        + f_blob_key
+                        + "\" is "
+                        + std::to_string(blob->get_data().length())
+                        + " bytes instead of "
+                        + std::to_string(f_blob_size)
+                        + ".");
+            }
+            f_blob = blob;
+        });
+
+    return f_blob->get_data();
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,169 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <cstdint>
+#include    <memory>
+#include    <mutex>
+#include    <string>
+#include    <string_view>
+
+
+// C
+//
+#include    <sys/stat.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class binary_spool_buffer;
+class blob_store;
+
+
+enum class content_encoding_t
+{
+    CONTENT_ENCODING_NONE,              // data is sent as is
+    CONTENT_ENCODING_QUOTED_PRINTABLE,
+    CONTENT_ENCODING_BASE64
+};
+
+
+class attachment_payload
+{
+public:
+    typedef std::shared_ptr<attachment_payload const>   pointer_t;
+    typedef std::shared_ptr<std::string const>          buffer_t;
+
+                            attachment_payload(attachment_payload const &) = delete;
+                            ~attachment_payload();
+
+    attachment_payload &    operator = (attachment_payload const &) = delete;
+
+    static pointer_t        from_data(buffer_t data, content_encoding_t encoding);
+    static pointer_t        from_raw_data(
+                                  buffer_t raw_data
+                                , content_encoding_t encoding
+                                , int flags = 0);
+    static pointer_t        from_view(
+                                  std::shared_ptr<void const> owner
+                                , std::string_view const & data
+                                , content_encoding_t encoding);
+    static pointer_t        from_file(std::string const & path, content_encoding_t encoding);
+    static pointer_t        from_raw_file(
+                                  std::string const & path
+                                , content_encoding_t encoding
+                                , int flags = 0);
+    static pointer_t        from_blob(
+                                  std::shared_ptr<blob_store> store
+                                , std::string const & key
+                                , std::uint64_t size
+                                , content_encoding_t encoding);
+    pointer_t               with_encoding(content_encoding_t encoding) const;
+
+    std::string_view        get_data_view() const;
+    std::string_view        get_raw_data_view() const;
+    std::string const &     get_data() const;
+    std::string const &     get_raw_data() const;
+    buffer_t                get_data_buffer() const;
+    buffer_t                get_raw_data_buffer() const;
+    content_encoding_t      get_encoding() const;
+    int                     get_encoding_flags() const;
+    std::string const &     get_digest() const;
+
+    // file-backed payloads
+    //
+    bool                    is_file() const;
+    bool                    is_raw_file() const;
+    std::string const &     get_path() const;
+    off_t                   get_file_size() const;
+    timespec const &        get_file_mtime() const;
+    bool                    is_stable() const;
+
+    // blob-backed payloads
+    //
+    bool                    is_blob() const;
+    std::string const &     get_blob_key() const;
+
+private:
+                            attachment_payload(
+                                  buffer_t data
+                                , buffer_t raw_data
+                                , content_encoding_t encoding
+                                , int flags);
+
+    static pointer_t        create_file(
+                                  std::string const & path
+                                , content_encoding_t encoding
+                                , int flags
+                                , bool raw);
+    std::string_view        get_file_view() const;
+    std::string_view        get_blob_view() const;
+
+    // one of the two buffers (or the file) is defined on construction,
+    // the other is computed on first use; the once flags make that thread
+    // safe since one payload is shared between many attachments
+    //
+    mutable std::once_flag  f_data_once = std::once_flag();
+    mutable std::once_flag  f_raw_data_once = std::once_flag();
+    mutable buffer_t        f_data = buffer_t();
+    mutable buffer_t        f_raw_data = buffer_t();
+    content_encoding_t      f_encoding = content_encoding_t::CONTENT_ENCODING_NONE;
+    int                     f_encoding_flags = 0;
+
+    // a view in a buffer owned by someone else (i.e. a spool file)
+    //
+    std::shared_ptr<void const>
+                            f_view_owner = std::shared_ptr<void const>();
+    std::string_view        f_view = std::string_view();
+
+    // the file is only mapped when its data is first needed
+    //
+    std::string             f_path = std::string();
+    bool                    f_raw_file = false;
+    off_t                   f_file_size = 0;
+    timespec                f_file_mtime = timespec();
+    mutable std::once_flag  f_map_once = std::once_flag();
+    mutable void *          f_map = nullptr;
+    mutable std::size_t     f_map_size = 0;
+
+    // the blob is only loaded when its data is first needed
+    //
+    std::shared_ptr<blob_store>
+                            f_blob_store = std::shared_ptr<blob_store>();
+    std::string             f_blob_key = std::string();
+    std::uint64_t           f_blob_size = 0;
+    mutable std::once_flag  f_blob_once = std::once_flag();
+    mutable std::shared_ptr<binary_spool_buffer const>
+                            f_blob = std::shared_ptr<binary_spool_buffer const>();
+
+    // the SHA-256 of the data, the key of the payload in a blob_store
+    //
+    mutable std::once_flag  f_digest_once = std::once_flag();
+    mutable std::string     f_digest = std::string();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
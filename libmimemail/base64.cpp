@@ -0,0 +1,612 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Base64 Content-Transfer-Encoding.
+ *
+ * Binary attachments (images, PDF, archives...) are best sent base64
+ * encoded. Since such attachments can be large and get encoded once
+ * per email, the encoder uses SIMD kernels when available. The kernel
+ * is selected at runtime the first time the encoder is used:
+ *
+ * \li AVX2 -- 24 input bytes per iteration (x86)
+ * \li SSSE3 -- 12 input bytes per iteration (x86)
+ * \li NEON -- 48 input bytes per iteration (aarch64)
+ * \li scalar -- 3 input bytes per iteration (all others)
+ *
+ * The x86 kernels are based on the reshuffle and translate steps
+ * described by Wojciech Mula.
+ *
+ * The encoder works on a stream. Lines are wrapped at 76 characters
+ * as required by RFC 2045 and separated by a "\n" (the transports
+ * convert the new lines as required).
+ */
+
+// self
+//
+#include    "libmimemail/base64.h"
+
+#include    "libmimemail/exception.h"
+#include    "libmimemail/metrics.h"
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cstdint>
+
+
+// C
+//
+#if defined(__x86_64__) || defined(__i386__)
+#include    <immintrin.h>
+#define LIBMIMEMAIL_BASE64_X86
+#elif defined(__aarch64__)
+#include    <arm_neon.h>
+#define LIBMIMEMAIL_BASE64_NEON
+#endif
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+char const g_base64_alphabet[65] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+    "abcdefghijklmnopqrstuvwxyz"
+    "0123456789+/";
+
+
+/** \brief Amount of data encoded at once when not wrapping lines.
+ *
+ * Must be a multiple of 3.
+ */
+constexpr std::size_t const UNWRAPPED_BLOCK_SIZE = 3 * 4096;
+
+
+/** \brief A kernel encoding as many bytes as it can.
+ *
+ * The kernel encodes whole blocks of input bytes and returns the number
+ * of bytes it consumed (always a multiple of 3). The \p readable parameter
+ * is the number of bytes accessible from \p src, which may be more than
+ * \p size; kernels use it to safely load a full vector.
+ */
+typedef std::size_t (*kernel_t)(
+          unsigned char const * src
+        , std::size_t size
+        , std::size_t readable
+        , char * dst);
+
+
+std::size_t scalar_kernel(
+      unsigned char const * src
+    , std::size_t size
+    , std::size_t readable
+    , char * dst)
+{
+    static_cast<void>(readable);
+
+    std::size_t i(0);
+    for(; i + 3 <= size; i += 3, dst += 4)
+    {
+        std::uint32_t const v((src[i] << 16) | (src[i + 1] << 8) | src[i + 2]);
+        dst[0] = g_base64_alphabet[(v >> 18) & 0x3F];
+        dst[1] = g_base64_alphabet[(v >> 12) & 0x3F];
+        dst[2] = g_base64_alphabet[(v >>  6) & 0x3F];
+        dst[3] = g_base64_alphabet[ v        & 0x3F];
+    }
+    return i;
+}
+
+
+#ifdef LIBMIMEMAIL_BASE64_X86
+__attribute__((target("ssse3")))
+inline __m128i ssse3_reshuffle(__m128i in)
+{
+    // spread 12 bytes in 16 so each 32 bit word has its 3 input bytes,
+    // then move each 6 bit index to its own byte
+    //
+    in = _mm_shuffle_epi8(in, _mm_set_epi8(
+                10, 11,  9, 10,  7,  8,  6,  7,  4,  5,  3,  4,  1,  2,  0,  1));
+    __m128i const t0(_mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00)));
+    __m128i const t1(_mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040)));
+    __m128i const t2(_mm_and_si128(in, _mm_set1_epi32(0x003f03f0)));
+    __m128i const t3(_mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010)));
+    return _mm_or_si128(t1, t3);
+}
+
+
+__attribute__((target("ssse3")))
+inline __m128i ssse3_translate(__m128i in)
+{
+    // offsets to add to each index to get its character:
+    //   0..25 -> 'A', 26..51 -> 'a' - 26, 52..61 -> '0' - 52,
+    //   62 -> '+' - 62, 63 -> '/' - 63
+    //
+    __m128i const lut(_mm_setr_epi8(
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0));
+    __m128i indices(_mm_subs_epu8(in, _mm_set1_epi8(51)));
+    __m128i const mask(_mm_cmpgt_epi8(in, _mm_set1_epi8(25)));
+    indices = _mm_sub_epi8(indices, mask);
+    return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+
+__attribute__((target("ssse3")))
+std::size_t ssse3_kernel(
+      unsigned char const * src
+    , std::size_t size
+    , std::size_t readable
+    , char * dst)
+{
+    std::size_t i(0);
+    for(; i + 12 <= size && i + 16 <= readable; i += 12, dst += 16)
+    {
+        __m128i in(_mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i)));
+        _mm_storeu_si128(
+                  reinterpret_cast<__m128i *>(dst)
+                , ssse3_translate(ssse3_reshuffle(in)));
+    }
+    return i;
+}
+
+
+__attribute__((target("avx2")))
+inline __m256i avx2_reshuffle(__m256i in)
+{
+    in = _mm256_shuffle_epi8(in, _mm256_set_epi8(
+                10, 11,  9, 10,  7,  8,  6,  7,  4,  5,  3,  4,  1,  2,  0,  1,
+                10, 11,  9, 10,  7,  8,  6,  7,  4,  5,  3,  4,  1,  2,  0,  1));
+    __m256i const t0(_mm256_and_si256(in, _mm256_set1_epi32(0x0fc0fc00)));
+    __m256i const t1(_mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040)));
+    __m256i const t2(_mm256_and_si256(in, _mm256_set1_epi32(0x003f03f0)));
+    __m256i const t3(_mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010)));
+    return _mm256_or_si256(t1, t3);
+}
+
+
+__attribute__((target("avx2")))
+inline __m256i avx2_translate(__m256i in)
+{
+    __m256i const lut(_mm256_setr_epi8(
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0,
+                65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0));
+    __m256i indices(_mm256_subs_epu8(in, _mm256_set1_epi8(51)));
+    __m256i const mask(_mm256_cmpgt_epi8(in, _mm256_set1_epi8(25)));
+    indices = _mm256_sub_epi8(indices, mask);
+    return _mm256_add_epi8(in, _mm256_shuffle_epi8(lut, indices));
+}
+
+
+__attribute__((target("avx2")))
+std::size_t avx2_kernel(
+      unsigned char const * src
+    , std::size_t size
+    , std::size_t readable
+    , char * dst)
+{
+    std::size_t i(0);
+    for(; i + 24 <= size && i + 28 <= readable; i += 24, dst += 32)
+    {
+        // each 128 bit lane gets 12 input bytes
+        //
+        __m256i in(_mm256_castsi128_si256(
+                _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i))));
+        in = _mm256_inserti128_si256(
+                  in
+                , _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i + 12))
+                , 1);
+        _mm256_storeu_si256(
+                  reinterpret_cast<__m256i *>(dst)
+                , avx2_translate(avx2_reshuffle(in)));
+    }
+
+    // the SSSE3 kernel may be able to do one more block
+    //
+    return i + ssse3_kernel(src + i, size - i, readable - i, dst);
+}
+#endif
+
+
+#ifdef LIBMIMEMAIL_BASE64_NEON
+std::size_t neon_kernel(
+      unsigned char const * src
+    , std::size_t size
+    , std::size_t readable
+    , char * dst)
+{
+    static_cast<void>(readable);
+
+    unsigned char const * alphabet(reinterpret_cast<unsigned char const *>(g_base64_alphabet));
+    uint8x16x4_t lut;
+    lut.val[0] = vld1q_u8(alphabet);
+    lut.val[1] = vld1q_u8(alphabet + 16);
+    lut.val[2] = vld1q_u8(alphabet + 32);
+    lut.val[3] = vld1q_u8(alphabet + 48);
+
+    std::size_t i(0);
+    for(; i + 48 <= size; i += 48, dst += 64)
+    {
+        // the load de-interleaves the bytes so each register holds
+        // the first, second, and third bytes of 16 triplets
+        //
+        uint8x16x3_t const in(vld3q_u8(src + i));
+
+        uint8x16x4_t indices;
+        indices.val[0] = vshrq_n_u8(in.val[0], 2);
+        indices.val[1] = vorrq_u8(
+                  vshlq_n_u8(vandq_u8(in.val[0], vdupq_n_u8(0x03)), 4)
+                , vshrq_n_u8(in.val[1], 4));
+        indices.val[2] = vorrq_u8(
+                  vshlq_n_u8(vandq_u8(in.val[1], vdupq_n_u8(0x0F)), 2)
+                , vshrq_n_u8(in.val[2], 6));
+        indices.val[3] = vandq_u8(in.val[2], vdupq_n_u8(0x3F));
+
+        uint8x16x4_t out;
+        out.val[0] = vqtbl4q_u8(lut, indices.val[0]);
+        out.val[1] = vqtbl4q_u8(lut, indices.val[1]);
+        out.val[2] = vqtbl4q_u8(lut, indices.val[2]);
+        out.val[3] = vqtbl4q_u8(lut, indices.val[3]);
+        vst4q_u8(reinterpret_cast<unsigned char *>(dst), out);
+    }
+    return i;
+}
+#endif
+
+
+struct kernel_info
+{
+    kernel_t        f_kernel = nullptr;
+    char const *    f_name = nullptr;
+};
+
+
+kernel_info select_kernel()
+{
+#ifdef LIBMIMEMAIL_BASE64_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return kernel_info{ avx2_kernel, "avx2" };
+    }
+    if(__builtin_cpu_supports("ssse3"))
+    {
+        return kernel_info{ ssse3_kernel, "ssse3" };
+    }
+#endif
+#ifdef LIBMIMEMAIL_BASE64_NEON
+    return kernel_info{ neon_kernel, "neon" };
+#else
+    return kernel_info{ scalar_kernel, "scalar" };
+#endif
+}
+
+
+kernel_info const & get_kernel()
+{
+    static kernel_info const kernel(select_kernel());
+    return kernel;
+}
+
+
+/** \brief Encode a buffer.
+ *
+ * This function encodes all the bytes in \p src, including the last
+ * one or two bytes which get padded with '='.
+ *
+ * \param[in] src  The bytes to encode.
+ * \param[in] size  The number of bytes to encode.
+ * \param[in] readable  The number of bytes accessible from \p src.
+ * \param[out] dst  The destination, at least (size + 2) / 3 * 4 bytes.
+ */
+void encode_buffer(
+      unsigned char const * src
+    , std::size_t size
+    , std::size_t readable
+    , char * dst)
+{
+    std::size_t const done(get_kernel().f_kernel(src, size, readable, dst));
+    std::size_t const more(scalar_kernel(src + done, size - done, readable - done, dst + done / 3 * 4));
+    std::size_t const i(done + more);
+    dst += i / 3 * 4;
+
+    switch(size - i)
+    {
+    case 1:
+        dst[0] = g_base64_alphabet[src[i] >> 2];
+        dst[1] = g_base64_alphabet[(src[i] & 0x03) << 4];
+        dst[2] = '=';
+        dst[3] = '=';
+        break;
+
+    case 2:
+        dst[0] = g_base64_alphabet[src[i] >> 2];
+        dst[1] = g_base64_alphabet[((src[i] & 0x03) << 4) | (src[i + 1] >> 4)];
+        dst[2] = g_base64_alphabet[(src[i + 1] & 0x0F) << 2];
+        dst[3] = '=';
+        break;
+
+    }
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Initialize a base64 encoder.
+ *
+ * The \p line_length defines the maximum number of characters per line.
+ * RFC 2045 requires lines of at most 76 characters, which is the default.
+ * Use 0 to not wrap the output at all.
+ *
+ * \exception invalid_parameter
+ * The \p line_length must be a multiple of 4.
+ *
+ * \param[in] line_length  The length of the output lines.
+ */
+base64_encoder::base64_encoder(std::size_t line_length)
+    : f_line_length(line_length)
+    , f_line_input(line_length == 0 ? UNWRAPPED_BLOCK_SIZE : line_length / 4 * 3)
+{
+    if(line_length % 4 != 0)
+    {
+        throw invalid_parameter(
+                  "base64_encoder::base64_encoder(): the line length ("
+                + std::to_string(line_length)
+                + ") must be a multiple of 4.");
+    }
+}
+
+
+/** \brief Add data to be encoded.
+ *
+ * The data gets encoded immediately except for the last incomplete line,
+ * which is kept until more data is added or finish() gets called.
+ *
+ * \param[in] data  The data to encode.
+ * \param[in] size  The size of \p data in bytes.
+ */
+void base64_encoder::add_input(char const * data, std::size_t size)
+{
+    unsigned char const * s(reinterpret_cast<unsigned char const *>(data));
+
+    if(!f_pending.empty())
+    {
+        std::size_t const missing(std::min(size, f_line_input - f_pending.length()));
+        f_pending.append(data, missing);
+        s += missing;
+        size -= missing;
+        if(f_pending.length() < f_line_input)
+        {
+            return;
+        }
+        encode_line(
+                  reinterpret_cast<unsigned char const *>(f_pending.data())
+                , f_pending.length()
+                , f_pending.length());
+        f_pending.clear();
+    }
+
+    for(; size >= f_line_input; s += f_line_input, size -= f_line_input)
+    {
+        encode_line(s, f_line_input, size);
+    }
+
+    f_pending.assign(reinterpret_cast<char const *>(s), size);
+}
+
+
+/** \brief Add data to be encoded.
+ *
+ * \param[in] data  The data to encode.
+ */
+void base64_encoder::add_input(std::string_view const & data)
+{
+    add_input(data.data(), data.length());
+}
+
+
+/** \brief Retrieve the output generated so far.
+ *
+ * When streaming, the caller can send this output and then clear() it
+ * so the encoder does not keep the whole result in memory.
+ *
+ * \return A reference to the output buffer.
+ */
+std::string & base64_encoder::get_output()
+{
+    return f_output;
+}
+
+
+/** \brief Encode the last bytes.
+ *
+ * This function encodes the last incomplete line and pads it as required.
+ * No new line is added after the last line.
+ *
+ * \return A reference to the output buffer.
+ */
+std::string const & base64_encoder::finish()
+{
+    if(!f_pending.empty())
+    {
+        encode_line(
+                  reinterpret_cast<unsigned char const *>(f_pending.data())
+                , f_pending.length()
+                , f_pending.length());
+        f_pending.clear();
+    }
+
+    return f_output;
+}
+
+
+/** \brief Encode one line in the output buffer.
+ *
+ * \param[in] data  The data to encode.
+ * \param[in] size  The number of bytes to encode.
+ * \param[in] readable  The number of bytes accessible from \p data.
+ */
+void base64_encoder::encode_line(
+      unsigned char const * data
+    , std::size_t size
+    , std::size_t readable)
+{
+    if(f_need_newline)
+    {
+        f_output += '\n';
+    }
+
+    std::size_t const pos(f_output.length());
+    f_output.resize(pos + (size + 2) / 3 * 4);
+    encode_buffer(data, size, readable, f_output.data() + pos);
+
+    f_need_newline = f_line_length != 0;
+}
+
+
+/** \brief Encode a buffer in one go.
+ *
+ * \param[in] data  The data to encode.
+ * \param[in] line_length  The length of the output lines, 0 to not wrap.
+ *
+ * \return The encoded data.
+ */
+std::string base64_encoder::encode(std::string_view const & data, std::size_t line_length)
+{
+    metrics_timer timer(metric_stage_t::METRIC_STAGE_BASE64);
+
+    base64_encoder encoder(line_length);
+    encoder.f_output.reserve(encoded_size(data.length(), line_length));
+    encoder.add_input(data);
+    encoder.finish();
+    return std::move(encoder.f_output);
+}
+
+
+/** \brief Compute the size of the encoded data.
+ *
+ * \param[in] size  The size of the data to encode.
+ * \param[in] line_length  The length of the output lines, 0 to not wrap.
+ *
+ * \return The size of the output including the new lines.
+ */
+std::size_t base64_encoder::encoded_size(std::size_t size, std::size_t line_length)
+{
+    std::size_t const result((size + 2) / 3 * 4);
+    if(line_length == 0
+    || result == 0)
+    {
+        return result;
+    }
+
+    return result + (result - 1) / line_length;
+}
+
+
+/** \brief Decode base64 data.
+ *
+ * Characters which are not part of the base64 alphabet (i.e. new lines)
+ * are ignored, as required by RFC 2045. Decoding stops at the first
+ * padding character.
+ *
+ * \param[in] data  The data to decode.
+ *
+ * \return The decoded data.
+ */
+std::string base64_decode(std::string_view const & data)
+{
+    std::string result;
+    result.reserve(data.length() / 4 * 3);
+
+    std::uint32_t v(0);
+    int bits(0);
+    for(char const c : data)
+    {
+        int n;
+        if(c >= 'A' && c <= 'Z')
+        {
+            n = c - 'A';
+        }
+        else if(c >= 'a' && c <= 'z')
+        {
+            n = c - 'a' + 26;
+        }
+        else if(c >= '0' && c <= '9')
+        {
+            n = c - '0' + 52;
+        }
+        else if(c == '+')
+        {
+            n = 62;
+        }
+        else if(c == '/')
+        {
+            n = 63;
+        }
+        else if(c == '=')
+        {
+            break;
+        }
+        else
+        {
+            continue;
+        }
+
+        v = (v << 6) | n;
+        bits += 6;
+        if(bits >= 8)
+        {
+            bits -= 8;
+            result += static_cast<char>((v >> bits) & 0xFF);
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Get the name of the encoding kernel in use.
+ *
+ * This is mainly useful for benchmarks and logs.
+ *
+ * \return One of "avx2", "ssse3", "neon", or "scalar".
+ */
+char const * base64_kernel_name()
+{
+    return get_kernel().f_name;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
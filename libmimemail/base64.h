@@ -0,0 +1,67 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <string>
+#include    <string_view>
+
+
+
+namespace libmimemail
+{
+
+
+
+class base64_encoder
+{
+public:
+    static constexpr std::size_t const  LINE_LENGTH = 76;
+
+                            base64_encoder(std::size_t line_length = LINE_LENGTH);
+
+    void                    add_input(char const * data, std::size_t size);
+    void                    add_input(std::string_view const & data);
+    std::string &           get_output();
+    std::string const &     finish();
+
+    static std::string      encode(std::string_view const & data, std::size_t line_length = LINE_LENGTH);
+    static std::size_t      encoded_size(std::size_t size, std::size_t line_length = LINE_LENGTH);
+
+private:
+    void                    encode_line(
+                                  unsigned char const * data
+                                , std::size_t size
+                                , std::size_t readable);
+
+    std::size_t             f_line_length = LINE_LENGTH;
+    std::size_t             f_line_input = LINE_LENGTH / 4 * 3;
+    std::string             f_pending = std::string();
+    std::string             f_output = std::string();
+    bool                    f_need_newline = false;
+};
+
+
+std::string                 base64_decode(std::string_view const & data);
+char const *                base64_kernel_name();
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,697 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Binary spool format for emails.
+ *
+ * The snapdev serializer is flexible but loading an email with it means
+ * copying every field in a new string. Queued emails are saved and loaded
+ * often so this file offers a simpler, length-prefixed binary format:
+ *
+ * \li the writer keeps references to the strings of the email, only the
+ * length prefixes are saved in its own buffer, and the whole email gets
+ * written with a single writev();
+ * \li the reader works against a buffer, generally a memory mapped file,
+ * and returns views in that buffer so the attachment data is not copied.
+ *
+ * All the numbers are saved in little endian. Strings are prefixed by
+ * a 32 bit size and data by a 64 bit size.
+ */
+
+// self
+//
+#include    "libmimemail/binary_spool.h"
+
+#include    "libmimemail/mime_writer.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C++
+//
+#include    <cstring>
+
+
+// C
+//
+#include    <endian.h>
+#include    <fcntl.h>
+#include    <sys/mman.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Check whether a buffer is an email in the binary spool format.
+ *
+ * \param[in] data  The beginning of the buffer, at least 8 bytes.
+ *
+ * \return true if \p data starts with the binary spool magic.
+ */
+bool is_binary_spool(std::string_view const & data)
+{
+    return data.length() >= sizeof(BINARY_SPOOL_MAGIC) + sizeof(std::uint32_t)
+        && memcmp(data.data(), BINARY_SPOOL_MAGIC, sizeof(BINARY_SPOOL_MAGIC)) == 0;
+}
+
+
+
+binary_spool_buffer::binary_spool_buffer()
+{
+}
+
+
+/** \brief Release the buffer.
+ *
+ * If the buffer is a memory mapped file, it gets unmapped.
+ */
+binary_spool_buffer::~binary_spool_buffer()
+{
+    if(f_map != nullptr)
+    {
+        munmap(f_map, f_map_size);
+    }
+}
+
+
+/** \brief Create a buffer from a string.
+ *
+ * \param[in] data  The data, moved in the buffer.
+ *
+ * \return The new buffer.
+ */
+binary_spool_buffer::pointer_t binary_spool_buffer::from_string(std::string && data)
+{
+    std::shared_ptr<binary_spool_buffer> buffer(new binary_spool_buffer());
+    buffer->f_string = std::move(data);
+    return buffer;
+}
+
+
+/** \brief Create a buffer by memory mapping a file.
+ *
+ * The file stays mapped as long as the buffer exists. This includes
+ * the lifetime of the attachments loaded from this buffer since their
+ * data remains in the file.
+ *
+ * \param[in] path  The path to the spool file.
+ *
+ * \return The new buffer or a null pointer if the file cannot be mapped.
+ */
+binary_spool_buffer::pointer_t binary_spool_buffer::from_file(std::string const & path)
+{
+    snapdev::raii_fd_t fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    if(fd.get() == -1)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not open spool file \""
+            << path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return pointer_t();
+    }
+
+    struct stat st;
+    if(fstat(fd.get(), &st) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not stat spool file \""
+            << path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return pointer_t();
+    }
+
+    std::shared_ptr<binary_spool_buffer> buffer(new binary_spool_buffer());
+    if(st.st_size == 0)
+    {
+        return buffer;
+    }
+
+    void * map(mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.get(), 0));
+    if(map == MAP_FAILED)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not map spool file \""
+            << path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return pointer_t();
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    buffer->f_map = map;
+    buffer->f_map_size = st.st_size;
+    return buffer;
+}
+
+
+/** \brief Create a buffer by memory mapping part of a file.
+ *
+ * Only the pages covering \p size bytes at \p offset get mapped and
+ * the data is not read until accessed. This is used to load an email
+ * from a mail_spool segment: a headers only deserialize() then never
+ * reads the pages of the attachments.
+ *
+ * The caller keeps ownership of \p fd. The mapping remains valid even
+ * after the file descriptor gets closed.
+ *
+ * \param[in] fd  The file descriptor of the file to map.
+ * \param[in] offset  The offset of the data in the file.
+ * \param[in] size  The size of the data.
+ *
+ * \return The new buffer or a null pointer with errno set if the file
+ * cannot be mapped.
+ */
+binary_spool_buffer::pointer_t binary_spool_buffer::from_file(int fd, std::uint64_t offset, std::size_t size)
+{
+    std::shared_ptr<binary_spool_buffer> buffer(new binary_spool_buffer());
+    if(size == 0)
+    {
+        return buffer;
+    }
+
+    // mmap() requires an offset which is a multiple of the page size
+    //
+    std::uint64_t const page_size(sysconf(_SC_PAGESIZE));
+    std::uint64_t const start(offset - offset % page_size);
+    std::size_t const map_size(offset - start + size);
+    void * map(mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, start));
+    if(map == MAP_FAILED)
+    {
+        return pointer_t();
+    }
+
+    buffer->f_map = map;
+    buffer->f_map_size = map_size;
+    buffer->f_map_offset = offset - start;
+    return buffer;
+}
+
+
+/** \brief Get the data of this buffer.
+ *
+ * \return A view of the whole buffer.
+ */
+std::string_view binary_spool_buffer::get_data() const
+{
+    if(f_map != nullptr)
+    {
+        return std::string_view(
+                  reinterpret_cast<char const *>(f_map) + f_map_offset
+                , f_map_size - f_map_offset);
+    }
+    return f_string;
+}
+
+
+
+/** \brief Initialize a writer.
+ *
+ * The magic and version get added immediately.
+ */
+binary_spool_writer::binary_spool_writer()
+{
+    add_scalar(BINARY_SPOOL_MAGIC, sizeof(BINARY_SPOOL_MAGIC));
+    add(BINARY_SPOOL_VERSION);
+}
+
+
+/** \brief Save the large attachments in a blob store.
+ *
+ * When a store is defined, the data of the attachments of at least
+ * blob_store::get_minimum_size() bytes gets saved in the store and the
+ * spool only holds its key. The reader needs the same store to load
+ * those attachments.
+ *
+ * \param[in] store  The store to use or nullptr to save the data inline.
+ */
+void binary_spool_writer::set_blob_store(std::shared_ptr<blob_store> store)
+{
+    f_blob_store = store;
+}
+
+
+std::shared_ptr<blob_store> binary_spool_writer::get_blob_store() const
+{
+    return f_blob_store;
+}
+
+
+void binary_spool_writer::add(std::uint8_t value)
+{
+    add_scalar(&value, sizeof(value));
+}
+
+
+void binary_spool_writer::add(std::uint32_t value)
+{
+    value = htole32(value);
+    add_scalar(&value, sizeof(value));
+}
+
+
+void binary_spool_writer::add(std::uint64_t value)
+{
+    value = htole64(value);
+    add_scalar(&value, sizeof(value));
+}
+
+
+/** \brief Add a string.
+ *
+ * The string is not copied, it must remain valid until the data was
+ * written with write() or to_string().
+ *
+ * \param[in] value  The string to add.
+ */
+void binary_spool_writer::add(std::string_view const & value)
+{
+    add(static_cast<std::uint32_t>(value.length()));
+    if(!value.empty())
+    {
+        segment s;
+        s.f_data = value.data();
+        s.f_size = value.length();
+        f_segments.push_back(s);
+        f_size += value.length();
+    }
+}
+
+
+/** \brief Add a large buffer.
+ *
+ * This is similar to add(std::string_view) with a 64 bit size. Like
+ * strings, the data is not copied.
+ *
+ * \param[in] data  The data to add.
+ */
+void binary_spool_writer::add_data(std::string_view const & data)
+{
+    add(static_cast<std::uint64_t>(data.length()));
+    if(!data.empty())
+    {
+        segment s;
+        s.f_data = data.data();
+        s.f_size = data.length();
+        f_segments.push_back(s);
+        f_size += data.length();
+    }
+}
+
+
+/** \brief Get the total size of the data added so far.
+ *
+ * \return The number of bytes that write() sends to the sink.
+ */
+std::size_t binary_spool_writer::size() const
+{
+    return f_size;
+}
+
+
+/** \brief Write the data to a sink.
+ *
+ * The sink receives all the data in one call. With an fd_mime_sink,
+ * this means one writev() (unless the email has more than IOV_MAX
+ * strings).
+ *
+ * \param[in] sink  The sink receiving the data.
+ *
+ * \return true if the sink accepted the data.
+ */
+bool binary_spool_writer::write(mime_sink & sink) const
+{
+    std::vector<iovec> const iov(get_iovec());
+    return sink.write(iov.data(), static_cast<int>(iov.size()));
+}
+
+
+/** \brief Get the data in a string.
+ *
+ * \return A copy of all the data.
+ */
+std::string binary_spool_writer::to_string() const
+{
+    std::string result;
+    result.reserve(f_size);
+    for(auto const & v : get_iovec())
+    {
+        result.append(reinterpret_cast<char const *>(v.iov_base), v.iov_len);
+    }
+    return result;
+}
+
+
+void binary_spool_writer::add_scalar(void const * data, std::size_t size)
+{
+    // consecutive scalars share one segment
+    //
+    if(f_segments.empty()
+    || f_segments.back().f_data != nullptr)
+    {
+        segment s;
+        s.f_offset = f_scalars.length();
+        f_segments.push_back(s);
+    }
+    f_scalars.append(reinterpret_cast<char const *>(data), size);
+    f_segments.back().f_size += size;
+    f_size += size;
+}
+
+
+/** \brief Get the data as a list of buffers.
+ *
+ * The buffers remain valid until the writer or the strings it references
+ * get modified.
+ *
+ * \return The buffers to write, in order.
+ */
+std::vector<iovec> binary_spool_writer::get_iovec() const
+{
+    // the scalars buffer may have moved while growing so the pointers
+    // are only computed here
+    //
+    std::vector<iovec> result;
+    result.reserve(f_segments.size());
+    for(auto const & s : f_segments)
+    {
+        iovec v;
+        v.iov_base = const_cast<char *>(s.f_data == nullptr
+                                    ? f_scalars.data() + s.f_offset
+                                    : s.f_data);
+        v.iov_len = s.f_size;
+        result.push_back(v);
+    }
+    return result;
+}
+
+
+
+/** \brief Initialize a reader.
+ *
+ * \exception invalid_parameter
+ * The \p buffer cannot be a null pointer.
+ *
+ * \param[in] buffer  The buffer to read.
+ */
+binary_spool_reader::binary_spool_reader(binary_spool_buffer::pointer_t buffer)
+    : f_buffer(buffer)
+{
+    if(f_buffer != nullptr)
+    {
+        f_data = f_buffer->get_data();
+    }
+    else
+    {
+        f_failed = true;
+    }
+}
+
+
+/** \brief Read and verify the magic and version.
+ *
+ * \return true if the buffer is in a binary spool format this version
+ * of the library supports.
+ */
+bool binary_spool_reader::read_magic()
+{
+    if(!is_binary_spool(f_data.substr(f_offset)))
+    {
+        f_failed = true;
+        return false;
+    }
+    f_offset += sizeof(BINARY_SPOOL_MAGIC);
+
+    if(!read(f_version))
+    {
+        return false;
+    }
+    if(f_version > BINARY_SPOOL_VERSION)
+    {
+        SNAP_LOG_ERROR
+            << "binary spool version "
+            << f_version
+            << " is not supported (newest supported version is "
+            << BINARY_SPOOL_VERSION
+            << ")."
+            << SNAP_LOG_SEND;
+        f_failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+
+/** \brief Define the version of the data being read.
+ *
+ * This is used when the reader does not start at the beginning of the
+ * spool, i.e. to load the attachments of an email which was first
+ * loaded headers only. The version is then the one read by the
+ * read_magic() of the first reader.
+ *
+ * \param[in] version  The version of the binary spool format.
+ */
+void binary_spool_reader::set_version(std::uint32_t version)
+{
+    f_version = version;
+}
+
+
+/** \brief Get the version read by read_magic().
+ *
+ * \return The version of the binary spool format or 0.
+ */
+std::uint32_t binary_spool_reader::get_version() const
+{
+    return f_version;
+}
+
+
+bool binary_spool_reader::read(std::uint8_t & value)
+{
+    return read_scalar(&value, sizeof(value));
+}
+
+
+bool binary_spool_reader::read(std::uint32_t & value)
+{
+    if(!read_scalar(&value, sizeof(value)))
+    {
+        return false;
+    }
+    value = le32toh(value);
+    return true;
+}
+
+
+bool binary_spool_reader::read(std::uint64_t & value)
+{
+    if(!read_scalar(&value, sizeof(value)))
+    {
+        return false;
+    }
+    value = le64toh(value);
+    return true;
+}
+
+
+/** \brief Read a string as a view in the buffer.
+ *
+ * The view remains valid as long as the buffer exists.
+ *
+ * \param[out] value  The view of the string.
+ *
+ * \return true if the string was read.
+ */
+bool binary_spool_reader::read(std::string_view & value)
+{
+    std::uint32_t size(0);
+    if(!read(size))
+    {
+        return false;
+    }
+    if(size > f_data.length() - f_offset)
+    {
+        f_failed = true;
+        return false;
+    }
+    value = f_data.substr(f_offset, size);
+    f_offset += size;
+    return true;
+}
+
+
+bool binary_spool_reader::read(std::string & value)
+{
+    std::string_view v;
+    if(!read(v))
+    {
+        return false;
+    }
+    value = std::string(v);
+    return true;
+}
+
+
+/** \brief Read data added with binary_spool_writer::add_data().
+ *
+ * \param[out] data  The view of the data.
+ *
+ * \return true if the data was read.
+ */
+bool binary_spool_reader::read_data(std::string_view & data)
+{
+    std::uint64_t size(0);
+    if(!read(size))
+    {
+        return false;
+    }
+    if(size > f_data.length() - f_offset)
+    {
+        f_failed = true;
+        return false;
+    }
+    data = f_data.substr(f_offset, size);
+    f_offset += size;
+    return true;
+}
+
+
+std::size_t binary_spool_reader::get_offset() const
+{
+    return f_offset;
+}
+
+
+bool binary_spool_reader::set_offset(std::size_t offset)
+{
+    if(offset > f_data.length())
+    {
+        f_failed = true;
+        return false;
+    }
+    f_offset = offset;
+    return true;
+}
+
+
+/** \brief Get the number of bytes left to read.
+ *
+ * This is used to verify counts read from the buffer before using them.
+ *
+ * \return The number of bytes after the current offset.
+ */
+std::size_t binary_spool_reader::get_remaining() const
+{
+    return f_data.length() - f_offset;
+}
+
+
+/** \brief Check whether a read failed.
+ *
+ * Once a read failed, for example because the buffer is truncated, all
+ * the following reads fail.
+ *
+ * \return true if a read failed.
+ */
+bool binary_spool_reader::has_failed() const
+{
+    return f_failed;
+}
+
+
+/** \brief Get the buffer being read.
+ *
+ * This is used to keep the buffer alive when creating views in it.
+ *
+ * \return The buffer.
+ */
+binary_spool_buffer::pointer_t binary_spool_reader::get_buffer() const
+{
+    return f_buffer;
+}
+
+
+/** \brief Define the store holding the blobs referenced by the spool.
+ *
+ * \param[in] store  The store used when the data was saved.
+ */
+void binary_spool_reader::set_blob_store(std::shared_ptr<blob_store> store)
+{
+    f_blob_store = store;
+}
+
+
+std::shared_ptr<blob_store> binary_spool_reader::get_blob_store() const
+{
+    return f_blob_store;
+}
+
+
+bool binary_spool_reader::read_scalar(void * value, std::size_t size)
+{
+    if(f_failed
+    || size > f_data.length() - f_offset)
+    {
+        f_failed = true;
+        return false;
+    }
+    memcpy(value, f_data.data() + f_offset, size);
+    f_offset += size;
+    return true;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,166 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <cstdint>
+#include    <memory>
+#include    <string>
+#include    <string_view>
+#include    <vector>
+
+
+// C
+//
+#include    <sys/uio.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class blob_store;
+class mime_sink;
+
+
+// the binary spool starts with this magic followed by the version,
+// the snapdev serializer format starts with a different magic so both
+// formats can coexist in one spool
+//
+// version 2 added the attachments saved in a blob_store
+//
+constexpr char const            BINARY_SPOOL_MAGIC[4] = { 'L', 'M', 'M', 'B' };
+constexpr std::uint32_t const   BINARY_SPOOL_VERSION = 2;
+
+bool                        is_binary_spool(std::string_view const & data);
+
+
+class binary_spool_buffer
+{
+public:
+    typedef std::shared_ptr<binary_spool_buffer const>  pointer_t;
+
+                            binary_spool_buffer(binary_spool_buffer const &) = delete;
+                            ~binary_spool_buffer();
+
+    binary_spool_buffer &   operator = (binary_spool_buffer const &) = delete;
+
+    static pointer_t        from_string(std::string && data);
+    static pointer_t        from_file(std::string const & path);
+    static pointer_t        from_file(int fd, std::uint64_t offset, std::size_t size);
+
+    std::string_view        get_data() const;
+
+private:
+                            binary_spool_buffer();
+
+    std::string             f_string = std::string();
+    void *                  f_map = nullptr;
+    std::size_t             f_map_size = 0;
+    std::size_t             f_map_offset = 0;
+};
+
+
+class binary_spool_writer
+{
+public:
+                            binary_spool_writer();
+
+    void                    set_blob_store(std::shared_ptr<blob_store> store);
+    std::shared_ptr<blob_store>
+                            get_blob_store() const;
+
+    void                    add(std::uint8_t value);
+    void                    add(std::uint32_t value);
+    void                    add(std::uint64_t value);
+    void                    add(std::string_view const & value);
+    void                    add_data(std::string_view const & data);
+
+    std::size_t             size() const;
+    bool                    write(mime_sink & sink) const;
+    std::string             to_string() const;
+    std::vector<iovec>      get_iovec() const;
+
+private:
+    // a segment is either a run of f_scalars (data is nullptr) or a
+    // reference to a string saved by the caller
+    //
+    struct segment
+    {
+        char const *        f_data = nullptr;
+        std::size_t         f_offset = 0;
+        std::size_t         f_size = 0;
+    };
+    typedef std::vector<segment>    segment_vector_t;
+
+    void                    add_scalar(void const * data, std::size_t size);
+
+    std::string             f_scalars = std::string();
+    segment_vector_t        f_segments = segment_vector_t();
+    std::size_t             f_size = 0;
+    std::shared_ptr<blob_store>
+                            f_blob_store = std::shared_ptr<blob_store>();
+};
+
+
+class binary_spool_reader
+{
+public:
+                            binary_spool_reader(binary_spool_buffer::pointer_t buffer);
+
+    bool                    read_magic();
+    void                    set_version(std::uint32_t version);
+    std::uint32_t           get_version() const;
+
+    bool                    read(std::uint8_t & value);
+    bool                    read(std::uint32_t & value);
+    bool                    read(std::uint64_t & value);
+    bool                    read(std::string_view & value);
+    bool                    read(std::string & value);
+    bool                    read_data(std::string_view & data);
+
+    std::size_t             get_offset() const;
+    bool                    set_offset(std::size_t offset);
+    std::size_t             get_remaining() const;
+    bool                    has_failed() const;
+    binary_spool_buffer::pointer_t
+                            get_buffer() const;
+    void                    set_blob_store(std::shared_ptr<blob_store> store);
+    std::shared_ptr<blob_store>
+                            get_blob_store() const;
+
+private:
+    bool                    read_scalar(void * value, std::size_t size);
+
+    binary_spool_buffer::pointer_t
+                            f_buffer = binary_spool_buffer::pointer_t();
+    std::string_view        f_data = std::string_view();
+    std::size_t             f_offset = 0;
+    std::uint32_t           f_version = 0;
+    bool                    f_failed = false;
+    std::shared_ptr<blob_store>
+                            f_blob_store = std::shared_ptr<blob_store>();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
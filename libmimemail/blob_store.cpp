@@ -0,0 +1,838 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief A content-addressed store of attachment data.
+ *
+ * A campaign sends the same attachments to many recipients. When each
+ * email gets saved in a spool, the data of those attachments would be
+ * written once per email. With a blob_store attached to the spool, the
+ * data is saved once under its SHA-256 and the emails only hold the
+ * key (see attachment::serialize()).
+ *
+ * Each blob is a file named after its key, in a sub-directory named
+ * after the first two characters of the key, so no directory ends up
+ * with too many files. When the library is compiled with zstd, the
+ * blobs can be compressed; those files get a ".zst" extension.
+ * Uncompressed blobs are memory mapped when loaded.
+ *
+ * A blob gets written to a temporary file, synced, then renamed so a
+ * key found in the store always references complete data. Since many
+ * emails share one blob, blobs are not removed along the emails; use
+ * collect_garbage() (see mail_spool::collect_blobs()) once in a while.
+ */
+
+// self
+//
+#include    "libmimemail/blob_store.h"
+
+#include    "libmimemail/exception.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/not_used.h>
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// OpenSSL
+//
+#include    <openssl/evp.h>
+
+
+// zstd
+//
+#ifdef LIBMIMEMAIL_ZSTD
+#include    <zstd.h>
+#endif
+
+
+// C++
+//
+#include    <cstring>
+
+
+// C
+//
+#include    <dirent.h>
+#include    <fcntl.h>
+#include    <sys/stat.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief The length of a key, the SHA-256 in hexadecimal.
+ */
+constexpr std::size_t const     KEY_LENGTH = 64;
+
+
+/** \brief The extension of the compressed blobs.
+ */
+constexpr char const            COMPRESSED_EXTENSION[] = ".zst";
+
+
+/** \brief The prefix of the files being written.
+ */
+constexpr char const            TEMPORARY_PREFIX[] = "tmp-";
+
+
+/** \brief Check that a key is a valid SHA-256.
+ *
+ * The keys come from spool files so they get checked before they are
+ * used to build a path.
+ *
+ * \param[in] key  The key to check.
+ *
+ * \return true if \p key is 64 lowercase hexadecimal digits.
+ */
+bool is_valid_key(std::string const & key)
+{
+    if(key.length() != KEY_LENGTH)
+    {
+        return false;
+    }
+    for(char const c : key)
+    {
+        if((c < '0' || c > '9')
+        && (c < 'a' || c > 'f'))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/** \brief Close a directory handle.
+ */
+struct dir_deleter
+{
+    void operator () (DIR * dir) const
+    {
+        closedir(dir);
+    }
+};
+
+
+void sync_directory(std::string const & path)
+{
+    snapdev::raii_fd_t dir(::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(dir.get() == -1
+    || fsync(dir.get()) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_WARNING
+            << "could not sync blob store directory \""
+            << path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+    }
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Initialize a blob store.
+ *
+ * The store is not usable until open() was called.
+ *
+ * \exception invalid_parameter
+ * The path cannot be empty.
+ *
+ * \param[in] path  The directory holding the blobs.
+ */
+blob_store::blob_store(std::string const & path)
+    : f_path(path)
+{
+    if(f_path.empty())
+    {
+        throw invalid_parameter("the blob store path cannot be empty.");
+    }
+}
+
+
+/** \brief Check whether the blobs can be compressed.
+ *
+ * \return true if the library was compiled with zstd.
+ */
+bool blob_store::has_compression()
+{
+#ifdef LIBMIMEMAIL_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
+
+
+/** \brief Compute the key of some data.
+ *
+ * \param[in] data  The data of a blob.
+ *
+ * \return The SHA-256 of \p data in lowercase hexadecimal.
+ */
+std::string blob_store::compute_key(std::string_view const & data)
+{
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size(0);
+    if(EVP_Digest(data.data(), data.length(), digest, &size, EVP_sha256(), nullptr) != 1)
+    {
+        throw libmimemail_logic_error("blob_store::compute_key(): the SHA-256 digest failed.");
+    }
+
+    char const hex[] = "0123456789abcdef";
+    std::string key;
+    key.reserve(size * 2);
+    for(unsigned int idx(0); idx < size; ++idx)
+    {
+        key += hex[digest[idx] >> 4];
+        key += hex[digest[idx] & 15];
+    }
+    return key;
+}
+
+
+std::string const & blob_store::get_path() const
+{
+    return f_path;
+}
+
+
+/** \brief Change the compression of the new blobs.
+ *
+ * A level of 0 saves the blobs as is. Otherwise this is the zstd
+ * compression level. A blob is only saved compressed if that makes
+ * it smaller. Existing blobs are not modified.
+ *
+ * \exception invalid_parameter
+ * The library was compiled without zstd and \p level is not 0.
+ *
+ * \param[in] level  The compression level.
+ */
+void blob_store::set_compression_level(int level)
+{
+    if(level != 0
+    && !has_compression())
+    {
+        throw invalid_parameter("blob_store::set_compression_level(): this library was compiled without zstd.");
+    }
+    if(level < 0)
+    {
+        throw invalid_parameter("blob_store::set_compression_level(): the level cannot be negative.");
+    }
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_compression_level = level;
+}
+
+
+int blob_store::get_compression_level() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_compression_level;
+}
+
+
+/** \brief Change the size under which the data stays in the emails.
+ *
+ * Saving small attachments in the store is not worth an extra file.
+ *
+ * \param[in] size  The minimum size of a blob in bytes.
+ */
+void blob_store::set_minimum_size(std::size_t size)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_minimum_size = size;
+}
+
+
+std::size_t blob_store::get_minimum_size() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_minimum_size;
+}
+
+
+/** \brief Create the store directory if it does not exist yet.
+ *
+ * \return true if the store is ready.
+ */
+bool blob_store::open()
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    if(f_opened)
+    {
+        return true;
+    }
+
+    if(mkdir(f_path.c_str(), 0700) != 0
+    && errno != EEXIST)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create blob store directory \""
+            << f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    f_opened = true;
+    return true;
+}
+
+
+/** \brief Save a blob.
+ *
+ * If the store already has the blob, nothing gets written. Its
+ * modification time gets updated instead so collect_garbage() sees
+ * it as in use.
+ *
+ * \exception invalid_parameter
+ * The key is not a valid key or the store was not opened.
+ *
+ * \param[in] key  The key of the data as returned by compute_key().
+ * \param[in] data  The data of the blob.
+ *
+ * \return true if the blob is in the store.
+ */
+bool blob_store::put(std::string const & key, std::string_view const & data)
+{
+    if(!is_valid_key(key))
+    {
+        throw invalid_parameter("blob_store::put(): \"" + key + "\" is not a valid blob key.");
+    }
+
+    int level(0);
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        if(!f_opened)
+        {
+            throw invalid_parameter("blob_store::put() called before open().");
+        }
+
+        // a blob we already have gets its modification time refreshed
+        // so a concurrent collect_garbage() does not remove it
+        //
+        if(touch(key))
+        {
+            f_known.insert(key);
+            return true;
+        }
+        f_known.erase(key);
+        level = f_compression_level;
+    }
+
+    std::string const dir(f_path + '/' + key.substr(0, 2));
+    if(mkdir(dir.c_str(), 0700) != 0
+    && errno != EEXIST)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create blob store directory \""
+            << dir
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    bool compressed(false);
+    std::string buffer;
+#ifdef LIBMIMEMAIL_ZSTD
+    if(level > 0)
+    {
+        buffer.resize(ZSTD_compressBound(data.length()));
+        std::size_t const size(ZSTD_compress(
+                  buffer.data()
+                , buffer.length()
+                , data.data()
+                , data.length()
+                , level));
+        if(!ZSTD_isError(size)
+        && size < data.length())
+        {
+            buffer.resize(size);
+            compressed = true;
+        }
+    }
+#else
+    snapdev::NOT_USED(level);
+#endif
+
+    if(!write_file(
+              get_filename(key, compressed)
+            , compressed ? std::string_view(buffer) : data))
+    {
+        return false;
+    }
+    sync_directory(dir);
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_known.insert(key);
+    return true;
+}
+
+
+/** \brief Check whether the store has a blob.
+ *
+ * \param[in] key  The key of the blob.
+ *
+ * \return true if the blob exists.
+ */
+bool blob_store::contains(std::string const & key) const
+{
+    if(!is_valid_key(key))
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        if(f_known.find(key) != f_known.end())
+        {
+            return true;
+        }
+    }
+
+    struct stat st;
+    if(stat(get_filename(key, false).c_str(), &st) != 0
+    && stat(get_filename(key, true).c_str(), &st) != 0)
+    {
+        return false;
+    }
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_known.insert(key);
+    return true;
+}
+
+
+/** \brief Load a blob.
+ *
+ * An uncompressed blob is memory mapped. A compressed blob gets
+ * decompressed in memory.
+ *
+ * \param[in] key  The key of the blob.
+ *
+ * \return The data of the blob or a null pointer if it cannot be loaded.
+ */
+binary_spool_buffer::pointer_t blob_store::get(std::string const & key) const
+{
+    if(!is_valid_key(key))
+    {
+        SNAP_LOG_ERROR
+            << "\""
+            << key
+            << "\" is not a valid blob key."
+            << SNAP_LOG_SEND;
+        return binary_spool_buffer::pointer_t();
+    }
+
+    std::string const filename(get_filename(key, false));
+    if(access(filename.c_str(), F_OK) == 0)
+    {
+        return binary_spool_buffer::from_file(filename);
+    }
+
+    std::string const compressed_filename(get_filename(key, true));
+    if(access(compressed_filename.c_str(), F_OK) != 0)
+    {
+        SNAP_LOG_ERROR
+            << "blob \""
+            << key
+            << "\" not found in blob store \""
+            << f_path
+            << "\"."
+            << SNAP_LOG_SEND;
+        return binary_spool_buffer::pointer_t();
+    }
+
+#ifdef LIBMIMEMAIL_ZSTD
+    binary_spool_buffer::pointer_t const file(binary_spool_buffer::from_file(compressed_filename));
+    if(file == nullptr)
+    {
+        return file;
+    }
+    std::string_view const compressed(file->get_data());
+    unsigned long long const size(ZSTD_getFrameContentSize(compressed.data(), compressed.length()));
+    if(size == ZSTD_CONTENTSIZE_ERROR
+    || size == ZSTD_CONTENTSIZE_UNKNOWN)
+    {
+        SNAP_LOG_ERROR
+            << "blob \""
+            << compressed_filename
+            << "\" is not a valid zstd frame."
+            << SNAP_LOG_SEND;
+        return binary_spool_buffer::pointer_t();
+    }
+    std::string data(size, '\0');
+    std::size_t const r(ZSTD_decompress(
+              data.data()
+            , data.length()
+            , compressed.data()
+            , compressed.length()));
+    if(ZSTD_isError(r)
+    || r != size)
+    {
+        SNAP_LOG_ERROR
+            << "could not decompress blob \""
+            << compressed_filename
+            << "\"."
+            << SNAP_LOG_SEND;
+        return binary_spool_buffer::pointer_t();
+    }
+    return binary_spool_buffer::from_string(std::move(data));
+#else
+    SNAP_LOG_ERROR
+        << "blob \""
+        << compressed_filename
+        << "\" is compressed but this library was compiled without zstd."
+        << SNAP_LOG_SEND;
+    return binary_spool_buffer::pointer_t();
+#endif
+}
+
+
+/** \brief Remove a blob.
+ *
+ * \param[in] key  The key of the blob to remove.
+ *
+ * \return true if the blob was removed.
+ */
+bool blob_store::remove(std::string const & key)
+{
+    if(!is_valid_key(key))
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        f_known.erase(key);
+    }
+
+    bool const removed(unlink(get_filename(key, false).c_str()) == 0);
+    bool const removed_compressed(unlink(get_filename(key, true).c_str()) == 0);
+    return removed || removed_compressed;
+}
+
+
+/** \brief Get the keys of all the blobs.
+ *
+ * \return The list of keys found in the store directory.
+ */
+std::vector<std::string> blob_store::get_keys() const
+{
+    std::vector<std::string> result;
+
+    std::unique_ptr<DIR, dir_deleter> top(opendir(f_path.c_str()));
+    if(top == nullptr)
+    {
+        return result;
+    }
+    for(dirent * sub(readdir(top.get())); sub != nullptr; sub = readdir(top.get()))
+    {
+        if(strlen(sub->d_name) != 2
+        || sub->d_name[0] == '.')
+        {
+            continue;
+        }
+        std::unique_ptr<DIR, dir_deleter> dir(opendir((f_path + '/' + sub->d_name).c_str()));
+        if(dir == nullptr)
+        {
+            continue;
+        }
+        for(dirent * ent(readdir(dir.get())); ent != nullptr; ent = readdir(dir.get()))
+        {
+            std::string const key(std::string(ent->d_name).substr(0, KEY_LENGTH));
+            if(is_valid_key(key)
+            && (ent->d_name[KEY_LENGTH] == '\0'
+                || strcmp(ent->d_name + KEY_LENGTH, COMPRESSED_EXTENSION) == 0))
+            {
+                result.push_back(key);
+            }
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Remove the blobs which are not referenced anymore.
+ *
+ * Blobs modified at or after \p before are kept. Use the time at which
+ * the list of \p referenced keys started to be gathered so a blob saved
+ * or reused by put() for a new email in the meantime does not get
+ * removed. The leftovers
+ * of interrupted writes get removed too.
+ *
+ * \param[in] referenced  The keys of the blobs still in use.
+ * \param[in] before  Only remove blobs older than this time.
+ *
+ * \return The number of files removed.
+ */
+std::size_t blob_store::collect_garbage(key_set_t const & referenced, time_t before)
+{
+    std::size_t count(0);
+
+    std::unique_ptr<DIR, dir_deleter> top(opendir(f_path.c_str()));
+    if(top == nullptr)
+    {
+        return count;
+    }
+    for(dirent * sub(readdir(top.get())); sub != nullptr; sub = readdir(top.get()))
+    {
+        if(strlen(sub->d_name) != 2
+        || sub->d_name[0] == '.')
+        {
+            continue;
+        }
+        std::string const dir_path(f_path + '/' + sub->d_name);
+        std::unique_ptr<DIR, dir_deleter> dir(opendir(dir_path.c_str()));
+        if(dir == nullptr)
+        {
+            continue;
+        }
+        for(dirent * ent(readdir(dir.get())); ent != nullptr; ent = readdir(dir.get()))
+        {
+            if(ent->d_name[0] == '.')
+            {
+                continue;
+            }
+            std::string const key(std::string(ent->d_name).substr(0, KEY_LENGTH));
+            bool const temporary(strncmp(ent->d_name, TEMPORARY_PREFIX, sizeof(TEMPORARY_PREFIX) - 1) == 0);
+            if(!temporary
+            && (!is_valid_key(key)
+                || referenced.find(key) != referenced.end()))
+            {
+                continue;
+            }
+
+            // put() refreshes the time under the same lock so a blob
+            // reused while we check it cannot be removed
+            //
+            std::string const filename(dir_path + '/' + ent->d_name);
+            std::lock_guard<std::mutex> lock(f_mutex);
+            struct stat st;
+            if(stat(filename.c_str(), &st) != 0
+            || st.st_mtime >= before)
+            {
+                continue;
+            }
+
+            if(!temporary)
+            {
+                f_known.erase(key);
+            }
+            if(unlink(filename.c_str()) == 0)
+            {
+                ++count;
+            }
+        }
+    }
+
+    return count;
+}
+
+
+/** \brief Get the name of the file of a blob.
+ *
+ * \param[in] key  The key of the blob.
+ * \param[in] compressed  Whether the name of the compressed file is wanted.
+ *
+ * \return The path to the blob file.
+ */
+std::string blob_store::get_filename(std::string const & key, bool compressed) const
+{
+    std::string filename(f_path);
+    filename += '/';
+    filename += key.substr(0, 2);
+    filename += '/';
+    filename += key;
+    if(compressed)
+    {
+        filename += COMPRESSED_EXTENSION;
+    }
+    return filename;
+}
+
+
+/** \brief Refresh the modification time of a blob.
+ *
+ * The caller must hold f_mutex.
+ *
+ * \param[in] key  The key of the blob.
+ *
+ * \return true if the blob exists.
+ */
+bool blob_store::touch(std::string const & key) const
+{
+    bool const touched(utimensat(AT_FDCWD, get_filename(key, false).c_str(), nullptr, 0) == 0);
+    bool const touched_compressed(utimensat(AT_FDCWD, get_filename(key, true).c_str(), nullptr, 0) == 0);
+    return touched || touched_compressed;
+}
+
+
+/** \brief Write a blob file.
+ *
+ * The data is written to a temporary file in the same directory, synced,
+ * then renamed.
+ *
+ * \param[in] filename  The final name of the blob file.
+ * \param[in] data  The data to write.
+ *
+ * \return true if the file was written.
+ */
+bool blob_store::write_file(std::string const & filename, std::string_view const & data)
+{
+    std::uint64_t sequence(0);
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        sequence = ++f_sequence;
+    }
+    std::string const dir(filename.substr(0, filename.rfind('/') + 1));
+    std::string const temporary(
+              dir
+            + TEMPORARY_PREFIX
+            + std::to_string(getpid())
+            + '-'
+            + std::to_string(sequence));
+
+    {
+        snapdev::raii_fd_t fd(::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600));
+        if(fd.get() == -1)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not create blob file \""
+                << temporary
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+
+        char const * s(data.data());
+        std::size_t size(data.length());
+        while(size > 0)
+        {
+            ssize_t const r(::write(fd.get(), s, size));
+            if(r < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "could not write blob file \""
+                    << temporary
+                    << "\" (errno: "
+                    << e
+                    << ", "
+                    << strerror(e)
+                    << ")."
+                    << SNAP_LOG_SEND;
+                unlink(temporary.c_str());
+                return false;
+            }
+            s += r;
+            size -= r;
+        }
+
+        if(fdatasync(fd.get()) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not sync blob file \""
+                << temporary
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            unlink(temporary.c_str());
+            return false;
+        }
+    }
+
+    if(rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not rename blob file \""
+            << temporary
+            << "\" to \""
+            << filename
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        unlink(temporary.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,99 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/binary_spool.h>
+
+
+// C++
+//
+#include    <memory>
+#include    <mutex>
+#include    <set>
+#include    <string>
+#include    <string_view>
+#include    <vector>
+
+
+// C
+//
+#include    <time.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class blob_store
+{
+public:
+    typedef std::shared_ptr<blob_store>     pointer_t;
+    typedef std::set<std::string>           key_set_t;
+
+    static constexpr std::size_t const      DEFAULT_MINIMUM_SIZE = 4 * 1024;
+
+                            blob_store(std::string const & path);
+                            blob_store(blob_store const &) = delete;
+
+    blob_store &            operator = (blob_store const &) = delete;
+
+    static bool             has_compression();
+    static std::string      compute_key(std::string_view const & data);
+
+    std::string const &     get_path() const;
+    void                    set_compression_level(int level);
+    int                     get_compression_level() const;
+    void                    set_minimum_size(std::size_t size);
+    std::size_t             get_minimum_size() const;
+    bool                    open();
+
+    bool                    put(std::string const & key, std::string_view const & data);
+    bool                    contains(std::string const & key) const;
+    binary_spool_buffer::pointer_t
+                            get(std::string const & key) const;
+    bool                    remove(std::string const & key);
+    std::vector<std::string>
+                            get_keys() const;
+    std::size_t             collect_garbage(key_set_t const & referenced, time_t before);
+
+private:
+    std::string             get_filename(std::string const & key, bool compressed) const;
+    bool                    touch(std::string const & key) const;
+    bool                    write_file(std::string const & filename, std::string_view const & data);
+
+    std::string             f_path = std::string();
+    int                     f_compression_level = 0;
+    std::size_t             f_minimum_size = DEFAULT_MINIMUM_SIZE;
+
+    // the keys known to be on disk, so contains() does not even need
+    // a stat()
+    //
+    mutable std::mutex      f_mutex = std::mutex();
+    mutable key_set_t       f_known = key_set_t();
+    bool                    f_opened = false;
+    std::uint64_t           f_sequence = 0;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
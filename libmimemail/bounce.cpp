@@ -0,0 +1,672 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Process the bounces of the emails sent with this library.
+ *
+ * When an email cannot be delivered, the MTA which gave up sends back a
+ * delivery status notification (DSN, RFC 3464) to the sender. A DSN is
+ * a multipart/report message with a message/delivery-status part which
+ * lists the recipients, what happened to them (the action) and the
+ * status code, followed by the original message or its headers.
+ *
+ * The mime_writer saves the site key and the email key of each email
+ * it renders in the X-Site-Key and X-Email-Key headers. parse_bounce()
+ * reads them back from the original headers so a bounce can be matched
+ * with the email which bounced (see bounce_report::matches()).
+ *
+ * A bounce storm after a campaign means thousands of messages. The
+ * process_...() functions parse a whole mailbox in memory (the file is
+ * memory mapped, not read) and spread the messages between the threads
+ * of the thread_pool, a thread which is done with its share taking
+ * messages from the others.
+ */
+
+// self
+//
+#include    "libmimemail/bounce.h"
+
+#include    "libmimemail/exception.h"
+#include    "libmimemail/names.h"
+#include    "libmimemail/thread_pool.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief Get the body of an entity without copying it if possible.
+ *
+ * \param[in] entity  The entity of which the body is wanted.
+ * \param[out] storage  The string used if the body needs decoding.
+ *
+ * \return A view of the decoded body.
+ */
+std::string_view get_body_view(mime_entity const & entity, std::string & storage)
+{
+    std::string const & encoding(entity.get_transfer_encoding());
+    if(encoding == "quoted-printable"
+    || encoding == "base64")
+    {
+        storage = entity.get_body();
+        return storage;
+    }
+    return entity.get_raw_body();
+}
+
+
+/** \brief Remove the type of a DSN field.
+ *
+ * Fields such as Final-Recipient are written as "<type>; <value>"
+ * (i.e. "rfc822; user@example.com").
+ *
+ * \param[in] value  The unfolded value of the field.
+ *
+ * \return The value without the type.
+ */
+std::string strip_type(std::string const & value)
+{
+    std::string::size_type pos(value.find(';'));
+    pos = pos == std::string::npos ? 0 : pos + 1;
+    while(pos < value.length() && (value[pos] == ' ' || value[pos] == '\t'))
+    {
+        ++pos;
+    }
+    return value.substr(pos);
+}
+
+
+dsn_action_t string_to_action(std::string const & action)
+{
+    std::string a(action);
+    std::transform(a.begin(), a.end(), a.begin(), [](char c) { return c >= 'A' && c <= 'Z' ? c | 0x20 : c; });
+
+    // ignore comments such as "failed (bad mailbox)"
+    //
+    a = a.substr(0, a.find_first_of(" \t("));
+
+    if(a == "failed")
+    {
+        return dsn_action_t::DSN_ACTION_FAILED;
+    }
+    if(a == "delayed")
+    {
+        return dsn_action_t::DSN_ACTION_DELAYED;
+    }
+    if(a == "delivered")
+    {
+        return dsn_action_t::DSN_ACTION_DELIVERED;
+    }
+    if(a == "relayed")
+    {
+        return dsn_action_t::DSN_ACTION_RELAYED;
+    }
+    if(a == "expanded")
+    {
+        return dsn_action_t::DSN_ACTION_EXPANDED;
+    }
+    return dsn_action_t::DSN_ACTION_UNKNOWN;
+}
+
+
+/** \brief Parse the body of a message/delivery-status part.
+ *
+ * The body is a block of per-message fields followed by one block of
+ * fields per recipient. The blocks are separated by empty lines and
+ * their fields use the header syntax.
+ *
+ * \param[in] body  The decoded body of the part.
+ * \param[in,out] report  The report receiving the fields.
+ */
+void parse_delivery_status(std::string_view body, bounce_report & report)
+{
+    while(!body.empty())
+    {
+        mime_message block;
+        if(!block.parse(body))
+        {
+            return;
+        }
+        mime_entity const & fields(block.get_root());
+        if(!fields.get_headers().empty())
+        {
+            if(fields.has_header("Final-Recipient")
+            || fields.has_header("Action"))
+            {
+                delivery_status status;
+                status.set_original_recipient(strip_type(fields.get_header("Original-Recipient")));
+                status.set_final_recipient(strip_type(fields.get_header("Final-Recipient")));
+                status.set_action(string_to_action(fields.get_header("Action")));
+                std::string const code(fields.get_header("Status"));
+                status.set_status(code.substr(0, code.find_first_of(" \t(")));
+                status.set_diagnostic_code(fields.get_header("Diagnostic-Code"));
+                status.set_remote_mta(strip_type(fields.get_header("Remote-MTA")));
+                report.add_status(status);
+            }
+            else if(fields.has_header("Reporting-MTA"))
+            {
+                report.set_reporting_mta(strip_type(fields.get_header("Reporting-MTA")));
+            }
+        }
+
+        // the rest is the body of this block (views in the same data)
+        //
+        std::string_view const next(fields.get_raw_body());
+        if(next.length() >= body.length())
+        {
+            return;
+        }
+        body = next;
+    }
+}
+
+
+
+} // no name namespace
+
+
+
+
+/////////////////////
+// DELIVERY STATUS //
+/////////////////////
+
+
+/** \brief Set the Original-Recipient.
+ *
+ * This is the recipient as specified by the sender, if the MTA kept
+ * it (the address type, "rfc822;", is removed).
+ *
+ * \param[in] recipient  The original recipient address.
+ */
+void delivery_status::set_original_recipient(std::string const & recipient)
+{
+    f_original_recipient = recipient;
+}
+
+
+std::string const & delivery_status::get_original_recipient() const
+{
+    return f_original_recipient;
+}
+
+
+/** \brief Set the Final-Recipient.
+ *
+ * This is the recipient as the reporting MTA saw it, which may differ
+ * from the original recipient after aliases or forwarding.
+ *
+ * \param[in] recipient  The final recipient address.
+ */
+void delivery_status::set_final_recipient(std::string const & recipient)
+{
+    f_final_recipient = recipient;
+}
+
+
+std::string const & delivery_status::get_final_recipient() const
+{
+    return f_final_recipient;
+}
+
+
+/** \brief Get the address to which the email was sent.
+ *
+ * \return The original recipient if available, the final recipient
+ * otherwise.
+ */
+std::string const & delivery_status::get_recipient() const
+{
+    return f_original_recipient.empty()
+                ? f_final_recipient
+                : f_original_recipient;
+}
+
+
+void delivery_status::set_action(dsn_action_t action)
+{
+    f_action = action;
+}
+
+
+dsn_action_t delivery_status::get_action() const
+{
+    return f_action;
+}
+
+
+/** \brief Set the status code.
+ *
+ * The status code is the enhanced status code of RFC 3463 such as
+ * "5.1.1" (bad destination mailbox address).
+ *
+ * \param[in] status  The status code.
+ */
+void delivery_status::set_status(std::string const & status)
+{
+    f_status = status;
+}
+
+
+std::string const & delivery_status::get_status() const
+{
+    return f_status;
+}
+
+
+/** \brief Set the diagnostic code.
+ *
+ * This is the reply of the remote server, such as
+ * "smtp; 550 5.1.1 User unknown".
+ *
+ * \param[in] code  The diagnostic code.
+ */
+void delivery_status::set_diagnostic_code(std::string const & code)
+{
+    f_diagnostic_code = code;
+}
+
+
+std::string const & delivery_status::get_diagnostic_code() const
+{
+    return f_diagnostic_code;
+}
+
+
+void delivery_status::set_remote_mta(std::string const & mta)
+{
+    f_remote_mta = mta;
+}
+
+
+std::string const & delivery_status::get_remote_mta() const
+{
+    return f_remote_mta;
+}
+
+
+/** \brief Check whether the recipient is not going to receive the email.
+ *
+ * A delayed delivery is not a permanent failure; the MTA keeps trying.
+ *
+ * \return true if the action is "failed" or, when there is no action,
+ * the status is a 5.x.x.
+ */
+bool delivery_status::is_permanent_failure() const
+{
+    switch(f_action)
+    {
+    case dsn_action_t::DSN_ACTION_FAILED:
+        return true;
+
+    case dsn_action_t::DSN_ACTION_UNKNOWN:
+        return !f_status.empty() && f_status[0] == '5';
+
+    default:
+        return false;
+
+    }
+}
+
+
+
+
+///////////////////
+// BOUNCE REPORT //
+///////////////////
+
+
+void bounce_report::set_dsn(bool dsn)
+{
+    f_dsn = dsn;
+}
+
+
+/** \brief Check whether the message was a delivery status notification.
+ *
+ * Bounces which do not follow RFC 3464 (plain text bounces of older
+ * MTAs) have no statuses. Their site and email keys may still be
+ * defined if the original message was attached.
+ *
+ * \return true if a message/delivery-status part was found.
+ */
+bool bounce_report::is_dsn() const
+{
+    return f_dsn;
+}
+
+
+void bounce_report::set_reporting_mta(std::string const & mta)
+{
+    f_reporting_mta = mta;
+}
+
+
+std::string const & bounce_report::get_reporting_mta() const
+{
+    return f_reporting_mta;
+}
+
+
+void bounce_report::add_status(delivery_status const & status)
+{
+    f_statuses.push_back(status);
+}
+
+
+/** \brief Get the status of each recipient.
+ *
+ * \return The statuses in the order found in the DSN.
+ */
+bounce_report::status_vector_t const & bounce_report::get_statuses() const
+{
+    return f_statuses;
+}
+
+
+void bounce_report::set_site_key(std::string const & site_key)
+{
+    f_site_key = site_key;
+}
+
+
+/** \brief Get the site key of the email which bounced.
+ *
+ * \return The X-Site-Key of the original message or an empty string.
+ */
+std::string const & bounce_report::get_site_key() const
+{
+    return f_site_key;
+}
+
+
+void bounce_report::set_email_key(std::string const & email_key)
+{
+    f_email_key = email_key;
+}
+
+
+/** \brief Get the email key of the email which bounced.
+ *
+ * \return The X-Email-Key of the original message or an empty string.
+ */
+std::string const & bounce_report::get_email_key() const
+{
+    return f_email_key;
+}
+
+
+void bounce_report::set_original_message_id(std::string const & message_id)
+{
+    f_original_message_id = message_id;
+}
+
+
+std::string const & bounce_report::get_original_message_id() const
+{
+    return f_original_message_id;
+}
+
+
+/** \brief Check whether this bounce is about the specified email.
+ *
+ * The email keys have to be equal. The site keys are compared only if
+ * the bounce includes one.
+ *
+ * \param[in] e  The email to compare with.
+ *
+ * \return true if the bounce is about \p e.
+ */
+bool bounce_report::matches(email const & e) const
+{
+    return !f_email_key.empty()
+        && f_email_key == e.get_email_key()
+        && (f_site_key.empty() || f_site_key == e.get_site_key());
+}
+
+
+
+
+///////////////
+// FUNCTIONS //
+///////////////
+
+
+/** \brief Extract the delivery status and keys of a bounce.
+ *
+ * The report is reset first.
+ *
+ * \param[in] message  The parsed bounce message.
+ * \param[out] report  The report receiving the results.
+ *
+ * \return true if the message is a DSN or refers to one of our emails.
+ */
+bool parse_bounce(mime_message const & message, bounce_report & report)
+{
+    report = bounce_report();
+
+    mime_entity const & root(message.get_root());
+    std::string storage;
+
+    mime_entity const * status(root.find_part("message/delivery-status"));
+    if(status == nullptr)
+    {
+        status = root.find_part("message/global-delivery-status");
+    }
+    if(status != nullptr)
+    {
+        report.set_dsn(true);
+        parse_delivery_status(get_body_view(*status, storage), report);
+    }
+
+    mime_entity const * original(nullptr);
+    for(auto const & type : { "message/rfc822", "text/rfc822-headers", "message/global", "message/global-headers" })
+    {
+        original = root.find_part(type);
+        if(original != nullptr)
+        {
+            break;
+        }
+    }
+    if(original != nullptr)
+    {
+        mime_message headers;
+        if(headers.parse(get_body_view(*original, storage)))
+        {
+            mime_entity const & h(headers.get_root());
+            report.set_site_key(h.get_header(g_name_libmimemail_email_x_site_key));
+            report.set_email_key(h.get_header(g_name_libmimemail_email_x_email_key));
+            report.set_original_message_id(h.get_header("Message-ID"));
+        }
+    }
+
+    return report.is_dsn()
+        || !report.get_email_key().empty();
+}
+
+
+/** \brief Parse a bounce message and extract its delivery status.
+ *
+ * \param[in] data  The whole bounce message.
+ * \param[out] report  The report receiving the results.
+ *
+ * \return true if the message is a DSN or refers to one of our emails.
+ */
+bool parse_bounce(std::string_view const & data, bounce_report & report)
+{
+    mime_message message;
+    if(!message.parse(data))
+    {
+        report = bounce_report();
+        return false;
+    }
+    return parse_bounce(message, report);
+}
+
+
+/** \brief Split an mbox file in messages.
+ *
+ * Each message starts with a line beginning with "From ". The messages
+ * are views in \p mbox. The ">From " quoting is not removed; it does
+ * not matter for the headers of a bounce.
+ *
+ * \param[in] mbox  The content of the mbox file.
+ *
+ * \return The messages, "From " line included.
+ */
+std::vector<std::string_view> split_mbox(std::string_view const & mbox)
+{
+    std::vector<std::string_view> result;
+    std::size_t start(std::string_view::npos);
+    std::size_t pos(0);
+    while(pos < mbox.length())
+    {
+        if(mbox.compare(pos, 5, "From ") == 0)
+        {
+            if(start != std::string_view::npos)
+            {
+                result.push_back(mbox.substr(start, pos - start));
+            }
+            start = pos;
+        }
+        std::size_t const nl(mbox.find('\n', pos));
+        if(nl == std::string_view::npos)
+        {
+            break;
+        }
+        pos = nl + 1;
+    }
+
+    if(start != std::string_view::npos)
+    {
+        result.push_back(mbox.substr(start));
+    }
+    else if(!mbox.empty())
+    {
+        // not an mbox, view the whole as one message
+        //
+        result.push_back(mbox);
+    }
+
+    return result;
+}
+
+
+/** \brief Parse many bounces in parallel.
+ *
+ * A message which is not a bounce gets an empty report (is_dsn() is
+ * false and no keys).
+ *
+ * \param[in] messages  The messages to parse.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ *
+ * \return One report per message, in the same order.
+ */
+bounce_report_vector_t process_bounces(
+      std::vector<std::string_view> const & messages
+    , std::size_t threads)
+{
+    bounce_report_vector_t result(messages.size());
+    thread_pool::get_instance().parallel_for(
+          messages.size()
+        , threads
+        , [&messages, &result](std::size_t index)
+          {
+              parse_bounce(messages[index], result[index]);
+          });
+    return result;
+}
+
+
+/** \brief Parse many bounce files in parallel.
+ *
+ * Each file holds one message, as in a Maildir. The files are memory
+ * mapped while parsed.
+ *
+ * \param[in] paths  The paths to the messages.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ *
+ * \return One report per file, in the same order. The report of a file
+ * which cannot be read is empty.
+ */
+bounce_report_vector_t process_bounce_files(
+      std::vector<std::string> const & paths
+    , std::size_t threads)
+{
+    bounce_report_vector_t result(paths.size());
+    thread_pool::get_instance().parallel_for(
+          paths.size()
+        , threads
+        , [&paths, &result](std::size_t index)
+          {
+              binary_spool_buffer::pointer_t buffer(binary_spool_buffer::from_file(paths[index]));
+              if(buffer != nullptr)
+              {
+                  parse_bounce(buffer->get_data(), result[index]);
+              }
+          });
+    return result;
+}
+
+
+/** \brief Parse all the bounces of an mbox file.
+ *
+ * \param[in] path  The path to the mbox file.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ *
+ * \return One report per message of the mbox. If the file cannot be
+ * read, the error is logged and the result is empty.
+ */
+bounce_report_vector_t process_mbox(
+      std::string const & path
+    , std::size_t threads)
+{
+    binary_spool_buffer::pointer_t buffer(binary_spool_buffer::from_file(path));
+    if(buffer == nullptr)
+    {
+        return bounce_report_vector_t();
+    }
+    return process_bounces(split_mbox(buffer->get_data()), threads);
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
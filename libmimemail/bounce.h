@@ -0,0 +1,127 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/email.h>
+#include    <libmimemail/mime_parser.h>
+
+
+// C++
+//
+#include    <string>
+#include    <string_view>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+enum class dsn_action_t
+{
+    DSN_ACTION_UNKNOWN,
+    DSN_ACTION_FAILED,
+    DSN_ACTION_DELAYED,
+    DSN_ACTION_DELIVERED,
+    DSN_ACTION_RELAYED,
+    DSN_ACTION_EXPANDED,
+};
+
+
+class delivery_status
+{
+public:
+    void                    set_original_recipient(std::string const & recipient);
+    std::string const &     get_original_recipient() const;
+    void                    set_final_recipient(std::string const & recipient);
+    std::string const &     get_final_recipient() const;
+    std::string const &     get_recipient() const;
+    void                    set_action(dsn_action_t action);
+    dsn_action_t            get_action() const;
+    void                    set_status(std::string const & status);
+    std::string const &     get_status() const;
+    void                    set_diagnostic_code(std::string const & code);
+    std::string const &     get_diagnostic_code() const;
+    void                    set_remote_mta(std::string const & mta);
+    std::string const &     get_remote_mta() const;
+    bool                    is_permanent_failure() const;
+
+private:
+    std::string             f_original_recipient = std::string();
+    std::string             f_final_recipient = std::string();
+    dsn_action_t            f_action = dsn_action_t::DSN_ACTION_UNKNOWN;
+    std::string             f_status = std::string();
+    std::string             f_diagnostic_code = std::string();
+    std::string             f_remote_mta = std::string();
+};
+
+
+class bounce_report
+{
+public:
+    typedef std::vector<delivery_status>    status_vector_t;
+
+    void                    set_dsn(bool dsn);
+    bool                    is_dsn() const;
+    void                    set_reporting_mta(std::string const & mta);
+    std::string const &     get_reporting_mta() const;
+    void                    add_status(delivery_status const & status);
+    status_vector_t const & get_statuses() const;
+    void                    set_site_key(std::string const & site_key);
+    std::string const &     get_site_key() const;
+    void                    set_email_key(std::string const & email_key);
+    std::string const &     get_email_key() const;
+    void                    set_original_message_id(std::string const & message_id);
+    std::string const &     get_original_message_id() const;
+    bool                    matches(email const & e) const;
+
+private:
+    bool                    f_dsn = false;
+    std::string             f_reporting_mta = std::string();
+    status_vector_t         f_statuses = status_vector_t();
+    std::string             f_site_key = std::string();
+    std::string             f_email_key = std::string();
+    std::string             f_original_message_id = std::string();
+};
+
+typedef std::vector<bounce_report>  bounce_report_vector_t;
+
+
+bool                        parse_bounce(mime_message const & message, bounce_report & report);
+bool                        parse_bounce(std::string_view const & data, bounce_report & report);
+
+std::vector<std::string_view>
+                            split_mbox(std::string_view const & mbox);
+bounce_report_vector_t      process_bounces(
+                                  std::vector<std::string_view> const & messages
+                                , std::size_t threads = 0);
+bounce_report_vector_t      process_bounce_files(
+                                  std::vector<std::string> const & paths
+                                , std::size_t threads = 0);
+bounce_report_vector_t      process_mbox(
+                                  std::string const & path
+                                , std::size_t threads = 0);
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,176 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/exception.h>
+
+
+// C++
+//
+#include    <atomic>
+#include    <memory>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief A bounded multi-producer multi-consumer queue.
+ *
+ * This is Dmitry Vyukov's bounded MPMC queue: each cell has a sequence
+ * number telling whether it is ready to be written or read for a given
+ * position so producers and consumers only need one compare-and-swap
+ * on their position to claim a cell. No mutex is used.
+ *
+ * The capacity gets rounded up to a power of two.
+ */
+template<typename T>
+class bounded_queue
+{
+public:
+                            bounded_queue(std::size_t capacity)
+                            {
+                                if(capacity < 2)
+                                {
+                                    capacity = 2;
+                                }
+                                std::size_t size(1);
+                                while(size < capacity)
+                                {
+                                    size <<= 1;
+                                }
+                                if(size == 0)
+                                {
+                                    throw invalid_parameter("bounded_queue: capacity is too large.");
+                                }
+                                f_mask = size - 1;
+                                f_cells.reset(new cell[size]);
+                                for(std::size_t idx(0); idx < size; ++idx)
+                                {
+                                    f_cells[idx].f_sequence.store(idx, std::memory_order_relaxed);
+                                }
+                            }
+
+                            bounded_queue(bounded_queue const &) = delete;
+    bounded_queue &         operator = (bounded_queue const &) = delete;
+
+    std::size_t             capacity() const
+                            {
+                                return f_mask + 1;
+                            }
+
+    /** \brief Add an item at the end of the queue.
+     *
+     * \param[in] value  The value to add, moved only on success.
+     *
+     * \return false if the queue is full.
+     */
+    bool                    try_push(T & value)
+                            {
+                                cell * c(nullptr);
+                                std::size_t pos(f_enqueue.load(std::memory_order_relaxed));
+                                for(;;)
+                                {
+                                    c = &f_cells[pos & f_mask];
+                                    std::size_t const seq(c->f_sequence.load(std::memory_order_acquire));
+                                    std::intptr_t const diff(static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos));
+                                    if(diff == 0)
+                                    {
+                                        if(f_enqueue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                                        {
+                                            break;
+                                        }
+                                    }
+                                    else if(diff < 0)
+                                    {
+                                        return false;
+                                    }
+                                    else
+                                    {
+                                        pos = f_enqueue.load(std::memory_order_relaxed);
+                                    }
+                                }
+                                c->f_value = std::move(value);
+                                c->f_sequence.store(pos + 1, std::memory_order_release);
+                                return true;
+                            }
+
+    /** \brief Remove the item at the front of the queue.
+     *
+     * \param[out] value  The value removed from the queue.
+     *
+     * \return false if the queue is empty.
+     */
+    bool                    try_pop(T & value)
+                            {
+                                cell * c(nullptr);
+                                std::size_t pos(f_dequeue.load(std::memory_order_relaxed));
+                                for(;;)
+                                {
+                                    c = &f_cells[pos & f_mask];
+                                    std::size_t const seq(c->f_sequence.load(std::memory_order_acquire));
+                                    std::intptr_t const diff(static_cast<std::intptr_t>(seq) - static_cast<std::intptr_t>(pos + 1));
+                                    if(diff == 0)
+                                    {
+                                        if(f_dequeue.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                                        {
+                                            break;
+                                        }
+                                    }
+                                    else if(diff < 0)
+                                    {
+                                        return false;
+                                    }
+                                    else
+                                    {
+                                        pos = f_dequeue.load(std::memory_order_relaxed);
+                                    }
+                                }
+                                value = std::move(c->f_value);
+                                c->f_value = T();
+                                c->f_sequence.store(pos + f_mask + 1, std::memory_order_release);
+                                return true;
+                            }
+
+private:
+    struct cell
+    {
+        std::atomic<std::size_t>    f_sequence = 0;
+        T                           f_value = T();
+    };
+
+    std::unique_ptr<cell[]> f_cells = std::unique_ptr<cell[]>();
+    std::size_t             f_mask = 0;
+
+    // keep the positions on separate cache lines so producers and
+    // consumers do not fight over the same line
+    //
+    alignas(64) std::atomic<std::size_t>
+                            f_enqueue = 0;
+    alignas(64) std::atomic<std::size_t>
+                            f_dequeue = 0;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,828 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Sign emails with DKIM.
+ *
+ * The DKIM-Signature (RFC 6376) is computed while the email gets rendered
+ * so the message does not need to go through a second pass in the MTA.
+ * The body hash is computed incrementally as the writer adds the body
+ * data, attachments included. Once the body is complete, the header
+ * signature gets computed and the DKIM-Signature field is written first,
+ * followed by the headers and the body.
+ *
+ * The signer always uses the relaxed canonicalization for the headers
+ * and the body. It accepts RSA (rsa-sha256) and Ed25519 (ed25519-sha256,
+ * RFC 8463) private keys.
+ *
+ * The lines of the messages we generate end with "\n" and possibly
+ * "\r\n" (quoted-printable soft line breaks). Both are viewed as CRLF
+ * since this is what the transports send.
+ */
+
+// self
+//
+#include    "libmimemail/dkim.h"
+
+#include    "libmimemail/base64.h"
+#include    "libmimemail/exception.h"
+#include    "libmimemail/metrics.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// OpenSSL
+//
+#include    <openssl/err.h>
+#include    <openssl/pem.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cctype>
+#include    <mutex>
+#include    <vector>
+
+
+// C
+//
+#include    <time.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief Amount of canonicalized data accumulated before hashing it.
+ *
+ * The relaxed canonicalization transforms the body one character at
+ * a time. The result is saved in a buffer which gets hashed once it
+ * reaches this size.
+ */
+constexpr std::size_t const     HASH_BUFFER_SIZE = 64 * 1024;
+
+
+/** \brief Length of the lines of the b= tag.
+ *
+ * The signature gets folded so the DKIM-Signature field stays readable.
+ */
+constexpr std::size_t const     SIGNATURE_LINE_LENGTH = 72;
+
+
+std::mutex              g_default_dkim_signer_mutex;
+dkim_signer::pointer_t  g_default_dkim_signer = dkim_signer::pointer_t();
+
+
+/** \brief The headers signed by default.
+ *
+ * Only the headers present in the email get signed. The From header is
+ * mandatory.
+ */
+char const * const g_default_signed_headers[] =
+{
+    "From",
+    "Sender",
+    "Reply-To",
+    "Subject",
+    "Date",
+    "Message-ID",
+    "To",
+    "Cc",
+    "MIME-Version",
+    "Content-Type",
+    "Content-Transfer-Encoding",
+    "In-Reply-To",
+    "References",
+    "List-Unsubscribe",
+    "List-Unsubscribe-Post",
+};
+
+
+bool is_wsp(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+
+/** \brief One header field as found in the header block.
+ *
+ * The name is the part before the colon. The field is the whole field
+ * including continuation lines, without the final line ending.
+ */
+struct header_field
+{
+    std::string_view        f_name = std::string_view();
+    std::string_view        f_field = std::string_view();
+};
+typedef std::vector<header_field>   header_field_vector_t;
+
+
+/** \brief Cut a header block in fields.
+ *
+ * The block ends with an empty line or the end of \p headers.
+ *
+ * \param[in] headers  The headers as written in the email.
+ *
+ * \return The list of fields in the order they appear.
+ */
+header_field_vector_t split_headers(std::string_view const & headers)
+{
+    header_field_vector_t result;
+    std::size_t pos(0);
+    while(pos < headers.length())
+    {
+        std::size_t eol(headers.find('\n', pos));
+        if(eol == std::string_view::npos)
+        {
+            eol = headers.length();
+        }
+        if(eol == pos
+        || (eol == pos + 1 && headers[pos] == '\r'))
+        {
+            // empty line, end of the headers
+            //
+            break;
+        }
+
+        // include the continuation lines
+        //
+        std::size_t end(eol);
+        while(end + 1 < headers.length()
+           && is_wsp(headers[end + 1]))
+        {
+            end = headers.find('\n', end + 1);
+            if(end == std::string_view::npos)
+            {
+                end = headers.length();
+            }
+        }
+
+        std::string_view field(headers.substr(pos, end - pos));
+        if(!field.empty()
+        && field.back() == '\r')
+        {
+            field.remove_suffix(1);
+        }
+        std::size_t const colon(field.find(':'));
+        if(colon != std::string_view::npos)
+        {
+            std::string_view name(field.substr(0, colon));
+            while(!name.empty()
+               && is_wsp(name.back()))
+            {
+                name.remove_suffix(1);
+            }
+            header_field f;
+            f.f_name = name;
+            f.f_field = field;
+            result.push_back(f);
+        }
+
+        pos = end + 1;
+    }
+
+    return result;
+}
+
+
+bool same_name(std::string_view const & lhs, std::string_view const & rhs)
+{
+    return lhs.length() == rhs.length()
+        && std::equal(
+                  lhs.begin()
+                , lhs.end()
+                , rhs.begin()
+                , [](char a, char b)
+                  {
+                      return std::tolower(static_cast<unsigned char>(a))
+                          == std::tolower(static_cast<unsigned char>(b));
+                  });
+}
+
+
+/** \brief Canonicalize one header field with the relaxed algorithm.
+ *
+ * The name is lowercased, the lines unfolded, the sequences of spaces
+ * reduced to one space, and the spaces around the colon and at the end
+ * removed (RFC 6376 section 3.4.2).
+ *
+ * \param[in] field  The field to canonicalize.
+ * \param[in,out] out  The buffer where the canonicalized field gets
+ *                     appended, without the final CRLF.
+ */
+void relaxed_header(std::string_view const & field, std::string & out)
+{
+    std::size_t const colon(field.find(':'));
+    std::string_view name(field.substr(0, colon));
+    while(!name.empty()
+       && is_wsp(name.back()))
+    {
+        name.remove_suffix(1);
+    }
+    for(char const c : name)
+    {
+        out += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    }
+    out += ':';
+
+    bool space(false);
+    bool started(false);
+    for(char const c : field.substr(colon + 1))
+    {
+        if(c == '\r' || c == '\n')
+        {
+            continue;
+        }
+        if(is_wsp(c))
+        {
+            space = true;
+            continue;
+        }
+        if(space && started)
+        {
+            out += ' ';
+        }
+        space = false;
+        started = true;
+        out += c;
+    }
+}
+
+
+/** \brief Sign data with the private key.
+ *
+ * \param[in] key  The private key.
+ * \param[in] ed25519  Whether the key is an Ed25519 key.
+ * \param[in] data  The data to sign.
+ * \param[out] signature  The binary signature.
+ *
+ * \return true if the data got signed.
+ */
+bool sign_data(EVP_PKEY * key, bool ed25519, std::string const & data, std::string & signature)
+{
+    std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+    if(ctx == nullptr)
+    {
+        return false;
+    }
+
+    unsigned char const * input(reinterpret_cast<unsigned char const *>(data.data()));
+    std::size_t input_size(data.length());
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    if(ed25519)
+    {
+        // RFC 8463: PureEdDSA of the SHA-256 hash of the headers
+        //
+        unsigned int digest_size(0);
+        if(EVP_Digest(input, input_size, digest, &digest_size, EVP_sha256(), nullptr) != 1)
+        {
+            return false;
+        }
+        input = digest;
+        input_size = digest_size;
+    }
+
+    if(EVP_DigestSignInit(ctx.get(), nullptr, ed25519 ? nullptr : EVP_sha256(), nullptr, key) != 1)
+    {
+        return false;
+    }
+    std::size_t size(0);
+    if(EVP_DigestSign(ctx.get(), nullptr, &size, input, input_size) != 1)
+    {
+        return false;
+    }
+    signature.resize(size);
+    if(EVP_DigestSign(
+              ctx.get()
+            , reinterpret_cast<unsigned char *>(signature.data())
+            , &size
+            , input
+            , input_size) != 1)
+    {
+        return false;
+    }
+    signature.resize(size);
+    return true;
+}
+
+
+
+} // no name namespace
+
+
+
+
+////////////////////
+// DKIM BODY HASH //
+////////////////////
+
+
+/** \brief Start a new body hash.
+ *
+ * The body hash is the SHA-256 of the body canonicalized with the
+ * relaxed algorithm. The data can be added in any number of calls
+ * without any restrictions on where the buffers start or end.
+ *
+ * \exception libmimemail_logic_error
+ * The SHA-256 digest could not be initialized.
+ */
+dkim_body_hash::dkim_body_hash()
+    : f_context(EVP_MD_CTX_new())
+{
+    if(f_context == nullptr
+    || EVP_DigestInit_ex(f_context, EVP_sha256(), nullptr) != 1)
+    {
+        EVP_MD_CTX_free(f_context);
+        throw libmimemail_logic_error("dkim_body_hash::dkim_body_hash(): could not initialize the SHA-256 digest.");
+    }
+    f_buffer.reserve(HASH_BUFFER_SIZE + 2);
+}
+
+
+dkim_body_hash::~dkim_body_hash()
+{
+    EVP_MD_CTX_free(f_context);
+}
+
+
+/** \brief Add body data to the hash.
+ *
+ * \param[in] data  The body data.
+ * \param[in] size  The size of \p data.
+ */
+void dkim_body_hash::add(char const * data, std::size_t size)
+{
+    char const * const end(data + size);
+    for(; data < end; ++data)
+    {
+        char const c(*data);
+        if(f_cr)
+        {
+            f_cr = false;
+            if(c == '\n')
+            {
+                end_line();
+                continue;
+            }
+            add_content('\r');
+        }
+        switch(c)
+        {
+        case '\r':
+            f_cr = true;
+            break;
+
+        case '\n':
+            end_line();
+            break;
+
+        case ' ':
+        case '\t':
+            f_space = true;
+            break;
+
+        default:
+            add_content(c);
+            break;
+
+        }
+    }
+}
+
+
+void dkim_body_hash::add(std::string_view const & data)
+{
+    add(data.data(), data.length());
+}
+
+
+void dkim_body_hash::add(iovec const * iov, int count)
+{
+    for(int idx(0); idx < count; ++idx)
+    {
+        add(reinterpret_cast<char const *>(iov[idx].iov_base), iov[idx].iov_len);
+    }
+}
+
+
+/** \brief Get the body hash.
+ *
+ * The empty lines at the end of the body are ignored and a missing
+ * line ending on the last line is added, as required by the relaxed
+ * canonicalization.
+ *
+ * \return The hash, base64 encoded, as expected in the bh= tag.
+ */
+std::string dkim_body_hash::finish()
+{
+    if(f_cr)
+    {
+        f_cr = false;
+        add_content('\r');
+    }
+    if(f_has_data)
+    {
+        end_line();
+    }
+    update();
+
+    unsigned char digest[EVP_MAX_MD_SIZE];
+    unsigned int size(0);
+    EVP_DigestFinal_ex(f_context, digest, &size);
+    return base64_encoder::encode(
+              std::string_view(reinterpret_cast<char const *>(digest), size)
+            , 0);
+}
+
+
+/** \brief Compute the hash of a complete body.
+ *
+ * \param[in] body  The body of the email.
+ *
+ * \return The hash, base64 encoded.
+ */
+std::string dkim_body_hash::compute(std::string_view const & body)
+{
+    dkim_body_hash h;
+    h.add(body);
+    return h.finish();
+}
+
+
+void dkim_body_hash::add_content(char c)
+{
+    if(!f_has_data)
+    {
+        // the empty lines are only kept if followed by some data
+        //
+        for(; f_empty_lines > 0; --f_empty_lines)
+        {
+            f_buffer += "\r\n";
+            if(f_buffer.length() >= HASH_BUFFER_SIZE)
+            {
+                update();
+            }
+        }
+        f_has_data = true;
+    }
+    if(f_space)
+    {
+        f_buffer += ' ';
+        f_space = false;
+    }
+    f_buffer += c;
+    if(f_buffer.length() >= HASH_BUFFER_SIZE)
+    {
+        update();
+    }
+}
+
+
+void dkim_body_hash::end_line()
+{
+    // trailing spaces are ignored
+    //
+    f_space = false;
+    if(f_has_data)
+    {
+        f_buffer += "\r\n";
+        f_has_data = false;
+    }
+    else
+    {
+        ++f_empty_lines;
+    }
+}
+
+
+void dkim_body_hash::update()
+{
+    if(!f_buffer.empty())
+    {
+        EVP_DigestUpdate(f_context, f_buffer.data(), f_buffer.length());
+        f_buffer.clear();
+    }
+}
+
+
+
+
+/////////////////
+// DKIM SIGNER //
+/////////////////
+
+
+/** \brief Initialize a DKIM signer.
+ *
+ * The signer can be shared between threads. The public key has to be
+ * published in the DNS under `<selector>._domainkey.<domain>`.
+ *
+ * \exception invalid_parameter
+ * The domain or selector are empty, or the private key cannot be loaded
+ * or is neither an RSA nor an Ed25519 key.
+ *
+ * \param[in] domain  The signing domain (d= tag).
+ * \param[in] selector  The selector of the key (s= tag).
+ * \param[in] private_key  The private key in PEM format.
+ */
+dkim_signer::dkim_signer(
+          std::string const & domain
+        , std::string const & selector
+        , std::string const & private_key)
+    : f_domain(domain)
+    , f_selector(selector)
+    , f_signed_headers(std::begin(g_default_signed_headers), std::end(g_default_signed_headers))
+{
+    if(f_domain.empty()
+    || f_selector.empty())
+    {
+        throw invalid_parameter("dkim_signer::dkim_signer(): the domain and selector cannot be empty.");
+    }
+
+    std::unique_ptr<BIO, decltype(&BIO_free)> bio(
+              BIO_new_mem_buf(private_key.data(), static_cast<int>(private_key.length()))
+            , &BIO_free);
+    if(bio != nullptr)
+    {
+        f_key = PEM_read_bio_PrivateKey(bio.get(), nullptr, nullptr, nullptr);
+    }
+    if(f_key == nullptr)
+    {
+        ERR_clear_error();
+        throw invalid_parameter("dkim_signer::dkim_signer(): could not load the private key.");
+    }
+
+    switch(EVP_PKEY_base_id(f_key))
+    {
+    case EVP_PKEY_RSA:
+        f_algorithm = "rsa-sha256";
+        break;
+
+    case EVP_PKEY_ED25519:
+        f_algorithm = "ed25519-sha256";
+        break;
+
+    default:
+        EVP_PKEY_free(f_key);
+        f_key = nullptr;
+        throw invalid_parameter("dkim_signer::dkim_signer(): the private key must be an RSA or an Ed25519 key.");
+
+    }
+}
+
+
+dkim_signer::~dkim_signer()
+{
+    EVP_PKEY_free(f_key);
+}
+
+
+std::string const & dkim_signer::get_domain() const
+{
+    return f_domain;
+}
+
+
+std::string const & dkim_signer::get_selector() const
+{
+    return f_selector;
+}
+
+
+/** \brief Get the name of the signing algorithm.
+ *
+ * \return "rsa-sha256" or "ed25519-sha256" depending on the key.
+ */
+std::string const & dkim_signer::get_algorithm() const
+{
+    return f_algorithm;
+}
+
+
+/** \brief Change the list of headers to sign.
+ *
+ * The From header is always signed, whether in the list or not.
+ *
+ * \param[in] names  The names of the headers to sign.
+ */
+void dkim_signer::set_signed_headers(string_list_t const & names)
+{
+    f_signed_headers = names;
+    if(std::none_of(
+              f_signed_headers.begin()
+            , f_signed_headers.end()
+            , [](std::string const & n)
+              {
+                  return same_name(n, "From");
+              }))
+    {
+        f_signed_headers.insert(f_signed_headers.begin(), "From");
+    }
+}
+
+
+string_list_t const & dkim_signer::get_signed_headers() const
+{
+    return f_signed_headers;
+}
+
+
+/** \brief Compute the DKIM-Signature of an email.
+ *
+ * The \p headers are the header fields exactly as written in the email.
+ * They may be followed by the empty line and the body which get ignored.
+ *
+ * \exception missing_parameter
+ * The headers do not include a From field.
+ *
+ * \param[in] headers  The header fields of the email.
+ * \param[in] body_hash  The hash of the body as returned by
+ *                       dkim_body_hash::finish().
+ *
+ * \return The DKIM-Signature field, including its line ending, to be
+ * written before the other headers, or an empty string if the signature
+ * could not be computed.
+ */
+std::string dkim_signer::sign(
+      std::string_view const & headers
+    , std::string const & body_hash) const
+{
+    metrics_timer timer(metric_stage_t::METRIC_STAGE_DKIM_SIGN);
+
+    header_field_vector_t const fields(split_headers(headers));
+
+    // a header which appears multiple times gets signed from the bottom
+    // up; we keep track of the instances already used
+    //
+    std::vector<bool> used(fields.size(), false);
+    std::string names;
+    std::string canonicalized;
+    bool has_from(false);
+    for(auto const & n : f_signed_headers)
+    {
+        for(std::size_t idx(fields.size()); idx > 0; --idx)
+        {
+            if(!used[idx - 1]
+            && same_name(fields[idx - 1].f_name, n))
+            {
+                used[idx - 1] = true;
+                if(!names.empty())
+                {
+                    names += ':';
+                }
+                names += fields[idx - 1].f_name;
+                relaxed_header(fields[idx - 1].f_field, canonicalized);
+                canonicalized += "\r\n";
+                has_from = has_from || same_name(n, "From");
+            }
+        }
+    }
+    if(!has_from)
+    {
+        throw missing_parameter("dkim_signer::sign(): the headers to sign must include a From field.");
+    }
+
+    std::string field("DKIM-Signature: v=1; a=");
+    field += f_algorithm;
+    field += "; c=relaxed/relaxed; d=";
+    field += f_domain;
+    field += "; s=";
+    field += f_selector;
+    field += ";\n\tt=";
+    field += std::to_string(time(nullptr));
+    field += "; h=";
+    field += names;
+    field += ";\n\tbh=";
+    field += body_hash;
+    field += ";\n\tb=";
+
+    // the signature covers the DKIM-Signature field itself, with an
+    // empty b= tag and without the final line ending
+    //
+    relaxed_header(field, canonicalized);
+
+    std::string signature;
+    if(!sign_data(f_key, f_algorithm == "ed25519-sha256", canonicalized, signature))
+    {
+        ERR_clear_error();
+        SNAP_LOG_ERROR
+            << "dkim_signer::sign(): could not sign the headers with the "
+            << f_algorithm
+            << " key of \""
+            << f_selector
+            << "._domainkey."
+            << f_domain
+            << "\"."
+            << SNAP_LOG_SEND;
+        return std::string();
+    }
+
+    std::string const b(base64_encoder::encode(signature, 0));
+    for(std::size_t pos(0); pos < b.length(); pos += SIGNATURE_LINE_LENGTH)
+    {
+        if(pos > 0)
+        {
+            field += "\n\t";
+        }
+        field += b.substr(pos, SIGNATURE_LINE_LENGTH);
+    }
+    field += '\n';
+
+    return field;
+}
+
+
+/** \brief Compute the DKIM-Signature of an email from buffers.
+ *
+ * This is the same as the other sign() function with the headers
+ * given as the buffers collected by a writer.
+ *
+ * \param[in] headers  The buffers holding the header fields.
+ * \param[in] count  The number of buffers.
+ * \param[in] body_hash  The hash of the body.
+ *
+ * \return The DKIM-Signature field or an empty string on error.
+ */
+std::string dkim_signer::sign(
+      iovec const * headers
+    , int count
+    , std::string const & body_hash) const
+{
+    std::string h;
+    for(int idx(0); idx < count; ++idx)
+    {
+        h.append(reinterpret_cast<char const *>(headers[idx].iov_base), headers[idx].iov_len);
+    }
+    return sign(h, body_hash);
+}
+
+
+/** \brief Get the default DKIM signer.
+ *
+ * \return The signer used by new mime_writer objects, nullptr by default.
+ */
+dkim_signer::pointer_t get_default_dkim_signer()
+{
+    std::lock_guard<std::mutex> lock(g_default_dkim_signer_mutex);
+    return g_default_dkim_signer;
+}
+
+
+/** \brief Change the default DKIM signer.
+ *
+ * Once set, all the emails rendered by a mime_writer get signed, this
+ * includes email::send(), the email_batch, and the email_template:
+ *
+ * \code
+ *     libmimemail::set_default_dkim_signer(
+ *             std::make_shared<libmimemail::dkim_signer>(
+ *                       "example.com"
+ *                     , "mail2024"
+ *                     , private_key_pem));
+ * \endcode
+ *
+ * Setting the signer to nullptr stops the signing of new writers.
+ *
+ * \param[in] signer  The new default signer.
+ */
+void set_default_dkim_signer(dkim_signer::pointer_t signer)
+{
+    std::lock_guard<std::mutex> lock(g_default_dkim_signer_mutex);
+    g_default_dkim_signer = signer;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
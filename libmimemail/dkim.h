@@ -0,0 +1,121 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/email.h>
+
+
+// OpenSSL
+//
+#include    <openssl/evp.h>
+
+
+// C++
+//
+#include    <memory>
+#include    <string>
+#include    <string_view>
+
+
+// C
+//
+#include    <sys/uio.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class dkim_body_hash
+{
+public:
+                            dkim_body_hash();
+                            dkim_body_hash(dkim_body_hash const &) = delete;
+                            ~dkim_body_hash();
+
+    dkim_body_hash &        operator = (dkim_body_hash const &) = delete;
+
+    void                    add(char const * data, std::size_t size);
+    void                    add(std::string_view const & data);
+    void                    add(iovec const * iov, int count);
+    std::string             finish();
+
+    static std::string      compute(std::string_view const & body);
+
+private:
+    void                    add_content(char c);
+    void                    end_line();
+    void                    update();
+
+    EVP_MD_CTX *            f_context = nullptr;
+    std::string             f_buffer = std::string();
+    std::size_t             f_empty_lines = 0;
+    bool                    f_has_data = false;
+    bool                    f_space = false;
+    bool                    f_cr = false;
+};
+
+
+class dkim_signer
+{
+public:
+    typedef std::shared_ptr<dkim_signer>    pointer_t;
+
+                            dkim_signer(
+                                  std::string const & domain
+                                , std::string const & selector
+                                , std::string const & private_key);
+                            dkim_signer(dkim_signer const &) = delete;
+                            ~dkim_signer();
+
+    dkim_signer &           operator = (dkim_signer const &) = delete;
+
+    std::string const &     get_domain() const;
+    std::string const &     get_selector() const;
+    std::string const &     get_algorithm() const;
+    void                    set_signed_headers(string_list_t const & names);
+    string_list_t const &   get_signed_headers() const;
+
+    std::string             sign(
+                                  std::string_view const & headers
+                                , std::string const & body_hash) const;
+    std::string             sign(
+                                  iovec const * headers
+                                , int count
+                                , std::string const & body_hash) const;
+
+private:
+    std::string             f_domain = std::string();
+    std::string             f_selector = std::string();
+    std::string             f_algorithm = std::string();
+    string_list_t           f_signed_headers = string_list_t();
+    EVP_PKEY *              f_key = nullptr;
+};
+
+
+dkim_signer::pointer_t      get_default_dkim_signer();
+void                        set_default_dkim_signer(dkim_signer::pointer_t signer);
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
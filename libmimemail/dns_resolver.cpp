@@ -0,0 +1,1011 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief A minimal DNS client used to retrieve MX records.
+ *
+ * The mail_exchangers class used to run the `dig` command and parse its
+ * text output. This file implements the DNS protocol directly: it sends
+ * the MX query over UDP (and TCP when the answer gets truncated) to the
+ * name servers found in `/etc/resolv.conf` and parses the binary answer.
+ *
+ * The answer includes the TTL of the records so the results can be
+ * cached.
+ */
+
+// self
+//
+#include    "libmimemail/dns_resolver.h"
+
+#include    "libmimemail/exception.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cctype>
+#include    <chrono>
+#include    <fstream>
+#include    <random>
+
+
+// C
+//
+#include    <arpa/inet.h>
+#include    <errno.h>
+#include    <netinet/in.h>
+#include    <poll.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+constexpr std::uint16_t const   DNS_CLASS_IN = 1;
+constexpr std::uint16_t const   DNS_TYPE_OPT = 41;
+constexpr std::uint16_t const   DNS_FLAG_QR = 0x8000;
+constexpr std::uint16_t const   DNS_FLAG_TC = 0x0200;
+constexpr std::uint16_t const   DNS_FLAG_RD = 0x0100;
+constexpr std::uint16_t const   DNS_RCODE_MASK = 0x000F;
+constexpr std::uint16_t const   DNS_RCODE_NOERROR = 0;
+constexpr std::uint16_t const   DNS_RCODE_NXDOMAIN = 3;
+constexpr std::size_t const     DNS_HEADER_SIZE = 12;
+constexpr int const             DNS_PORT = 53;
+
+typedef std::chrono::steady_clock   clock_t;
+
+
+std::uint16_t get_uint16(std::uint8_t const * data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+
+std::uint32_t get_uint32(std::uint8_t const * data)
+{
+    return (static_cast<std::uint32_t>(data[0]) << 24)
+         | (static_cast<std::uint32_t>(data[1]) << 16)
+         | (static_cast<std::uint32_t>(data[2]) <<  8)
+         |  static_cast<std::uint32_t>(data[3]);
+}
+
+
+void add_uint16(std::string & out, std::uint16_t value)
+{
+    out += static_cast<char>(value >> 8);
+    out += static_cast<char>(value);
+}
+
+
+/** \brief Read a domain name from a DNS message.
+ *
+ * Names in DNS messages are a list of labels, possibly ending with a
+ * pointer to another name found earlier in the message (compression).
+ *
+ * The resulting name is in lowercase without the ending period.
+ *
+ * \param[in] data  The DNS message.
+ * \param[in] size  The size of the DNS message.
+ * \param[in,out] pos  The position of the name, moved after the name.
+ * \param[out] name  The resulting name.
+ *
+ * \return true if the name was valid.
+ */
+bool read_name(std::uint8_t const * data, std::size_t size, std::size_t & pos, std::string & name)
+{
+    name.clear();
+
+    std::size_t p(pos);
+    bool jumped(false);
+    int jumps(0);
+    for(;;)
+    {
+        if(p >= size)
+        {
+            return false;
+        }
+        std::uint8_t const len(data[p]);
+        if((len & 0xC0) == 0xC0)
+        {
+            if(p + 1 >= size)
+            {
+                return false;
+            }
+            std::size_t const ptr(((len & 0x3F) << 8) | data[p + 1]);
+            if(!jumped)
+            {
+                pos = p + 2;
+                jumped = true;
+            }
+            ++jumps;
+            if(jumps > 64
+            || ptr >= size)
+            {
+                return false;
+            }
+            p = ptr;
+            continue;
+        }
+        if((len & 0xC0) != 0)
+        {
+            // extended label types are not supported
+            //
+            return false;
+        }
+        ++p;
+        if(len == 0)
+        {
+            break;
+        }
+        if(p + len > size)
+        {
+            return false;
+        }
+        if(!name.empty())
+        {
+            name += '.';
+        }
+        for(std::size_t idx(0); idx < len; ++idx)
+        {
+            name += static_cast<char>(std::tolower(data[p + idx]));
+        }
+        p += len;
+        if(name.length() > 255)
+        {
+            return false;
+        }
+    }
+
+    if(!jumped)
+    {
+        pos = p;
+    }
+
+    return true;
+}
+
+
+int remaining_ms(clock_t::time_point deadline)
+{
+    auto const left(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock_t::now()).count());
+    return left < 0 ? 0 : static_cast<int>(left);
+}
+
+
+bool wait_socket(int s, short events, clock_t::time_point deadline)
+{
+    pollfd fd = {};
+    fd.fd = s;
+    fd.events = events;
+    for(;;)
+    {
+        int const r(poll(&fd, 1, remaining_ms(deadline)));
+        if(r > 0)
+        {
+            return (fd.revents & events) != 0;
+        }
+        if(r == 0
+        || errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+
+/** \brief Send a query over UDP and wait for the answer.
+ *
+ * Answers with a different identifier are ignored (they may be late
+ * answers to a previous query).
+ *
+ * \param[in] nameserver  The IP address of the name server.
+ * \param[in] query  The query to send.
+ * \param[in] id  The identifier of the query.
+ * \param[in] deadline  When to give up.
+ * \param[out] answer  The answer.
+ *
+ * \return true if an answer was received.
+ */
+bool udp_exchange(
+      std::string const & nameserver
+    , std::string const & query
+    , std::uint16_t id
+    , clock_t::time_point deadline
+    , std::vector<std::uint8_t> & answer)
+{
+    sockaddr_storage addr;
+    socklen_t len(0);
+    if(!dns_resolver::make_address(nameserver, addr, len))
+    {
+        return false;
+    }
+
+    snapdev::raii_fd_t s(socket(addr.ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if(s.get() == -1)
+    {
+        return false;
+    }
+
+    // connecting means we only get answers from that server
+    //
+    if(connect(s.get(), reinterpret_cast<sockaddr const *>(&addr), len) != 0
+    || send(s.get(), query.data(), query.length(), 0) != static_cast<ssize_t>(query.length()))
+    {
+        return false;
+    }
+
+    answer.resize(65536);
+    for(;;)
+    {
+        if(!wait_socket(s.get(), POLLIN, deadline))
+        {
+            return false;
+        }
+        ssize_t const r(recv(s.get(), answer.data(), answer.size(), 0));
+        if(r < 0)
+        {
+            if(errno == EAGAIN
+            || errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if(static_cast<std::size_t>(r) >= DNS_HEADER_SIZE
+        && get_uint16(answer.data()) == id)
+        {
+            answer.resize(r);
+            return true;
+        }
+    }
+}
+
+
+bool tcp_read(int s, std::uint8_t * buf, std::size_t size, clock_t::time_point deadline)
+{
+    while(size > 0)
+    {
+        if(!wait_socket(s, POLLIN, deadline))
+        {
+            return false;
+        }
+        ssize_t const r(recv(s, buf, size, 0));
+        if(r < 0)
+        {
+            if(errno == EAGAIN
+            || errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if(r == 0)
+        {
+            return false;
+        }
+        buf += r;
+        size -= r;
+    }
+    return true;
+}
+
+
+/** \brief Send a query over TCP and wait for the answer.
+ *
+ * This is used when the UDP answer was truncated.
+ *
+ * \param[in] nameserver  The IP address of the name server.
+ * \param[in] query  The query to send.
+ * \param[in] deadline  When to give up.
+ * \param[out] answer  The answer.
+ *
+ * \return true if an answer was received.
+ */
+bool tcp_exchange(
+      std::string const & nameserver
+    , std::string const & query
+    , clock_t::time_point deadline
+    , std::vector<std::uint8_t> & answer)
+{
+    sockaddr_storage addr;
+    socklen_t len(0);
+    if(!dns_resolver::make_address(nameserver, addr, len))
+    {
+        return false;
+    }
+
+    snapdev::raii_fd_t s(socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if(s.get() == -1)
+    {
+        return false;
+    }
+
+    if(connect(s.get(), reinterpret_cast<sockaddr const *>(&addr), len) != 0)
+    {
+        if(errno != EINPROGRESS
+        || !wait_socket(s.get(), POLLOUT, deadline))
+        {
+            return false;
+        }
+        int error(0);
+        socklen_t error_len(sizeof(error));
+        if(getsockopt(s.get(), SOL_SOCKET, SO_ERROR, &error, &error_len) != 0
+        || error != 0)
+        {
+            return false;
+        }
+    }
+
+    // over TCP, the message is preceeded by its size
+    //
+    std::string message;
+    add_uint16(message, static_cast<std::uint16_t>(query.length()));
+    message += query;
+    char const * d(message.data());
+    std::size_t size(message.length());
+    while(size > 0)
+    {
+        if(!wait_socket(s.get(), POLLOUT, deadline))
+        {
+            return false;
+        }
+        ssize_t const r(send(s.get(), d, size, MSG_NOSIGNAL));
+        if(r < 0)
+        {
+            if(errno == EAGAIN
+            || errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        d += r;
+        size -= r;
+    }
+
+    std::uint8_t length[2];
+    if(!tcp_read(s.get(), length, sizeof(length), deadline))
+    {
+        return false;
+    }
+    answer.resize(get_uint16(length));
+    return tcp_read(s.get(), answer.data(), answer.size(), deadline);
+}
+
+
+dns_resolver::nameserver_list_t load_resolv_conf()
+{
+    dns_resolver::nameserver_list_t result;
+
+    std::ifstream conf("/etc/resolv.conf");
+    std::string line;
+    while(std::getline(conf, line))
+    {
+        std::string::size_type const start(line.find_first_not_of(" \t"));
+        if(start == std::string::npos
+        || line.compare(start, 10, "nameserver") != 0)
+        {
+            continue;
+        }
+        std::string::size_type const ip_start(line.find_first_not_of(" \t", start + 10));
+        if(ip_start == std::string::npos
+        || ip_start == start + 10)
+        {
+            continue;
+        }
+        std::string::size_type const ip_end(line.find_first_of(" \t#;", ip_start));
+        result.push_back(line.substr(ip_start, ip_end == std::string::npos ? std::string::npos : ip_end - ip_start));
+    }
+
+    if(result.empty())
+    {
+        // the resolver default is to use the local server
+        //
+        result.push_back("127.0.0.1");
+    }
+
+    return result;
+}
+
+
+
+}
+// no name namespace
+
+
+
+
+/////////////////////
+// DNS MX RESPONSE //
+/////////////////////
+
+
+/** \brief Set the status of the response.
+ *
+ * \param[in] status  The new status.
+ */
+void dns_mx_response::set_status(dns_status_t status)
+{
+    f_status = status;
+}
+
+
+/** \brief Retrieve the status of the response.
+ *
+ * \return The status of the response.
+ */
+dns_status_t dns_mx_response::get_status() const
+{
+    return f_status;
+}
+
+
+/** \brief Set the TTL of this response.
+ *
+ * For a positive response, this is the smallest TTL of the MX records.
+ * For a negative response, this is the TTL defined by the SOA record
+ * of the authority section (see RFC 2308).
+ *
+ * \param[in] ttl  The TTL in seconds.
+ */
+void dns_mx_response::set_ttl(std::uint32_t ttl)
+{
+    f_ttl = ttl;
+}
+
+
+/** \brief Retrieve the TTL of this response.
+ *
+ * \return The number of seconds the response can be cached.
+ */
+std::uint32_t dns_mx_response::get_ttl() const
+{
+    return f_ttl;
+}
+
+
+/** \brief Set the domain of the SOA found in the authority section.
+ *
+ * When the domain exists but has no MX record, the authority section
+ * has the SOA of the domain.
+ *
+ * \param[in] domain  The name of the SOA record owner.
+ */
+void dns_mx_response::set_authority_domain(std::string const & domain)
+{
+    f_authority_domain = domain;
+}
+
+
+/** \brief Retrieve the name of the SOA owner.
+ *
+ * \return The domain name found in the authority section or an empty string.
+ */
+std::string const & dns_mx_response::get_authority_domain() const
+{
+    return f_authority_domain;
+}
+
+
+/** \brief Add a mail exchanger to the response.
+ *
+ * \param[in] mx  The mail exchanger to add.
+ */
+void dns_mx_response::add_mail_exchanger(mail_exchanger const & mx)
+{
+    f_mail_exchangers.push_back(mx);
+}
+
+
+/** \brief Retrieve the mail exchangers found in the response.
+ *
+ * \return A reference to the list of mail exchangers.
+ */
+mail_exchanger::mail_exchange_vector_t const & dns_mx_response::get_mail_exchangers() const
+{
+    return f_mail_exchangers;
+}
+
+
+/** \brief Check whether the response includes a "null MX".
+ *
+ * A domain which does not accept emails can say so with an MX record
+ * with an empty domain name (RFC 7505).
+ *
+ * \return true if one of the MX records is a null MX.
+ */
+bool dns_mx_response::has_null_mx() const
+{
+    return std::any_of(
+              f_mail_exchangers.begin()
+            , f_mail_exchangers.end()
+            , [](mail_exchanger const & mx)
+            {
+                return mx.get_domain().empty();
+            });
+}
+
+
+
+
+//////////////////
+// DNS RESOLVER //
+//////////////////
+
+
+/** \brief Initialize the resolver.
+ *
+ * The resolver uses the name servers defined in `/etc/resolv.conf`
+ * by default.
+ */
+dns_resolver::dns_resolver()
+    : f_nameservers(get_system_nameservers())
+{
+}
+
+
+/** \brief Change the list of name servers.
+ *
+ * \exception invalid_parameter
+ * The list cannot be empty.
+ *
+ * \param[in] nameservers  The IP addresses of the name servers to query.
+ */
+void dns_resolver::set_nameservers(nameserver_list_t const & nameservers)
+{
+    if(nameservers.empty())
+    {
+        throw invalid_parameter("dns_resolver::set_nameservers(): the list of name servers cannot be empty.");
+    }
+    f_nameservers = nameservers;
+}
+
+
+/** \brief Retrieve the list of name servers.
+ *
+ * \return The IP addresses of the name servers.
+ */
+dns_resolver::nameserver_list_t const & dns_resolver::get_nameservers() const
+{
+    return f_nameservers;
+}
+
+
+/** \brief Change the time to wait for an answer.
+ *
+ * \param[in] seconds  The number of seconds to wait for each server.
+ */
+void dns_resolver::set_timeout(int seconds)
+{
+    if(seconds <= 0)
+    {
+        throw invalid_parameter("dns_resolver::set_timeout(): the timeout must be positive.");
+    }
+    f_timeout = seconds;
+}
+
+
+/** \brief Retrieve the time to wait for an answer.
+ *
+ * \return The timeout in seconds.
+ */
+int dns_resolver::get_timeout() const
+{
+    return f_timeout;
+}
+
+
+/** \brief Change the number of times each server gets queried.
+ *
+ * \param[in] attempts  The number of attempts, at least 1.
+ */
+void dns_resolver::set_attempts(int attempts)
+{
+    if(attempts <= 0)
+    {
+        throw invalid_parameter("dns_resolver::set_attempts(): the number of attempts must be positive.");
+    }
+    f_attempts = attempts;
+}
+
+
+/** \brief Retrieve the number of times each server gets queried.
+ *
+ * \return The number of attempts.
+ */
+int dns_resolver::get_attempts() const
+{
+    return f_attempts;
+}
+
+
+/** \brief Query the MX records of a domain.
+ *
+ * This function sends the MX query to each name server in turn until one
+ * of them sends a definitive answer.
+ *
+ * \param[in] domain  The domain to query.
+ * \param[out] response  The response.
+ *
+ * \return true if a definitive answer was received (SUCCESS, NO_DATA,
+ * or NAME_ERROR).
+ */
+bool dns_resolver::query_mx(std::string const & domain, dns_mx_response & response) const
+{
+    response = dns_mx_response();
+
+    std::uint16_t const id(generate_dns_query_id());
+    std::string const query(build_query(id, domain, DNS_TYPE_MX));
+
+    dns_status_t status(dns_status_t::DNS_STATUS_TIMEOUT);
+    for(int attempt(0); attempt < f_attempts; ++attempt)
+    {
+        for(auto const & ns : f_nameservers)
+        {
+            clock_t::time_point const deadline(clock_t::now() + std::chrono::seconds(f_timeout));
+            std::vector<std::uint8_t> answer;
+            if(!udp_exchange(ns, query, id, deadline, answer))
+            {
+                continue;
+            }
+
+            if((get_uint16(answer.data() + 2) & DNS_FLAG_TC) != 0)
+            {
+                // the answer did not fit in a UDP packet, try with TCP
+                //
+                if(!tcp_exchange(ns, query, deadline, answer))
+                {
+                    continue;
+                }
+            }
+
+            if(!parse_mx_response(answer.data(), answer.size(), id, response))
+            {
+                SNAP_LOG_DEBUG
+                    << "invalid DNS answer from "
+                    << ns
+                    << " for MX of \""
+                    << domain
+                    << "\"."
+                    << SNAP_LOG_SEND;
+                status = dns_status_t::DNS_STATUS_INVALID;
+                continue;
+            }
+
+            status = response.get_status();
+            if(status != dns_status_t::DNS_STATUS_SERVER_FAILURE)
+            {
+                return true;
+            }
+        }
+    }
+
+    response.set_status(status);
+    return false;
+}
+
+
+/** \brief Retrieve the name servers defined in `/etc/resolv.conf`.
+ *
+ * The file is read only once.
+ *
+ * \return The list of the system name servers.
+ */
+dns_resolver::nameserver_list_t const & dns_resolver::get_system_nameservers()
+{
+    static nameserver_list_t const nameservers(load_resolv_conf());
+    return nameservers;
+}
+
+
+/** \brief Convert the IP address of a name server to a socket address.
+ *
+ * The port is set to 53.
+ *
+ * \param[in] ip  The IPv4 or IPv6 address of the name server.
+ * \param[out] addr  The resulting socket address.
+ * \param[out] len  The size of the socket address.
+ *
+ * \return true if \p ip is a valid IP address.
+ */
+bool dns_resolver::make_address(std::string const & ip, sockaddr_storage & addr, socklen_t & len)
+{
+    addr = sockaddr_storage();
+
+    sockaddr_in * in4(reinterpret_cast<sockaddr_in *>(&addr));
+    if(inet_pton(AF_INET, ip.c_str(), &in4->sin_addr) == 1)
+    {
+        in4->sin_family = AF_INET;
+        in4->sin_port = htons(DNS_PORT);
+        len = sizeof(sockaddr_in);
+        return true;
+    }
+
+    // remove the scope (i.e. "fe80::1%eth0") which inet_pton() does not accept
+    //
+    std::string const ip6(ip.substr(0, ip.find('%')));
+    sockaddr_in6 * in6(reinterpret_cast<sockaddr_in6 *>(&addr));
+    if(inet_pton(AF_INET6, ip6.c_str(), &in6->sin6_addr) == 1)
+    {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(DNS_PORT);
+        len = sizeof(sockaddr_in6);
+        return true;
+    }
+
+    return false;
+}
+
+
+/** \brief Build a DNS query.
+ *
+ * The query asks for recursion and includes an EDNS0 OPT record so the
+ * server can send answers larger than 512 bytes over UDP.
+ *
+ * \exception invalid_parameter
+ * The domain must be a valid domain name (labels of 1 to 63 characters).
+ *
+ * \param[in] id  The identifier of the query.
+ * \param[in] domain  The domain name to query.
+ * \param[in] type  The type of record to query (i.e. DNS_TYPE_MX).
+ *
+ * \return The binary query.
+ */
+std::string dns_resolver::build_query(std::uint16_t id, std::string const & domain, std::uint16_t type)
+{
+    std::string query;
+    query.reserve(DNS_HEADER_SIZE + domain.length() + 2 + 4 + 11);
+
+    add_uint16(query, id);
+    add_uint16(query, DNS_FLAG_RD);
+    add_uint16(query, 1);       // QDCOUNT
+    add_uint16(query, 0);       // ANCOUNT
+    add_uint16(query, 0);       // NSCOUNT
+    add_uint16(query, 1);       // ARCOUNT (OPT)
+
+    std::string::size_type start(0);
+    while(start < domain.length())
+    {
+        std::string::size_type end(domain.find('.', start));
+        if(end == std::string::npos)
+        {
+            end = domain.length();
+        }
+        std::string::size_type const len(end - start);
+        if(len == 0
+        || len > 63)
+        {
+            throw invalid_parameter(
+                      "dns_resolver::build_query(): invalid domain name \""
+                    + domain
+                    + "\".");
+        }
+        query += static_cast<char>(len);
+        query.append(domain, start, len);
+        start = end + 1;
+    }
+    query += '\0';
+    add_uint16(query, type);
+    add_uint16(query, DNS_CLASS_IN);
+
+    // EDNS0 OPT record (RFC 6891)
+    //
+    query += '\0';              // root domain
+    add_uint16(query, DNS_TYPE_OPT);
+    add_uint16(query, DNS_UDP_PAYLOAD_SIZE);
+    add_uint16(query, 0);       // extended RCODE & version
+    add_uint16(query, 0);       // flags
+    add_uint16(query, 0);       // RDLENGTH
+
+    return query;
+}
+
+
+/** \brief Parse the answer to an MX query.
+ *
+ * This function extracts the MX records from the answer section and the
+ * SOA record from the authority section, if present.
+ *
+ * A name server failure (SERVFAIL, REFUSED, etc.) is considered valid;
+ * the status of the \p response is set to DNS_STATUS_SERVER_FAILURE
+ * in that case.
+ *
+ * \param[in] data  The binary answer.
+ * \param[in] size  The size of the answer.
+ * \param[in] id  The identifier of the query.
+ * \param[out] response  The parsed response.
+ *
+ * \return true if the answer was parsed successfully.
+ */
+bool dns_resolver::parse_mx_response(
+      std::uint8_t const * data
+    , std::size_t size
+    , std::uint16_t id
+    , dns_mx_response & response)
+{
+    response = dns_mx_response();
+    response.set_status(dns_status_t::DNS_STATUS_INVALID);
+
+    if(size < DNS_HEADER_SIZE
+    || get_uint16(data) != id)
+    {
+        return false;
+    }
+
+    std::uint16_t const flags(get_uint16(data + 2));
+    if((flags & DNS_FLAG_QR) == 0)
+    {
+        return false;
+    }
+    std::uint16_t const rcode(flags & DNS_RCODE_MASK);
+    if(rcode != DNS_RCODE_NOERROR
+    && rcode != DNS_RCODE_NXDOMAIN)
+    {
+        response.set_status(dns_status_t::DNS_STATUS_SERVER_FAILURE);
+        return true;
+    }
+
+    std::uint16_t const qdcount(get_uint16(data + 4));
+    std::uint16_t const ancount(get_uint16(data + 6));
+    std::uint16_t const nscount(get_uint16(data + 8));
+
+    std::size_t pos(DNS_HEADER_SIZE);
+    std::string name;
+    for(std::uint16_t idx(0); idx < qdcount; ++idx)
+    {
+        if(!read_name(data, size, pos, name)
+        || pos + 4 > size)
+        {
+            return false;
+        }
+        pos += 4;   // QTYPE & QCLASS
+    }
+
+    bool has_ttl(false);
+    std::uint32_t ttl(0);
+    for(int section(0); section < 2; ++section)
+    {
+        std::uint16_t const count(section == 0 ? ancount : nscount);
+        for(std::uint16_t idx(0); idx < count; ++idx)
+        {
+            if(!read_name(data, size, pos, name)
+            || pos + 10 > size)
+            {
+                return false;
+            }
+            std::uint16_t const type(get_uint16(data + pos));
+            std::uint16_t const rr_class(get_uint16(data + pos + 2));
+            std::uint32_t const rr_ttl(get_uint32(data + pos + 4));
+            std::uint16_t const rdlength(get_uint16(data + pos + 8));
+            pos += 10;
+            if(pos + rdlength > size)
+            {
+                return false;
+            }
+            std::size_t const rdata(pos);
+            pos += rdlength;
+
+            if(rr_class != DNS_CLASS_IN)
+            {
+                continue;
+            }
+
+            if(section == 0
+            && type == DNS_TYPE_MX)
+            {
+                if(rdlength < 3)
+                {
+                    return false;
+                }
+                std::size_t exchange_pos(rdata + 2);
+                std::string exchange;
+                if(!read_name(data, size, exchange_pos, exchange))
+                {
+                    return false;
+                }
+                response.add_mail_exchanger(mail_exchanger(get_uint16(data + rdata), exchange, rr_ttl));
+                if(!has_ttl || rr_ttl < ttl)
+                {
+                    ttl = rr_ttl;
+                    has_ttl = true;
+                }
+            }
+            else if(section == 1
+                 && type == DNS_TYPE_SOA
+                 && response.get_mail_exchangers().empty())
+            {
+                // negative caching TTL is the smallest of the SOA TTL
+                // and the SOA MINIMUM field (RFC 2308)
+                //
+                std::size_t soa_pos(rdata);
+                std::string mname;
+                std::string rname;
+                if(!read_name(data, size, soa_pos, mname)
+                || !read_name(data, size, soa_pos, rname)
+                || soa_pos + 20 > rdata + rdlength)
+                {
+                    return false;
+                }
+                std::uint32_t const minimum(get_uint32(data + soa_pos + 16));
+                ttl = std::min(rr_ttl, minimum);
+                has_ttl = true;
+                response.set_authority_domain(name);
+            }
+        }
+    }
+
+    response.set_ttl(ttl);
+    if(!response.get_mail_exchangers().empty())
+    {
+        response.set_status(dns_status_t::DNS_STATUS_SUCCESS);
+    }
+    else if(rcode == DNS_RCODE_NXDOMAIN)
+    {
+        response.set_status(dns_status_t::DNS_STATUS_NAME_ERROR);
+    }
+    else
+    {
+        response.set_status(dns_status_t::DNS_STATUS_NO_DATA);
+    }
+
+    return true;
+}
+
+
+
+
+/** \brief Generate a random DNS query identifier.
+ *
+ * The identifier must be random to make it harder to spoof answers.
+ *
+ * \return A random 16 bit number.
+ */
+std::uint16_t generate_dns_query_id()
+{
+    thread_local std::mt19937 generator(std::random_device{}());
+    return static_cast<std::uint16_t>(generator());
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,120 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/mail_exchanger.h>
+
+
+// C++
+//
+#include    <cstdint>
+
+
+// C
+//
+#include    <sys/socket.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+enum class dns_status_t
+{
+    DNS_STATUS_SUCCESS,             // found MX records
+    DNS_STATUS_NO_DATA,             // domain exists, but no MX records
+    DNS_STATUS_NAME_ERROR,          // domain does not exist (NXDOMAIN)
+    DNS_STATUS_SERVER_FAILURE,      // server could not answer (SERVFAIL, REFUSED...)
+    DNS_STATUS_TIMEOUT,             // no server answered
+    DNS_STATUS_INVALID              // the answer could not be parsed
+};
+
+
+class dns_mx_response
+{
+public:
+    void                    set_status(dns_status_t status);
+    dns_status_t            get_status() const;
+    void                    set_ttl(std::uint32_t ttl);
+    std::uint32_t           get_ttl() const;
+    void                    set_authority_domain(std::string const & domain);
+    std::string const &     get_authority_domain() const;
+    void                    add_mail_exchanger(mail_exchanger const & mx);
+    mail_exchanger::mail_exchange_vector_t const &
+                            get_mail_exchangers() const;
+    bool                    has_null_mx() const;
+
+private:
+    dns_status_t            f_status = dns_status_t::DNS_STATUS_TIMEOUT;
+    std::uint32_t           f_ttl = 0;
+    std::string             f_authority_domain = std::string();
+    mail_exchanger::mail_exchange_vector_t
+                            f_mail_exchangers = mail_exchanger::mail_exchange_vector_t();
+};
+
+
+class dns_resolver
+{
+public:
+    typedef std::vector<std::string>        nameserver_list_t;
+
+    static constexpr int const              DNS_DEFAULT_TIMEOUT = 5;    // in seconds
+    static constexpr int const              DNS_DEFAULT_ATTEMPTS = 2;
+    static constexpr std::uint16_t const    DNS_TYPE_MX = 15;
+    static constexpr std::uint16_t const    DNS_TYPE_SOA = 6;
+    static constexpr std::uint16_t const    DNS_UDP_PAYLOAD_SIZE = 1232;
+
+                            dns_resolver();
+
+    void                    set_nameservers(nameserver_list_t const & nameservers);
+    nameserver_list_t const &
+                            get_nameservers() const;
+    void                    set_timeout(int seconds);
+    int                     get_timeout() const;
+    void                    set_attempts(int attempts);
+    int                     get_attempts() const;
+
+    bool                    query_mx(std::string const & domain, dns_mx_response & response) const;
+
+    static nameserver_list_t const &
+                            get_system_nameservers();
+    static bool             make_address(std::string const & ip, sockaddr_storage & addr, socklen_t & len);
+    static std::string      build_query(std::uint16_t id, std::string const & domain, std::uint16_t type);
+    static bool             parse_mx_response(
+                                  std::uint8_t const * data
+                                , std::size_t size
+                                , std::uint16_t id
+                                , dns_mx_response & response);
+
+private:
+    nameserver_list_t       f_nameservers = nameserver_list_t();
+    int                     f_timeout = DNS_DEFAULT_TIMEOUT;
+    int                     f_attempts = DNS_DEFAULT_ATTEMPTS;
+};
+
+
+std::uint16_t               generate_dns_query_id();
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
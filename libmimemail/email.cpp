@@ -20,24 +20,14 @@
 //
 #include    "libmimemail/email.h"
 
+#include    "libmimemail/metrics.h"
+#include    "libmimemail/mime_writer.h"
 #include    "libmimemail/names.h"
-#include    "libmimemail/version.h"
 
 
 // edhttp
 //
-#include    <edhttp/http_date.h>
-#include    <edhttp/mime_type.h>
 #include    <edhttp/names.h>
-#include    <edhttp/quoted_printable.h>
-#include    <edhttp/weighted_http_string.h>
-
-
-// eventdispatcher lib
-//
-#include    <cppprocess/io_capture_pipe.h>
-#include    <cppprocess/io_data_pipe.h>
-#include    <cppprocess/process.h>
 
 
 // snaplogger lib
@@ -50,6 +40,11 @@
 #include    <libtld/tld.h>
 
 
+// C++
+//
+#include    <type_traits>
+
+
 // last include
 //
 #include    <snapdev/poison.h>
@@ -59,85 +54,33 @@
 namespace libmimemail
 {
 
-namespace
-{
 
-/** \brief Copy the filename if defined.
- *
- * Check whether the filename is defined in the Content-Disposition
- * or the Content-Type fields and make sure to duplicate it in
- * both fields. This ensures that most email systems have access
- * to the filename.
- *
- * \note
- * The valid location of the filename is the Content-Disposition,
- * but it has been saved in the 'name' sub-field of the Content-Type
- * field and some tools only check that field.
- *
- * \param[in,out] attachment_headers  The headers to be checked for
- *                                    a filename.
- */
-void copy_filename_to_content_type(header_map_t & attachment_headers)
+
+namespace
 {
-    if(attachment_headers.find(edhttp::g_name_edhttp_field_content_disposition) != attachment_headers.end()
-    && attachment_headers.find(edhttp::g_name_edhttp_field_content_type) != attachment_headers.end())
-    {
-        // both fields are defined, copy the filename as required
-        std::string const content_disposition(attachment_headers[edhttp::g_name_edhttp_field_content_disposition]);
-        std::string const content_type(attachment_headers[edhttp::g_name_edhttp_field_content_type]);
 
-        edhttp::weighted_http_string content_disposition_subfields(content_disposition);
-        edhttp::weighted_http_string content_type_subfields(content_type);
 
-        edhttp::string_part::vector_t & content_disposition_parts(content_disposition_subfields.get_parts());
-        edhttp::string_part::vector_t & content_type_parts(content_type_subfields.get_parts());
 
-        if(content_disposition_parts.size() > 0
-        && content_type_parts.size() > 0)
-        {
-            // we only use part 1 (there should not be more than one though)
-            //
-            std::string const filename(content_disposition_parts[0].get_parameter("filename"));
-            if(!filename.empty())
-            {
-                // okay, we found the filename in the Content-Disposition,
-                // copy that to the Content-Type
-                //
-                // Note: we always force the name parameter so if it was
-                //       already defined, we make sure it is the same as
-                //       in the Content-Disposition field
-                //
-                content_type_parts[0].add_parameter("name", filename);
-                attachment_headers[edhttp::g_name_edhttp_field_content_type] = content_type_subfields.to_string();
-            }
-            else
-            {
-                std::string const name(content_type_parts[0].get_parameter("name"));
-                if(!name.empty())
-                {
-                    // Somehow the filename is defined in the Content-Type field
-                    // but not in the Content-Disposition...
-                    //
-                    // copy it to the Content-Disposition too (where it should be)
-                    //
-                    content_disposition_parts[0].add_parameter("filename", name);
-                    attachment_headers[edhttp::g_name_edhttp_field_content_disposition] = content_disposition_subfields.to_string();
-                }
-            }
-        }
-    }
-}
+// the std::pmr vectors move the emails and attachments when they grow
+// only if these constructors cannot throw
+//
+static_assert(std::is_nothrow_move_constructible_v<header_map>);
+static_assert(std::is_nothrow_move_constructible_v<attachment>);
+static_assert(std::is_nothrow_move_constructible_v<email>);
 
 
+void count_deserialized(std::size_t size)
+{
+    if(metrics_enabled())
+    {
+        record_counter(metric_counter_t::METRIC_COUNTER_EMAILS_DESERIALIZED, 1);
+        record_counter(metric_counter_t::METRIC_COUNTER_BYTES_DESERIALIZED, size);
+    }
 }
-// no name namespace
-
-
-
-
 
 
 
+} // no name namespace
 
 
 
@@ -170,6 +113,15 @@ void copy_filename_to_content_type(header_map_t & attachment_headers)
  * PDF, etc.). There is no specific limit to the number of attachments
  * or the size per se, although more email systems do limit the size
  * of an email so we do enforce some limit (i.e. 25Mb).
+ *
+ * \note
+ * Different email objects can be used from different threads at the
+ * same time, including to render or send them, even if they are copies
+ * of each other: the attachment data they share is immutable. One email
+ * object can be read (const functions only) from several threads at
+ * once, except for an email loaded with headers only (see
+ * deserialize()) which loads its attachments on first access. An email
+ * being modified must not be accessed by any other thread.
  */
 email::email()
     : f_time(time(nullptr))
@@ -177,6 +129,88 @@ email::email()
 }
 
 
+/** \brief Initialize an email object using the specified allocator.
+ *
+ * The headers, attachments, and parameters of the email get allocated
+ * with \p alloc. Generally, \p alloc is the resource of an email_arena
+ * so many emails can be built and released at once without going
+ * through the global heap each time.
+ *
+ * \warning
+ * The email must be destroyed before the memory resource.
+ *
+ * \param[in] alloc  The allocator used by this email.
+ */
+email::email(allocator_type const & alloc)
+    : f_time(time(nullptr))
+    , f_headers(alloc)
+    , f_attachments(alloc)
+    , f_parameters(alloc)
+{
+}
+
+
+/** \brief Copy an email object using the specified allocator.
+ *
+ * The std::pmr containers call this constructor when an email gets
+ * added to them so the copy uses the memory of the container.
+ *
+ * \param[in] rhs  The email to copy.
+ * \param[in] alloc  The allocator used by the copy.
+ */
+email::email(email const & rhs, allocator_type const & alloc)
+    : f_branding(rhs.f_branding)
+    , f_cumulative(rhs.f_cumulative)
+    , f_site_key(rhs.f_site_key)
+    , f_email_path(rhs.f_email_path)
+    , f_email_key(rhs.f_email_key)
+    , f_time(rhs.f_time)
+    , f_headers(rhs.f_headers, alloc)
+    , f_attachments(rhs.f_attachments, alloc)
+    , f_parameters(rhs.f_parameters, alloc)
+    , f_lazy_buffer(rhs.f_lazy_buffer)
+    , f_lazy_offset(rhs.f_lazy_offset)
+    , f_lazy_count(rhs.f_lazy_count)
+    , f_lazy_version(rhs.f_lazy_version)
+    , f_lazy_blob_store(rhs.f_lazy_blob_store)
+{
+}
+
+
+/** \brief Move an email object using the specified allocator.
+ *
+ * The std::pmr containers call this constructor when they grow, for
+ * example the vector of an email_arena. Since the emails of a container
+ * share its allocator, the headers, attachments, and parameters are
+ * moved, not copied. If \p alloc is not the allocator of \p rhs (i.e.
+ * an email moved out of an arena), they get copied, which may throw
+ * std::bad_alloc.
+ *
+ * The containers decide whether to move or copy on growth by checking
+ * the plain move constructor, which is noexcept.
+ *
+ * \param[in] rhs  The email to move.
+ * \param[in] alloc  The allocator used by the new email.
+ */
+email::email(email && rhs, allocator_type const & alloc)
+    : f_branding(rhs.f_branding)
+    , f_cumulative(std::move(rhs.f_cumulative))
+    , f_site_key(std::move(rhs.f_site_key))
+    , f_email_path(std::move(rhs.f_email_path))
+    , f_email_key(std::move(rhs.f_email_key))
+    , f_time(rhs.f_time)
+    , f_headers(std::move(rhs.f_headers), alloc)
+    , f_attachments(std::move(rhs.f_attachments), alloc)
+    , f_parameters(std::move(rhs.f_parameters), alloc)
+    , f_lazy_buffer(std::move(rhs.f_lazy_buffer))
+    , f_lazy_offset(rhs.f_lazy_offset)
+    , f_lazy_count(rhs.f_lazy_count)
+    , f_lazy_version(rhs.f_lazy_version)
+    , f_lazy_blob_store(std::move(rhs.f_lazy_blob_store))
+{
+}
+
+
 /** \brief Clean up the email object.
  *
  * This function ensures that an email object is cleaned up before
@@ -187,6 +221,16 @@ email::~email()
 }
 
 
+/** \brief Get the allocator used by this email.
+ *
+ * \return The allocator of the headers, attachments, and parameters.
+ */
+email::allocator_type email::get_allocator() const
+{
+    return f_headers.get_allocator();
+}
+
+
 /** \brief Change whether the branding is to be shown or not.
  *
  * By default, the send() function includes a couple of branding
@@ -378,6 +422,10 @@ std::string const & email::get_email_path() const
  * When a new email is posted, it is assigned a unique number used as a
  * key in different places.
  *
+ * The mime_writer writes the site and email keys in the X-Site-Key and
+ * X-Email-Key headers so a bounce can be matched with the email which
+ * bounced (see parse_bounce()).
+ *
  * \param[in] email_key  The name (key/URI) of the site being built.
  */
 void email::set_email_key(std::string const & email_key)
@@ -438,6 +486,7 @@ void email::set_from(std::string const & from)
 {
     // parse the email to verify that it is valid
     //
+    metrics_timer parse_timer(metric_stage_t::METRIC_STAGE_ADDRESS_PARSING);
     tld_email_list emails;
     if(emails.parse(from, 0) != TLD_RESULT_SUCCESS)
     {
@@ -450,10 +499,11 @@ void email::set_from(std::string const & from)
     {
         throw invalid_parameter("email::set_from(): multiple \"From:\" emails");
     }
+    parse_timer.stop();
 
     // save the email as the From email address
     //
-    f_headers[g_name_libmimemail_email_from] = from;
+    f_headers[HEADER_ID_FROM] = from;
 }
 
 
@@ -486,6 +536,7 @@ void email::set_to(std::string const & to)
 {
     // parse the email to verify that it is valid
     //
+    metrics_timer parse_timer(metric_stage_t::METRIC_STAGE_ADDRESS_PARSING);
     tld_email_list emails;
     if(emails.parse(to, 0) != TLD_RESULT_SUCCESS)
     {
@@ -498,10 +549,11 @@ void email::set_to(std::string const & to)
         //
         throw invalid_parameter("email::set_to(): not even one \"To:\" email");
     }
+    parse_timer.stop();
 
     // save the email as the To email address
     //
-    f_headers[g_name_libmimemail_email_to] = to;
+    f_headers[HEADER_ID_TO] = to;
 }
 
 
@@ -547,10 +599,10 @@ void email::set_priority(priority_t priority)
 
     }
 
-    f_headers[g_name_libmimemail_email_x_priority] = std::to_string(static_cast<int>(priority)) + " (" + name + ")";
-    f_headers[g_name_libmimemail_email_x_msmail_priority] = name;
-    f_headers[g_name_libmimemail_email_importance] = name;
-    f_headers[g_name_libmimemail_email_precedence] = name;
+    f_headers[HEADER_ID_X_PRIORITY] = std::to_string(static_cast<int>(priority)) + " (" + name + ")";
+    f_headers[HEADER_ID_X_MSMAIL_PRIORITY] = name;
+    f_headers[HEADER_ID_IMPORTANCE] = name;
+    f_headers[HEADER_ID_PRECEDENCE] = name;
 }
 
 
@@ -576,7 +628,7 @@ void email::set_priority(priority_t priority)
  */
 void email::set_subject(std::string const & subject)
 {
-    f_headers[g_name_libmimemail_email_subject] = subject;
+    f_headers[HEADER_ID_SUBJECT] = subject;
 }
 
 
@@ -594,7 +646,9 @@ void email::set_subject(std::string const & subject)
  *
  * The To, Cc, and Bcc fields are defined in this way. If multiple
  * destinations are defined, you must concatenate them in the
- * \p value parameter before calling this function.
+ * \p value parameter before calling this function. All the addresses
+ * of these three fields receive the email. The Bcc field itself is
+ * not included in the email sent.
  *
  * Note that the name of a header is case insensitive. So the names
  * "Content-Type" and "content-type" represent the same header. Which
@@ -645,6 +699,7 @@ void email::add_header(std::string const & name, std::string const & value)
             // if not unknown then we should check the field value
             // as a list of emails
             //
+            metrics_timer parse_timer(metric_stage_t::METRIC_STAGE_ADDRESS_PARSING);
             tld_email_list emails;
             if(emails.parse(value, 0) != TLD_RESULT_SUCCESS)
             {
@@ -674,7 +729,7 @@ void email::add_header(std::string const & name, std::string const & value)
         }
     }
 
-    f_headers[snapdev::to_case_insensitive_string(name)] = value;
+    f_headers[name] = value;
 }
 
 
@@ -691,7 +746,7 @@ void email::add_header(std::string const & name, std::string const & value)
  */
 void email::remove_header(std::string const & name)
 {
-    auto const it(f_headers.find(snapdev::to_case_insensitive_string(name)));
+    auto const it(f_headers.find(name));
     if(it != f_headers.end())
     {
         f_headers.erase(it);
@@ -716,7 +771,7 @@ bool email::has_header(std::string const & name) const
         throw invalid_parameter("email::has_header(): Cannot check for a header with an empty name.");
     }
 
-    return f_headers.find(snapdev::to_case_insensitive_string(name)) != f_headers.end();
+    return f_headers.find(name) != f_headers.end();
 }
 
 
@@ -744,7 +799,7 @@ std::string email::get_header(std::string const & name) const
         throw invalid_parameter("email::get_header(): Cannot retrieve a header with an empty name.");
     }
 
-    auto const it(f_headers.find(snapdev::to_case_insensitive_string(name)));
+    auto const it(f_headers.find(name));
     if(it != f_headers.end())
     {
         return it->second;
@@ -755,11 +810,34 @@ std::string email::get_header(std::string const & name) const
 }
 
 
+/** \brief Retrieve the value of a well-known header.
+ *
+ * This is the same as get_header() with the name of that header, only
+ * faster since no names get compared.
+ *
+ * \param[in] id  The identifier of the header, one of HEADER_ID_...
+ *
+ * \return The current value of that header or an empty string if undefined.
+ */
+std::string email::get_header(header_id_t id) const
+{
+    auto const it(f_headers.find(id));
+    if(it != f_headers.end())
+    {
+        return it->second;
+    }
+    return std::string();
+}
+
+
 /** \brief Get all the headers defined in this email.
  *
  * This function returns the map of the headers defined in this email. This
  * can be used to quickly scan all the headers.
  *
+ * The headers are listed in the order in which they were first added,
+ * which is also the order in which they get written in the email.
+ *
  * \note
  * It is important to remember that since this function returns a reference
  * to the map of headers, it may break if you call add_header() while going
@@ -791,6 +869,7 @@ header_map_t const & email::get_all_headers() const
  */
 void email::set_body_attachment(attachment const & data)
 {
+    load_attachments();
     f_attachments.insert(f_attachments.begin(), data);
 }
 
@@ -825,6 +904,7 @@ void email::set_body_attachment(attachment const & data)
  */
 void email::add_attachment(attachment const & data)
 {
+    load_attachments();
     f_attachments.push_back(data);
 }
 
@@ -842,6 +922,10 @@ void email::add_attachment(attachment const & data)
  */
 int email::get_attachment_count() const
 {
+    if(f_lazy_buffer != nullptr)
+    {
+        return f_attachments.size() + f_lazy_count;
+    }
     return f_attachments.size();
 }
 
@@ -867,13 +951,38 @@ int email::get_attachment_count() const
  * \sa add_attachment()
  * \sa get_attachment_count()
  */
-attachment & email::get_attachment(int index) const
+attachment & email::get_attachment(int index)
+{
+    load_attachments();
+    if(static_cast<size_t>(index) >= f_attachments.size())
+    {
+        throw std::out_of_range("email::get_attachment() called with an invalid index");
+    }
+    return f_attachments[index];
+}
+
+
+/** \brief Retrieve a read-only reference to an attachment.
+ *
+ * This function is used when rendering an email. It does not allow
+ * for the attachment to be modified, which means a const email can
+ * safely be rendered by several threads at once.
+ *
+ * \exception out_of_range
+ * If the index is out of range, this exception is raised.
+ *
+ * \param[in] index  The index of the attachment to retrieve.
+ *
+ * \return A constant reference to the corresponding attachment.
+ */
+attachment const & email::get_attachment(int index) const
 {
+    load_attachments();
     if(static_cast<size_t>(index) >= f_attachments.size())
     {
         throw std::out_of_range("email::get_attachment() called with an invalid index");
     }
-    return const_cast<attachment &>(f_attachments[index]);
+    return f_attachments[index];
 }
 
 
@@ -990,6 +1099,8 @@ const email::parameter_map_t & email::get_all_parameters() const
  */
 void email::deserialize(snapdev::deserializer<std::stringstream> & in)
 {
+    metrics_timer deserialize_timer(metric_stage_t::METRIC_STAGE_DESERIALIZE);
+
     snapdev::deserializer<std::stringstream>::process_hunk_t func(std::bind(
                   &email::process_hunk
                 , this
@@ -1000,7 +1111,9 @@ void email::deserialize(snapdev::deserializer<std::stringstream> & in)
         SNAP_LOG_WARNING
             << "email unserialization stopped early."
             << SNAP_LOG_SEND;
+        return;
     }
+    count_metric(metric_counter_t::METRIC_COUNTER_EMAILS_DESERIALIZED);
 }
 
 
@@ -1058,7 +1171,7 @@ bool email::process_hunk(
         {
             std::string value;
             in.read_data(value);
-            f_headers[snapdev::to_case_insensitive_string(field.f_sub_name)] = value;
+            f_headers[field.f_sub_name] = value;
         }
         break;
 
@@ -1067,7 +1180,7 @@ bool email::process_hunk(
         {
             std::string value;
             in.read_data(value);
-            f_headers[snapdev::to_case_insensitive_string(field.f_sub_name)] = value;
+            f_headers[field.f_sub_name] = value;
         }
         break;
 
@@ -1101,6 +1214,9 @@ bool email::process_hunk(
  */
 void email::serialize(snapdev::serializer<std::stringstream> & out) const
 {
+    metrics_timer serialize_timer(metric_stage_t::METRIC_STAGE_SERIALIZE);
+    count_metric(metric_counter_t::METRIC_COUNTER_EMAILS_SERIALIZED);
+
     std::string const version(
                   std::to_string(EMAIL_MAJOR_VERSION)
                 + '.'
@@ -1121,6 +1237,7 @@ void email::serialize(snapdev::serializer<std::stringstream> & out) const
         out.add_value("header", snapdev::to_string(it.first), it.second);
     }
 
+    load_attachments();
     for(auto const & it : f_attachments)
     {
         snapdev::recursive sub_field(out, "attachment");
@@ -1134,479 +1251,389 @@ void email::serialize(snapdev::serializer<std::stringstream> & out) const
 }
 
 
-/** \brief Send this email.
+/** \brief Serialize the email in the binary spool format.
  *
- * This function sends  the specified email. It generates all the body
- * and attachments, etc.
+ * This is an alternative to the snapdev serializer which is much faster
+ * to save and load. The writer references the strings of this email
+ * instead of copying them so the email must not be modified until the
+ * writer data was written (see binary_spool_writer::write()).
  *
- * Note that the function uses callbacks in order to retrieve the body
- * and attachment from the database as the Snap! environment uses those
- * for much of the data to be sent in emails. However, it is not a
- * requirements in case you want to send an email from another server
- * than a snap_child or snap_backend.
- *
- * \exception email_exception_missing_parameter
- * If the From header or the destination email only are missing this
- * exception is raised.
+ * \param[in,out] out  The writer where the email gets saved.
  *
- * \return true if the send() command worked (note that does not mean the
- * email made it; we'll know later whether it failed if we received a
- * bounced email).
+ * \sa deserialize(binary_spool_reader & in)
  */
-bool email::send() const
+void email::serialize(binary_spool_writer & out) const
 {
-    // verify that the `From` and `To` headers are defined
-    //
-    std::string const from(get_header(g_name_libmimemail_email_from));
-    std::string const to(get_header(g_name_libmimemail_email_to));
+    metrics_timer serialize_timer(metric_stage_t::METRIC_STAGE_SERIALIZE);
+    std::size_t const start_size(out.size());
+
+    out.add(static_cast<std::uint32_t>(EMAIL_MAJOR_VERSION));
+    out.add(static_cast<std::uint32_t>(EMAIL_MINOR_VERSION));
 
-    if(from.empty()
-    || to.empty())
+    out.add(static_cast<std::uint8_t>(f_branding ? 1 : 0));
+    out.add(std::string_view(f_cumulative));
+    out.add(std::string_view(f_site_key));
+    out.add(std::string_view(f_email_path));
+    out.add(std::string_view(f_email_key));
+    out.add(static_cast<std::uint64_t>(f_time));
+
+    out.add(static_cast<std::uint32_t>(f_headers.size()));
+    for(auto const & it : f_headers)
     {
-        throw missing_parameter("email::send() called without a From or a To header field defined. Make sure you call the set_from() and set_header() functions appropriately.");
+        out.add(std::string_view(it.first.data(), it.first.length()));
+        out.add(std::string_view(it.second));
     }
 
-    // verify that we have at least one attachment
-    // (the body is an attachment)
-    //
-    int const max_attachments(get_attachment_count());
-    if(max_attachments < 1)
+    out.add(static_cast<std::uint32_t>(f_parameters.size()));
+    for(auto const & it : f_parameters)
     {
-        throw missing_parameter("email::send() called without at least one attachment (body).");
+        out.add(std::string_view(it.first));
+        out.add(std::string_view(it.second));
     }
 
-    // we want to transform the body from HTML to text ahead of time
-    //
-    attachment const & body_attachment(get_attachment(0));
+    load_attachments();
+    out.add(static_cast<std::uint32_t>(f_attachments.size()));
+    for(auto const & it : f_attachments)
+    {
+        it.serialize(out);
+    }
 
-    // TODO: verify that the body is indeed HTML!
-    //       although html2text works against plain text but that is a waste
-    //
-    //       also, we should offer a way for the person creating an email
-    //       to specify both: a plain text body and an HTML body
-    //
-    std::string plain_text;
-    std::string const body_mime_type(body_attachment.get_header(edhttp::g_name_edhttp_field_content_type));
+    if(metrics_enabled())
+    {
+        record_counter(metric_counter_t::METRIC_COUNTER_EMAILS_SERIALIZED, 1);
+        record_counter(metric_counter_t::METRIC_COUNTER_BYTES_SERIALIZED, out.size() - start_size);
+    }
+}
 
-    // TODO: this test is wrong as it would match things like "text/html-special"
-    //
-    if(body_mime_type.substr(0, 9) == "text/html")
+
+/** \brief Unserialize an email saved in the binary spool format.
+ *
+ * The reader is expected to be positioned at the start of the email,
+ * the magic is read here.
+ *
+ * The data of the attachments is not copied; the attachments keep a
+ * reference to the reader buffer which remains valid until all of them
+ * are destroyed. The headers and parameters are copied.
+ *
+ * When \p headers_only is true, the function stops once the top level
+ * fields (headers, parameters, time, site key, etc.) were read. This is
+ * used to scan a spool quickly: with a memory mapped file, the pages
+ * holding the attachments are not even read from disk. The attachments
+ * get loaded on the first call to a function using them, such as
+ * get_attachment(). In that case \p in is left positioned at the start
+ * of the attachments.
+ *
+ * \param[in,out] in  The reader with the binary email.
+ * \param[in] headers_only  Whether to defer loading the attachments.
+ *
+ * \return true if the email was loaded, false if the data is not a valid
+ * binary email (an error is logged).
+ *
+ * \sa serialize(binary_spool_writer & out)
+ */
+bool email::deserialize(binary_spool_reader & in, bool headers_only)
+{
+    metrics_timer deserialize_timer(metric_stage_t::METRIC_STAGE_DESERIALIZE);
+    std::size_t const start_offset(in.get_offset());
+
+    std::uint32_t major(0);
+    std::uint32_t minor(0);
+    std::uint8_t branding(0);
+    std::uint64_t time(0);
+    std::uint32_t count(0);
+    if(!in.read_magic()
+    || !in.read(major)
+    || !in.read(minor)
+    || !in.read(branding)
+    || !in.read(f_cumulative)
+    || !in.read(f_site_key)
+    || !in.read(f_email_path)
+    || !in.read(f_email_key)
+    || !in.read(time)
+    || !in.read(count))
     {
-        cppprocess::process h2t("html2text");
-        h2t.set_command("html2text");
-        //h2t.add_argument("-help");
-        h2t.add_argument("-nobs");
-        h2t.add_argument("-utf8");
-        h2t.add_argument("-style");
-        h2t.add_argument("pretty");
-        h2t.add_argument("-width");
-        h2t.add_argument("70");
-        std::string html_data;
-
-        cppprocess::io_data_pipe::pointer_t in(std::make_shared<cppprocess::io_data_pipe>());
-        h2t.set_input_io(in);
-
-        cppprocess::io_capture_pipe::pointer_t out(std::make_shared<cppprocess::io_capture_pipe>());
-        h2t.set_output_io(out);
-
-        std::string data(body_attachment.get_data());
-
-        // TODO: support other encoding, err if not supported
-        //
-        if(body_attachment.get_header(edhttp::g_name_edhttp_field_content_transfer_encoding)
-                                == edhttp::g_name_edhttp_param_quoted_printable)
-        {
-            // if it was quoted-printable encoded, we have to decode
-            //
-            // I know, we encode in this very function and could just
-            // keep a copy of the original, HOWEVER, the end user could
-            // build the whole email with this encoding already in place
-            // and thus we anyway would have to decode... This being said,
-            // we could have that as an optimization XXX
-            //
-            html_data = edhttp::quoted_printable_decode(data.data());
-        }
-        else
-        {
-            html_data = data.data();
-        }
-        in->add_input(html_data);
+        SNAP_LOG_ERROR
+            << "binary email unserialization failed reading the email header."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    f_branding = branding != 0;
+    f_time = static_cast<time_t>(time);
 
-        // conver that HTML to plain text
-        //
-        int r(h2t.start());
-        if(r == 0)
-        {
-            r = h2t.wait();
-        }
-        if(r == 0)
-        {
-            plain_text = out->get_output();
-        }
-        else
+    for(std::uint32_t idx(0); idx < count; ++idx)
+    {
+        std::string_view name;
+        std::string value;
+        if(!in.read(name)
+        || !in.read(value))
         {
-            // no plain text, but let us know that something went wrong at least
-            //
-            SNAP_LOG_WARNING
-                << "An error occurred while executing html2text (exit code: "
-                << r
-                << ")"
+            SNAP_LOG_ERROR
+                << "binary email unserialization failed reading the headers."
                 << SNAP_LOG_SEND;
+            return false;
         }
+        f_headers[name] = value;
     }
 
-    // convert the "from" email address in a TLD email address so we can use
-    // the f_email_only version for the command line "sender" parameter
-    //
-    tld_email_list from_list;
-    if(from_list.parse(from, 0) != TLD_RESULT_SUCCESS)
+    if(!in.read(count))
     {
-        throw invalid_parameter(
-                  "email::send() called with invalid sender email address: \""
-                + from
-                + "\" (parsing failed).");
+        return false;
     }
-    tld_email_list::tld_email_t s;
-    if(!from_list.next(s))
+    for(std::uint32_t idx(0); idx < count; ++idx)
     {
-        throw invalid_parameter(
-                  "email::send() called with invalid sender email address: \""
-                + from
-                + "\" (no email returned).");
+        std::string name;
+        std::string value;
+        if(!in.read(name)
+        || !in.read(value))
+        {
+            SNAP_LOG_ERROR
+                << "binary email unserialization failed reading the parameters."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        f_parameters[name] = value;
     }
 
-    // convert the "to" email address in a TLD email address so we can use
-    // the f_email_only version for the command line "to" parameter
-    //
-    tld_email_list to_list;
-    if(to_list.parse(to, 0) != TLD_RESULT_SUCCESS)
+    if(!in.read(count))
     {
-        throw invalid_parameter(
-                  "email::send() called with invalid destination email address: \""
-                + to
-                + "\" (parsing failed).");
-    }
-    tld_email_list::tld_email_t m;
-    if(!to_list.next(m))
-    {
-        throw invalid_parameter(
-                  "email::send() called with invalid destination email address: \""
-                + to
-                + "\" (no email returned).");
+        return false;
     }
 
-    // create an output stream to send the email
+    // the count comes from the spool, make sure it is possible before
+    // reserving space for that many attachments
     //
-    cppprocess::process p("sendmail");
-    p.set_command("sendmail");
-    p.add_argument("-f");
-    p.add_argument(s.f_email_only);
-    p.add_argument(m.f_email_only);
-    SNAP_LOG_TRACE
-        << "sendmail command: ["
-        << p.get_command_line()
-        << "]"
-        << SNAP_LOG_SEND;
-
-    cppprocess::io_data_pipe::pointer_t in(std::make_shared<cppprocess::io_data_pipe>());
-    p.set_input_io(in);
-
-    int const start_status(p.start());
-    if(start_status != 0)
+    if(count > in.get_remaining() / attachment::BINARY_MINIMUM_SIZE)
     {
         SNAP_LOG_ERROR
-            << "could not start process \""
-            << p.get_name()
-            << "\" (command line: "
-            << p.get_command_line()
-            << ")."
+            << "binary email unserialization found "
+            << count
+            << " attachments in "
+            << in.get_remaining()
+            << " bytes."
             << SNAP_LOG_SEND;
         return false;
     }
-
-    //snap_pipe spipe(cmd, snap_pipe::mode_t::PIPE_MODE_IN);
-    //std::ostream f(&spipe);
-
-    // convert email data to text and send that to the sendmail command line
-    //
-    header_map_t headers(f_headers);
-    bool const body_only(max_attachments == 1 && plain_text.empty());
-    std::string boundary;
-    if(body_only)
+    if(headers_only)
     {
-        // if the body is by itself, then its encoding needs to be transported
-        // to the main set of headers
-        //
-        if(body_attachment.get_header(edhttp::g_name_edhttp_field_content_transfer_encoding)
-                                == edhttp::g_name_edhttp_param_quoted_printable)
-        {
-            headers[edhttp::g_name_edhttp_field_content_transfer_encoding]
-                                = edhttp::g_name_edhttp_param_quoted_printable;
-        }
+        load_attachments();
+        f_lazy_buffer = in.get_buffer();
+        f_lazy_offset = in.get_offset();
+        f_lazy_count = count;
+        f_lazy_version = in.get_version();
+        f_lazy_blob_store = in.get_blob_store();
+        count_deserialized(in.get_offset() - start_offset);
+        return true;
     }
-    else
+    f_attachments.reserve(f_attachments.size() + count);
+    for(std::uint32_t idx(0); idx < count; ++idx)
     {
-        // boundary      := 0*69<bchars> bcharsnospace
-        // bchars        := bcharsnospace / " "
-        // bcharsnospace := DIGIT / ALPHA / "'" / "(" / ")" /
-        //                  "+" / "_" / "," / "-" / "." /
-        //                  "/" / ":" / "=" / "?"
-        //
-        // Note: we generate boundaries without special characters
-        //       (and especially no spaces or dashes) to make it simpler
-        //
-        // Note: the boundary starts wity "=S" which is not a valid
-        //       quoted-printable sequence of characters (on purpose)
-        //
-        char const allowed[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"; //'()+_,./:=?";
-        boundary.reserve(15 + 20);
-        boundary = "=Snap.Websites=";
-        for(int i(0); i < 20; ++i)
+        attachment a;
+        if(!a.deserialize(in, false))
         {
-            // this is just for boundaries, so rand() is more than enough
-            // it just needs to not match anything in the emails
-            //
-            int const c(static_cast<int>(rand() % (sizeof(allowed) - 1)));
-            boundary += allowed[c];
+            SNAP_LOG_ERROR
+                << "binary email unserialization failed reading attachment #"
+                << idx
+                << "."
+                << SNAP_LOG_SEND;
+            return false;
         }
-        headers[edhttp::g_name_edhttp_field_content_type] = "multipart/mixed;\n  boundary=\"" + boundary + "\"";
-        headers[g_name_libmimemail_email_mime_version] = "1.0";
+        f_attachments.push_back(std::move(a));
     }
 
-    // setup the "Date: ..." field if not already defined
-    //
-    if(headers.find(g_name_libmimemail_email_date) == headers.end())
-    {
-        // the date must be specified in English only which prevents us from
-        // using the strftime()
-        //
-        headers[g_name_libmimemail_email_date] = edhttp::date_to_string(time(nullptr), edhttp::date_format_t::DATE_FORMAT_EMAIL);
-    }
+    count_deserialized(in.get_offset() - start_offset);
+    return true;
+}
 
-    // setup a default "Content-Language: ..." because in general
-    // that makes things work better
-    //
-    if(headers.find(edhttp::g_name_edhttp_field_content_language) == headers.end())
-    {
-        headers[edhttp::g_name_edhttp_field_content_language] = "en-us";
-    }
 
-    for(auto const & it : headers)
+/** \brief Load the attachments deferred by a headers only deserialize().
+ *
+ * This function does nothing if the attachments were already loaded.
+ *
+ * \exception corrupted_data
+ * The binary data of the attachments is not valid. The top level fields
+ * were valid so this generally means the spool file is truncated.
+ */
+void email::load_attachments() const
+{
+    if(f_lazy_buffer == nullptr)
     {
-        // TODO: the it.second needs to be URI encoded to be valid
-        //       in an email; if some characters appear that need
-        //       encoding, we should err (we probably want to
-        //       capture those in the add_header() though)
-        //
-        //f << it.first << ": " << it.second << std::endl;
-        in->add_input(snapdev::to_string(it.first));
-        in->add_input(": ");
-        in->add_input(it.second);
-        in->add_input("\n");
+        return;
     }
 
-    // XXX: allow administrators to change the `branding` flag
-    //
-    if(f_branding)
+    binary_spool_reader in(f_lazy_buffer);
+    in.set_offset(f_lazy_offset);
+    in.set_version(f_lazy_version);
+    in.set_blob_store(f_lazy_blob_store);
+    attachment::vector_t attachments;
+    attachments.reserve(f_lazy_count);
+    for(std::uint32_t idx(0); idx < f_lazy_count; ++idx)
     {
-        //f << "X-Generated-By: Snap! Websites C++ v" SNAPWEBSITES_VERSION_STRING " (https://snapwebsites.org/)" << std::endl
-        //  << "X-Mailer: Snap! Websites C++ v" SNAPWEBSITES_VERSION_STRING " (https://snapwebsites.org/)" << std::endl;
-        in->add_input(
-            "X-Generated-By: Snap! Websites C++ v" LIBMIMEMAIL_VERSION_STRING " (https://snapwebsites.org/)\n"
-            "X-Mailer: Snap! Websites C++ v" LIBMIMEMAIL_VERSION_STRING " (https://snapwebsites.org/)\n");
+        attachment a;
+        if(!a.deserialize(in, false))
+        {
+            throw corrupted_data(
+                      "email::load_attachments(): could not load attachment #"
+                    + std::to_string(idx)
+                    + ".");
+        }
+        attachments.push_back(std::move(a));
     }
 
-    // end the headers
-    //
-    //f << std::endl;
-    in->add_input("\n");
+    f_attachments.insert(
+              f_attachments.end()
+            , std::make_move_iterator(attachments.begin())
+            , std::make_move_iterator(attachments.end()));
+    f_lazy_buffer.reset();
+    f_lazy_blob_store.reset();
+}
+
 
-    if(body_only)
+/** \brief Send this email.
+ *
+ * This function sends  the specified email. It generates all the body
+ * and attachments, etc.
+ *
+ * Note that the function uses callbacks in order to retrieve the body
+ * and attachment from the database as the Snap! environment uses those
+ * for much of the data to be sent in emails. However, it is not a
+ * requirements in case you want to send an email from another server
+ * than a snap_child or snap_backend.
+ *
+ * \exception email_exception_missing_parameter
+ * If the From header or the destination email only are missing this
+ * exception is raised.
+ *
+ * \return true if the send() command worked (note that does not mean the
+ * email made it; we'll know later whether it failed if we received a
+ * bounced email).
+ *
+ * \sa get_default_transport()
+ */
+bool email::send() const
+{
+    return send(get_default_transport());
+}
+
+
+/** \brief Send this email using the specified transport.
+ *
+ * This function renders the email and hands it to the transport \p t.
+ * This lets you send emails directly through SMTP using an
+ * smtp_transport object instead of the default sendmail command.
+ *
+ * Reusing the same smtp_transport between calls means the connections
+ * to the SMTP servers remain open between emails.
+ *
+ * When the transport supports 8BITMIME, the text parts are sent as
+ * is instead of being quoted-printable encoded.
+ *
+ * \exception invalid_parameter
+ * The transport pointer cannot be null.
+ *
+ * \param[in] t  The transport used to send this email.
+ *
+ * \return true if the transport accepted the email.
+ *
+ * \sa send()
+ */
+bool email::send(transport::pointer_t t) const
+{
+    if(t == nullptr)
     {
-        // in this case we only have one entry, probably HTML, and thus we
-        // can avoid the multi-part headers and attachments
-        //
-        //f << body_attachment.get_data().data() << std::endl;
-        in->add_input(body_attachment.get_data().data());
-        in->add_input("\n");
+        throw invalid_parameter("email::send() called with a null transport.");
     }
-    else
+
+    metrics_timer send_timer(metric_stage_t::METRIC_STAGE_SEND);
+
+    envelope env;
+    std::string message;
+    render(env, message, t->supports_8bitmime());
+
+    bool const result(t->send_message(env, message));
+    if(metrics_enabled())
     {
-        // TBD: should we make this text changeable by client?
-        //
-        //f << "The following are various parts of a multipart email." << std::endl
-        //  << "It is likely to include a text version (first part) that you should" << std::endl
-        //  << "be able to read as is." << std::endl
-        //  << "It may be followed by HTML and then various attachments." << std::endl
-        //  << "Please consider installing a MIME capable client to read this email." << std::endl
-        //  << std::endl;
-        in->add_input(
-                "The following are various parts of a multipart email.\n"
-                "It is likely to include a text version (first part) that you should\n"
-                "be able to read as is.\n"
-                "It may be followed by HTML and then various attachments.\n"
-                "Please consider installing a MIME capable client to read this email.\n"
-                "\n");
-
-        int i(0);
-        if(!plain_text.empty())
+        if(result)
         {
-            // if we have plain text then we have alternatives
-            //
-            //f << "--" << boundary << std::endl
-            //  << "Content-Type: multipart/alternative;" << std::endl
-            //  << "  boundary=\"" << boundary << ".msg\"" << std::endl
-            //  << std::endl
-            //  << "--" << boundary << ".msg" << std::endl
-            //  << "Content-Type: text/plain; charset=\"utf-8\"" << std::endl
-            //  //<< "MIME-Version: 1.0" << std::endl -- only show this one in the main header
-            //  << "Content-Transfer-Encoding: quoted-printable" << std::endl
-            //  << "Content-Description: Mail message body" << std::endl
-            //  << std::endl
-            //  << quoted_printable::encode(plain_text, quoted_printable::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD) << std::endl;
-            in->add_input("--");
-            in->add_input(boundary);
-            in->add_input("\n");
-            in->add_input(edhttp::g_name_edhttp_field_content_type);
-            in->add_input(": ");
-            in->add_input(edhttp::g_name_edhttp_param_multipart_alternative);
-            in->add_input(";\n"
-                          "  boundary-\"");
-            in->add_input(boundary);
-            in->add_input(".msg\"\n"
-                          "\n");
-            in->add_input("--");
-            in->add_input(boundary);
-            in->add_input(".msg\n");
-            in->add_input("\n");
-            in->add_input(edhttp::g_name_edhttp_field_content_type);
-            in->add_input(": text/plain; charset=\"utf-8\"\n");
-            in->add_input(edhttp::g_name_edhttp_field_content_transfer_encoding);
-            in->add_input(": ");
-            in->add_input(edhttp::g_name_edhttp_param_quoted_printable);
-            in->add_input("\n");
-            in->add_input(edhttp::g_name_edhttp_field_content_description);
-            in->add_input(": Mail message body\n");
-            in->add_input("\n");
-            in->add_input(edhttp::quoted_printable_encode(
-                              plain_text
-                            , edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD));
-            in->add_input("\n");
-
-            // at this time, this if() should always be true
-            //
-            if(i < max_attachments)
-            {
-                // now include the HTML
-                //
-                //f << "--" << boundary << ".msg" << std::endl;
-                in->add_input("--");
-                in->add_input(boundary);
-                in->add_input(".msg\n");
-                for(auto const & it : body_attachment.get_all_headers())
-                {
-                    //f << it.first << ": " << it.second << std::endl;
-                    in->add_input(snapdev::to_string(it.first));
-                    in->add_input(": ");
-                    in->add_input(it.second);
-                    in->add_input("\n");
-                }
-                // one empty line to end the headers
-                //
-                in->add_input("\n");
-
-                // here the data in body_attachment is already encoded
-                //
-                //f << std::endl
-                //  << body_attachment.get_data().data() << std::endl
-                //  << "--" << boundary << ".msg--" << std::endl
-                //  << std::endl;
-                in->add_input(body_attachment.get_data().data());
-                in->add_input("--");
-                in->add_input(boundary);
-                in->add_input(".msg--\n\n");
-
-                // we used "attachment" 0, so print the others starting at 1
-                //
-                i = 1;
-            }
+            record_counter(metric_counter_t::METRIC_COUNTER_EMAILS_SENT, 1);
+            record_counter(metric_counter_t::METRIC_COUNTER_BYTES_SENT, message.length());
         }
-
-        // send the remaining attachments (possibly attachment 0 if
-        // we did not have plain text)
-        //
-        for(; i < max_attachments; ++i)
+        else
         {
-            // work on this attachment
-            //
-            attachment const & a(get_attachment(i));
-
-            // send the boundary
-            //
-            //f << "--" << boundary << std::endl;
-            in->add_input("--");
-            in->add_input(boundary);
-            in->add_input("\n");
-
-            // send  the headers for that attachment
-            //
-            // we get a copy and modify it slightly by making sure that
-            // the filename is defined in both the Content-Disposition
-            // and the Content-Type
-            //
-            header_map_t attachment_headers(a.get_all_headers());
-            copy_filename_to_content_type(attachment_headers);
-            for(auto const & it : attachment_headers)
-            {
-                //f << it.first << ": " << it.second << std::endl;
-                in->add_input(snapdev::to_string(it.first));
-                in->add_input(": ");
-                in->add_input(it.second);
-                in->add_input("\n");
-            }
-            // one empty line to end the headers
-            //
-            //f << std::endl;
-            in->add_input("\n");
-
-            // here the data is already encoded
-            //
-            //f << a.get_data().data() << std::endl;
-            in->add_input(a.get_data().data());
-            in->add_input("\n");
+            record_counter(metric_counter_t::METRIC_COUNTER_EMAILS_FAILED, 1);
         }
+    }
+    return result;
+}
 
-        // last boundary to end them all
-        //
-        //f << "--" << boundary << "--" << std::endl;
-        in->add_input("--");
-        in->add_input(boundary);
-        in->add_input("--\n");
+
+/** \brief Send this email without blocking.
+ *
+ * The email is rendered here and then handed to the transport with
+ * transport::send_message_async(). With the sendmail_transport, the
+ * message gets piped to sendmail from the ed::communicator loop and
+ * \p callback is called once sendmail exited. This lets one thread
+ * have many emails in flight.
+ *
+ * \exception missing_parameter
+ * See render() for details.
+ *
+ * \param[in] callback  The function called with the result of the send.
+ * \param[in] t  The transport to use, the default transport if nullptr.
+ *
+ * \sa send()
+ */
+void email::send_async(
+      send_result::callback_t callback
+    , transport::pointer_t t) const
+{
+    if(t == nullptr)
+    {
+        t = get_default_transport();
     }
 
-    // end the message
-    //
-    //f << std::endl
-    //  << "." << std::endl;
-    in->add_input("\n"
-                  ".\n");
-
-    // make sure the ostream gets flushed or some data could be left in
-    // a cache and never written to the pipe (unlikely since we do not
-    // use the cache, but future C++ versions could have a problem.)
-    //
-    //f.flush();
+    envelope env;
+    std::string message;
+    render(env, message, t->supports_8bitmime());
 
-    // close pipe as soon as we are done writing to it
-    // and return true if it all worked as expected
-    //
-    //return spipe.close_pipe() == 0;
+    t->send_message_async(env, std::move(message), callback);
+}
 
-    // TODO: this needs to be using ed::communicator so we need a callback
-    //       if we want to support a similar "interface" (i.e. if the caller
-    //       wants to know whether it worked)
-    //
-    return p.wait() == 0;
+
+/** \brief Render this email.
+ *
+ * This function generates the envelope (sender and recipients) and the
+ * message itself (headers and body) as it will be given to a transport.
+ *
+ * This is what the send() function uses. It is also used to render many
+ * emails ahead of time and send them all at once (see email_batch).
+ *
+ * To write the email directly to a file descriptor or another sink
+ * without building the message in memory, use a mime_writer.
+ *
+ * When \p allow_8bit is true, the text parts are written as is with
+ * an "8bit" transfer encoding instead of quoted-printable whenever
+ * possible. Only use this if the message is going to be sent to a
+ * server which supports 8BITMIME (see transport::supports_8bitmime()).
+ *
+ * \exception missing_parameter
+ * If the From header or the destination email only are missing or
+ * the email has no attachment (no body), this exception is raised.
+ *
+ * \exception invalid_parameter
+ * If the From or To email addresses cannot be parsed, this exception
+ * is raised.
+ *
+ * \param[out] env  The envelope to be used by the transport.
+ * \param[out] message  The message ready to be sent.
+ * \param[in] allow_8bit  Whether parts can be written with "8bit".
+ */
+void email::render(envelope & env, std::string & message, bool allow_8bit) const
+{
+    message.clear();
+    buffer_mime_sink sink(message);
+    mime_writer writer(sink);
+    writer.set_8bit(allow_8bit);
+    writer.write_email(*this, env);
 }
 
 
@@ -1620,6 +1647,8 @@ bool email::send() const
  */
 bool email::operator == (email const & rhs) const
 {
+    load_attachments();
+    rhs.load_attachments();
     return f_branding    == rhs.f_branding
         && f_cumulative  == rhs.f_cumulative
         && f_site_key    == rhs.f_site_key
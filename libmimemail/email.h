@@ -23,6 +23,7 @@
 //
 #include    <libmimemail/attachment.h>
 #include    <libmimemail/exception.h>
+#include    <libmimemail/transport.h>
 
 
 // snapdev
@@ -34,6 +35,7 @@
 //
 #include    <map>
 #include    <memory>
+#include    <memory_resource>
 
 
 
@@ -62,11 +64,22 @@ enum class priority_t
 class email
 {
 public:
-    typedef std::map<std::string, std::string>                      parameter_map_t;
+    typedef std::pmr::map<std::string, std::string>                 parameter_map_t;
+    typedef std::pmr::polymorphic_allocator<std::byte>              allocator_type;
 
                             email();
+                            email(email const & rhs) = default;
+                            email(email && rhs) = default;
+    explicit                email(allocator_type const & alloc);
+                            email(email const & rhs, allocator_type const & alloc);
+                            email(email && rhs, allocator_type const & alloc);
     virtual                 ~email();
 
+    email &                 operator = (email const & rhs) = default;
+    email &                 operator = (email && rhs) = default;
+
+    allocator_type          get_allocator() const;
+
     // basic flags and strings
     //
     void                    set_branding(bool branding = true);
@@ -91,6 +104,7 @@ public:
     void                    remove_header(std::string const & name);
     bool                    has_header(std::string const & name) const;
     std::string             get_header(std::string const & name) const;
+    std::string             get_header(header_id_t id) const;
     header_map_t const &    get_all_headers() const;
 
     // attachments
@@ -98,7 +112,8 @@ public:
     void                    set_body_attachment(attachment const & data);
     void                    add_attachment(attachment const & data);
     int                     get_attachment_count() const;
-    attachment &            get_attachment(int index) const;
+    attachment &            get_attachment(int index);
+    attachment const &      get_attachment(int index) const;
 
     // parameters (like headers but not included in email and names are
     // case sensitive)
@@ -111,8 +126,15 @@ public:
     //
     void                    serialize(snapdev::serializer<std::stringstream> & out) const;
     void                    deserialize(snapdev::deserializer<std::stringstream> & in);
+    void                    serialize(binary_spool_writer & out) const;
+    bool                    deserialize(binary_spool_reader & in, bool headers_only = false);
 
     bool                    send() const;
+    bool                    send(transport::pointer_t t) const;
+    void                    send_async(
+                                  send_result::callback_t callback
+                                , transport::pointer_t t = transport::pointer_t()) const;
+    void                    render(envelope & env, std::string & message, bool allow_8bit = false) const;
 
     bool                    operator == (email const & rhs) const;
 
@@ -120,6 +142,7 @@ private:
     bool                    process_hunk(
                                   snapdev::deserializer<std::stringstream> & in
                                 , snapdev::field_t const & field);
+    void                    load_attachments() const;
 
     bool                    f_branding = true;
     std::string             f_cumulative = std::string();
@@ -128,8 +151,19 @@ private:
     std::string             f_email_key = std::string(); // set on post_email()
     time_t                  f_time = static_cast<time_t>(-1);
     header_map_t            f_headers = header_map_t();
-    attachment::vector_t    f_attachments = attachment::vector_t();
+    mutable attachment::vector_t
+                            f_attachments = attachment::vector_t();
     parameter_map_t         f_parameters = parameter_map_t();
+
+    // attachments not yet loaded by a headers only deserialize()
+    //
+    mutable binary_spool_buffer::pointer_t
+                            f_lazy_buffer = binary_spool_buffer::pointer_t();
+    std::size_t             f_lazy_offset = 0;
+    std::uint32_t           f_lazy_count = 0;
+    std::uint32_t           f_lazy_version = 0;
+    mutable std::shared_ptr<blob_store>
+                            f_lazy_blob_store = std::shared_ptr<blob_store>();
 };
 
 
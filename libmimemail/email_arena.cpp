@@ -0,0 +1,167 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Build many emails in one block of memory.
+ *
+ * A campaign builds a large number of emails, sends them, and frees
+ * them right away. Each email allocates its headers, attachments, and
+ * parameters separately. With many sender threads, these allocations
+ * compete for the heap and the memory does not always go back to the
+ * system once freed.
+ *
+ * The email_arena allocates all of those from a monotonic buffer: an
+ * allocation is a pointer increment, freeing is a no-op, and the whole
+ * arena gets released at once with release() or when destroyed. An
+ * arena is not thread safe; use one arena per thread.
+ *
+ * \code
+ *     libmimemail::email_arena arena(
+ *               libmimemail::email_arena::DEFAULT_INITIAL_SIZE
+ *             , users.size());
+ *     for(auto const & user : users)
+ *     {
+ *         libmimemail::email & e(arena.create_email());
+ *         e.set_from(...);
+ *         ...
+ *     }
+ *     libmimemail::render_parallel(arena.get_emails(), ...);
+ *     arena.release();
+ * \endcode
+ *
+ * The header names and values are std::string objects as returned by
+ * email::get_header(), so they are only allocated in the arena when
+ * short enough to fit in the string itself.
+ */
+
+// self
+//
+#include    "libmimemail/email_arena.h"
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Initialize an arena.
+ *
+ * The arena allocates \p initial_size bytes on the first allocation.
+ * Each time it runs out of space, it allocates a larger block.
+ *
+ * When the number of emails to create is known, pass it as
+ * \p email_count so the vector of emails does not have to grow.
+ * Growing moves the emails, but the old buffers stay in the arena
+ * until release() is called.
+ *
+ * \param[in] initial_size  The size of the first block of memory.
+ * \param[in] email_count  The number of emails to reserve space for.
+ */
+email_arena::email_arena(std::size_t initial_size, std::size_t email_count)
+    : f_resource(initial_size)
+    , f_emails(&f_resource)
+{
+    reserve(email_count);
+}
+
+
+/** \brief Destroy the emails then release the memory of the arena.
+ */
+email_arena::~email_arena()
+{
+    release();
+}
+
+
+/** \brief Get the memory resource of this arena.
+ *
+ * This resource can be given to the email and attachment constructors
+ * or to any std::pmr container. The objects must be destroyed before
+ * release() gets called.
+ *
+ * \return A pointer to the memory resource.
+ */
+std::pmr::memory_resource * email_arena::get_resource()
+{
+    return &f_resource;
+}
+
+
+/** \brief Reserve space for a number of emails.
+ *
+ * Call this function before create_email() when the number of emails
+ * is known. The references returned by create_email() remain valid
+ * until more than \p email_count emails were created.
+ *
+ * \param[in] email_count  The number of emails to reserve space for.
+ */
+void email_arena::reserve(std::size_t email_count)
+{
+    f_emails.reserve(email_count);
+}
+
+
+/** \brief Create a new email in this arena.
+ *
+ * The email and its containers are allocated in the arena. The
+ * reference remains valid until the next call to create_email() or
+ * release().
+ *
+ * \return A reference to the new email.
+ */
+email & email_arena::create_email()
+{
+    return f_emails.emplace_back();
+}
+
+
+/** \brief Get the emails created in this arena.
+ *
+ * \return A reference to the vector of emails.
+ */
+email_arena::email_vector_t & email_arena::get_emails()
+{
+    return f_emails;
+}
+
+
+/** \brief Release all the emails and memory of this arena.
+ *
+ * The emails created with create_email() are destroyed and all the
+ * memory allocated by the arena goes back to the system at once. Any
+ * other object using the arena resource must have been destroyed first.
+ */
+void email_arena::release()
+{
+    // clear() does not give back the vector buffer; swap with an empty
+    // vector so nothing references the arena anymore
+    //
+    email_vector_t(&f_resource).swap(f_emails);
+    f_resource.release();
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,67 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/email.h>
+
+
+// C++
+//
+#include    <memory_resource>
+
+
+
+namespace libmimemail
+{
+
+
+
+class email_arena
+{
+public:
+    typedef std::pmr::vector<email>         email_vector_t;
+
+    static constexpr std::size_t const      DEFAULT_INITIAL_SIZE = 64 * 1024;
+
+                            email_arena(
+                                      std::size_t initial_size = DEFAULT_INITIAL_SIZE
+                                    , std::size_t email_count = 0);
+                            email_arena(email_arena const &) = delete;
+                            ~email_arena();
+
+    email_arena &           operator = (email_arena const &) = delete;
+
+    std::pmr::memory_resource *
+                            get_resource();
+    void                    reserve(std::size_t email_count);
+    email &                 create_email();
+    email_vector_t &        get_emails();
+    void                    release();
+
+private:
+    std::pmr::monotonic_buffer_resource
+                            f_resource;
+    email_vector_t          f_emails;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
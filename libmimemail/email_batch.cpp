@@ -0,0 +1,362 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Send many emails at once.
+ *
+ * The email_batch renders a set of emails and sends them all through
+ * one call to the transport. With the smtp_transport, this means the
+ * emails going to the same destination share connections and, when
+ * the server supports PIPELINING, round trips.
+ *
+ * Large sets of emails can be rendered in parallel with
+ * render_parallel(). The emails are spread over a pool of threads which
+ * steal work from each other once done with their share, so the
+ * rendering (encoding, text conversion, header assembly) scales with the
+ * number of cores even when some emails are much bigger than others.
+ *
+ * The emails get rendered before the transport is known, so their text
+ * parts always use quoted-printable, even when the transport supports
+ * 8BITMIME (see transport::supports_8bitmime()).
+ */
+
+// self
+//
+#include    "libmimemail/email_batch.h"
+
+#include    "libmimemail/thread_pool.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Render an email and add it to this batch.
+ *
+ * The email is rendered immediately so the batch does not keep a copy
+ * of the email object, only of the envelope and the rendered message.
+ *
+ * If the email cannot be rendered (i.e. it has no From or no body), the
+ * error is logged and that email gets the SEND_STATUS_INVALID status
+ * once send() gets called. The other emails are not affected.
+ *
+ * \param[in] e  The email to add to this batch.
+ */
+void email_batch::add_email(email const & e)
+{
+    rendered_email r;
+    try
+    {
+        e.render(r.get_envelope(), r.get_message());
+    }
+    catch(libmimemail_exception const & ex)
+    {
+        SNAP_LOG_ERROR
+            << "email_batch::add_email(): could not render email: "
+            << ex.what()
+            << SNAP_LOG_SEND;
+
+        // the position of invalid emails is marked with -1
+        //
+        f_positions.push_back(static_cast<std::size_t>(-1));
+        ++f_count;
+        return;
+    }
+
+    f_positions.push_back(f_emails.size());
+    f_emails.push_back(std::move(r));
+    ++f_count;
+}
+
+
+/** \brief Render many emails and add them to this batch.
+ *
+ * This function is the same as calling add_email() for each email
+ * except that the rendering happens in parallel (see render_parallel()).
+ *
+ * \param[in] emails  The emails to add to this batch.
+ * \param[in] count  The number of emails in \p emails.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ */
+void email_batch::add_emails(email const * emails, std::size_t count, std::size_t threads)
+{
+    rendered_email::vector_t rendered(count);
+    std::vector<envelope> const envelopes(render_parallel(
+              emails
+            , count
+            , [&rendered](std::size_t index)
+              {
+                  return std::make_shared<buffer_mime_sink>(rendered[index].get_message());
+              }
+            , threads));
+
+    f_emails.reserve(f_emails.size() + rendered.size());
+    for(std::size_t idx(0); idx < rendered.size(); ++idx)
+    {
+        if(envelopes[idx].get_recipients().empty())
+        {
+            f_positions.push_back(static_cast<std::size_t>(-1));
+        }
+        else
+        {
+            rendered[idx].get_envelope() = envelopes[idx];
+            f_positions.push_back(f_emails.size());
+            f_emails.push_back(std::move(rendered[idx]));
+        }
+        ++f_count;
+    }
+}
+
+
+/** \brief Render a vector of emails and add them to this batch.
+ *
+ * \param[in] emails  The emails to add to this batch.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ */
+void email_batch::add_emails(std::vector<email> const & emails, std::size_t threads)
+{
+    add_emails(emails.data(), emails.size(), threads);
+}
+
+
+/** \brief Render a vector of emails allocated in an arena and add them.
+ *
+ * \param[in] emails  The emails to add to this batch.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ */
+void email_batch::add_emails(std::pmr::vector<email> const & emails, std::size_t threads)
+{
+    add_emails(emails.data(), emails.size(), threads);
+}
+
+
+/** \brief Get the number of emails in this batch.
+ *
+ * This includes emails which could not be rendered.
+ *
+ * \return The number of times add_email() was called.
+ */
+std::size_t email_batch::size() const
+{
+    return f_count;
+}
+
+
+/** \brief Check whether the batch is empty.
+ *
+ * \return true if add_email() was never called since the last clear().
+ */
+bool email_batch::empty() const
+{
+    return f_count == 0;
+}
+
+
+/** \brief Remove all the emails from this batch.
+ *
+ * This function can be used to reuse a batch object once it was sent.
+ */
+void email_batch::clear()
+{
+    f_emails.clear();
+    f_positions.clear();
+    f_count = 0;
+}
+
+
+/** \brief Send all the emails of this batch.
+ *
+ * The emails are all given to the transport at once. The transport is
+ * expected to group them by destination to share connections and round
+ * trips.
+ *
+ * \param[in] t  The transport to use; if nullptr, use the default transport.
+ *
+ * \return One status per email, in the order they were added.
+ */
+send_status_vector_t email_batch::send(transport::pointer_t t) const
+{
+    if(t == nullptr)
+    {
+        t = get_default_transport();
+    }
+
+    send_status_vector_t result(f_count, send_status_t::SEND_STATUS_INVALID);
+    if(f_emails.empty())
+    {
+        return result;
+    }
+
+    send_status_vector_t const status(t->send_messages(f_emails));
+    for(std::size_t idx(0); idx < f_count; ++idx)
+    {
+        if(f_positions[idx] < status.size())
+        {
+            result[idx] = status[f_positions[idx]];
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Send many emails at once.
+ *
+ * This function is a shortcut which creates an email_batch, adds all
+ * the \p emails to it and sends them.
+ *
+ * \param[in] emails  The emails to send.
+ * \param[in] t  The transport to use; if nullptr, use the default transport.
+ *
+ * \return One status per email, in the same order as \p emails.
+ */
+send_status_vector_t send_many(
+      std::vector<email> const & emails
+    , transport::pointer_t t)
+{
+    email_batch batch;
+    batch.add_emails(emails);
+    return batch.send(t);
+}
+
+
+/** \brief Render many emails in parallel.
+ *
+ * Each email is rendered to the sink returned by \p factory for its
+ * index. The factory gets called from the rendering threads, at most
+ * once per email, and must be safe to call concurrently. Each sink is
+ * only used by one thread.
+ *
+ * The emails are split in one range per thread. A thread which is
+ * done with its range steals the remaining emails of the other ranges.
+ * The calling thread is one of the rendering threads; the others come
+ * from the thread_pool and are reused by the next calls.
+ *
+ * An email which cannot be rendered (i.e. it has no From) gets an
+ * empty envelope (no recipients) and the error is logged. The
+ * same happens if the factory returns a null sink. Any other exception
+ * stops the rendering and is rethrown once all the threads are done.
+ *
+ * \param[in] emails  The emails to render.
+ * \param[in] count  The number of emails in \p emails.
+ * \param[in] factory  The function returning the sink of each email.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ *
+ * \return The envelope of each email, in the same order as \p emails.
+ */
+std::vector<envelope> render_parallel(
+      email const * emails
+    , std::size_t count
+    , sink_factory_t const & factory
+    , std::size_t threads)
+{
+    std::vector<envelope> result(count);
+    if(count == 0)
+    {
+        return result;
+    }
+
+    thread_pool::get_instance().parallel_for(
+              count
+            , threads
+            , [&](std::size_t index)
+            {
+                mime_sink::pointer_t sink(factory(index));
+                if(sink == nullptr)
+                {
+                    SNAP_LOG_ERROR
+                        << "render_parallel(): no sink for email #"
+                        << index
+                        << "."
+                        << SNAP_LOG_SEND;
+                    return;
+                }
+
+                try
+                {
+                    mime_writer writer(*sink);
+                    if(!writer.write_email(emails[index], result[index]))
+                    {
+                        result[index] = envelope();
+                    }
+                }
+                catch(libmimemail_exception const & e)
+                {
+                    SNAP_LOG_ERROR
+                        << "render_parallel(): could not render email #"
+                        << index
+                        << ": "
+                        << e.what()
+                        << SNAP_LOG_SEND;
+                    result[index] = envelope();
+                }
+            });
+
+    return result;
+}
+
+
+/** \brief Render a vector of emails in parallel.
+ *
+ * \param[in] emails  The emails to render.
+ * \param[in] factory  The function returning the sink of each email.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ *
+ * \return The envelope of each email, in the same order as \p emails.
+ */
+std::vector<envelope> render_parallel(
+      std::vector<email> const & emails
+    , sink_factory_t const & factory
+    , std::size_t threads)
+{
+    return render_parallel(emails.data(), emails.size(), factory, threads);
+}
+
+
+/** \brief Render a vector of emails allocated in an arena in parallel.
+ *
+ * \param[in] emails  The emails to render, i.e. email_arena::get_emails().
+ * \param[in] factory  The function returning the sink of each email.
+ * \param[in] threads  The number of threads to use, 0 means one per core.
+ *
+ * \return The envelope of each email, in the same order as \p emails.
+ */
+std::vector<envelope> render_parallel(
+      std::pmr::vector<email> const & emails
+    , sink_factory_t const & factory
+    , std::size_t threads)
+{
+    return render_parallel(emails.data(), emails.size(), factory, threads);
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,77 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/email.h>
+#include    <libmimemail/mime_writer.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+typedef std::function<mime_sink::pointer_t(std::size_t index)>   sink_factory_t;
+
+
+class email_batch
+{
+public:
+    void                    add_email(email const & e);
+    void                    add_emails(email const * emails, std::size_t count, std::size_t threads = 0);
+    void                    add_emails(std::vector<email> const & emails, std::size_t threads = 0);
+    void                    add_emails(std::pmr::vector<email> const & emails, std::size_t threads = 0);
+    std::size_t             size() const;
+    bool                    empty() const;
+    void                    clear();
+
+    send_status_vector_t    send(transport::pointer_t t = transport::pointer_t()) const;
+
+private:
+    rendered_email::vector_t
+                            f_emails = rendered_email::vector_t();
+    std::vector<std::size_t>
+                            f_positions = std::vector<std::size_t>();
+    std::size_t             f_count = 0;
+};
+
+
+send_status_vector_t        send_many(
+                                  std::vector<email> const & emails
+                                , transport::pointer_t t = transport::pointer_t());
+std::vector<envelope>       render_parallel(
+                                  email const * emails
+                                , std::size_t count
+                                , sink_factory_t const & factory
+                                , std::size_t threads = 0);
+std::vector<envelope>       render_parallel(
+                                  std::vector<email> const & emails
+                                , sink_factory_t const & factory
+                                , std::size_t threads = 0);
+std::vector<envelope>       render_parallel(
+                                  std::pmr::vector<email> const & emails
+                                , sink_factory_t const & factory
+                                , std::size_t threads = 0);
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,884 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Render one email for many recipients.
+ *
+ * A campaign sends the same email to many recipients with a few
+ * personalized fields (name, unsubscribe link, etc.) Building and
+ * rendering a new email for each recipient means encoding the body,
+ * converting it to text, and copying the attachments over and over.
+ *
+ * The email_template renders the email once. The result is cut in
+ * static pieces separated by variables. Rendering for a recipient only
+ * encodes the values of the variables and sends the static pieces
+ * as they are.
+ *
+ * Variables are written as `{{name}}` where the name is composed of
+ * letters, digits, '_', '.', and '-'. They are recognized in the
+ * headers (i.e. the Subject) and in the body (first attachment) when
+ * it is not encoded or quoted-printable encoded. In the body, the text
+ * alternative gets the variables too. Values inserted in an HTML body
+ * are HTML escaped and values inserted in headers have their new lines
+ * removed.
+ *
+ * The email API does not accept variables in the To header. Instead,
+ * the To header always comes from the `to` variable (TO_VARIABLE), or
+ * the To of the email when that variable is not defined.
+ *
+ * Headers computed while rendering, such as the Date and the MIME
+ * boundaries, are computed once and shared by all the recipients.
+ *
+ * When the emails get DKIM signed and the body has no variables, the
+ * body is the same for all the recipients. Its hash is computed once
+ * and only the signature of the headers is computed for each recipient.
+ *
+ * Since the email gets rendered once when the template is created,
+ * before the transport is known, its text parts always use
+ * quoted-printable (see transport::supports_8bitmime()).
+ */
+
+// self
+//
+#include    "libmimemail/email_template.h"
+
+#include    "libmimemail/exception.h"
+#include    "libmimemail/html_to_text.h"
+#include    "libmimemail/names.h"
+#include    "libmimemail/quoted_printable.h"
+
+
+// edhttp
+//
+#include    <edhttp/names.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cstring>
+
+
+// C
+//
+#include    <limits.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+#ifdef IOV_MAX
+constexpr std::size_t const     MAX_IOVEC = IOV_MAX;
+#else
+constexpr std::size_t const     MAX_IOVEC = 1024;
+#endif
+
+
+/** \brief The name of the variable used for the To header.
+ *
+ * The value is expected to be a valid email address such as
+ * "Alexis Wilke <alexis@example.com>".
+ */
+char const * const              TO_VARIABLE = "to";
+
+
+/** \brief Address used as the To while rendering the static parts.
+ *
+ * It gets replaced by the `to` variable in the compiled template.
+ */
+char const * const              TO_MARKER = "libmimemail-template-to@example.com";
+
+
+/** \brief Data used as the body while rendering the static parts.
+ *
+ * It only uses characters which are not modified by the quoted-printable
+ * encoding nor by the HTML to text conversion.
+ */
+char const * const              BODY_MARKER = "LibMimeMailTemplateBodyMarker";
+
+
+/** \brief Number of email_template::context_t values.
+ *
+ * A value is encoded once per context it is used in.
+ */
+constexpr std::size_t const     CONTEXT_COUNT = 5;
+
+
+char const * const              VARIABLE_OPEN = "{{";
+char const * const              VARIABLE_CLOSE = "}}";
+
+
+/** \brief Write all the buffers to the sink.
+ *
+ * \param[in] sink  The sink receiving the data.
+ * \param[in] iov  The buffers to write, of any number.
+ *
+ * \return true if the sink accepted all the buffers.
+ */
+bool write_all(mime_sink & sink, std::vector<iovec> const & iov)
+{
+    for(std::size_t pos(0); pos < iov.size(); pos += MAX_IOVEC)
+    {
+        std::size_t const count(std::min(iov.size() - pos, MAX_IOVEC));
+        if(!sink.write(iov.data() + pos, static_cast<int>(count)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool is_variable_char(char c)
+{
+    return (c >= 'a' && c <= 'z')
+        || (c >= 'A' && c <= 'Z')
+        || (c >= '0' && c <= '9')
+        || c == '_'
+        || c == '.'
+        || c == '-';
+}
+
+
+/** \brief A run of text followed by a variable name.
+ *
+ * The variable name is empty for the last run.
+ */
+typedef std::pair<std::string_view, std::string>     template_run_t;
+typedef std::vector<template_run_t>                 template_run_vector_t;
+
+
+/** \brief Cut a string at each variable.
+ *
+ * \param[in] data  The string to cut.
+ *
+ * \return The runs of text and the variables following each one.
+ */
+template_run_vector_t split_template(std::string_view const & data)
+{
+    template_run_vector_t result;
+
+    std::size_t start(0);
+    std::size_t pos(0);
+    for(;;)
+    {
+        std::size_t const open(data.find(VARIABLE_OPEN, pos));
+        if(open == std::string_view::npos)
+        {
+            break;
+        }
+        std::size_t const name_start(open + 2);
+        std::size_t name_end(name_start);
+        while(name_end < data.length()
+           && is_variable_char(data[name_end]))
+        {
+            ++name_end;
+        }
+        if(name_end == name_start
+        || data.substr(name_end, 2) != VARIABLE_CLOSE)
+        {
+            // not a variable, keep the "{{" as is
+            //
+            pos = name_start;
+            continue;
+        }
+
+        result.emplace_back(
+                  data.substr(start, open - start)
+                , std::string(data.substr(name_start, name_end - name_start)));
+        start = name_end + 2;
+        pos = start;
+    }
+
+    result.emplace_back(data.substr(start), std::string());
+    return result;
+}
+
+
+bool has_variables(std::string_view const & data)
+{
+    return split_template(data).size() > 1;
+}
+
+
+std::string html_escape(std::string const & value)
+{
+    std::string result;
+    result.reserve(value.length());
+    for(char const c : value)
+    {
+        switch(c)
+        {
+        case '&':
+            result += "&amp;";
+            break;
+
+        case '<':
+            result += "&lt;";
+            break;
+
+        case '>':
+            result += "&gt;";
+            break;
+
+        case '"':
+            result += "&quot;";
+            break;
+
+        case '\'':
+            result += "&#39;";
+            break;
+
+        default:
+            result += c;
+            break;
+
+        }
+    }
+    return result;
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Compile an email in a template.
+ *
+ * The email gets rendered once and the result is saved as static pieces
+ * separated by variables.
+ *
+ * The rendered emails get signed with the default DKIM signer, if any.
+ * Use set_dkim_signer() to change that.
+ *
+ * \exception missing_parameter
+ * The email must be valid for mime_writer::write_email(); see that
+ * function for details.
+ *
+ * \param[in] e  The email to use as a template.
+ */
+email_template::email_template(email const & e)
+{
+    compile(e);
+    set_dkim_signer(get_default_dkim_signer());
+}
+
+
+/** \brief Get the list of variables used by this template.
+ *
+ * \return The names of the variables found in the email, in the order
+ * they first appear.
+ */
+string_list_t const & email_template::get_variables() const
+{
+    return f_variables;
+}
+
+
+/** \brief Change the DKIM signer used to sign the rendered emails.
+ *
+ * If the body does not include variables, its hash gets computed here,
+ * once for all the recipients.
+ *
+ * \param[in] signer  The signer or nullptr to not sign the emails.
+ */
+void email_template::set_dkim_signer(dkim_signer::pointer_t signer)
+{
+    f_dkim_signer = signer;
+    f_body_hash.clear();
+    if(f_dkim_signer != nullptr
+    && f_static_body)
+    {
+        dkim_body_hash h;
+        for(std::size_t idx(f_header_pieces); idx < f_pieces.size(); ++idx)
+        {
+            h.add(f_static.data() + f_pieces[idx].f_offset, f_pieces[idx].f_size);
+        }
+        f_body_hash = h.finish();
+    }
+}
+
+
+dkim_signer::pointer_t email_template::get_dkim_signer() const
+{
+    return f_dkim_signer;
+}
+
+
+/** \brief Change the number of emails rendered before being sent.
+ *
+ * The send() function renders this many emails, hands them to the
+ * transport, then renders the next ones. This bounds the memory used
+ * by the rendered messages whatever the number of recipients.
+ *
+ * \exception invalid_parameter
+ * The size cannot be zero.
+ *
+ * \param[in] size  The maximum number of rendered emails kept at once.
+ */
+void email_template::set_chunk_size(std::size_t size)
+{
+    if(size == 0)
+    {
+        throw invalid_parameter("email_template::set_chunk_size(): the chunk size cannot be zero.");
+    }
+    f_chunk_size = size;
+}
+
+
+/** \brief Get the number of emails rendered before being sent.
+ *
+ * \return The chunk size, DEFAULT_CHUNK_SIZE by default.
+ */
+std::size_t email_template::get_chunk_size() const
+{
+    return f_chunk_size;
+}
+
+
+/** \brief Render the email for one recipient.
+ *
+ * The static pieces are given to the sink as they are, only the values
+ * of the variables get encoded.
+ *
+ * \param[in] variables  The values of the variables for this recipient.
+ * \param[in] sink  The sink receiving the email.
+ * \param[out] env  The envelope to use with the transport.
+ *
+ * \return true if the email was rendered and written to the sink; false
+ * if a variable is missing, the To is invalid, or the sink failed.
+ */
+bool email_template::render(
+      variable_map_t const & variables
+    , mime_sink & sink
+    , envelope & env) const
+{
+    std::string const to(render_to(variables));
+    env = envelope();
+    env.set_sender(f_sender);
+    if(!env.add_recipients(to)
+    || env.get_recipients().empty())
+    {
+        SNAP_LOG_ERROR
+            << "email_template::render(): invalid destination email address: \""
+            << to
+            << "\"."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    for(auto const & r : f_copy_recipients)
+    {
+        env.add_recipient(r);
+    }
+
+    std::vector<bool> encoded(f_variables.size() * CONTEXT_COUNT, false);
+    std::vector<std::string> encoded_values(f_variables.size() * CONTEXT_COUNT);
+
+    bool const sign(f_dkim_signer != nullptr);
+    std::size_t header_iov(0);
+    std::vector<iovec> iov;
+    iov.reserve(std::min(f_pieces.size() * 2 + 1, MAX_IOVEC));
+    for(std::size_t piece_idx(0); piece_idx < f_pieces.size(); ++piece_idx)
+    {
+        piece const & p(f_pieces[piece_idx]);
+        if(p.f_size > 0)
+        {
+            iovec v;
+            v.iov_base = const_cast<char *>(f_static.data() + p.f_offset);
+            v.iov_len = p.f_size;
+            iov.push_back(v);
+        }
+
+        if(p.f_variable >= 0)
+        {
+            // the same variable in the same context is encoded only once
+            //
+            std::size_t const idx(p.f_variable * CONTEXT_COUNT + static_cast<int>(p.f_context));
+            if(!encoded[idx])
+            {
+                std::string const & name(f_variables[p.f_variable]);
+                auto const it(variables.find(name));
+                if(it == variables.end())
+                {
+                    if(name != TO_VARIABLE)
+                    {
+                        SNAP_LOG_ERROR
+                            << "email_template::render(): variable \""
+                            << name
+                            << "\" is not defined."
+                            << SNAP_LOG_SEND;
+                        return false;
+                    }
+                    encoded_values[idx] = encode_value(f_to, p.f_context, p.f_flags);
+                }
+                else
+                {
+                    encoded_values[idx] = encode_value(it->second, p.f_context, p.f_flags);
+                }
+                encoded[idx] = true;
+            }
+            if(!encoded_values[idx].empty())
+            {
+                iovec v;
+                v.iov_base = const_cast<char *>(encoded_values[idx].data());
+                v.iov_len = encoded_values[idx].length();
+                iov.push_back(v);
+            }
+        }
+
+        if(piece_idx + 1 == f_header_pieces)
+        {
+            header_iov = iov.size();
+        }
+
+        // when signing, nothing gets written before the signature
+        //
+        if(!sign
+        && iov.size() + 2 > MAX_IOVEC)
+        {
+            if(!sink.write(iov.data(), static_cast<int>(iov.size())))
+            {
+                return false;
+            }
+            iov.clear();
+        }
+    }
+
+    if(sign)
+    {
+        std::string body_hash(f_body_hash);
+        if(body_hash.empty())
+        {
+            // the body has variables, it is specific to this recipient
+            //
+            dkim_body_hash h;
+            h.add(iov.data() + header_iov, static_cast<int>(iov.size() - header_iov));
+            body_hash = h.finish();
+        }
+        std::string const signature(f_dkim_signer->sign(
+                  iov.data()
+                , static_cast<int>(header_iov)
+                , body_hash));
+        if(signature.empty())
+        {
+            return false;
+        }
+        iovec v;
+        v.iov_base = const_cast<char *>(signature.data());
+        v.iov_len = signature.length();
+        iov.insert(iov.begin(), v);
+        return write_all(sink, iov);
+    }
+
+    if(!iov.empty())
+    {
+        return sink.write(iov.data(), static_cast<int>(iov.size()));
+    }
+
+    return true;
+}
+
+
+/** \brief Render the email for one recipient in memory.
+ *
+ * \param[in] variables  The values of the variables for this recipient.
+ * \param[out] result  The envelope and message.
+ *
+ * \return true if the email was rendered.
+ */
+bool email_template::render(
+      variable_map_t const & variables
+    , rendered_email & result) const
+{
+    std::string & message(result.get_message());
+    message.clear();
+    message.reserve(f_static.length());
+    buffer_mime_sink sink(message);
+    return render(variables, sink, result.get_envelope());
+}
+
+
+/** \brief Render and send the email to many recipients.
+ *
+ * Each entry of \p recipients is one set of variables, generally including
+ * the `to` variable. The emails are rendered and given to the transport
+ * in chunks of get_chunk_size() emails (see email_batch for details) so
+ * the rendered messages of all the recipients are never in memory at
+ * the same time.
+ *
+ * \param[in] recipients  The variables of each recipient.
+ * \param[in] t  The transport to use; if nullptr, use the default transport.
+ *
+ * \return One status per recipient, in order. The emails which could not
+ * be rendered get SEND_STATUS_INVALID.
+ */
+send_status_vector_t email_template::send(
+      variable_map_vector_t const & recipients
+    , transport::pointer_t t) const
+{
+    if(t == nullptr)
+    {
+        t = get_default_transport();
+    }
+
+    send_status_vector_t result(recipients.size(), send_status_t::SEND_STATUS_INVALID);
+
+    rendered_email::vector_t emails;
+    std::vector<std::size_t> positions;
+    std::size_t const chunk_size(std::min(f_chunk_size, recipients.size()));
+    emails.reserve(chunk_size);
+    positions.reserve(chunk_size);
+    for(std::size_t start(0); start < recipients.size(); start += chunk_size)
+    {
+        emails.clear();
+        positions.clear();
+        std::size_t const end(std::min(start + chunk_size, recipients.size()));
+        for(std::size_t idx(start); idx < end; ++idx)
+        {
+            rendered_email r;
+            if(render(recipients[idx], r))
+            {
+                positions.push_back(idx);
+                emails.push_back(std::move(r));
+            }
+        }
+        if(emails.empty())
+        {
+            continue;
+        }
+
+        send_status_vector_t const status(t->send_messages(emails));
+        for(std::size_t idx(0); idx < positions.size() && idx < status.size(); ++idx)
+        {
+            result[positions[idx]] = status[idx];
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Render the email once and cut the result in pieces.
+ *
+ * The email is rendered with markers in place of the To and of the body
+ * when the body includes variables. The markers are then replaced with
+ * the pieces of the original fields.
+ *
+ * \param[in] e  The email to compile.
+ */
+void email_template::compile(email const & e)
+{
+    f_to = e.get_header(g_name_libmimemail_email_to);
+
+    email copy(e);
+    copy.set_to(TO_MARKER);
+
+    // check whether the body has variables that we can replace
+    //
+    bool body_template(false);
+    bool is_html(false);
+    context_t body_context(context_t::CONTEXT_TEXT);
+    int body_flags(0);
+    std::string body;
+    if(copy.get_attachment_count() > 0)
+    {
+        attachment & a(copy.get_attachment(0));
+        std::string const mime_type(a.get_header(edhttp::g_name_edhttp_field_content_type));
+        is_html = mime_type.substr(0, 9) == "text/html";
+        attachment_payload::pointer_t const payload(a.get_payload());
+        if(payload != nullptr
+        && has_variables(a.get_raw_data_view()))
+        {
+            switch(payload->get_encoding())
+            {
+            case content_encoding_t::CONTENT_ENCODING_NONE:
+                body_template = true;
+                body_context = is_html ? context_t::CONTEXT_HTML : context_t::CONTEXT_TEXT;
+                body = a.get_raw_data();
+                a.set_data(std::string(BODY_MARKER), mime_type);
+                break;
+
+            case content_encoding_t::CONTENT_ENCODING_QUOTED_PRINTABLE:
+                body_template = true;
+                body_context = is_html ? context_t::CONTEXT_HTML_QP : context_t::CONTEXT_TEXT_QP;
+                body_flags = payload->get_encoding_flags();
+                body = a.get_raw_data();
+                a.quoted_printable_encode_and_set_data(BODY_MARKER, mime_type, body_flags);
+                break;
+
+            case content_encoding_t::CONTENT_ENCODING_BASE64:
+                SNAP_LOG_WARNING
+                    << "email_template: variables in a base64 encoded body are not replaced."
+                    << SNAP_LOG_SEND;
+                break;
+
+            }
+        }
+    }
+
+    std::string skeleton;
+    envelope env;
+    buffer_mime_sink sink(skeleton);
+    mime_writer writer(sink);
+    writer.set_dkim_signer(dkim_signer::pointer_t());
+    writer.write_email(copy, env);
+    f_sender = env.get_sender();
+
+    // the Cc and Bcc recipients are the same for everyone
+    //
+    envelope copies;
+    copies.add_recipients(e.get_header(g_name_libmimemail_email_cc));
+    copies.add_recipients(e.get_header(g_name_libmimemail_email_bcc));
+    f_copy_recipients = copies.get_recipients();
+    f_static.reserve(skeleton.length());
+
+    // headers and the empty line ending them, with the To replaced by
+    // the `to` variable
+    //
+    std::size_t const header_end(skeleton.find("\n\n") + 2);
+    std::string headers(skeleton.substr(0, header_end));
+    std::size_t const to_pos(headers.find(TO_MARKER));
+    if(to_pos != std::string::npos)
+    {
+        headers.replace(
+                  to_pos
+                , strlen(TO_MARKER)
+                , std::string(VARIABLE_OPEN) + TO_VARIABLE + VARIABLE_CLOSE);
+    }
+    add_template(headers, context_t::CONTEXT_HEADER, 0);
+    f_header_pieces = f_pieces.size();
+    f_static_body = !body_template;
+
+    if(!body_template)
+    {
+        add_static(std::string_view(skeleton).substr(header_end));
+        return;
+    }
+
+    std::size_t pos(header_end);
+    if(is_html)
+    {
+        // the text alternative, encoded the same way mime_writer does
+        //
+        std::string const text_marker(quoted_printable_encode(
+                      html_to_text::convert(BODY_MARKER)
+                    , edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD));
+        std::size_t const text_pos(skeleton.find(text_marker, pos));
+        if(text_pos == std::string::npos)
+        {
+            throw libmimemail_logic_error("email_template::compile(): the text alternative marker was not found.");
+        }
+        add_static(std::string_view(skeleton).substr(pos, text_pos - pos));
+        add_template(
+                  html_to_text::convert(body)
+                , context_t::CONTEXT_TEXT_QP
+                , edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD);
+        pos = text_pos + text_marker.length();
+    }
+
+    std::size_t const body_pos(skeleton.find(BODY_MARKER, pos));
+    if(body_pos == std::string::npos)
+    {
+        throw libmimemail_logic_error("email_template::compile(): the body marker was not found.");
+    }
+    add_static(std::string_view(skeleton).substr(pos, body_pos - pos));
+    add_template(body, body_context, body_flags);
+    add_static(std::string_view(skeleton).substr(body_pos + strlen(BODY_MARKER)));
+}
+
+
+/** \brief Append static data to the template.
+ *
+ * \param[in] data  The data to append.
+ */
+void email_template::add_static(std::string_view const & data)
+{
+    // the body never shares a piece with the headers so the signature
+    // can be computed on the headers alone
+    //
+    if(f_pieces.empty()
+    || f_pieces.back().f_variable != -1
+    || f_pieces.size() == f_header_pieces)
+    {
+        piece p;
+        p.f_offset = f_static.length();
+        f_pieces.push_back(p);
+    }
+    f_static.append(data.data(), data.length());
+    f_pieces.back().f_size += data.length();
+}
+
+
+/** \brief Append data with variables to the template.
+ *
+ * In the quoted-printable contexts, the static runs are encoded here.
+ * Each value gets surrounded by soft line breaks so the line lengths
+ * remain valid whatever the length of the values.
+ *
+ * \param[in] data  The data with variables.
+ * \param[in] context  The context in which the data appears.
+ * \param[in] flags  The quoted-printable flags.
+ */
+void email_template::add_template(
+      std::string_view const & data
+    , context_t context
+    , int flags)
+{
+    bool const qp(context == context_t::CONTEXT_TEXT_QP
+               || context == context_t::CONTEXT_HTML_QP);
+    std::string const soft_break(
+            (flags & edhttp::QUOTED_PRINTABLE_FLAG_LFONLY) != 0
+                    ? "=\n"
+                    : "=\r\n");
+
+    template_run_vector_t const runs(split_template(data));
+    for(std::size_t idx(0); idx < runs.size(); ++idx)
+    {
+        if(qp)
+        {
+            if(idx > 0)
+            {
+                add_static(soft_break);
+            }
+            add_static(quoted_printable_encode(runs[idx].first, flags));
+        }
+        else
+        {
+            add_static(runs[idx].first);
+        }
+
+        if(!runs[idx].second.empty())
+        {
+            if(qp)
+            {
+                add_static(soft_break);
+            }
+            if(f_pieces.empty()
+            || f_pieces.back().f_variable != -1)
+            {
+                piece p;
+                p.f_offset = f_static.length();
+                f_pieces.push_back(p);
+            }
+            f_pieces.back().f_variable = get_variable_index(runs[idx].second);
+            f_pieces.back().f_context = context;
+            f_pieces.back().f_flags = flags;
+        }
+    }
+}
+
+
+/** \brief Get the index of a variable, adding it if new.
+ *
+ * \param[in] name  The name of the variable.
+ *
+ * \return The index of the variable in f_variables.
+ */
+int email_template::get_variable_index(std::string const & name)
+{
+    auto const it(std::find(f_variables.begin(), f_variables.end(), name));
+    if(it != f_variables.end())
+    {
+        return static_cast<int>(it - f_variables.begin());
+    }
+    f_variables.push_back(name);
+    return static_cast<int>(f_variables.size() - 1);
+}
+
+
+/** \brief Encode a value for the context where it gets inserted.
+ *
+ * \param[in] value  The value of a variable.
+ * \param[in] context  Where the value goes.
+ * \param[in] flags  The quoted-printable flags.
+ *
+ * \return The encoded value.
+ */
+std::string email_template::encode_value(
+      std::string const & value
+    , context_t context
+    , int flags) const
+{
+    switch(context)
+    {
+    case context_t::CONTEXT_HEADER:
+        {
+            // prevent header injections
+            //
+            std::string result(value);
+            std::replace(result.begin(), result.end(), '\r', ' ');
+            std::replace(result.begin(), result.end(), '\n', ' ');
+            return result;
+        }
+
+    case context_t::CONTEXT_TEXT:
+        return value;
+
+    case context_t::CONTEXT_HTML:
+        return html_escape(value);
+
+    case context_t::CONTEXT_TEXT_QP:
+        return quoted_printable_encode(value, flags);
+
+    case context_t::CONTEXT_HTML_QP:
+        return quoted_printable_encode(html_escape(value), flags);
+
+    }
+
+    return value;
+}
+
+
+/** \brief Compute the To of a recipient.
+ *
+ * \param[in] variables  The variables of the recipient.
+ *
+ * \return The value of the To header for that recipient.
+ */
+std::string email_template::render_to(variable_map_t const & variables) const
+{
+    auto const it(variables.find(TO_VARIABLE));
+    return encode_value(
+              it == variables.end() ? f_to : it->second
+            , context_t::CONTEXT_HEADER
+            , 0);
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
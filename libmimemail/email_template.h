@@ -0,0 +1,120 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/dkim.h>
+#include    <libmimemail/email.h>
+#include    <libmimemail/mime_writer.h>
+
+
+// C++
+//
+#include    <map>
+#include    <string>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+class email_template
+{
+public:
+    typedef std::shared_ptr<email_template>             pointer_t;
+    typedef std::map<std::string, std::string>          variable_map_t;
+    typedef std::vector<variable_map_t>                 variable_map_vector_t;
+
+    static constexpr std::size_t const                  DEFAULT_CHUNK_SIZE = 1000;
+
+                            email_template(email const & e);
+
+    string_list_t const &   get_variables() const;
+    void                    set_dkim_signer(dkim_signer::pointer_t signer);
+    dkim_signer::pointer_t  get_dkim_signer() const;
+    void                    set_chunk_size(std::size_t size);
+    std::size_t             get_chunk_size() const;
+
+    bool                    render(
+                                  variable_map_t const & variables
+                                , mime_sink & sink
+                                , envelope & env) const;
+    bool                    render(
+                                  variable_map_t const & variables
+                                , rendered_email & result) const;
+    send_status_vector_t    send(
+                                  variable_map_vector_t const & recipients
+                                , transport::pointer_t t = transport::pointer_t()) const;
+
+private:
+    enum class context_t
+    {
+        CONTEXT_HEADER,         // CR and LF removed
+        CONTEXT_TEXT,           // as is
+        CONTEXT_HTML,           // HTML escaped
+        CONTEXT_TEXT_QP,        // quoted-printable encoded
+        CONTEXT_HTML_QP         // HTML escaped and quoted-printable encoded
+    };
+
+    // a static run of f_static followed by a variable (unless f_variable
+    // is -1, which is the case of the last piece)
+    //
+    struct piece
+    {
+        std::size_t         f_offset = 0;
+        std::size_t         f_size = 0;
+        int                 f_variable = -1;
+        context_t           f_context = context_t::CONTEXT_TEXT;
+        int                 f_flags = 0;
+    };
+    typedef std::vector<piece>  piece_vector_t;
+
+    void                    compile(email const & e);
+    void                    add_static(std::string_view const & data);
+    void                    add_template(
+                                  std::string_view const & data
+                                , context_t context
+                                , int flags);
+    int                     get_variable_index(std::string const & name);
+    std::string             encode_value(
+                                  std::string const & value
+                                , context_t context
+                                , int flags) const;
+    std::string             render_to(variable_map_t const & variables) const;
+
+    std::string             f_static = std::string();
+    piece_vector_t          f_pieces = piece_vector_t();
+    string_list_t           f_variables = string_list_t();
+    std::string             f_sender = std::string();
+    std::string             f_to = std::string();
+    string_list_t           f_copy_recipients = string_list_t();
+    std::size_t             f_header_pieces = 0;
+    bool                    f_static_body = false;
+    dkim_signer::pointer_t  f_dkim_signer = dkim_signer::pointer_t();
+    std::string             f_body_hash = std::string();
+    std::size_t             f_chunk_size = DEFAULT_CHUNK_SIZE;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
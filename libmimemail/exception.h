@@ -37,6 +37,8 @@ DECLARE_MAIN_EXCEPTION(libmimemail_exception);
 DECLARE_EXCEPTION(libmimemail_exception, invalid_parameter);
 DECLARE_EXCEPTION(libmimemail_exception, called_multiple_times);
 DECLARE_EXCEPTION(libmimemail_exception, called_after_end_header);
+DECLARE_EXCEPTION(libmimemail_exception, corrupted_data);
+DECLARE_EXCEPTION(libmimemail_exception, file_unavailable);
 DECLARE_EXCEPTION(libmimemail_exception, missing_parameter);
 DECLARE_EXCEPTION(libmimemail_exception, too_many_levels);
 
@@ -0,0 +1,786 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief The container of the email and attachment headers.
+ *
+ * An email has a small number of headers (10 to 20) which get set once
+ * and then read once or twice by the mime_writer. A std::map allocates
+ * one node per header and compares strings case insensitively on each
+ * step of a lookup. The header_map instead keeps the headers in one
+ * vector, in the order they were added, which is also the order in
+ * which they get written in the email.
+ *
+ * The well-known header names (From, To, Subject, Content-Type, etc.)
+ * are interned to a small integer, one of the HEADER_ID_... identifiers.
+ * The functions accepting such an identifier compare integers only; the
+ * library uses those internally. A name gets converted to its identifier
+ * first, and other names get compared as strings. Unknown names of a
+ * length no well-known name has skip the name table search altogether.
+ *
+ * The header_map offers the std::map functions used with the old
+ * header_map_t (find(), count(), at(), operator [], insert(), emplace(),
+ * erase(), key_type, mapped_type...). The iterators are vector
+ * iterators, though, which are invalidated by insertions and erasures.
+ *
+ * The vectors use a polymorphic allocator so the headers of an email
+ * created in an email_arena get allocated in that arena.
+ */
+
+// self
+//
+#include    "libmimemail/header_map.h"
+
+#include    "libmimemail/exception.h"
+#include    "libmimemail/names.h"
+
+
+// edhttp
+//
+#include    <edhttp/names.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// C
+//
+#include    <strings.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief Compare two header names case insensitively.
+ *
+ * \param[in] lhs  The left hand side name.
+ * \param[in] rhs  The right hand side name.
+ *
+ * \return A negative, zero, or positive number as strcasecmp() does.
+ */
+int compare_names(std::string_view const & lhs, std::string_view const & rhs)
+{
+    int const r(strncasecmp(lhs.data(), rhs.data(), std::min(lhs.length(), rhs.length())));
+    if(r != 0)
+    {
+        return r;
+    }
+    return lhs.length() < rhs.length()
+                ? -1
+                : (lhs.length() > rhs.length() ? 1 : 0);
+}
+
+
+/** \brief The well-known header names and how to search them.
+ *
+ * The f_names table is in the order of the identifiers: the name of
+ * identifier N is at position N - 1. The f_sorted table has the same
+ * identifiers sorted by name, case insensitively, for get_header_id().
+ *
+ * The f_lengths bits are set for the lengths of the well-known names.
+ * Most unknown names get rejected by this test without comparing any
+ * strings.
+ *
+ * The tables get built on first use since the names from the edhttp
+ * library may not yet be initialized at the time our statics are.
+ */
+struct well_known_names
+{
+    std::vector<std::string_view>
+                            f_names = std::vector<std::string_view>();
+    std::vector<header_id_t>
+                            f_sorted = std::vector<header_id_t>();
+    std::uint32_t           f_lengths = 0;
+};
+
+
+well_known_names const & get_well_known_names()
+{
+    static well_known_names const g_names([]()
+        {
+            well_known_names result;
+            result.f_names =
+            {
+                g_name_libmimemail_email_from,                          // HEADER_ID_FROM
+                g_name_libmimemail_email_to,                            // HEADER_ID_TO
+                g_name_libmimemail_email_cc,                            // HEADER_ID_CC
+                g_name_libmimemail_email_bcc,                           // HEADER_ID_BCC
+                g_name_libmimemail_email_x_priority,                    // HEADER_ID_X_PRIORITY
+                g_name_libmimemail_email_x_msmail_priority,             // HEADER_ID_X_MSMAIL_PRIORITY
+                g_name_libmimemail_email_importance,                    // HEADER_ID_IMPORTANCE
+                g_name_libmimemail_email_precedence,                    // HEADER_ID_PRECEDENCE
+                g_name_libmimemail_email_subject,                       // HEADER_ID_SUBJECT
+                g_name_libmimemail_email_mime_version,                  // HEADER_ID_MIME_VERSION
+                g_name_libmimemail_email_date,                          // HEADER_ID_DATE
+                g_name_libmimemail_email_x_site_key,                    // HEADER_ID_X_SITE_KEY
+                g_name_libmimemail_email_x_email_key,                   // HEADER_ID_X_EMAIL_KEY
+                edhttp::g_name_edhttp_field_content_type,               // HEADER_ID_CONTENT_TYPE
+                edhttp::g_name_edhttp_field_content_transfer_encoding,  // HEADER_ID_CONTENT_TRANSFER_ENCODING
+                edhttp::g_name_edhttp_field_content_disposition,        // HEADER_ID_CONTENT_DISPOSITION
+                edhttp::g_name_edhttp_field_content_language,           // HEADER_ID_CONTENT_LANGUAGE
+                edhttp::g_name_edhttp_field_content_description,        // HEADER_ID_CONTENT_DESCRIPTION
+                "Content-ID",                                           // HEADER_ID_CONTENT_ID
+                "In-Reply-To",                                          // HEADER_ID_IN_REPLY_TO
+                "List-Unsubscribe",                                     // HEADER_ID_LIST_UNSUBSCRIBE
+                "Message-ID",                                           // HEADER_ID_MESSAGE_ID
+                "References",                                           // HEADER_ID_REFERENCES
+                "Reply-To",                                             // HEADER_ID_REPLY_TO
+                "Return-Path",                                          // HEADER_ID_RETURN_PATH
+                "Sender",                                               // HEADER_ID_SENDER
+                "X-Generated-By",                                       // HEADER_ID_X_GENERATED_BY
+                "X-Mailer",                                             // HEADER_ID_X_MAILER
+            };
+            if(result.f_names.size() != HEADER_ID_MAX)
+            {
+                throw libmimemail_logic_error("the table of well-known header names does not match the HEADER_ID_... identifiers.");
+            }
+
+            for(std::size_t idx(0); idx < result.f_names.size(); ++idx)
+            {
+                result.f_sorted.push_back(static_cast<header_id_t>(idx + 1));
+                if(result.f_names[idx].length() < 32)
+                {
+                    result.f_lengths |= 1U << result.f_names[idx].length();
+                }
+            }
+            std::sort(
+                  result.f_sorted.begin()
+                , result.f_sorted.end()
+                , [&result](header_id_t lhs, header_id_t rhs)
+                  {
+                      return compare_names(result.f_names[lhs - 1], result.f_names[rhs - 1]) < 0;
+                  });
+            return result;
+        }());
+
+    return g_names;
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Get the identifier of a well-known header name.
+ *
+ * Callers which know which header they want should directly use one of
+ * the HEADER_ID_... identifiers instead.
+ *
+ * \param[in] name  The name of the header, in any case.
+ *
+ * \return The identifier of the header or HEADER_ID_UNKNOWN.
+ */
+header_id_t get_header_id(std::string_view const & name)
+{
+    well_known_names const & names(get_well_known_names());
+    if(name.length() >= 32
+    || (names.f_lengths & (1U << name.length())) == 0)
+    {
+        return HEADER_ID_UNKNOWN;
+    }
+
+    auto const it(std::lower_bound(
+              names.f_sorted.begin()
+            , names.f_sorted.end()
+            , name
+            , [&names](header_id_t lhs, std::string_view const & rhs)
+              {
+                  return compare_names(names.f_names[lhs - 1], rhs) < 0;
+              }));
+    if(it == names.f_sorted.end()
+    || compare_names(names.f_names[*it - 1], name) != 0)
+    {
+        return HEADER_ID_UNKNOWN;
+    }
+    return *it;
+}
+
+
+/** \brief Get the name of a well-known header.
+ *
+ * \exception invalid_parameter
+ * The identifier must be one of the HEADER_ID_... identifiers other than
+ * HEADER_ID_UNKNOWN.
+ *
+ * \param[in] id  The identifier of the header.
+ *
+ * \return The name of the header with its usual case.
+ */
+std::string_view get_header_name(header_id_t id)
+{
+    if(id == HEADER_ID_UNKNOWN
+    || id > HEADER_ID_MAX)
+    {
+        throw invalid_parameter("get_header_name() called with an unknown header identifier.");
+    }
+    return get_well_known_names().f_names[id - 1];
+}
+
+
+/** \brief Create an empty header map using the specified allocator.
+ *
+ * \param[in] alloc  The allocator used to store the headers.
+ */
+header_map::header_map(allocator_type const & alloc)
+    : f_headers(alloc)
+    , f_ids(alloc)
+{
+}
+
+
+/** \brief Copy a header map using the specified allocator.
+ *
+ * \param[in] rhs  The headers to copy.
+ * \param[in] alloc  The allocator used to store the headers.
+ */
+header_map::header_map(header_map const & rhs, allocator_type const & alloc)
+    : f_headers(rhs.f_headers, alloc)
+    , f_ids(rhs.f_ids, alloc)
+{
+}
+
+
+/** \brief Move a header map using the specified allocator.
+ *
+ * If \p alloc is not the allocator of \p rhs, the headers get copied,
+ * which may throw std::bad_alloc.
+ *
+ * \param[in] rhs  The headers to move.
+ * \param[in] alloc  The allocator used to store the headers.
+ */
+header_map::header_map(header_map && rhs, allocator_type const & alloc)
+    : f_headers(std::move(rhs.f_headers), alloc)
+    , f_ids(std::move(rhs.f_ids), alloc)
+{
+}
+
+
+/** \brief Get the allocator used by this header map.
+ *
+ * \return The allocator of the headers.
+ */
+header_map::allocator_type header_map::get_allocator() const
+{
+    return f_headers.get_allocator();
+}
+
+
+header_map::iterator header_map::begin()
+{
+    return f_headers.begin();
+}
+
+
+header_map::iterator header_map::end()
+{
+    return f_headers.end();
+}
+
+
+header_map::const_iterator header_map::begin() const
+{
+    return f_headers.begin();
+}
+
+
+header_map::const_iterator header_map::end() const
+{
+    return f_headers.end();
+}
+
+
+header_map::const_iterator header_map::cbegin() const
+{
+    return f_headers.cbegin();
+}
+
+
+header_map::const_iterator header_map::cend() const
+{
+    return f_headers.cend();
+}
+
+
+header_map::size_type header_map::size() const
+{
+    return f_headers.size();
+}
+
+
+bool header_map::empty() const
+{
+    return f_headers.empty();
+}
+
+
+void header_map::clear()
+{
+    f_headers.clear();
+    f_ids.clear();
+}
+
+
+/** \brief Get the identifier of a header.
+ *
+ * \param[in] it  An iterator to one of the headers of this map.
+ *
+ * \return The identifier of the header or HEADER_ID_UNKNOWN.
+ */
+header_id_t header_map::get_id(const_iterator it) const
+{
+    return f_ids[it - f_headers.cbegin()];
+}
+
+
+/** \brief Search for a well-known header.
+ *
+ * This is the fastest way to search a header since it compares
+ * identifiers only.
+ *
+ * \param[in] id  The identifier of the header to search.
+ *
+ * \return An iterator to the header or end().
+ */
+header_map::iterator header_map::find(header_id_t id)
+{
+    if(id == HEADER_ID_UNKNOWN)
+    {
+        return f_headers.end();
+    }
+    return f_headers.begin() + find_index(std::string_view(), id);
+}
+
+
+header_map::const_iterator header_map::find(header_id_t id) const
+{
+    if(id == HEADER_ID_UNKNOWN)
+    {
+        return f_headers.end();
+    }
+    return f_headers.begin() + find_index(std::string_view(), id);
+}
+
+
+/** \brief Search for a header.
+ *
+ * \param[in] name  The name of the header to search, in any case.
+ *
+ * \return An iterator to the header or end().
+ */
+header_map::iterator header_map::find(char const * name)
+{
+    return find(std::string_view(name));
+}
+
+
+header_map::iterator header_map::find(std::string const & name)
+{
+    return find(std::string_view(name));
+}
+
+
+header_map::iterator header_map::find(std::string_view const & name)
+{
+    return f_headers.begin() + find_index(name, get_header_id(name));
+}
+
+
+header_map::iterator header_map::find(snapdev::case_insensitive_string const & name)
+{
+    return find(std::string_view(name.data(), name.length()));
+}
+
+
+header_map::const_iterator header_map::find(char const * name) const
+{
+    return find(std::string_view(name));
+}
+
+
+header_map::const_iterator header_map::find(std::string const & name) const
+{
+    return find(std::string_view(name));
+}
+
+
+header_map::const_iterator header_map::find(std::string_view const & name) const
+{
+    return f_headers.begin() + find_index(name, get_header_id(name));
+}
+
+
+header_map::const_iterator header_map::find(snapdev::case_insensitive_string const & name) const
+{
+    return find(std::string_view(name.data(), name.length()));
+}
+
+
+header_map::size_type header_map::count(header_id_t id) const
+{
+    return find(id) == end() ? 0 : 1;
+}
+
+
+header_map::size_type header_map::count(char const * name) const
+{
+    return find(name) == end() ? 0 : 1;
+}
+
+
+header_map::size_type header_map::count(std::string const & name) const
+{
+    return find(name) == end() ? 0 : 1;
+}
+
+
+header_map::size_type header_map::count(std::string_view const & name) const
+{
+    return find(name) == end() ? 0 : 1;
+}
+
+
+header_map::size_type header_map::count(snapdev::case_insensitive_string const & name) const
+{
+    return find(name) == end() ? 0 : 1;
+}
+
+
+/** \brief Get a reference to the value of an existing header.
+ *
+ * As with a std::map, this function does not add the header.
+ *
+ * \exception libmimemail_out_of_range
+ * The header is not defined. This exception derives from
+ * std::out_of_range, as thrown by std::map::at().
+ *
+ * \param[in] name  The name or identifier of the header.
+ *
+ * \return A reference to the value of the header.
+ */
+std::string & header_map::at(header_id_t id)
+{
+    return const_cast<std::string &>(get_existing_value(std::string_view(), id));
+}
+
+
+std::string & header_map::at(char const * name)
+{
+    return at(std::string_view(name));
+}
+
+
+std::string & header_map::at(std::string const & name)
+{
+    return at(std::string_view(name));
+}
+
+
+std::string & header_map::at(std::string_view const & name)
+{
+    return const_cast<std::string &>(get_existing_value(name, get_header_id(name)));
+}
+
+
+std::string & header_map::at(snapdev::case_insensitive_string const & name)
+{
+    return at(std::string_view(name.data(), name.length()));
+}
+
+
+std::string const & header_map::at(header_id_t id) const
+{
+    return get_existing_value(std::string_view(), id);
+}
+
+
+std::string const & header_map::at(char const * name) const
+{
+    return at(std::string_view(name));
+}
+
+
+std::string const & header_map::at(std::string const & name) const
+{
+    return at(std::string_view(name));
+}
+
+
+std::string const & header_map::at(std::string_view const & name) const
+{
+    return get_existing_value(name, get_header_id(name));
+}
+
+
+std::string const & header_map::at(snapdev::case_insensitive_string const & name) const
+{
+    return at(std::string_view(name.data(), name.length()));
+}
+
+
+/** \brief Get a reference to the value of a header.
+ *
+ * If the header does not exist yet, it gets added at the end with an
+ * empty value. The name of an existing header is not modified.
+ *
+ * \exception invalid_parameter
+ * The identifier must be one of the HEADER_ID_... identifiers other than
+ * HEADER_ID_UNKNOWN.
+ *
+ * \param[in] name  The name or identifier of the header.
+ *
+ * \return A reference to the value of the header.
+ */
+std::string & header_map::operator [] (header_id_t id)
+{
+    return get_value(get_header_name(id), id);
+}
+
+
+std::string & header_map::operator [] (char const * name)
+{
+    return operator [] (std::string_view(name));
+}
+
+
+std::string & header_map::operator [] (std::string const & name)
+{
+    return operator [] (std::string_view(name));
+}
+
+
+std::string & header_map::operator [] (std::string_view const & name)
+{
+    return get_value(name, get_header_id(name));
+}
+
+
+std::string & header_map::operator [] (snapdev::case_insensitive_string const & name)
+{
+    return operator [] (std::string_view(name.data(), name.length()));
+}
+
+
+/** \brief Add a header unless it already exists.
+ *
+ * As with a std::map, an existing header keeps its value.
+ *
+ * \param[in] value  The name and value of the header.
+ *
+ * \return An iterator to the header with that name and whether
+ * \p value was inserted.
+ */
+std::pair<header_map::iterator, bool> header_map::insert(value_type const & value)
+{
+    return insert(value_type(value));
+}
+
+
+std::pair<header_map::iterator, bool> header_map::insert(value_type && value)
+{
+    std::string_view const name(value.first.data(), value.first.length());
+    header_id_t const id(get_header_id(name));
+    size_type const idx(find_index(name, id));
+    if(idx < f_headers.size())
+    {
+        return std::make_pair(f_headers.begin() + idx, false);
+    }
+
+    f_headers.push_back(std::move(value));
+    f_ids.push_back(id);
+    return std::make_pair(f_headers.end() - 1, true);
+}
+
+
+/** \brief Remove a header.
+ *
+ * The order of the other headers is kept.
+ *
+ * \param[in] it  An iterator to the header to remove.
+ *
+ * \return An iterator to the header following the removed header.
+ */
+header_map::iterator header_map::erase(const_iterator it)
+{
+    f_ids.erase(f_ids.begin() + (it - f_headers.cbegin()));
+    return f_headers.erase(it);
+}
+
+
+header_map::size_type header_map::erase(header_id_t id)
+{
+    const_iterator const it(find(id));
+    if(it == cend())
+    {
+        return 0;
+    }
+    erase(it);
+    return 1;
+}
+
+
+header_map::size_type header_map::erase(char const * name)
+{
+    return erase(std::string_view(name));
+}
+
+
+header_map::size_type header_map::erase(std::string const & name)
+{
+    return erase(std::string_view(name));
+}
+
+
+header_map::size_type header_map::erase(std::string_view const & name)
+{
+    const_iterator const it(find(name));
+    if(it == cend())
+    {
+        return 0;
+    }
+    erase(it);
+    return 1;
+}
+
+
+header_map::size_type header_map::erase(snapdev::case_insensitive_string const & name)
+{
+    return erase(std::string_view(name.data(), name.length()));
+}
+
+
+/** \brief Compare two sets of headers.
+ *
+ * Like with a map, the order in which the headers were added does not
+ * matter.
+ *
+ * \param[in] rhs  The other set of headers.
+ *
+ * \return true if both sets have the same headers with the same values.
+ */
+bool header_map::operator == (header_map const & rhs) const
+{
+    if(f_headers.size() != rhs.f_headers.size())
+    {
+        return false;
+    }
+    for(size_type idx(0); idx < f_headers.size(); ++idx)
+    {
+        value_type const & h(f_headers[idx]);
+        size_type const r(rhs.find_index(std::string_view(h.first.data(), h.first.length()), f_ids[idx]));
+        if(r == rhs.f_headers.size()
+        || rhs.f_headers[r].second != h.second)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+bool header_map::operator != (header_map const & rhs) const
+{
+    return !operator == (rhs);
+}
+
+
+/** \brief Search for the position of a header.
+ *
+ * \param[in] name  The name of the header.
+ * \param[in] id  The identifier of \p name as returned by get_header_id().
+ *
+ * \return The position of the header or size() when not found.
+ */
+header_map::size_type header_map::find_index(std::string_view const & name, header_id_t id) const
+{
+    size_type const max(f_ids.size());
+    if(id != HEADER_ID_UNKNOWN)
+    {
+        for(size_type idx(0); idx < max; ++idx)
+        {
+            if(f_ids[idx] == id)
+            {
+                return idx;
+            }
+        }
+        return max;
+    }
+
+    for(size_type idx(0); idx < max; ++idx)
+    {
+        if(f_ids[idx] == HEADER_ID_UNKNOWN
+        && f_headers[idx].first.length() == name.length()
+        && strncasecmp(f_headers[idx].first.data(), name.data(), name.length()) == 0)
+        {
+            return idx;
+        }
+    }
+    return max;
+}
+
+
+std::string const & header_map::get_existing_value(std::string_view const & name, header_id_t id) const
+{
+    size_type const idx(find_index(name, id));
+    if(idx >= f_headers.size())
+    {
+        throw libmimemail_out_of_range("header_map::at(): header not found.");
+    }
+    return f_headers[idx].second;
+}
+
+
+std::string & header_map::get_value(std::string_view const & name, header_id_t id)
+{
+    size_type const idx(find_index(name, id));
+    if(idx < f_headers.size())
+    {
+        return f_headers[idx].second;
+    }
+
+    if(f_headers.empty())
+    {
+        f_headers.reserve(INITIAL_CAPACITY);
+        f_ids.reserve(INITIAL_CAPACITY);
+    }
+    f_headers.emplace_back(
+              snapdev::case_insensitive_string(name.data(), name.length())
+            , std::string());
+    f_ids.push_back(id);
+    return f_headers.back().second;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,188 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// snapdev
+//
+#include    <snapdev/case_insensitive_string.h>
+
+
+// C++
+//
+#include    <cstdint>
+#include    <memory_resource>
+#include    <string>
+#include    <string_view>
+#include    <utility>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+// well-known header names get a non-zero identifier; using these with
+// the header_map functions avoids comparing names
+//
+typedef std::uint16_t           header_id_t;
+
+constexpr header_id_t const     HEADER_ID_UNKNOWN = 0;
+constexpr header_id_t const     HEADER_ID_FROM = 1;
+constexpr header_id_t const     HEADER_ID_TO = 2;
+constexpr header_id_t const     HEADER_ID_CC = 3;
+constexpr header_id_t const     HEADER_ID_BCC = 4;
+constexpr header_id_t const     HEADER_ID_X_PRIORITY = 5;
+constexpr header_id_t const     HEADER_ID_X_MSMAIL_PRIORITY = 6;
+constexpr header_id_t const     HEADER_ID_IMPORTANCE = 7;
+constexpr header_id_t const     HEADER_ID_PRECEDENCE = 8;
+constexpr header_id_t const     HEADER_ID_SUBJECT = 9;
+constexpr header_id_t const     HEADER_ID_MIME_VERSION = 10;
+constexpr header_id_t const     HEADER_ID_DATE = 11;
+constexpr header_id_t const     HEADER_ID_X_SITE_KEY = 12;
+constexpr header_id_t const     HEADER_ID_X_EMAIL_KEY = 13;
+constexpr header_id_t const     HEADER_ID_CONTENT_TYPE = 14;
+constexpr header_id_t const     HEADER_ID_CONTENT_TRANSFER_ENCODING = 15;
+constexpr header_id_t const     HEADER_ID_CONTENT_DISPOSITION = 16;
+constexpr header_id_t const     HEADER_ID_CONTENT_LANGUAGE = 17;
+constexpr header_id_t const     HEADER_ID_CONTENT_DESCRIPTION = 18;
+constexpr header_id_t const     HEADER_ID_CONTENT_ID = 19;
+constexpr header_id_t const     HEADER_ID_IN_REPLY_TO = 20;
+constexpr header_id_t const     HEADER_ID_LIST_UNSUBSCRIBE = 21;
+constexpr header_id_t const     HEADER_ID_MESSAGE_ID = 22;
+constexpr header_id_t const     HEADER_ID_REFERENCES = 23;
+constexpr header_id_t const     HEADER_ID_REPLY_TO = 24;
+constexpr header_id_t const     HEADER_ID_RETURN_PATH = 25;
+constexpr header_id_t const     HEADER_ID_SENDER = 26;
+constexpr header_id_t const     HEADER_ID_X_GENERATED_BY = 27;
+constexpr header_id_t const     HEADER_ID_X_MAILER = 28;
+constexpr header_id_t const     HEADER_ID_MAX = HEADER_ID_X_MAILER;
+
+header_id_t                     get_header_id(std::string_view const & name);
+std::string_view                get_header_name(header_id_t id);
+
+
+class header_map
+{
+public:
+    typedef snapdev::case_insensitive_string    key_type;
+    typedef std::string                         mapped_type;
+    typedef std::pair<key_type, mapped_type>    value_type;
+    typedef std::pmr::vector<value_type>        vector_t;
+    typedef vector_t::iterator                  iterator;
+    typedef vector_t::const_iterator            const_iterator;
+    typedef vector_t::size_type                 size_type;
+    typedef std::pmr::polymorphic_allocator<std::byte>
+                                                allocator_type;
+
+    static constexpr size_type const            INITIAL_CAPACITY = 8;
+
+                            header_map() = default;
+                            header_map(header_map const & rhs) = default;
+                            header_map(header_map && rhs) = default;
+    explicit                header_map(allocator_type const & alloc);
+                            header_map(header_map const & rhs, allocator_type const & alloc);
+                            header_map(header_map && rhs, allocator_type const & alloc);
+
+    header_map &            operator = (header_map const & rhs) = default;
+    header_map &            operator = (header_map && rhs) = default;
+
+    allocator_type          get_allocator() const;
+
+    iterator                begin();
+    iterator                end();
+    const_iterator          begin() const;
+    const_iterator          end() const;
+    const_iterator          cbegin() const;
+    const_iterator          cend() const;
+    size_type               size() const;
+    bool                    empty() const;
+    void                    clear();
+
+    header_id_t             get_id(const_iterator it) const;
+
+    iterator                find(header_id_t id);
+    iterator                find(char const * name);
+    iterator                find(std::string const & name);
+    iterator                find(std::string_view const & name);
+    iterator                find(snapdev::case_insensitive_string const & name);
+    const_iterator          find(header_id_t id) const;
+    const_iterator          find(char const * name) const;
+    const_iterator          find(std::string const & name) const;
+    const_iterator          find(std::string_view const & name) const;
+    const_iterator          find(snapdev::case_insensitive_string const & name) const;
+
+    size_type               count(header_id_t id) const;
+    size_type               count(char const * name) const;
+    size_type               count(std::string const & name) const;
+    size_type               count(std::string_view const & name) const;
+    size_type               count(snapdev::case_insensitive_string const & name) const;
+
+    std::string &           at(header_id_t id);
+    std::string &           at(char const * name);
+    std::string &           at(std::string const & name);
+    std::string &           at(std::string_view const & name);
+    std::string &           at(snapdev::case_insensitive_string const & name);
+    std::string const &     at(header_id_t id) const;
+    std::string const &     at(char const * name) const;
+    std::string const &     at(std::string const & name) const;
+    std::string const &     at(std::string_view const & name) const;
+    std::string const &     at(snapdev::case_insensitive_string const & name) const;
+
+    std::string &           operator [] (header_id_t id);
+    std::string &           operator [] (char const * name);
+    std::string &           operator [] (std::string const & name);
+    std::string &           operator [] (std::string_view const & name);
+    std::string &           operator [] (snapdev::case_insensitive_string const & name);
+
+    std::pair<iterator, bool>
+                            insert(value_type const & value);
+    std::pair<iterator, bool>
+                            insert(value_type && value);
+    template<typename ... ARGS>
+    std::pair<iterator, bool>
+                            emplace(ARGS && ... args)
+                            {
+                                return insert(value_type(std::forward<ARGS>(args)...));
+                            }
+
+    iterator                erase(const_iterator it);
+    size_type               erase(header_id_t id);
+    size_type               erase(char const * name);
+    size_type               erase(std::string const & name);
+    size_type               erase(std::string_view const & name);
+    size_type               erase(snapdev::case_insensitive_string const & name);
+
+    bool                    operator == (header_map const & rhs) const;
+    bool                    operator != (header_map const & rhs) const;
+
+private:
+    size_type               find_index(std::string_view const & name, header_id_t id) const;
+    std::string const &     get_existing_value(std::string_view const & name, header_id_t id) const;
+    std::string &           get_value(std::string_view const & name, header_id_t id);
+
+    vector_t                f_headers = vector_t();
+    std::pmr::vector<header_id_t>
+                            f_ids = std::pmr::vector<header_id_t>();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
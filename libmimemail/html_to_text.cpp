@@ -0,0 +1,1160 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Convert HTML to plain text.
+ *
+ * The email::send() function used to run the html2text tool with:
+ *
+ * \code
+ *     html2text -nobs -utf8 -style pretty -width 70
+ * \endcode
+ *
+ * to generate the plain text alternative of HTML emails. This file
+ * implements an equivalent conversion in the library:
+ *
+ * \li the output is UTF-8 and wrapped at 70 columns (by default),
+ * \li headings are surrounded by asterisks (6 for H1 down to 1 for H6),
+ * \li list items are indented and start with "*", "o", "+" (unordered)
+ *     or their number (ordered),
+ * \li horizontal rules become a line of "=",
+ * \li entities are converted to UTF-8,
+ * \li the content of `<head>`, `<script>`, and `<style>` is dropped.
+ *
+ * The converter accepts its input in chunks so it can be fed as the
+ * HTML gets read or decoded.
+ */
+
+// self
+//
+#include    "libmimemail/html_to_text.h"
+
+#include    "libmimemail/metrics.h"
+
+
+// C++
+//
+#include    <cstdlib>
+#include    <cstring>
+#include    <map>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+// longest entity we recognize, including the '&' and ';'
+//
+constexpr std::size_t const     MAX_ENTITY_LENGTH = 32;
+
+
+std::map<std::string, char32_t> const g_entities =
+{
+    { "AElig",   U'\u00C6' },
+    { "Aacute",  U'\u00C1' },
+    { "Acirc",   U'\u00C2' },
+    { "Agrave",  U'\u00C0' },
+    { "Aring",   U'\u00C5' },
+    { "Atilde",  U'\u00C3' },
+    { "Auml",    U'\u00C4' },
+    { "Ccedil",  U'\u00C7' },
+    { "Dagger",  U'\u2021' },
+    { "ETH",     U'\u00D0' },
+    { "Eacute",  U'\u00C9' },
+    { "Ecirc",   U'\u00CA' },
+    { "Egrave",  U'\u00C8' },
+    { "Euml",    U'\u00CB' },
+    { "Iacute",  U'\u00CD' },
+    { "Icirc",   U'\u00CE' },
+    { "Igrave",  U'\u00CC' },
+    { "Iuml",    U'\u00CF' },
+    { "Ntilde",  U'\u00D1' },
+    { "OElig",   U'\u0152' },
+    { "Oacute",  U'\u00D3' },
+    { "Ocirc",   U'\u00D4' },
+    { "Ograve",  U'\u00D2' },
+    { "Oslash",  U'\u00D8' },
+    { "Otilde",  U'\u00D5' },
+    { "Ouml",    U'\u00D6' },
+    { "Scaron",  U'\u0160' },
+    { "THORN",   U'\u00DE' },
+    { "Uacute",  U'\u00DA' },
+    { "Ucirc",   U'\u00DB' },
+    { "Ugrave",  U'\u00D9' },
+    { "Uuml",    U'\u00DC' },
+    { "Yacute",  U'\u00DD' },
+    { "Yuml",    U'\u0178' },
+    { "aacute",  U'\u00E1' },
+    { "acirc",   U'\u00E2' },
+    { "acute",   U'\u00B4' },
+    { "aelig",   U'\u00E6' },
+    { "agrave",  U'\u00E0' },
+    { "amp",     U'&' },
+    { "apos",    U'\'' },
+    { "aring",   U'\u00E5' },
+    { "atilde",  U'\u00E3' },
+    { "auml",    U'\u00E4' },
+    { "bdquo",   U'\u201E' },
+    { "brvbar",  U'\u00A6' },
+    { "bull",    U'\u2022' },
+    { "ccedil",  U'\u00E7' },
+    { "cedil",   U'\u00B8' },
+    { "cent",    U'\u00A2' },
+    { "copy",    U'\u00A9' },
+    { "curren",  U'\u00A4' },
+    { "dagger",  U'\u2020' },
+    { "darr",    U'\u2193' },
+    { "deg",     U'\u00B0' },
+    { "divide",  U'\u00F7' },
+    { "eacute",  U'\u00E9' },
+    { "ecirc",   U'\u00EA' },
+    { "egrave",  U'\u00E8' },
+    { "emsp",    U'\u2003' },
+    { "ensp",    U'\u2002' },
+    { "eth",     U'\u00F0' },
+    { "euml",    U'\u00EB' },
+    { "euro",    U'\u20AC' },
+    { "frac12",  U'\u00BD' },
+    { "frac14",  U'\u00BC' },
+    { "frac34",  U'\u00BE' },
+    { "gt",      U'>' },
+    { "hellip",  U'\u2026' },
+    { "iacute",  U'\u00ED' },
+    { "icirc",   U'\u00EE' },
+    { "iexcl",   U'\u00A1' },
+    { "igrave",  U'\u00EC' },
+    { "iquest",  U'\u00BF' },
+    { "iuml",    U'\u00EF' },
+    { "laquo",   U'\u00AB' },
+    { "larr",    U'\u2190' },
+    { "ldquo",   U'\u201C' },
+    { "lsaquo",  U'\u2039' },
+    { "lsquo",   U'\u2018' },
+    { "lt",      U'<' },
+    { "macr",    U'\u00AF' },
+    { "mdash",   U'\u2014' },
+    { "micro",   U'\u00B5' },
+    { "middot",  U'\u00B7' },
+    { "nbsp",    U'\u00A0' },
+    { "ndash",   U'\u2013' },
+    { "not",     U'\u00AC' },
+    { "ntilde",  U'\u00F1' },
+    { "oacute",  U'\u00F3' },
+    { "ocirc",   U'\u00F4' },
+    { "oelig",   U'\u0153' },
+    { "ograve",  U'\u00F2' },
+    { "ordf",    U'\u00AA' },
+    { "ordm",    U'\u00BA' },
+    { "oslash",  U'\u00F8' },
+    { "otilde",  U'\u00F5' },
+    { "ouml",    U'\u00F6' },
+    { "para",    U'\u00B6' },
+    { "plusmn",  U'\u00B1' },
+    { "pound",   U'\u00A3' },
+    { "quot",    U'"' },
+    { "raquo",   U'\u00BB' },
+    { "rarr",    U'\u2192' },
+    { "rdquo",   U'\u201D' },
+    { "reg",     U'\u00AE' },
+    { "rsaquo",  U'\u203A' },
+    { "rsquo",   U'\u2019' },
+    { "sbquo",   U'\u201A' },
+    { "scaron",  U'\u0161' },
+    { "sect",    U'\u00A7' },
+    { "shy",     U'\u00AD' },
+    { "sup1",    U'\u00B9' },
+    { "sup2",    U'\u00B2' },
+    { "sup3",    U'\u00B3' },
+    { "szlig",   U'\u00DF' },
+    { "thinsp",  U'\u2009' },
+    { "thorn",   U'\u00FE' },
+    { "times",   U'\u00D7' },
+    { "trade",   U'\u2122' },
+    { "uacute",  U'\u00FA' },
+    { "uarr",    U'\u2191' },
+    { "ucirc",   U'\u00FB' },
+    { "ugrave",  U'\u00F9' },
+    { "uml",     U'\u00A8' },
+    { "uuml",    U'\u00FC' },
+    { "yacute",  U'\u00FD' },
+    { "yen",     U'\u00A5' },
+    { "yuml",    U'\u00FF' },
+    { "zwj",     U'\u200D' },
+    { "zwnj",    U'\u200C' },
+};
+
+
+char const * const g_bullets[] =
+{
+    "* ",
+    "o ",
+    "+ ",
+};
+
+
+bool is_space(char c)
+{
+    return c == ' '
+        || c == '\t'
+        || c == '\n'
+        || c == '\r'
+        || c == '\f';
+}
+
+
+char to_lower(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+}
+
+
+std::string to_utf8(char32_t wc)
+{
+    std::string result;
+    if(wc < 0x80)
+    {
+        result += static_cast<char>(wc);
+    }
+    else if(wc < 0x800)
+    {
+        result += static_cast<char>((wc >> 6) | 0xC0);
+        result += static_cast<char>((wc & 0x3F) | 0x80);
+    }
+    else if(wc < 0x10000)
+    {
+        result += static_cast<char>((wc >> 12) | 0xE0);
+        result += static_cast<char>(((wc >> 6) & 0x3F) | 0x80);
+        result += static_cast<char>((wc & 0x3F) | 0x80);
+    }
+    else if(wc < 0x110000)
+    {
+        result += static_cast<char>((wc >> 18) | 0xF0);
+        result += static_cast<char>(((wc >> 12) & 0x3F) | 0x80);
+        result += static_cast<char>(((wc >> 6) & 0x3F) | 0x80);
+        result += static_cast<char>((wc & 0x3F) | 0x80);
+    }
+    return result;
+}
+
+
+/** \brief Decode an entity.
+ *
+ * \param[in] name  The entity name without the '&' and ';'.
+ * \param[out] wc  The corresponding character.
+ *
+ * \return true if the entity is known.
+ */
+bool decode_entity(std::string const & name, char32_t & wc)
+{
+    if(name.empty())
+    {
+        return false;
+    }
+
+    if(name[0] == '#')
+    {
+        char const * s(name.c_str() + 1);
+        int base(10);
+        if(*s == 'x' || *s == 'X')
+        {
+            base = 16;
+            ++s;
+        }
+        if(*s == '\0')
+        {
+            return false;
+        }
+        char32_t value(0);
+        for(; *s != '\0'; ++s)
+        {
+            int digit(0);
+            if(*s >= '0' && *s <= '9')
+            {
+                digit = *s - '0';
+            }
+            else if(base == 16 && *s >= 'a' && *s <= 'f')
+            {
+                digit = *s - 'a' + 10;
+            }
+            else if(base == 16 && *s >= 'A' && *s <= 'F')
+            {
+                digit = *s - 'A' + 10;
+            }
+            else
+            {
+                return false;
+            }
+            value = value * base + digit;
+            if(value >= 0x110000)
+            {
+                return false;
+            }
+        }
+        if(value == 0
+        || (value >= 0xD800 && value <= 0xDFFF))
+        {
+            wc = U'\uFFFD';
+        }
+        else
+        {
+            wc = value;
+        }
+        return true;
+    }
+
+    auto const it(g_entities.find(name));
+    if(it == g_entities.end())
+    {
+        return false;
+    }
+    wc = it->second;
+    return true;
+}
+
+
+/** \brief Retrieve the value of an attribute from a tag.
+ *
+ * \param[in] tag  The tag content, without the '<' and '>'.
+ * \param[in] name  The name of the attribute in lowercase.
+ *
+ * \return The value of the attribute or an empty string.
+ */
+std::string get_attribute(std::string const & tag, char const * name)
+{
+    std::size_t const name_len(strlen(name));
+    std::size_t pos(0);
+
+    // skip the tag name
+    //
+    while(pos < tag.length() && !is_space(tag[pos]))
+    {
+        ++pos;
+    }
+
+    while(pos < tag.length())
+    {
+        while(pos < tag.length() && (is_space(tag[pos]) || tag[pos] == '/'))
+        {
+            ++pos;
+        }
+        std::size_t const start(pos);
+        while(pos < tag.length() && !is_space(tag[pos]) && tag[pos] != '=' && tag[pos] != '/')
+        {
+            ++pos;
+        }
+        bool match(pos - start == name_len);
+        for(std::size_t idx(0); match && idx < name_len; ++idx)
+        {
+            match = to_lower(tag[start + idx]) == name[idx];
+        }
+        while(pos < tag.length() && is_space(tag[pos]))
+        {
+            ++pos;
+        }
+        if(pos >= tag.length()
+        || tag[pos] != '=')
+        {
+            if(pos == start)
+            {
+                ++pos;
+            }
+            continue;
+        }
+        ++pos;
+        while(pos < tag.length() && is_space(tag[pos]))
+        {
+            ++pos;
+        }
+        std::string value;
+        if(pos < tag.length()
+        && (tag[pos] == '"' || tag[pos] == '\''))
+        {
+            char const quote(tag[pos]);
+            std::size_t const end(tag.find(quote, pos + 1));
+            value = tag.substr(pos + 1, end == std::string::npos ? std::string::npos : end - pos - 1);
+            pos = end == std::string::npos ? tag.length() : end + 1;
+        }
+        else
+        {
+            std::size_t const value_start(pos);
+            while(pos < tag.length() && !is_space(tag[pos]))
+            {
+                ++pos;
+            }
+            value = tag.substr(value_start, pos - value_start);
+        }
+        if(match)
+        {
+            return value;
+        }
+    }
+
+    return std::string();
+}
+
+
+bool is_skip_tag(std::string const & name)
+{
+    return name == "head"
+        || name == "script"
+        || name == "style"
+        || name == "template"
+        || name == "title";
+}
+
+
+/** \brief Find the closing tag of a skipped element.
+ *
+ * \param[in] input  The input buffer.
+ * \param[in] pos  Where to start searching.
+ * \param[in] name  The name of the tag to search.
+ *
+ * \return The position of the "</name" or std::string::npos.
+ */
+std::string::size_type find_end_tag(std::string const & input, std::string::size_type pos, std::string const & name)
+{
+    for(;;)
+    {
+        pos = input.find("</", pos);
+        if(pos == std::string::npos
+        || pos + 2 + name.length() > input.length())
+        {
+            return std::string::npos;
+        }
+        bool match(true);
+        for(std::size_t idx(0); match && idx < name.length(); ++idx)
+        {
+            match = to_lower(input[pos + 2 + idx]) == name[idx];
+        }
+        if(match)
+        {
+            return pos;
+        }
+        pos += 2;
+    }
+}
+
+
+
+}
+// no name namespace
+
+
+
+/** \brief Initialize an HTML to text converter.
+ *
+ * \param[in] width  The maximum number of characters per line.
+ */
+html_to_text::html_to_text(std::size_t width)
+    : f_width(width)
+{
+}
+
+
+/** \brief Add HTML data to the converter.
+ *
+ * The data can be added in any number of chunks; a tag or an entity
+ * cut between two chunks is properly handled.
+ *
+ * \param[in] data  A pointer to the HTML data.
+ * \param[in] size  The number of bytes in \p data.
+ */
+void html_to_text::add_input(char const * data, std::size_t size)
+{
+    f_input.append(data, size);
+    process(false);
+}
+
+
+/** \brief Add HTML data to the converter.
+ *
+ * \param[in] data  The HTML data.
+ */
+void html_to_text::add_input(std::string const & data)
+{
+    add_input(data.data(), data.length());
+}
+
+
+/** \brief Convert the remaining input and return the plain text.
+ *
+ * The result ends with exactly one newline unless it is empty.
+ *
+ * \return The plain text version of the HTML input.
+ */
+std::string const & html_to_text::finish()
+{
+    process(true);
+    block(0);
+
+    while(!f_output.empty()
+       && f_output.back() == '\n')
+    {
+        f_output.pop_back();
+    }
+    if(!f_output.empty())
+    {
+        f_output += '\n';
+    }
+
+    return f_output;
+}
+
+
+/** \brief Convert an HTML document to plain text.
+ *
+ * \param[in] html  The HTML to convert.
+ * \param[in] width  The maximum number of characters per line.
+ *
+ * \return The plain text version of \p html.
+ */
+std::string html_to_text::convert(std::string const & html, std::size_t width)
+{
+    metrics_timer timer(metric_stage_t::METRIC_STAGE_HTML_TO_TEXT);
+
+    html_to_text converter(width);
+    converter.add_input(html);
+    return converter.finish();
+}
+
+
+void html_to_text::process(bool end)
+{
+    std::string::size_type pos(0);
+    std::string::size_type const size(f_input.length());
+    while(pos < size)
+    {
+        if(!f_skip_tag.empty())
+        {
+            std::string::size_type const close(find_end_tag(f_input, pos, f_skip_tag));
+            if(close == std::string::npos)
+            {
+                // keep enough to detect the closing tag in the next chunk
+                //
+                std::size_t const keep(f_skip_tag.length() + 2);
+                if(end)
+                {
+                    pos = size;
+                }
+                else if(size - pos > keep)
+                {
+                    pos = size - keep;
+                }
+                break;
+            }
+            pos = close;
+        }
+
+        if(f_input[pos] == '<')
+        {
+            if(f_input.compare(pos, 4, "<!--") == 0
+            || (!end && size - pos < 4 && std::string("<!--").compare(0, size - pos, f_input, pos) == 0))
+            {
+                std::string::size_type const close(f_input.find("-->", pos + 4));
+                if(close == std::string::npos)
+                {
+                    if(end)
+                    {
+                        pos = size;
+                    }
+                    break;
+                }
+                pos = close + 3;
+                continue;
+            }
+
+            if(pos + 1 >= size)
+            {
+                if(end)
+                {
+                    process_text("<", 1);
+                    ++pos;
+                }
+                break;
+            }
+
+            char const c(f_input[pos + 1]);
+            if((c >= 'a' && c <= 'z')
+            || (c >= 'A' && c <= 'Z')
+            || c == '/'
+            || c == '!'
+            || c == '?')
+            {
+                // find the end of the tag, '>' may appear in quoted values
+                //
+                char quote('\0');
+                std::string::size_type gt(pos + 1);
+                for(; gt < size; ++gt)
+                {
+                    char const t(f_input[gt]);
+                    if(quote != '\0')
+                    {
+                        if(t == quote)
+                        {
+                            quote = '\0';
+                        }
+                    }
+                    else if(t == '"' || t == '\'')
+                    {
+                        quote = t;
+                    }
+                    else if(t == '>')
+                    {
+                        break;
+                    }
+                }
+                if(gt >= size)
+                {
+                    if(end)
+                    {
+                        pos = size;
+                    }
+                    break;
+                }
+                process_tag(f_input.substr(pos + 1, gt - pos - 1));
+                pos = gt + 1;
+                continue;
+            }
+
+            // a lone '<' is just text
+            //
+            process_text("<", 1);
+            ++pos;
+            continue;
+        }
+
+        std::string::size_type text_end(f_input.find('<', pos));
+        if(text_end == std::string::npos)
+        {
+            text_end = size;
+            if(!end)
+            {
+                // do not cut an entity in half
+                //
+                std::string::size_type const amp(f_input.rfind('&'));
+                if(amp != std::string::npos
+                && amp >= pos
+                && size - amp < MAX_ENTITY_LENGTH
+                && f_input.find(';', amp) == std::string::npos)
+                {
+                    text_end = amp;
+                }
+            }
+        }
+        if(text_end == pos)
+        {
+            break;
+        }
+        process_text(f_input.data() + pos, text_end - pos);
+        pos = text_end;
+    }
+
+    f_input.erase(0, pos);
+}
+
+
+void html_to_text::process_text(char const * s, std::size_t size)
+{
+    for(std::size_t idx(0); idx < size; ++idx)
+    {
+        if(s[idx] == '&')
+        {
+            std::size_t end(idx + 1);
+            while(end < size
+               && end - idx < MAX_ENTITY_LENGTH
+               && s[end] != ';'
+               && s[end] != '&'
+               && !is_space(s[end]))
+            {
+                ++end;
+            }
+            char32_t wc(U'\0');
+            if(end < size
+            && s[end] == ';'
+            && decode_entity(std::string(s + idx + 1, end - idx - 1), wc))
+            {
+                idx = end;
+                if(wc == U'\u00A0')
+                {
+                    // a non-breaking space is part of the word
+                    //
+                    if(f_pre == 0)
+                    {
+                        f_word += ' ';
+                        ++f_word_width;
+                    }
+                    else
+                    {
+                        add_char(' ');
+                    }
+                }
+                else if(wc != U'\u00AD')
+                {
+                    add_string(to_utf8(wc));
+                }
+                continue;
+            }
+        }
+        add_char(s[idx]);
+    }
+}
+
+
+void html_to_text::process_tag(std::string const & tag)
+{
+    if(tag.empty()
+    || tag[0] == '!'
+    || tag[0] == '?')
+    {
+        // DOCTYPE, CDATA, processing instruction...
+        //
+        return;
+    }
+
+    bool const closing(tag[0] == '/');
+    std::string name;
+    for(std::size_t idx(closing ? 1 : 0); idx < tag.length(); ++idx)
+    {
+        char const c(tag[idx]);
+        if(is_space(c) || c == '/')
+        {
+            break;
+        }
+        name += to_lower(c);
+    }
+
+    if(!f_skip_tag.empty())
+    {
+        if(closing
+        && name == f_skip_tag)
+        {
+            f_skip_tag.clear();
+        }
+        return;
+    }
+
+    if(closing)
+    {
+        end_tag(name);
+    }
+    else if(is_skip_tag(name))
+    {
+        if(tag.back() != '/')
+        {
+            f_skip_tag = name;
+        }
+    }
+    else
+    {
+        start_tag(name, tag);
+    }
+}
+
+
+void html_to_text::start_tag(std::string const & name, std::string const & tag)
+{
+    if(name == "br")
+    {
+        flush_word();
+        if(!f_line_started)
+        {
+            start_line();
+        }
+        end_line();
+    }
+    else if(name == "p")
+    {
+        block(1);
+    }
+    else if(name.length() == 2
+         && name[0] == 'h'
+         && name[1] >= '1'
+         && name[1] <= '6')
+    {
+        block(1);
+        std::string const stars(7 - (name[1] - '0'), '*');
+        add_string(stars + " ");
+        f_heading_suffix = " " + stars;
+    }
+    else if(name == "ul"
+         || name == "ol"
+         || name == "dir"
+         || name == "menu")
+    {
+        block(f_lists.empty() ? 1 : 0);
+        f_indents.push_back(f_indent);
+        list_state l;
+        l.f_ordered = name == "ol";
+        if(l.f_ordered)
+        {
+            std::string const start(get_attribute(tag, "start"));
+            if(!start.empty())
+            {
+                l.f_counter = std::atoi(start.c_str()) - 1;
+            }
+        }
+        f_lists.push_back(l);
+    }
+    else if(name == "li")
+    {
+        block(0);
+        std::size_t const base(f_indents.empty() ? f_indent : f_indents.back());
+        f_indent = base + 4;
+        if(f_lists.empty()
+        || !f_lists.back().f_ordered)
+        {
+            std::size_t const depth(f_lists.empty() ? 0 : f_lists.size() - 1);
+            f_marker = g_bullets[depth % (sizeof(g_bullets) / sizeof(g_bullets[0]))];
+        }
+        else
+        {
+            ++f_lists.back().f_counter;
+            f_marker = std::to_string(f_lists.back().f_counter) + ". ";
+        }
+    }
+    else if(name == "blockquote")
+    {
+        block(1);
+        f_indents.push_back(f_indent);
+        f_indent += 2;
+    }
+    else if(name == "dd")
+    {
+        block(0);
+        f_indents.push_back(f_indent);
+        f_indent += 4;
+    }
+    else if(name == "pre")
+    {
+        block(1);
+        ++f_pre;
+        f_skip_newline = true;
+    }
+    else if(name == "hr")
+    {
+        block(1);
+        start_line();
+        if(f_width > f_indent)
+        {
+            f_line += std::string(f_width - f_indent, '=');
+            f_line_width = f_width;
+        }
+        end_line();
+        block(1);
+    }
+    else if(name == "img")
+    {
+        std::string const alt(get_attribute(tag, "alt"));
+        if(!alt.empty())
+        {
+            add_string("[" + alt + "]");
+        }
+    }
+    else if(name == "td"
+         || name == "th")
+    {
+        flush_word();
+        f_pending_space = f_line_started;
+    }
+    else if(name == "table"
+         || name == "dl"
+         || name == "fieldset")
+    {
+        block(1);
+    }
+    else if(name == "div"
+         || name == "tr"
+         || name == "dt"
+         || name == "section"
+         || name == "article"
+         || name == "header"
+         || name == "footer"
+         || name == "nav"
+         || name == "main"
+         || name == "aside"
+         || name == "address"
+         || name == "center"
+         || name == "figure"
+         || name == "figcaption"
+         || name == "form")
+    {
+        block(0);
+    }
+}
+
+
+void html_to_text::end_tag(std::string const & name)
+{
+    if(name == "p")
+    {
+        block(1);
+    }
+    else if(name.length() == 2
+         && name[0] == 'h'
+         && name[1] >= '1'
+         && name[1] <= '6')
+    {
+        flush_word();
+        f_pending_space = false;
+        add_string(f_heading_suffix);
+        f_heading_suffix.clear();
+        block(1);
+    }
+    else if(name == "ul"
+         || name == "ol"
+         || name == "dir"
+         || name == "menu")
+    {
+        if(!f_lists.empty())
+        {
+            f_lists.pop_back();
+        }
+        block(f_lists.empty() ? 1 : 0);
+        f_marker.clear();
+        if(!f_indents.empty())
+        {
+            f_indent = f_indents.back();
+            f_indents.pop_back();
+        }
+    }
+    else if(name == "li")
+    {
+        block(0);
+        f_marker.clear();
+    }
+    else if(name == "blockquote"
+         || name == "dd")
+    {
+        block(name == "dd" ? 0 : 1);
+        if(!f_indents.empty())
+        {
+            f_indent = f_indents.back();
+            f_indents.pop_back();
+        }
+    }
+    else if(name == "pre")
+    {
+        if(f_line_started)
+        {
+            end_line();
+        }
+        if(f_pre > 0)
+        {
+            --f_pre;
+        }
+        block(1);
+    }
+    else if(name == "table"
+         || name == "dl"
+         || name == "fieldset")
+    {
+        block(1);
+    }
+    else if(name == "div"
+         || name == "tr"
+         || name == "dt"
+         || name == "section"
+         || name == "article"
+         || name == "header"
+         || name == "footer"
+         || name == "nav"
+         || name == "main"
+         || name == "aside"
+         || name == "address"
+         || name == "center"
+         || name == "figure"
+         || name == "figcaption"
+         || name == "form")
+    {
+        block(0);
+    }
+}
+
+
+void html_to_text::add_char(char c)
+{
+    if(f_pre > 0)
+    {
+        if(f_skip_newline)
+        {
+            f_skip_newline = false;
+            if(c == '\n')
+            {
+                return;
+            }
+        }
+        if(c == '\r')
+        {
+            return;
+        }
+        if(!f_line_started)
+        {
+            start_line();
+        }
+        if(c == '\n')
+        {
+            end_line();
+            return;
+        }
+        if(c == '\t')
+        {
+            do
+            {
+                f_line += ' ';
+                ++f_line_width;
+            }
+            while(f_line_width % 8 != 0);
+            return;
+        }
+        f_line += c;
+        if((c & 0xC0) != 0x80)
+        {
+            ++f_line_width;
+        }
+        return;
+    }
+
+    if(is_space(c))
+    {
+        flush_word();
+        if(f_line_started)
+        {
+            f_pending_space = true;
+        }
+        return;
+    }
+
+    f_word += c;
+    if((c & 0xC0) != 0x80)
+    {
+        ++f_word_width;
+    }
+}
+
+
+void html_to_text::add_string(std::string const & s)
+{
+    for(auto c : s)
+    {
+        add_char(c);
+    }
+}
+
+
+void html_to_text::flush_word()
+{
+    if(f_word.empty())
+    {
+        return;
+    }
+
+    if(!f_line_started)
+    {
+        start_line();
+    }
+    else if(f_pending_space)
+    {
+        if(f_line_width + 1 + f_word_width > f_width
+        && f_line_width > f_indent)
+        {
+            end_line();
+            start_line();
+        }
+        else
+        {
+            f_line += ' ';
+            ++f_line_width;
+        }
+    }
+
+    f_line += f_word;
+    f_line_width += f_word_width;
+    f_word.clear();
+    f_word_width = 0;
+    f_pending_space = false;
+}
+
+
+void html_to_text::start_line()
+{
+    if(f_blank_lines > 0
+    && !f_output.empty())
+    {
+        f_output.append(f_blank_lines, '\n');
+    }
+    f_blank_lines = 0;
+
+    std::size_t const marker_len(f_marker.length());
+    std::size_t const pad(f_indent > marker_len ? f_indent - marker_len : 0);
+    f_line.assign(pad, ' ');
+    f_line += f_marker;
+    f_line_width = pad + marker_len;
+    f_marker.clear();
+    f_line_started = true;
+}
+
+
+void html_to_text::end_line()
+{
+    if(!f_line_started)
+    {
+        return;
+    }
+
+    while(!f_line.empty()
+       && f_line.back() == ' ')
+    {
+        f_line.pop_back();
+    }
+    f_output += f_line;
+    f_output += '\n';
+
+    f_line.clear();
+    f_line_width = 0;
+    f_line_started = false;
+    f_pending_space = false;
+}
+
+
+void html_to_text::block(int blank_lines)
+{
+    flush_word();
+    end_line();
+    f_pending_space = false;
+    if(f_blank_lines < blank_lines)
+    {
+        f_blank_lines = blank_lines;
+    }
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,88 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <string>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+class html_to_text
+{
+public:
+    static constexpr std::size_t const  DEFAULT_WIDTH = 70;
+
+                            html_to_text(std::size_t width = DEFAULT_WIDTH);
+
+    void                    add_input(char const * data, std::size_t size);
+    void                    add_input(std::string const & data);
+    std::string const &     finish();
+
+    static std::string      convert(std::string const & html, std::size_t width = DEFAULT_WIDTH);
+
+private:
+    struct list_state
+    {
+        bool                f_ordered = false;
+        int                 f_counter = 0;
+    };
+
+    void                    process(bool end);
+    void                    process_text(char const * s, std::size_t size);
+    void                    process_tag(std::string const & tag);
+    void                    start_tag(std::string const & name, std::string const & tag);
+    void                    end_tag(std::string const & name);
+    void                    add_char(char c);
+    void                    add_string(std::string const & s);
+    void                    flush_word();
+    void                    start_line();
+    void                    end_line();
+    void                    block(int blank_lines);
+
+    std::size_t             f_width = DEFAULT_WIDTH;
+    std::string             f_input = std::string();
+    std::string             f_output = std::string();
+    std::string             f_line = std::string();
+    std::size_t             f_line_width = 0;
+    bool                    f_line_started = false;
+    std::string             f_word = std::string();
+    std::size_t             f_word_width = 0;
+    bool                    f_pending_space = false;
+    int                     f_blank_lines = 0;
+    std::size_t             f_indent = 0;
+    std::string             f_marker = std::string();
+    int                     f_pre = 0;
+    bool                    f_skip_newline = false;
+    std::string             f_skip_tag = std::string();
+    std::string             f_heading_suffix = std::string();
+    std::vector<list_state> f_lists = std::vector<list_state>();
+    std::vector<std::size_t>
+                            f_indents = std::vector<std::size_t>();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -19,11 +19,10 @@
 //
 #include    "libmimemail/mail_exchanger.h"
 
-
-// cppprocess
-//
-#include    <cppprocess/process.h>
-#include    <cppprocess/io_capture_pipe.h>
+#include    "libmimemail/dns_resolver.h"
+#include    "libmimemail/metrics.h"
+#include    "libmimemail/mx_cache.h"
+#include    "libmimemail/mx_resolver.h"
 
 
 // snaplogger
@@ -31,21 +30,11 @@
 #include    <snaplogger/message.h>
 
 
-// snapdev
-//
-#include    <snapdev/tokenize_string.h>
-
-
 // libtld
 //
 #include    <libtld/tld.h>
 
 
-// C
-//
-#include    <string.h>
-
-
 // last include
 //
 #include    <snapdev/poison.h>
@@ -58,9 +47,10 @@ namespace libmimemail
 
 
 
-mail_exchanger::mail_exchanger(int priority, std::string const & domain)
+mail_exchanger::mail_exchanger(int priority, std::string const & domain, std::uint32_t ttl)
     : f_priority(priority)
     , f_domain(domain)
+    , f_ttl(ttl)
 {
 }
 
@@ -77,6 +67,19 @@ std::string mail_exchanger::get_domain() const
 }
 
 
+/** \brief Retrieve the TTL of this MX record.
+ *
+ * The TTL is the number of seconds the DNS server said this record
+ * can be cached. It is 0 when unknown.
+ *
+ * \return The TTL in seconds.
+ */
+std::uint32_t mail_exchanger::get_ttl() const
+{
+    return f_ttl;
+}
+
+
 bool mail_exchanger::operator < (mail_exchanger const & rhs) const
 {
     return f_priority < rhs.f_priority;
@@ -88,7 +91,80 @@ bool mail_exchanger::operator < (mail_exchanger const & rhs) const
 
 
 
+/** \brief Retrieve the mail exchangers of a domain.
+ *
+ * The result comes from the process wide MX cache (see mx_cache) which
+ * only queries the DNS when the domain is not yet cached or its TTL
+ * expired.
+ *
+ * \param[in] domain  The domain for which the MX records are wanted.
+ */
 mail_exchangers::mail_exchangers(std::string const & domain)
+{
+    *this = *mx_cache::get_instance().lookup(domain);
+}
+
+
+/** \brief Private constructor used by query().
+ */
+mail_exchangers::mail_exchangers()
+{
+}
+
+
+/** \brief Query the DNS for the mail exchangers of a domain.
+ *
+ * This function bypasses the cache.
+ *
+ * \param[in] domain  The domain for which the MX records are wanted.
+ *
+ * \return The mail exchangers of \p domain.
+ */
+mail_exchangers::pointer_t mail_exchangers::query(std::string const & domain)
+{
+    std::shared_ptr<mail_exchangers> result(new mail_exchangers());
+    result->load(domain);
+    return result;
+}
+
+
+/** \brief Resolve the mail exchangers of many domains in parallel.
+ *
+ * This function sends the MX queries of all the \p domains at once and
+ * calls \p callback with each result as it arrives. It returns once all
+ * the domains were resolved. The results are saved in the MX cache so
+ * this is a good way to warm up the cache before sending a campaign.
+ *
+ * To resolve domains without blocking, use an mx_resolver directly
+ * (or an mx_resolver_connection with the ed::communicator).
+ *
+ * \param[in] domains  The list of domains to resolve.
+ * \param[in] callback  The function called with each result.
+ */
+void mail_exchangers::resolve_many(
+      std::vector<std::string> const & domains
+    , resolve_callback_t callback)
+{
+    mx_resolver resolver;
+    for(auto const & d : domains)
+    {
+        resolver.add_domain(d, callback);
+    }
+    resolver.run();
+}
+
+
+/** \brief Transform a domain in the domain to use in the MX query.
+ *
+ * The MX query has to use the plain domain name, i.e.
+ * "mail.m2osw.com" has to be queried as "m2osw.com".
+ *
+ * \param[in] domain  The domain of an email address.
+ * \param[out] full_domain  The domain to use in the query.
+ *
+ * \return true if \p domain is valid.
+ */
+bool mail_exchangers::get_query_domain(std::string const & domain, std::string & full_domain)
 {
     // use plain domain name to query the MX record
     // (i.e. a query with "mail.m2osw.com" fails!)
@@ -96,188 +172,125 @@ mail_exchangers::mail_exchangers(std::string const & domain)
     tld_object domain_obj(domain);
     if(!domain_obj.is_valid())
     {
-        // f_domain_found is false by default... it failed
         SNAP_LOG_DEBUG
             << "mail_exchanger called with an invalid domain name: \""
             << domain
             << "\"."
             << SNAP_LOG_SEND;
-        return;
+        return false;
     }
 
     // got the plain domain name now
     //
-    std::string const full_domain(domain_obj.full_domain());
+    full_domain = domain_obj.full_domain();
+    return true;
+}
 
-    // generate a command line to execute `dig`
-    //
-    cppprocess::process dig("dig");
-    dig.set_command("/usr/bin/dig");
-    dig.add_argument(full_domain);
-    dig.add_argument("mx");  // get MX field
-    cppprocess::io_capture_pipe::pointer_t out(std::make_shared<cppprocess::io_capture_pipe>());
-    dig.set_output_io(out);
-    int r(dig.start());
-    if(r == 0)
-    {
-        r = dig.wait();
-    }
 
-    // retrieve the dig output
-    //
-    std::string const output(out->get_trimmed_output());
+/** \brief Create the mail exchangers from a DNS answer.
+ *
+ * This function is used once the MX query of \p full_domain was answered,
+ * whether synchronously (see query()) or asynchronously (see mx_resolver).
+ *
+ * \param[in] full_domain  The domain that was queried.
+ * \param[in] response  The answer of the DNS server.
+ *
+ * \return The corresponding mail exchangers.
+ */
+mail_exchangers::pointer_t mail_exchangers::from_response(
+      std::string const & full_domain
+    , dns_mx_response const & response)
+{
+    std::shared_ptr<mail_exchangers> result(new mail_exchangers());
+    result->set_response(full_domain, response);
+    return result;
+}
+
 
-    if(r != 0)
+void mail_exchangers::load(std::string const & domain)
+{
+    std::string full_domain;
+    if(!get_query_domain(domain, full_domain))
     {
-        // dig command failed
-        SNAP_LOG_DEBUG
-            << "dig.run() returned "
-            << r
-            << " and output: ["
-            << output
-            << "]"
-            << SNAP_LOG_SEND;
+        // f_domain_found is false by default... it failed
         return;
     }
 
-    // dig worked, check the results
+    // query the MX records
     //
-    std::vector<std::string> lines;
-    int const count(snapdev::tokenize_string(lines, output, "\n", true, " "));
-    if(count <= 0)
+    dns_resolver resolver;
+    dns_mx_response response;
+    metrics_timer lookup_timer(metric_stage_t::METRIC_STAGE_MX_LOOKUP);
+    bool const found(resolver.query_mx(full_domain, response));
+    lookup_timer.stop();
+    count_metric(metric_counter_t::METRIC_COUNTER_MX_LOOKUPS);
+    if(!found)
     {
-        // no output?
-        //
+        count_metric(metric_counter_t::METRIC_COUNTER_MX_LOOKUP_FAILURES);
         SNAP_LOG_DEBUG
-            << "dig returned no output ["
-            << output
-            << "]"
+            << "MX query for \""
+            << full_domain
+            << "\" failed (status: "
+            << static_cast<int>(response.get_status())
+            << ")."
             << SNAP_LOG_SEND;
         return;
     }
 
-    for(int l(0); l < count; ++l)
+    set_response(full_domain, response);
+}
+
+
+void mail_exchangers::set_response(std::string const & full_domain, dns_mx_response const & response)
+{
+    switch(response.get_status())
     {
-        // if no MX are found, we generally get a line with the authority
-        //
-        if(strncmp(";; AUTHORITY SECTION:", lines[l].c_str(), 21) == 0)
+    case dns_status_t::DNS_STATUS_SUCCESS:
+        f_ttl = response.get_ttl();
+        if(response.has_null_mx())
         {
-            ++l;
-            if(l >= count)
-            {
-                break;
-            }
-            std::vector<std::string> fields;
-            /*int const ln_count*/ (snapdev::tokenize_string(fields, lines[l], " \t", true, " ."));
-            if(fields.empty()
-            || fields[0] != full_domain)
-            {
-                SNAP_LOG_DEBUG
-                    << "authority ("
-                    << (fields.empty() ? "<empty>" : fields[0])
-                    << ") does not match the domain we used ("
-                    << full_domain
-                    << ")"
-                    << SNAP_LOG_SEND;
-                return;
-            }
-            f_domain_found = true;
-        }
-        else if(strncmp(";; ANSWER SECTION:", lines[l].c_str(), 18) == 0)
-        {
-            mail_exchanger::mail_exchange_vector_t exchangers;
-            for(++l; l < count; ++l)
-            {
-                if(lines[l].empty())
-                {
-                    break;
-                }
-
-                // TODO: instead of just taking the priority and MX
-                //       priority and domain names, we probably should
-                //       take all the fields available even if we are
-                //       to not use them in some circumstances
-
-                std::string::size_type pos(lines[l].find("MX"));
-                if(pos != std::string::npos)
-                {
-                    // skip the MX (+2) and then skip spaces
-                    //
-                    char const * mx(lines[l].c_str() + pos + 2);
-
-                    // skip spaces
-                    //
-                    for(; *mx != '\0' && std::isspace(*mx); ++mx);
-
-                    // if valid, we now have a decimal number
-                    //
-                    if(*mx < '0' || *mx > '9')
-                    {
-                        SNAP_LOG_DEBUG
-                            << "priority missing in \""
-                            << lines[l]
-                            << "\""
-                            << SNAP_LOG_SEND;
-                        return;
-                    }
-
-                    int priority(0);
-                    for(; *mx >= '0' && *mx <= '9'; ++mx)
-                    {
-                        // some random maximum; valid MX priority is generally
-                        // under 1,000 anyway
-                        //
-                        if(priority > 500000000)
-                        {
-                            SNAP_LOG_DEBUG
-                                << "priority too large in \""
-                                << lines[l]
-                                << "\""
-                                << SNAP_LOG_SEND;
-                            return;
-                        }
-                        priority = priority * 10 + *mx - '0';
-                    }
-
-                    // skip spaces between priority and domain name
-                    //
-                    for(; *mx != '\0' && (std::isspace(*mx) || *mx == '.'); ++mx);
-
-                    // now we have a domain name that ends with a period
-                    //
-                    if(*mx == '\0')
-                    {
-                        SNAP_LOG_DEBUG
-                            << "invalid domain entry in \""
-                            << lines[l]
-                            << "\""
-                            << SNAP_LOG_SEND;
-                        return;
-                    }
-                    std::string mx_domain(mx);
-                    if(mx_domain[mx_domain.length() - 1] == '.')
-                    {
-                        // remove the ending period if present
-                        //
-                        mx_domain.pop_back();
-                    }
-
-                    // it is considered valid, add it and move on
-                    //
-                    mail_exchanger const mx_item(priority, mx_domain);
-                    exchangers.push_back(mx_item);
-                }
-            }
-
-            // this also means the domain is considered valid
-            // even if we do not find any authoritative section...
-            // however, we expect at least one entry to be valid
+            // the domain explicitly says it does not accept emails (RFC 7505)
             //
-            f_domain_found = !exchangers.empty();
+            SNAP_LOG_DEBUG
+                << "domain \""
+                << full_domain
+                << "\" has a null MX."
+                << SNAP_LOG_SEND;
+            f_negative = true;
+            return;
+        }
+        f_mail_exchangers = response.get_mail_exchangers();
+        f_domain_found = true;
+        break;
 
-            f_mail_exchangers.swap(exchangers);
-            break;
+    case dns_status_t::DNS_STATUS_NO_DATA:
+        // no MX, the authority has to match the domain for it to exist
+        //
+        f_ttl = response.get_ttl();
+        if(response.get_authority_domain() != full_domain)
+        {
+            SNAP_LOG_DEBUG
+                << "authority ("
+                << (response.get_authority_domain().empty() ? "<empty>" : response.get_authority_domain())
+                << ") does not match the domain we used ("
+                << full_domain
+                << ")"
+                << SNAP_LOG_SEND;
+            f_negative = true;
+            return;
         }
+        f_domain_found = true;
+        break;
+
+    case dns_status_t::DNS_STATUS_NAME_ERROR:
+        f_ttl = response.get_ttl();
+        f_negative = true;
+        break;
+
+    default:
+        // server failure, time out, etc. -- no TTL
+        break;
+
     }
 }
 
@@ -288,12 +301,44 @@ bool mail_exchangers::domain_found() const
 }
 
 
+/** \brief Check whether the DNS said that the domain has no mail exchangers.
+ *
+ * This function returns true when the DNS gave a definite answer saying
+ * that the domain cannot receive emails: the domain does not exist
+ * (NXDOMAIN), it has no MX records (NODATA) or it has a null MX.
+ *
+ * When domain_found() and is_negative() both return false, the query
+ * failed for a transient reason (server failure, time out, invalid
+ * answer, etc.) and trying again later may work.
+ *
+ * \return true if the domain is known not to have mail exchangers.
+ */
+bool mail_exchangers::is_negative() const
+{
+    return f_negative;
+}
+
+
 size_t mail_exchangers::size() const
 {
     return f_mail_exchangers.size();
 }
 
 
+/** \brief Retrieve the TTL of the DNS answer.
+ *
+ * For a domain with MX records, this is the smallest TTL of those records.
+ * Otherwise this is the negative caching TTL defined by the SOA of the
+ * domain. In both cases, 0 means that it is not known.
+ *
+ * \return The number of seconds this result can be cached.
+ */
+std::uint32_t mail_exchangers::get_ttl() const
+{
+    return f_ttl;
+}
+
+
 mail_exchanger::mail_exchange_vector_t mail_exchangers::get_mail_exchangers() const
 {
     return f_mail_exchangers;
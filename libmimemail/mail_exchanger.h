@@ -23,6 +23,9 @@
 
 // C++
 //
+#include    <cstdint>
+#include    <functional>
+#include    <memory>
 #include    <string>
 #include    <vector>
 
@@ -33,21 +36,26 @@ namespace libmimemail
 
 
 
+class dns_mx_response;
+
+
 class mail_exchanger
 {
 public:
     typedef std::vector<mail_exchanger>     mail_exchange_vector_t;
 
-                    mail_exchanger(int priority, std::string const & domain);
+                    mail_exchanger(int priority, std::string const & domain, std::uint32_t ttl = 0);
 
     int             get_priority() const;
     std::string     get_domain() const;
+    std::uint32_t   get_ttl() const;
 
     bool            operator < (mail_exchanger const & rhs) const;
 
 private:
     int             f_priority = 0;
     std::string     f_domain = std::string();
+    std::uint32_t   f_ttl = 0;
 };
 
 
@@ -58,14 +66,38 @@ private:
 class mail_exchangers
 {
 public:
+    typedef std::shared_ptr<mail_exchangers const>  pointer_t;
+    typedef std::function<void(std::string const & domain, pointer_t mx)>
+                                                    resolve_callback_t;
+
                     mail_exchangers(std::string const & domain);
 
+    static pointer_t
+                    query(std::string const & domain);
+    static void     resolve_many(
+                          std::vector<std::string> const & domains
+                        , resolve_callback_t callback);
+    static bool     get_query_domain(std::string const & domain, std::string & full_domain);
+    static pointer_t
+                    from_response(
+                          std::string const & full_domain
+                        , dns_mx_response const & response);
+
     bool            domain_found() const;
+    bool            is_negative() const;
     size_t          size() const;
+    std::uint32_t   get_ttl() const;
     mail_exchanger::mail_exchange_vector_t get_mail_exchangers() const;
 
 private:
+                    mail_exchangers();
+
+    void            load(std::string const & domain);
+    void            set_response(std::string const & full_domain, dns_mx_response const & response);
+
     bool            f_domain_found = false;
+    bool            f_negative = false;
+    std::uint32_t   f_ttl = 0;
     mail_exchanger::mail_exchange_vector_t f_mail_exchangers = mail_exchanger::mail_exchange_vector_t();
 };
 
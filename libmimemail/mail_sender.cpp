@@ -0,0 +1,823 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Send emails from a pool of worker threads.
+ *
+ * The mail_sender accepts emails from any number of threads. The emails
+ * go through a bounded lock-free queue to a pool of workers which render
+ * and send them with a transport.
+ *
+ * The emails are grouped by destination domain (or by the primary
+ * mail exchanger of that domain, see set_group_by_mail_exchanger()).
+ * Each group has a maximum number of emails being sent in parallel
+ * and an optional maximum rate (token bucket). An email which cannot be
+ * sent yet waits in its group without blocking a worker so the other
+ * groups keep going.
+ *
+ * An email with recipients in several groups (i.e. To, Cc and Bcc
+ * addresses at different domains) is sent once per group, each part
+ * with the recipients of that group only and a slot in that group.
+ * The parts share the rendered message. The callback is called once,
+ * when all the parts are done.
+ *
+ * The number of emails in the sender (queued, waiting in a group, or
+ * being sent) is bounded by the queue size. Once full, try_submit()
+ * fails and submit() blocks, which gives the producers backpressure.
+ */
+
+// self
+//
+#include    "libmimemail/mail_sender.h"
+
+#include    "libmimemail/mx_cache.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief How long an idle worker sleeps before checking for work.
+ *
+ * Workers get woken up when new work arrives; this is a safety net.
+ */
+constexpr std::chrono::milliseconds const   IDLE_WAIT = std::chrono::milliseconds(100);
+
+
+/** \brief How long a blocked submit() sleeps before checking for room.
+ */
+constexpr std::chrono::milliseconds const   SPACE_WAIT = std::chrono::milliseconds(10);
+
+
+
+} // no name namespace
+
+
+
+/** \brief Set the maximum number of emails sent in parallel.
+ *
+ * With the smtp_transport, this is the maximum number of connections
+ * opened to the group.
+ *
+ * \exception invalid_parameter
+ * The maximum must be at least 1.
+ *
+ * \param[in] max  The maximum number of emails sent in parallel.
+ */
+void domain_limits::set_max_connections(std::size_t max)
+{
+    if(max == 0)
+    {
+        throw invalid_parameter("domain_limits::set_max_connections(): the maximum number of connections must be at least 1.");
+    }
+    f_max_connections = max;
+}
+
+
+std::size_t domain_limits::get_max_connections() const
+{
+    return f_max_connections;
+}
+
+
+/** \brief Set the maximum number of emails sent per second.
+ *
+ * A rate of 0 means no limit. The rate is enforced with a token bucket
+ * allowing bursts of up to one second worth of emails.
+ *
+ * \exception invalid_parameter
+ * The rate cannot be negative.
+ *
+ * \param[in] messages_per_second  The maximum rate.
+ */
+void domain_limits::set_max_rate(double messages_per_second)
+{
+    if(messages_per_second < 0.0)
+    {
+        throw invalid_parameter("domain_limits::set_max_rate(): the rate cannot be negative.");
+    }
+    f_max_rate = messages_per_second;
+}
+
+
+double domain_limits::get_max_rate() const
+{
+    return f_max_rate;
+}
+
+
+
+/** \brief Start the sender.
+ *
+ * The worker threads get started immediately.
+ *
+ * \param[in] t  The transport used to send the emails, the default
+ * transport if nullptr.
+ * \param[in] queue_size  The maximum number of emails in the sender.
+ * \param[in] workers  The number of worker threads.
+ */
+mail_sender::mail_sender(
+          transport::pointer_t t
+        , std::size_t queue_size
+        , std::size_t workers)
+    : f_transport(t == nullptr ? get_default_transport() : t)
+    , f_queue(std::max(queue_size, static_cast<std::size_t>(1)))
+    , f_capacity(std::max(queue_size, static_cast<std::size_t>(1)))
+{
+    workers = std::max(workers, static_cast<std::size_t>(1));
+    f_workers.reserve(workers);
+    for(std::size_t idx(0); idx < workers; ++idx)
+    {
+        f_workers.emplace_back(&mail_sender::run, this);
+    }
+}
+
+
+/** \brief Stop the sender.
+ *
+ * The emails which were not sent yet are not sent; their callback gets
+ * called with SEND_STATUS_NOT_SENT. Call stop() first to send them.
+ */
+mail_sender::~mail_sender()
+{
+    stop(false);
+}
+
+
+/** \brief Set the limits of the groups without specific limits.
+ *
+ * The limits apply to groups created after this call.
+ *
+ * \param[in] limits  The default limits.
+ */
+void mail_sender::set_default_limits(domain_limits const & limits)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_default_limits = limits;
+}
+
+
+/** \brief Set the limits of one group.
+ *
+ * The group is a domain name (i.e. "example.com") or, when grouping by
+ * mail exchanger, the name of the primary MX host (i.e.
+ * "gmail-smtp-in.l.google.com"). Names are case insensitive.
+ *
+ * \param[in] group  The name of the group.
+ * \param[in] limits  The limits of that group.
+ */
+void mail_sender::set_limits(std::string const & group, domain_limits const & limits)
+{
+    std::string name(group);
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_limits[name] = limits;
+    auto it(f_groups.find(name));
+    if(it != f_groups.end())
+    {
+        it->second.f_limits = limits;
+    }
+}
+
+
+/** \brief Group the emails by mail exchanger instead of domain.
+ *
+ * Many domains are served by the same mail exchangers. When this flag
+ * is set, the group of an email is the primary MX of its destination
+ * domain, as found by the mx_cache, so the limits apply to the provider
+ * instead of each of its domains.
+ *
+ * \param[in] group_by_mx  Whether to group by mail exchanger.
+ */
+void mail_sender::set_group_by_mail_exchanger(bool group_by_mx)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_group_by_mx = group_by_mx;
+}
+
+
+/** \brief Submit an email without blocking.
+ *
+ * The email gets copied (its attachment data is shared, see
+ * attachment_payload) so the caller can reuse it immediately.
+ *
+ * \param[in] e  The email to send.
+ * \param[in] callback  The function called, from a worker thread, once
+ * the email was sent or failed.
+ *
+ * \return false if the sender is full or stopped.
+ */
+bool mail_sender::try_submit(email const & e, send_result::callback_t callback)
+{
+    if(f_stop)
+    {
+        return false;
+    }
+
+    if(f_pending.fetch_add(1) >= f_capacity)
+    {
+        f_pending.fetch_sub(1);
+        return false;
+    }
+
+    job::pointer_t j(std::make_shared<job>());
+    j->f_email = e;
+    j->f_callback = callback;
+    if(!f_queue.try_push(j))
+    {
+        // the queue is at least as large as f_capacity so this does not
+        // happen, but do not lose the count if it did
+        //
+        f_pending.fetch_sub(1);
+        return false;
+    }
+
+    // wake up a worker if some are sleeping; the fence pairs with the
+    // one in run() so either we see the sleeping worker or it sees
+    // the new job
+    //
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(f_sleeping_workers.load() > 0)
+    {
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+        }
+        f_work_ready.notify_one();
+    }
+
+    return true;
+}
+
+
+/** \brief Submit an email, waiting for room if the sender is full.
+ *
+ * \param[in] e  The email to send.
+ * \param[in] callback  The function called once the email was handled.
+ * \param[in] timeout  How long to wait for room; a negative value means
+ * no limit.
+ *
+ * \return false if the timeout elapsed or the sender was stopped.
+ */
+bool mail_sender::submit(
+      email const & e
+    , send_result::callback_t callback
+    , std::chrono::milliseconds timeout)
+{
+    clock_t::time_point const deadline(
+            timeout.count() < 0
+                ? clock_t::time_point::max()
+                : clock_t::now() + timeout);
+    for(;;)
+    {
+        if(try_submit(e, callback))
+        {
+            return true;
+        }
+        if(f_stop)
+        {
+            return false;
+        }
+        clock_t::time_point const now(clock_t::now());
+        if(now >= deadline)
+        {
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(f_mutex);
+        f_space_ready.wait_for(
+                  lock
+                , std::min<clock_t::duration>(deadline - now, SPACE_WAIT));
+    }
+}
+
+
+/** \brief Get the number of emails in the sender.
+ *
+ * \return The number of emails queued, waiting, or being sent.
+ */
+std::size_t mail_sender::get_pending() const
+{
+    return f_pending.load();
+}
+
+
+/** \brief Stop the worker threads.
+ *
+ * New emails are refused once this function was called. When \p drain
+ * is true, the function returns once all the emails were handled.
+ * Otherwise, it returns as soon as the emails being sent are done and
+ * the others get their callback called with SEND_STATUS_NOT_SENT.
+ *
+ * \param[in] drain  Whether to send the emails already submitted.
+ */
+void mail_sender::stop(bool drain)
+{
+    f_drain = drain;
+    f_stop = true;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        f_work_ready.notify_all();
+        f_space_ready.notify_all();
+    }
+
+    for(auto & w : f_workers)
+    {
+        if(w.joinable())
+        {
+            w.join();
+        }
+    }
+    f_workers.clear();
+
+    send_result not_sent;
+    not_sent.set_status(send_status_t::SEND_STATUS_NOT_SENT);
+    not_sent.set_error("the mail sender was stopped.");
+
+    job::pointer_t j;
+    while(f_queue.try_pop(j))
+    {
+        finish(j, not_sent);
+    }
+
+    std::vector<job::pointer_t> waiting;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        for(auto & g : f_groups)
+        {
+            waiting.insert(waiting.end(), g.second.f_waiting.begin(), g.second.f_waiting.end());
+            g.second.f_waiting.clear();
+        }
+    }
+    for(auto & w : waiting)
+    {
+        finish(w, not_sent);
+    }
+}
+
+
+/** \brief The loop of a worker thread.
+ */
+void mail_sender::run()
+{
+    for(;;)
+    {
+        if(f_stop
+        && (!f_drain || f_pending.load() == 0))
+        {
+            return;
+        }
+
+        // first check the emails waiting in a group for their turn
+        //
+        job::pointer_t j;
+        clock_t::duration wait(IDLE_WAIT);
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+            j = next_waiting_job(clock_t::now(), wait);
+        }
+        if(j != nullptr)
+        {
+            send(j);
+            continue;
+        }
+
+        // then take a new email
+        //
+        if(f_queue.try_pop(j))
+        {
+            dispatch(j);
+            continue;
+        }
+
+        // nothing to do, sleep until a new email arrives, a send ends,
+        // or a rate limited group gets a new token
+        //
+        std::unique_lock<std::mutex> lock(f_mutex);
+        ++f_sleeping_workers;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(f_queue.try_pop(j))
+        {
+            --f_sleeping_workers;
+            lock.unlock();
+            dispatch(j);
+            continue;
+        }
+        if(!f_stop)
+        {
+            f_work_ready.wait_for(lock, std::min<clock_t::duration>(wait, IDLE_WAIT));
+        }
+        else
+        {
+            // draining, f_work_ready was already notified
+            //
+            f_work_ready.wait_for(lock, std::min<clock_t::duration>(wait, SPACE_WAIT));
+        }
+        --f_sleeping_workers;
+    }
+}
+
+
+/** \brief Send a new email or make it wait in its group.
+ *
+ * \param[in] j  The job taken from the queue.
+ */
+void mail_sender::dispatch(job::pointer_t j)
+{
+    job::vector_t jobs;
+    if(!prepare(j, jobs))
+    {
+        return;
+    }
+
+    // this worker sends the first part which can go now; the other
+    // parts wait in their group for another worker so this one does not
+    // hold slots it is not using yet
+    //
+    job::pointer_t ready;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        for(auto const & part : jobs)
+        {
+            group & g(get_group(part->f_group));
+            if(ready == nullptr
+            && g.f_waiting.empty())
+            {
+                clock_t::duration wait(IDLE_WAIT);
+                if(acquire(g, clock_t::now(), wait))
+                {
+                    ready = part;
+                    continue;
+                }
+            }
+            g.f_waiting.push_back(part);
+        }
+        if(jobs.size() > 1)
+        {
+            f_work_ready.notify_all();
+        }
+    }
+    if(ready != nullptr)
+    {
+        send(ready);
+    }
+}
+
+
+/** \brief Render the email of a job and find its groups.
+ *
+ * When all the recipients belong to the same group, \p jobs is set to
+ * \p j alone. Otherwise one job is created per group with the recipients
+ * of that group. Those jobs share the rendered message and a delivery
+ * which calls the callback of \p j once they are all done.
+ *
+ * \param[in] j  The job to prepare.
+ * \param[out] jobs  The jobs to send.
+ *
+ * \return true if the jobs can be sent; false if the email could not be
+ * rendered, in which case the job is finished.
+ */
+bool mail_sender::prepare(job::pointer_t j, job::vector_t & jobs)
+{
+    try
+    {
+        std::string message;
+        j->f_email.render(j->f_envelope, message);
+        j->f_message = std::make_shared<std::string const>(std::move(message));
+    }
+    catch(libmimemail_exception const & e)
+    {
+        send_result result;
+        result.set_status(send_status_t::SEND_STATUS_INVALID);
+        result.set_error(std::string("the email could not be rendered: ") + e.what());
+        finish(j, result);
+        return false;
+    }
+
+    // the email itself is not needed anymore
+    //
+    j->f_email = email();
+
+    string_list_t const & recipients(j->f_envelope.get_recipients());
+    if(recipients.empty())
+    {
+        send_result result;
+        result.set_status(send_status_t::SEND_STATUS_INVALID);
+        result.set_error("the email has no recipient.");
+        finish(j, result);
+        return false;
+    }
+
+    std::map<std::string, envelope> groups;
+    for(auto const & r : recipients)
+    {
+        envelope & env(groups[get_group_name(r)]);
+        if(env.get_recipients().empty())
+        {
+            env.set_sender(j->f_envelope.get_sender());
+        }
+        env.add_recipient(r);
+    }
+
+    if(groups.size() == 1)
+    {
+        j->f_group = groups.begin()->first;
+        jobs.push_back(j);
+        return true;
+    }
+
+    delivery::pointer_t d(std::make_shared<delivery>());
+    d->f_callback = j->f_callback;
+    d->f_remaining = groups.size();
+    for(auto & g : groups)
+    {
+        job::pointer_t part(std::make_shared<job>());
+        part->f_envelope = std::move(g.second);
+        part->f_message = j->f_message;
+        part->f_group = g.first;
+        part->f_delivery = d;
+        jobs.push_back(part);
+    }
+
+    return true;
+}
+
+
+/** \brief Compute the name of the group of a recipient.
+ *
+ * \param[in] recipient  The email address of the recipient.
+ *
+ * \return The domain of the recipient or its primary mail exchanger.
+ */
+std::string mail_sender::get_group_name(std::string const & recipient)
+{
+    std::string::size_type const pos(recipient.rfind('@'));
+    std::string domain(pos == std::string::npos ? recipient : recipient.substr(pos + 1));
+    std::transform(domain.begin(), domain.end(), domain.begin(), ::tolower);
+
+    bool group_by_mx(false);
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        group_by_mx = f_group_by_mx;
+    }
+    if(!group_by_mx)
+    {
+        return domain;
+    }
+
+    mail_exchangers::pointer_t mx(mx_cache::get_instance().lookup(domain));
+    if(mx == nullptr
+    || !mx->domain_found()
+    || mx->size() == 0)
+    {
+        return domain;
+    }
+    mail_exchanger::mail_exchange_vector_t exchangers(mx->get_mail_exchangers());
+    std::string host(std::min_element(exchangers.begin(), exchangers.end())->get_domain());
+    std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    return host;
+}
+
+
+/** \brief Get a group, creating it if necessary.
+ *
+ * The caller must hold f_mutex.
+ *
+ * \param[in] name  The name of the group.
+ *
+ * \return A reference to the group.
+ */
+mail_sender::group & mail_sender::get_group(std::string const & name)
+{
+    auto it(f_groups.find(name));
+    if(it != f_groups.end())
+    {
+        return it->second;
+    }
+
+    group & g(f_groups[name]);
+    auto const limits(f_limits.find(name));
+    g.f_limits = limits == f_limits.end() ? f_default_limits : limits->second;
+    g.f_tokens = std::max(1.0, g.f_limits.get_max_rate());
+    g.f_last_refill = clock_t::now();
+    return g;
+}
+
+
+/** \brief Reserve a slot to send one email to a group.
+ *
+ * The caller must hold f_mutex.
+ *
+ * \param[in] g  The group.
+ * \param[in] now  The current time.
+ * \param[in,out] wait  Reduced to the time until the group gets a new
+ * token if the rate is the limit.
+ *
+ * \return true if the email can be sent now.
+ */
+bool mail_sender::acquire(group & g, clock_t::time_point now, clock_t::duration & wait)
+{
+    if(g.f_in_flight >= g.f_limits.get_max_connections())
+    {
+        // a worker gets notified when a send ends
+        //
+        return false;
+    }
+
+    double const rate(g.f_limits.get_max_rate());
+    if(rate > 0.0)
+    {
+        double const elapsed(std::chrono::duration<double>(now - g.f_last_refill).count());
+        g.f_tokens = std::min(std::max(1.0, rate), g.f_tokens + elapsed * rate);
+        g.f_last_refill = now;
+        if(g.f_tokens < 1.0)
+        {
+            wait = std::min(
+                      wait
+                    , std::chrono::duration_cast<clock_t::duration>(
+                            std::chrono::duration<double>((1.0 - g.f_tokens) / rate)));
+            return false;
+        }
+        g.f_tokens -= 1.0;
+    }
+
+    ++g.f_in_flight;
+    return true;
+}
+
+
+/** \brief Find a waiting email which can now be sent.
+ *
+ * The caller must hold f_mutex.
+ *
+ * \param[in] now  The current time.
+ * \param[in,out] wait  Reduced to the time until a group gets a token.
+ *
+ * \return The job to send or nullptr.
+ */
+mail_sender::job::pointer_t mail_sender::next_waiting_job(clock_t::time_point now, clock_t::duration & wait)
+{
+    for(auto & it : f_groups)
+    {
+        group & g(it.second);
+        if(!g.f_waiting.empty()
+        && acquire(g, now, wait))
+        {
+            job::pointer_t j(g.f_waiting.front());
+            g.f_waiting.pop_front();
+            return j;
+        }
+    }
+    return job::pointer_t();
+}
+
+
+/** \brief Send one email and release its slot.
+ *
+ * \param[in] j  The job to send.
+ */
+void mail_sender::send(job::pointer_t j)
+{
+    send_result result;
+    if(f_transport->send_message(j->f_envelope, *j->f_message))
+    {
+        result.set_status(send_status_t::SEND_STATUS_SENT);
+    }
+    else
+    {
+        result.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        result.set_error("the transport did not accept the email.");
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        auto it(f_groups.find(j->f_group));
+        if(it != f_groups.end())
+        {
+            group & g(it->second);
+            --g.f_in_flight;
+            if(!g.f_waiting.empty())
+            {
+                f_work_ready.notify_one();
+            }
+            else if(g.f_in_flight == 0
+                 && g.f_limits.get_max_rate() == 0.0)
+            {
+                // idle groups without a rate have no state worth keeping
+                //
+                f_groups.erase(it);
+            }
+        }
+    }
+
+    finish(j, result);
+}
+
+
+/** \brief Call the callback of a job and release its place.
+ *
+ * When the job is one part of an email sent to several groups, the
+ * results are combined and the callback is only called once the last
+ * part is done. The email was sent if all the parts were sent, it was
+ * partially sent if some of the parts were accepted, otherwise it gets
+ * the result of its first failing part.
+ *
+ * \param[in] j  The job which is done.
+ * \param[in] result  The result of the send.
+ */
+void mail_sender::finish(job::pointer_t j, send_result const & result)
+{
+    send_result::callback_t callback(j->f_callback);
+    send_result combined(result);
+    if(j->f_delivery != nullptr)
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        delivery & d(*j->f_delivery);
+        if(result.get_status() == send_status_t::SEND_STATUS_SENT
+        || result.get_status() == send_status_t::SEND_STATUS_PARTIAL)
+        {
+            d.f_accepted = true;
+        }
+        if(result.get_status() != send_status_t::SEND_STATUS_SENT
+        && !d.f_failed)
+        {
+            d.f_failed = true;
+            d.f_failure = result;
+        }
+        --d.f_remaining;
+        if(d.f_remaining > 0)
+        {
+            return;
+        }
+
+        callback = d.f_callback;
+        if(d.f_failed)
+        {
+            combined = d.f_failure;
+            if(d.f_accepted)
+            {
+                combined.set_status(send_status_t::SEND_STATUS_PARTIAL);
+            }
+        }
+    }
+
+    if(callback != nullptr)
+    {
+        try
+        {
+            callback(combined);
+        }
+        catch(std::exception const & e)
+        {
+            SNAP_LOG_ERROR
+                << "mail_sender callback raised an exception: "
+                << e.what()
+                << SNAP_LOG_SEND;
+        }
+    }
+
+    f_pending.fetch_sub(1);
+    f_space_ready.notify_one();
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,165 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/bounded_queue.h>
+#include    <libmimemail/email.h>
+
+
+// C++
+//
+#include    <chrono>
+#include    <condition_variable>
+#include    <deque>
+#include    <map>
+#include    <thread>
+
+
+
+namespace libmimemail
+{
+
+
+
+class domain_limits
+{
+public:
+    static constexpr std::size_t const  DEFAULT_MAX_CONNECTIONS = 2;
+
+    void                    set_max_connections(std::size_t max);
+    std::size_t             get_max_connections() const;
+    void                    set_max_rate(double messages_per_second);
+    double                  get_max_rate() const;
+
+private:
+    std::size_t             f_max_connections = DEFAULT_MAX_CONNECTIONS;
+    double                  f_max_rate = 0.0;       // 0 means no limit
+};
+
+
+class mail_sender
+{
+public:
+    typedef std::shared_ptr<mail_sender>    pointer_t;
+    typedef std::chrono::steady_clock       clock_t;
+
+    static constexpr std::size_t const  DEFAULT_QUEUE_SIZE = 1024;
+    static constexpr std::size_t const  DEFAULT_WORKERS = 4;
+
+                            mail_sender(
+                                  transport::pointer_t t = transport::pointer_t()
+                                , std::size_t queue_size = DEFAULT_QUEUE_SIZE
+                                , std::size_t workers = DEFAULT_WORKERS);
+                            mail_sender(mail_sender const &) = delete;
+                            ~mail_sender();
+
+    mail_sender &           operator = (mail_sender const &) = delete;
+
+    void                    set_default_limits(domain_limits const & limits);
+    void                    set_limits(std::string const & group, domain_limits const & limits);
+    void                    set_group_by_mail_exchanger(bool group_by_mx);
+
+    bool                    try_submit(email const & e, send_result::callback_t callback = send_result::callback_t());
+    bool                    submit(
+                                  email const & e
+                                , send_result::callback_t callback = send_result::callback_t()
+                                , std::chrono::milliseconds timeout = std::chrono::milliseconds(-1));
+    std::size_t             get_pending() const;
+    void                    stop(bool drain = true);
+
+private:
+    // an email with recipients in several groups is sent in several
+    // parts; the delivery gathers their results
+    //
+    struct delivery
+    {
+        typedef std::shared_ptr<delivery>   pointer_t;
+
+        send_result::callback_t f_callback = send_result::callback_t();
+        std::size_t             f_remaining = 0;
+        bool                    f_accepted = false;     // at least one part was (partially) sent
+        bool                    f_failed = false;
+        send_result             f_failure = send_result();
+    };
+
+    struct job
+    {
+        typedef std::shared_ptr<job>    pointer_t;
+        typedef std::vector<pointer_t>  vector_t;
+
+        email                   f_email = email();
+        send_result::callback_t f_callback = send_result::callback_t();
+        envelope                f_envelope = envelope();
+        std::shared_ptr<std::string const>
+                                f_message = std::shared_ptr<std::string const>();
+        std::string             f_group = std::string();
+        delivery::pointer_t     f_delivery = delivery::pointer_t();
+    };
+
+    struct group
+    {
+        domain_limits           f_limits = domain_limits();
+        std::size_t             f_in_flight = 0;
+        double                  f_tokens = 0.0;
+        clock_t::time_point     f_last_refill = clock_t::time_point();
+        std::deque<job::pointer_t>
+                                f_waiting = std::deque<job::pointer_t>();
+    };
+    typedef std::map<std::string, group>    group_map_t;
+
+    void                    run();
+    void                    dispatch(job::pointer_t j);
+    bool                    prepare(job::pointer_t j, job::vector_t & jobs);
+    std::string             get_group_name(std::string const & recipient);
+    group &                 get_group(std::string const & name);
+    bool                    acquire(group & g, clock_t::time_point now, clock_t::duration & wait);
+    job::pointer_t          next_waiting_job(clock_t::time_point now, clock_t::duration & wait);
+    void                    send(job::pointer_t j);
+    void                    finish(job::pointer_t j, send_result const & result);
+
+    transport::pointer_t    f_transport = transport::pointer_t();
+    bounded_queue<job::pointer_t>
+                            f_queue;
+    std::size_t             f_capacity = 0;
+    std::atomic<std::size_t>
+                            f_pending = 0;
+    std::atomic<bool>       f_stop = false;
+    std::atomic<bool>       f_drain = true;
+    std::atomic<std::size_t>
+                            f_sleeping_workers = 0;
+
+    // the mutex protects the groups and is used for the condition variables
+    //
+    std::mutex              f_mutex = std::mutex();
+    std::condition_variable f_work_ready = std::condition_variable();
+    std::condition_variable f_space_ready = std::condition_variable();
+    group_map_t             f_groups = group_map_t();
+    domain_limits           f_default_limits = domain_limits();
+    std::map<std::string, domain_limits>
+                            f_limits = std::map<std::string, domain_limits>();
+    bool                    f_group_by_mx = false;
+    std::vector<std::thread>
+                            f_workers = std::vector<std::thread>();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,1255 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief A durable spool of emails waiting to be sent.
+ *
+ * The spool is a directory of append-only segment files. Each enqueued
+ * email is appended to the current segment as one record holding the
+ * email key and the binary serialization of the email. A removal appends
+ * a tombstone record. On open() the segments are replayed in order to
+ * rebuild the in-memory index of the emails still in the spool.
+ *
+ * Concurrent enqueue() and remove() calls share their fdatasync(): the
+ * first caller to reach the commit becomes the leader and syncs
+ * everything written so far while the others wait for the result. So
+ * N threads enqueueing at the same time pay for about one disk flush,
+ * not N.
+ *
+ * Once all the emails of the oldest segments were removed, those
+ * segments get deleted. compact() copies the remaining emails
+ * of mostly empty segments to the current segment so those can be
+ * deleted too.
+ *
+ * With a blob_store, the large attachments are saved once in the store
+ * and the records only hold their key. A bulk send of one attachment to
+ * many recipients then writes that attachment once instead of once per
+ * email. The blobs no longer referenced get removed by collect_blobs().
+ */
+
+// self
+//
+#include    "libmimemail/mail_spool.h"
+
+#include    "libmimemail/binary_spool.h"
+#include    "libmimemail/exception.h"
+#include    "libmimemail/mime_writer.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <array>
+#include    <cstring>
+
+
+// C
+//
+#include    <dirent.h>
+#include    <endian.h>
+#include    <fcntl.h>
+#include    <sys/stat.h>
+#include    <time.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief The magic at the start of each record.
+ */
+constexpr char const            RECORD_MAGIC[4] = { 'L', 'M', 'S', 'R' };
+
+
+/** \brief The types of records found in a segment.
+ */
+constexpr std::uint8_t const    RECORD_EMAIL = 1;
+constexpr std::uint8_t const    RECORD_TOMBSTONE = 2;
+
+
+/** \brief The size of a record without its key and data.
+ *
+ * magic, type, key length, data length and CRC.
+ */
+constexpr std::uint64_t const   RECORD_OVERHEAD = 4 + 1 + 4 + 8 + 4;
+
+
+/** \brief The extension of the segment files.
+ */
+constexpr char const            SEGMENT_EXTENSION[] = ".spool";
+
+
+/** \brief Compute the CRC-32 (IEEE 802.3) of a buffer.
+ *
+ * The CRC protects each record against torn writes. Only the last
+ * segment may end with a partial record (the process died while
+ * writing it) and replaying stops there.
+ *
+ * \param[in] crc  The CRC of the previous buffers, 0 for the first one.
+ * \param[in] data  The buffer to add to the CRC.
+ * \param[in] size  The size of \p data in bytes.
+ *
+ * \return The updated CRC.
+ */
+std::uint32_t crc32(std::uint32_t crc, void const * data, std::size_t size)
+{
+    static std::array<std::uint32_t, 256> const g_table([]()
+        {
+            std::array<std::uint32_t, 256> table;
+            for(std::uint32_t n(0); n < 256; ++n)
+            {
+                std::uint32_t c(n);
+                for(int k(0); k < 8; ++k)
+                {
+                    c = (c & 1) != 0 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+                }
+                table[n] = c;
+            }
+            return table;
+        }());
+
+    std::uint8_t const * s(reinterpret_cast<std::uint8_t const *>(data));
+    crc = ~crc;
+    for(std::size_t idx(0); idx < size; ++idx)
+    {
+        crc = g_table[(crc ^ s[idx]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+
+/** \brief Build the name of a segment file.
+ *
+ * The identifier is zero padded so the files sort by identifier.
+ *
+ * \param[in] path  The spool directory.
+ * \param[in] id  The segment identifier.
+ *
+ * \return The path to the segment file.
+ */
+std::string segment_filename(std::string const & path, std::uint64_t id)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llu", static_cast<unsigned long long>(id));
+    return path + '/' + name + SEGMENT_EXTENSION;
+}
+
+
+/** \brief Parse the identifier of a segment from its filename.
+ *
+ * \param[in] name  The filename (without the directory).
+ * \param[out] id  The segment identifier.
+ *
+ * \return true if \p name is the name of a segment file.
+ */
+bool parse_segment_filename(char const * name, std::uint64_t & id)
+{
+    std::size_t const ext_len(sizeof(SEGMENT_EXTENSION) - 1);
+    std::size_t const len(strlen(name));
+    if(len != 16 + ext_len
+    || strcmp(name + 16, SEGMENT_EXTENSION) != 0)
+    {
+        return false;
+    }
+    id = 0;
+    for(std::size_t idx(0); idx < 16; ++idx)
+    {
+        if(name[idx] < '0' || name[idx] > '9')
+        {
+            return false;
+        }
+        id = id * 10 + (name[idx] - '0');
+    }
+    return true;
+}
+
+
+/** \brief Close a directory handle.
+ */
+struct dir_deleter
+{
+    void operator () (DIR * dir) const
+    {
+        closedir(dir);
+    }
+};
+
+
+/** \brief Read a buffer at a given offset, retrying on short reads.
+ *
+ * \param[in] fd  The file descriptor to read from.
+ * \param[out] buffer  The buffer receiving the data.
+ * \param[in] size  The number of bytes to read.
+ * \param[in] offset  The offset in the file.
+ *
+ * \return true if all the bytes were read.
+ */
+bool pread_all(int fd, char * buffer, std::size_t size, off_t offset)
+{
+    while(size > 0)
+    {
+        ssize_t const r(pread(fd, buffer, size, offset));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return false;
+        }
+        if(r == 0)
+        {
+            errno = EIO;
+            return false;
+        }
+        buffer += r;
+        size -= r;
+        offset += r;
+    }
+    return true;
+}
+
+
+
+} // no name namespace
+
+
+
+mail_spool::segment::~segment()
+{
+    if(f_fd != -1)
+    {
+        close(f_fd);
+    }
+}
+
+
+/** \brief Initialize a spool.
+ *
+ * The spool is not usable until open() was called.
+ *
+ * \param[in] path  The directory holding the spool segments.
+ */
+mail_spool::mail_spool(std::string const & path)
+    : f_path(path)
+{
+    if(f_path.empty())
+    {
+        throw invalid_parameter("the mail spool path cannot be empty.");
+    }
+}
+
+
+mail_spool::~mail_spool()
+{
+}
+
+
+/** \brief Change the size at which a new segment gets started.
+ *
+ * A record larger than the segment size still gets written, alone
+ * in its segment.
+ *
+ * \param[in] size  The new segment size in bytes.
+ */
+void mail_spool::set_segment_size(std::uint64_t size)
+{
+    if(size == 0)
+    {
+        throw invalid_parameter("the mail spool segment size cannot be zero.");
+    }
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_segment_size = size;
+}
+
+
+/** \brief Save the large attachments in a blob store.
+ *
+ * The store has to be the same each time the spool gets used since
+ * the emails only hold the keys of their blobs. The store gets opened
+ * by the spool open() function.
+ *
+ * \param[in] store  The blob store or nullptr to save the data inline.
+ */
+void mail_spool::set_blob_store(blob_store::pointer_t store)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_blob_store = store;
+}
+
+
+blob_store::pointer_t mail_spool::get_blob_store() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_blob_store;
+}
+
+
+/** \brief Open the spool and load its index.
+ *
+ * This function creates the spool directory if it does not exist yet,
+ * then replays all the segments in order. If the process died while
+ * writing a record, the last segment ends with a partial record which
+ * gets truncated.
+ *
+ * \return true if the spool is ready.
+ */
+bool mail_spool::open()
+{
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+
+        if(f_opened)
+        {
+            return true;
+        }
+
+        if(f_blob_store != nullptr
+        && !f_blob_store->open())
+        {
+            return false;
+        }
+
+        if(mkdir(f_path.c_str(), 0700) != 0
+        && errno != EEXIST)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not create mail spool directory \""
+                << f_path
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+
+        std::vector<std::uint64_t> ids;
+        {
+            std::unique_ptr<DIR, dir_deleter> dir(opendir(f_path.c_str()));
+            if(dir == nullptr)
+            {
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "could not read mail spool directory \""
+                    << f_path
+                    << "\" (errno: "
+                    << e
+                    << ", "
+                    << strerror(e)
+                    << ")."
+                    << SNAP_LOG_SEND;
+                return false;
+            }
+            for(dirent * ent(readdir(dir.get())); ent != nullptr; ent = readdir(dir.get()))
+            {
+                std::uint64_t id(0);
+                if(parse_segment_filename(ent->d_name, id))
+                {
+                    ids.push_back(id);
+                }
+            }
+        }
+        std::sort(ids.begin(), ids.end());
+
+        for(std::size_t idx(0); idx < ids.size(); ++idx)
+        {
+            segment::pointer_t s(std::make_shared<segment>());
+            s->f_id = ids[idx];
+            s->f_path = segment_filename(f_path, s->f_id);
+            s->f_fd = ::open(s->f_path.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+            if(s->f_fd == -1)
+            {
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "could not open mail spool segment \""
+                    << s->f_path
+                    << "\" (errno: "
+                    << e
+                    << ", "
+                    << strerror(e)
+                    << ")."
+                    << SNAP_LOG_SEND;
+                return false;
+            }
+            f_segments[s->f_id] = s;
+            if(!replay(s, idx + 1 == ids.size()))
+            {
+                return false;
+            }
+        }
+
+        if(f_segments.empty())
+        {
+            if(!rotate())
+            {
+                return false;
+            }
+        }
+        else
+        {
+            f_current = f_segments.rbegin()->second;
+        }
+
+        f_opened = true;
+    }
+
+    remove_dead_segments();
+
+    return true;
+}
+
+
+/** \brief Add an email to the spool.
+ *
+ * The email is saved under its email key (see email::set_email_key()).
+ * If the spool already holds an email with that key, it gets replaced.
+ *
+ * The function returns once the email is on disk. Concurrent calls
+ * share the same fdatasync() call.
+ *
+ * \exception invalid_parameter
+ * The email must have a key.
+ *
+ * \param[in] e  The email to save.
+ *
+ * \return true if the email was saved.
+ */
+bool mail_spool::enqueue(email const & e)
+{
+    std::string const & key(e.get_email_key());
+    if(key.empty())
+    {
+        throw invalid_parameter("an email must have a key to be added to the mail spool.");
+    }
+
+    binary_spool_writer out;
+    out.set_blob_store(get_blob_store());
+    e.serialize(out);
+
+    std::uint64_t sequence(0);
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+
+        location loc;
+        if(!append(RECORD_EMAIL, key, out.get_iovec(), loc, sequence))
+        {
+            return false;
+        }
+        add_location(key, loc);
+    }
+
+    return commit(sequence);
+}
+
+
+/** \brief Remove an email from the spool.
+ *
+ * Call this function once the email was sent. It appends a tombstone
+ * to the spool so the email does not come back on the next open().
+ * The oldest segments which do not hold any emails anymore get deleted.
+ *
+ * \param[in] key  The key of the email to remove.
+ *
+ * \return true if the email was removed, false if it was not in the
+ * spool or the tombstone could not be saved.
+ */
+bool mail_spool::remove(std::string const & key)
+{
+    std::uint64_t sequence(0);
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+
+        if(f_index.find(key) == f_index.end())
+        {
+            return false;
+        }
+
+        location loc;
+        if(!append(RECORD_TOMBSTONE, key, std::vector<iovec>(), loc, sequence))
+        {
+            return false;
+        }
+        remove_location(key);
+    }
+
+    if(!commit(sequence))
+    {
+        return false;
+    }
+
+    remove_dead_segments();
+
+    return true;
+}
+
+
+/** \brief Check whether the spool holds an email.
+ *
+ * \param[in] key  The key of the email to check.
+ *
+ * \return true if the email is in the spool.
+ */
+bool mail_spool::contains(std::string const & key) const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_index.find(key) != f_index.end();
+}
+
+
+/** \brief Load an email from the spool.
+ *
+ * With \p headers_only, the record gets memory mapped instead of read
+ * so the bytes of the attachments are only read from the segment if
+ * email::load_attachments() gets called.
+ *
+ * \param[in] key  The key of the email to load.
+ * \param[out] e  The email receiving the data.
+ * \param[in] headers_only  Delay the loading of the attachments, see
+ * email::deserialize().
+ *
+ * \return true if the email was loaded.
+ */
+bool mail_spool::load(std::string const & key, email & e, bool headers_only) const
+{
+    location loc;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        auto const it(f_index.find(key));
+        if(it == f_index.end())
+        {
+            return false;
+        }
+        loc = it->second;
+    }
+
+    binary_spool_buffer::pointer_t buffer;
+    if(headers_only)
+    {
+        buffer = binary_spool_buffer::from_file(
+                      loc.f_segment->f_fd
+                    , loc.f_data_offset
+                    , loc.f_data_size);
+    }
+    else
+    {
+        std::string data(loc.f_data_size, '\0');
+        if(pread_all(loc.f_segment->f_fd, data.data(), data.length(), loc.f_data_offset))
+        {
+            buffer = binary_spool_buffer::from_string(std::move(data));
+        }
+    }
+    if(buffer == nullptr)
+    {
+        int const err(errno);
+        SNAP_LOG_ERROR
+            << "could not read email \""
+            << key
+            << "\" from mail spool segment \""
+            << loc.f_segment->f_path
+            << "\" (errno: "
+            << err
+            << ", "
+            << strerror(err)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    binary_spool_reader in(buffer);
+    in.set_blob_store(get_blob_store());
+    return e.deserialize(in, headers_only);
+}
+
+
+/** \brief Get the keys of all the emails in the spool.
+ *
+ * \return The list of keys, sorted.
+ */
+string_list_t mail_spool::get_keys() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    string_list_t result;
+    result.reserve(f_index.size());
+    for(auto const & it : f_index)
+    {
+        result.push_back(it.first);
+    }
+    return result;
+}
+
+
+/** \brief Get the number of emails in the spool.
+ *
+ * \return The number of emails.
+ */
+std::size_t mail_spool::size() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_index.size();
+}
+
+
+/** \brief Reclaim the space used by removed emails.
+ *
+ * The function starts with the oldest segment. If less than \p ratio
+ * of its bytes belong to emails still in the spool, those emails get
+ * copied to the current segment and the old segment gets deleted. The
+ * compaction stops at the first segment which is dense enough.
+ *
+ * Going from the oldest segment is required for correctness: a
+ * tombstone can only be dropped once the segments written before it
+ * are gone.
+ *
+ * \param[in] ratio  The ratio of live bytes under which a segment
+ * gets compacted.
+ *
+ * \return true if the compaction succeeded.
+ */
+bool mail_spool::compact(double ratio)
+{
+    for(;;)
+    {
+        std::uint64_t sequence(0);
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+
+            if(f_segments.empty())
+            {
+                return true;
+            }
+            segment::pointer_t s(f_segments.begin()->second);
+            if(s == f_current
+            || static_cast<double>(s->f_live_bytes) >= static_cast<double>(s->f_size) * ratio)
+            {
+                return true;
+            }
+
+            std::vector<std::string> keys;
+            for(auto const & it : f_index)
+            {
+                if(it.second.f_segment == s)
+                {
+                    keys.push_back(it.first);
+                }
+            }
+            for(auto const & key : keys)
+            {
+                location const old(f_index[key]);
+                std::string data(old.f_data_size, '\0');
+                if(!pread_all(s->f_fd, data.data(), data.length(), old.f_data_offset))
+                {
+                    int const e(errno);
+                    SNAP_LOG_ERROR
+                        << "could not read email \""
+                        << key
+                        << "\" from mail spool segment \""
+                        << s->f_path
+                        << "\" (errno: "
+                        << e
+                        << ", "
+                        << strerror(e)
+                        << ")."
+                        << SNAP_LOG_SEND;
+                    return false;
+                }
+                std::vector<iovec> iov(1);
+                iov[0].iov_base = data.data();
+                iov[0].iov_len = data.length();
+                location loc;
+                if(!append(RECORD_EMAIL, key, iov, loc, sequence))
+                {
+                    return false;
+                }
+                add_location(key, loc);
+            }
+        }
+
+        // the copies must be on disk before the old segment goes away
+        //
+        if(sequence != 0
+        && !commit(sequence))
+        {
+            return false;
+        }
+
+        remove_dead_segments();
+    }
+}
+
+
+/** \brief Remove the blobs not referenced by any email of the spool.
+ *
+ * The emails get loaded to gather the keys of their blobs; the blobs
+ * themselves are not loaded. The blobs saved or reused after this
+ * function started are kept even if not found in an email.
+ *
+ * \return The number of blobs removed.
+ */
+std::size_t mail_spool::collect_blobs()
+{
+    blob_store::pointer_t const store(get_blob_store());
+    if(store == nullptr)
+    {
+        return 0;
+    }
+
+    // the modification times of the blobs are compared in seconds so
+    // keep anything saved during the second before we started
+    //
+    time_t const start(time(nullptr) - 1);
+
+    blob_store::key_set_t referenced;
+    auto add_key([&referenced](attachment const & a)
+        {
+            attachment_payload::pointer_t const payload(a.get_payload());
+            if(payload != nullptr
+            && payload->is_blob())
+            {
+                referenced.insert(payload->get_blob_key());
+            }
+        });
+    for(auto const & key : get_keys())
+    {
+        email e;
+        if(!load(key, e))
+        {
+            // an email we cannot read may still reference blobs
+            //
+            if(contains(key))
+            {
+                SNAP_LOG_ERROR
+                    << "could not load email \""
+                    << key
+                    << "\" while collecting blobs; no blobs removed."
+                    << SNAP_LOG_SEND;
+                return 0;
+            }
+            continue;
+        }
+        for(int idx(0); idx < e.get_attachment_count(); ++idx)
+        {
+            attachment const & a(e.get_attachment(idx));
+            add_key(a);
+            for(int sub(0); sub < a.get_related_count(); ++sub)
+            {
+                add_key(a.get_related(sub));
+            }
+        }
+    }
+
+    return store->collect_garbage(referenced, start);
+}
+
+
+/** \brief Replay the records of a segment.
+ *
+ * The function updates the index with the records found in the segment.
+ *
+ * A bad or partial record in the last segment means the process died
+ * while writing it. That record never got committed so it gets
+ * truncated. In any other segment, it means the data got damaged;
+ * the rest of that segment is ignored.
+ *
+ * \param[in] s  The segment to replay.
+ * \param[in] last  Whether \p s is the last segment.
+ *
+ * \return true unless an I/O error occurred.
+ */
+bool mail_spool::replay(segment::pointer_t s, bool last)
+{
+    std::uint64_t offset(0);
+    {
+        binary_spool_buffer::pointer_t buffer(binary_spool_buffer::from_file(s->f_path));
+        if(buffer == nullptr)
+        {
+            return false;
+        }
+        std::string_view const data(buffer->get_data());
+        binary_spool_reader in(buffer);
+        while(offset < data.length())
+        {
+            std::uint32_t magic(0);
+            std::uint8_t type(0);
+            std::string_view key;
+            std::string_view record_data;
+            std::uint32_t crc(0);
+            if(!in.read(magic)
+            || memcmp(&magic, RECORD_MAGIC, sizeof(magic)) != 0
+            || !in.read(type)
+            || (type != RECORD_EMAIL && type != RECORD_TOMBSTONE)
+            || !in.read(key)
+            || !in.read_data(record_data))
+            {
+                break;
+            }
+            std::size_t const crc_offset(in.get_offset());
+            if(!in.read(crc)
+            || crc != crc32(0, data.data() + offset + sizeof(magic), crc_offset - offset - sizeof(magic)))
+            {
+                break;
+            }
+
+            std::string const k(key);
+            if(type == RECORD_EMAIL)
+            {
+                location loc;
+                loc.f_segment = s;
+                loc.f_data_offset = record_data.data() - data.data();
+                loc.f_data_size = record_data.length();
+                loc.f_record_size = in.get_offset() - offset;
+                add_location(k, loc);
+            }
+            else
+            {
+                remove_location(k);
+            }
+            offset = in.get_offset();
+        }
+
+        if(offset == data.length())
+        {
+            s->f_size = offset;
+            return true;
+        }
+    }
+
+    if(!last)
+    {
+        SNAP_LOG_ERROR
+            << "mail spool segment \""
+            << s->f_path
+            << "\" is corrupted at offset "
+            << offset
+            << "; ignoring the rest of that segment."
+            << SNAP_LOG_SEND;
+        s->f_size = offset;
+        return true;
+    }
+
+    SNAP_LOG_WARNING
+        << "truncating partial record at offset "
+        << offset
+        << " of mail spool segment \""
+        << s->f_path
+        << "\"."
+        << SNAP_LOG_SEND;
+    if(ftruncate(s->f_fd, offset) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not truncate mail spool segment \""
+            << s->f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    s->f_size = offset;
+    return true;
+}
+
+
+/** \brief Save the location of an email in the index.
+ *
+ * If the email was already in the index, the previous record becomes
+ * dead.
+ *
+ * \param[in] key  The key of the email.
+ * \param[in] loc  The location of the email record.
+ */
+void mail_spool::add_location(std::string const & key, location const & loc)
+{
+    remove_location(key);
+
+    f_index[key] = loc;
+    ++loc.f_segment->f_live_count;
+    loc.f_segment->f_live_bytes += loc.f_record_size;
+}
+
+
+/** \brief Remove an email from the index.
+ *
+ * \param[in] key  The key of the email to remove.
+ */
+void mail_spool::remove_location(std::string const & key)
+{
+    auto const it(f_index.find(key));
+    if(it == f_index.end())
+    {
+        return;
+    }
+
+    // the caller already appended the record replacing this one (a new
+    // copy or a tombstone); the segment cannot be deleted before that
+    // record is on disk (see remove_dead_segments())
+    //
+    segment::pointer_t s(it->second.f_segment);
+    --s->f_live_count;
+    s->f_live_bytes -= it->second.f_record_size;
+    s->f_release_sequence = f_written;
+    f_index.erase(it);
+}
+
+
+/** \brief Append one record to the current segment.
+ *
+ * The caller must hold f_mutex. The record is written but not yet
+ * synced; pass the returned \p sequence to commit() to wait for the
+ * data to be on disk.
+ *
+ * \exception libmimemail_logic_error
+ * The spool must be opened first.
+ *
+ * \param[in] type  The type of record.
+ * \param[in] key  The key of the email.
+ * \param[in] data  The serialized email, empty for a tombstone.
+ * \param[out] loc  The location of the new record.
+ * \param[out] sequence  The write sequence number of the new record.
+ *
+ * \return true if the record was written.
+ */
+bool mail_spool::append(
+      std::uint8_t type
+    , std::string const & key
+    , std::vector<iovec> const & data
+    , location & loc
+    , std::uint64_t & sequence)
+{
+    if(f_current == nullptr)
+    {
+        throw libmimemail_logic_error("mail_spool::open() must be called first.");
+    }
+
+    std::uint64_t data_size(0);
+    for(auto const & v : data)
+    {
+        data_size += v.iov_len;
+    }
+    std::uint64_t const record_size(RECORD_OVERHEAD + key.length() + data_size);
+
+    if(f_current->f_size > 0
+    && f_current->f_size + record_size > f_segment_size)
+    {
+        if(!rotate())
+        {
+            return false;
+        }
+    }
+
+    char header[4 + 1 + 4];
+    memcpy(header, RECORD_MAGIC, 4);
+    header[4] = static_cast<char>(type);
+    std::uint32_t const key_size(htole32(static_cast<std::uint32_t>(key.length())));
+    memcpy(header + 5, &key_size, sizeof(key_size));
+    std::uint64_t const size(htole64(data_size));
+
+    std::uint32_t crc(crc32(0, header + 4, sizeof(header) - 4));
+    crc = crc32(crc, key.data(), key.length());
+    crc = crc32(crc, &size, sizeof(size));
+    for(auto const & v : data)
+    {
+        crc = crc32(crc, v.iov_base, v.iov_len);
+    }
+    crc = htole32(crc);
+
+    std::vector<iovec> iov;
+    iov.reserve(data.size() + 4);
+    iov.push_back({ header, sizeof(header) });
+    iov.push_back({ const_cast<char *>(key.data()), key.length() });
+    iov.push_back({ const_cast<std::uint64_t *>(&size), sizeof(size) });
+    iov.insert(iov.end(), data.begin(), data.end());
+    iov.push_back({ &crc, sizeof(crc) });
+
+    fd_mime_sink sink(f_current->f_fd);
+    if(!sink.write(iov.data(), static_cast<int>(iov.size())))
+    {
+        // do not leave a partial record behind, the next records would
+        // otherwise be lost on replay
+        //
+        if(ftruncate(f_current->f_fd, f_current->f_size) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not truncate mail spool segment \""
+                << f_current->f_path
+                << "\" after a failed write (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << "); starting a new segment."
+                << SNAP_LOG_SEND;
+            rotate();
+        }
+        return false;
+    }
+
+    loc.f_segment = f_current;
+    loc.f_data_offset = f_current->f_size + sizeof(header) + key.length() + sizeof(size);
+    loc.f_data_size = data_size;
+    loc.f_record_size = record_size;
+
+    f_current->f_size += record_size;
+    sequence = ++f_written;
+
+    return true;
+}
+
+
+/** \brief Start a new segment.
+ *
+ * The caller must hold f_mutex. The current segment gets synced first
+ * so commit() only ever has to sync the current segment.
+ *
+ * \return true if the new segment was created.
+ */
+bool mail_spool::rotate()
+{
+    if(f_current != nullptr
+    && f_current->f_size > 0
+    && fdatasync(f_current->f_fd) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not sync mail spool segment \""
+            << f_current->f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    segment::pointer_t s(std::make_shared<segment>());
+    s->f_id = f_segments.empty() ? 1 : f_segments.rbegin()->first + 1;
+    s->f_path = segment_filename(f_path, s->f_id);
+    s->f_fd = ::open(s->f_path.c_str(), O_RDWR | O_APPEND | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if(s->f_fd == -1)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create mail spool segment \""
+            << s->f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    sync_directory();
+
+    f_segments[s->f_id] = s;
+    f_current = s;
+
+    return true;
+}
+
+
+/** \brief Wait until a record is on disk.
+ *
+ * This is the group commit. If no other thread is syncing, the caller
+ * becomes the leader: it syncs the current segment, which covers all
+ * the records written so far, including those of the threads waiting
+ * behind it. Otherwise the caller waits for the leader and checks again.
+ *
+ * The fdatasync() happens without holding f_mutex so other threads
+ * can keep appending records meanwhile; those get synced by the next
+ * leader.
+ *
+ * Once an fdatasync() failed, the state of the file is unknown so all
+ * further commits fail.
+ *
+ * \param[in] sequence  The sequence number returned by append().
+ *
+ * \return true if the record is on disk.
+ */
+bool mail_spool::commit(std::uint64_t sequence)
+{
+    std::unique_lock<std::mutex> sync_lock(f_sync_mutex);
+    for(;;)
+    {
+        if(f_sync_failed)
+        {
+            return false;
+        }
+        if(f_synced >= sequence)
+        {
+            return true;
+        }
+        if(!f_syncing)
+        {
+            break;
+        }
+        f_synced_cond.wait(sync_lock);
+    }
+    f_syncing = true;
+    sync_lock.unlock();
+
+    segment::pointer_t s;
+    std::uint64_t target(0);
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        s = f_current;
+        target = f_written;
+    }
+    bool const synced(fdatasync(s->f_fd) == 0);
+    int const e(errno);
+
+    sync_lock.lock();
+    f_syncing = false;
+    if(synced)
+    {
+        f_synced = std::max(f_synced, target);
+    }
+    else
+    {
+        f_sync_failed = true;
+        SNAP_LOG_ERROR
+            << "could not sync mail spool segment \""
+            << s->f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+    }
+    f_synced_cond.notify_all();
+
+    return synced;
+}
+
+
+/** \brief Delete the oldest segments which are empty.
+ *
+ * Only the oldest segments get deleted: a segment without emails may
+ * still hold the tombstones of emails found in older segments.
+ *
+ * A segment also stays until the records which replaced its emails
+ * (the copies made by compact() or by an enqueue() of the same key)
+ * are on disk. Otherwise a concurrent remove() could delete the segment
+ * while those records are not yet synced and a crash would lose the
+ * emails.
+ */
+void mail_spool::remove_dead_segments()
+{
+    std::uint64_t synced(0);
+    {
+        std::lock_guard<std::mutex> sync_lock(f_sync_mutex);
+        synced = f_synced;
+    }
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    bool removed(false);
+    while(!f_segments.empty())
+    {
+        segment::pointer_t s(f_segments.begin()->second);
+        if(s == f_current
+        || s->f_live_count != 0
+        || s->f_release_sequence > synced)
+        {
+            break;
+        }
+        if(unlink(s->f_path.c_str()) != 0)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "could not delete mail spool segment \""
+                << s->f_path
+                << "\" (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            break;
+        }
+        f_segments.erase(f_segments.begin());
+        removed = true;
+    }
+
+    if(removed)
+    {
+        sync_directory();
+    }
+}
+
+
+/** \brief Sync the spool directory.
+ *
+ * Creating or deleting a segment is only durable once the directory
+ * itself was synced.
+ */
+void mail_spool::sync_directory() const
+{
+    snapdev::raii_fd_t dir(::open(f_path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if(dir.get() == -1
+    || fsync(dir.get()) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_WARNING
+            << "could not sync mail spool directory \""
+            << f_path
+            << "\" (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+    }
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,132 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/blob_store.h>
+#include    <libmimemail/email.h>
+
+
+// C++
+//
+#include    <condition_variable>
+#include    <map>
+#include    <mutex>
+
+
+
+namespace libmimemail
+{
+
+
+
+class mail_spool
+{
+public:
+    typedef std::shared_ptr<mail_spool>     pointer_t;
+
+    static constexpr std::uint64_t const    DEFAULT_SEGMENT_SIZE = 64 * 1024 * 1024;
+    static constexpr double const           DEFAULT_COMPACTION_RATIO = 0.5;
+
+                            mail_spool(std::string const & path);
+                            mail_spool(mail_spool const &) = delete;
+                            ~mail_spool();
+
+    mail_spool &            operator = (mail_spool const &) = delete;
+
+    void                    set_segment_size(std::uint64_t size);
+    void                    set_blob_store(blob_store::pointer_t store);
+    blob_store::pointer_t   get_blob_store() const;
+    bool                    open();
+
+    bool                    enqueue(email const & e);
+    bool                    remove(std::string const & key);
+    bool                    contains(std::string const & key) const;
+    bool                    load(std::string const & key, email & e, bool headers_only = false) const;
+    string_list_t           get_keys() const;
+    std::size_t             size() const;
+    bool                    compact(double ratio = DEFAULT_COMPACTION_RATIO);
+    std::size_t             collect_blobs();
+
+private:
+    struct segment
+    {
+        typedef std::shared_ptr<segment>    pointer_t;
+
+                                ~segment();
+
+        std::uint64_t           f_id = 0;
+        std::string             f_path = std::string();
+        int                     f_fd = -1;
+        std::uint64_t           f_size = 0;
+        std::uint64_t           f_live_bytes = 0;
+        std::size_t             f_live_count = 0;
+        std::uint64_t           f_release_sequence = 0;     // record which superseded the last email
+    };
+    typedef std::map<std::uint64_t, segment::pointer_t>     segment_map_t;
+
+    struct location
+    {
+        segment::pointer_t      f_segment = segment::pointer_t();
+        std::uint64_t           f_data_offset = 0;
+        std::uint64_t           f_data_size = 0;
+        std::uint64_t           f_record_size = 0;
+    };
+    typedef std::map<std::string, location>                 index_t;
+
+    bool                    replay(segment::pointer_t s, bool last);
+    void                    add_location(std::string const & key, location const & loc);
+    void                    remove_location(std::string const & key);
+    bool                    append(
+                                  std::uint8_t type
+                                , std::string const & key
+                                , std::vector<iovec> const & data
+                                , location & loc
+                                , std::uint64_t & sequence);
+    bool                    rotate();
+    bool                    commit(std::uint64_t sequence);
+    void                    remove_dead_segments();
+    void                    sync_directory() const;
+
+    std::string             f_path = std::string();
+    std::uint64_t           f_segment_size = DEFAULT_SEGMENT_SIZE;
+    blob_store::pointer_t   f_blob_store = blob_store::pointer_t();
+
+    // f_mutex protects the segments, the index and the writes
+    //
+    mutable std::mutex      f_mutex = std::mutex();
+    segment_map_t           f_segments = segment_map_t();
+    segment::pointer_t      f_current = segment::pointer_t();
+    index_t                 f_index = index_t();
+    std::uint64_t           f_written = 0;
+    bool                    f_opened = false;
+
+    // the group commit state
+    //
+    std::mutex              f_sync_mutex = std::mutex();
+    std::condition_variable f_synced_cond = std::condition_variable();
+    std::uint64_t           f_synced = 0;
+    bool                    f_syncing = false;
+    bool                    f_sync_failed = false;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
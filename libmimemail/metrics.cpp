@@ -0,0 +1,669 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Latency histograms and counters of the library hot paths.
+ *
+ * When sending gets slow, the metrics tell where the time goes: the
+ * HTML to text conversion, the address parsing, the encoding, starting
+ * sendmail, writing to its pipe, waiting for it to exit, the MX lookups
+ * or the (de)serialization of the emails.
+ *
+ * The metrics are off by default. While off, each instrumented spot
+ * costs one relaxed load of a flag and nothing gets recorded.
+ *
+ * While on, each thread records in its own set of counters so threads
+ * sending in parallel do not share cache lines. A snapshot adds up the
+ * counters of all the threads. A callback can also be registered to
+ * receive each latency as it gets measured (i.e. to feed it to your own
+ * monitoring system).
+ */
+
+// self
+//
+#include    "libmimemail/metrics.h"
+
+#include    "libmimemail/exception.h"
+
+
+// C++
+//
+#include    <algorithm>
+#include    <memory>
+#include    <mutex>
+#include    <vector>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+std::atomic<bool>           g_metrics_enabled(false);
+
+
+
+namespace
+{
+
+
+
+constexpr std::size_t const     STAGE_COUNT = static_cast<std::size_t>(metric_stage_t::METRIC_STAGE_max);
+constexpr std::size_t const     COUNTER_COUNT = static_cast<std::size_t>(metric_counter_t::METRIC_COUNTER_max);
+
+
+/** \brief The histogram of one stage as updated by its thread.
+ *
+ * Only the owner thread writes to these values. They are atomic because
+ * get_metrics() reads them from another thread.
+ */
+struct thread_histogram
+{
+    std::atomic<std::uint64_t>  f_count = 0;
+    std::atomic<std::uint64_t>  f_total = 0;
+    std::atomic<std::uint64_t>  f_max = 0;
+    std::atomic<std::uint64_t>  f_buckets[latency_histogram::BUCKET_COUNT] = {};
+};
+
+
+struct thread_metrics
+{
+    thread_histogram            f_histograms[STAGE_COUNT] = {};
+    std::atomic<std::uint64_t>  f_counters[COUNTER_COUNT] = {};
+};
+
+
+void add(std::atomic<std::uint64_t> & value, std::uint64_t increment)
+{
+    // single writer: a load and a store avoid a locked instruction
+    //
+    value.store(value.load(std::memory_order_relaxed) + increment, std::memory_order_relaxed);
+}
+
+
+void add_to_snapshot(thread_metrics const & t, metrics_snapshot & snapshot)
+{
+    for(std::size_t stage(0); stage < STAGE_COUNT; ++stage)
+    {
+        thread_histogram const & h(t.f_histograms[stage]);
+        latency_histogram & l(snapshot.get_histogram(static_cast<metric_stage_t>(stage)));
+        for(std::size_t idx(0); idx < latency_histogram::BUCKET_COUNT; ++idx)
+        {
+            l.add_bucket(idx, h.f_buckets[idx].load(std::memory_order_relaxed));
+        }
+        l.add_totals(
+                  h.f_count.load(std::memory_order_relaxed)
+                , h.f_total.load(std::memory_order_relaxed)
+                , h.f_max.load(std::memory_order_relaxed));
+    }
+    for(std::size_t counter(0); counter < COUNTER_COUNT; ++counter)
+    {
+        snapshot.add_counter(
+                  static_cast<metric_counter_t>(counter)
+                , t.f_counters[counter].load(std::memory_order_relaxed));
+    }
+}
+
+
+/** \brief All the threads which recorded metrics.
+ *
+ * The metrics of a thread which exits get added to f_exited so they
+ * remain part of the snapshots.
+ */
+struct metrics_registry
+{
+    std::mutex                  f_mutex = std::mutex();
+    std::vector<thread_metrics *>
+                                f_threads = std::vector<thread_metrics *>();
+    metrics_snapshot            f_exited = metrics_snapshot();
+    std::shared_ptr<metrics_callback_t const>
+                                f_callback = std::shared_ptr<metrics_callback_t const>();
+};
+
+
+metrics_registry & get_registry()
+{
+    static metrics_registry g_registry;
+    return g_registry;
+}
+
+
+/** \brief Register the metrics of the current thread.
+ *
+ * The object lives in a thread_local so it gets created the first time
+ * the thread records a metric and destroyed when the thread exits
+ * (before the registry: objects with a thread storage duration are
+ * destroyed before any static object).
+ */
+class thread_metrics_holder
+{
+public:
+    thread_metrics_holder()
+    {
+        metrics_registry & r(get_registry());
+        std::lock_guard<std::mutex> lock(r.f_mutex);
+        r.f_threads.push_back(&f_metrics);
+    }
+
+    thread_metrics_holder(thread_metrics_holder const &) = delete;
+
+    ~thread_metrics_holder()
+    {
+        metrics_registry & r(get_registry());
+        std::lock_guard<std::mutex> lock(r.f_mutex);
+        add_to_snapshot(f_metrics, r.f_exited);
+        auto it(std::find(r.f_threads.begin(), r.f_threads.end(), &f_metrics));
+        if(it != r.f_threads.end())
+        {
+            r.f_threads.erase(it);
+        }
+    }
+
+    thread_metrics_holder & operator = (thread_metrics_holder const &) = delete;
+
+    thread_metrics & get()
+    {
+        return f_metrics;
+    }
+
+private:
+    thread_metrics              f_metrics = thread_metrics();
+};
+
+
+thread_metrics & get_thread_metrics()
+{
+    thread_local thread_metrics_holder g_holder;
+    return g_holder.get();
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Get the name of a stage.
+ *
+ * The names are meant to be used as metric names (i.e. in a monitoring
+ * system) so they are lowercase with underscores.
+ *
+ * \param[in] stage  The stage of which the name is wanted.
+ *
+ * \return The name of the stage.
+ */
+char const * metric_stage_name(metric_stage_t stage)
+{
+    switch(stage)
+    {
+    case metric_stage_t::METRIC_STAGE_SEND:
+        return "send";
+
+    case metric_stage_t::METRIC_STAGE_RENDER:
+        return "render";
+
+    case metric_stage_t::METRIC_STAGE_HTML_TO_TEXT:
+        return "html_to_text";
+
+    case metric_stage_t::METRIC_STAGE_ADDRESS_PARSING:
+        return "address_parsing";
+
+    case metric_stage_t::METRIC_STAGE_QUOTED_PRINTABLE:
+        return "quoted_printable";
+
+    case metric_stage_t::METRIC_STAGE_BASE64:
+        return "base64";
+
+    case metric_stage_t::METRIC_STAGE_SENDMAIL_START:
+        return "sendmail_start";
+
+    case metric_stage_t::METRIC_STAGE_PIPE_WRITE:
+        return "pipe_write";
+
+    case metric_stage_t::METRIC_STAGE_SENDMAIL_WAIT:
+        return "sendmail_wait";
+
+    case metric_stage_t::METRIC_STAGE_MX_LOOKUP:
+        return "mx_lookup";
+
+    case metric_stage_t::METRIC_STAGE_SERIALIZE:
+        return "serialize";
+
+    case metric_stage_t::METRIC_STAGE_DESERIALIZE:
+        return "deserialize";
+
+    case metric_stage_t::METRIC_STAGE_DKIM_SIGN:
+        return "dkim_sign";
+
+    case metric_stage_t::METRIC_STAGE_max:
+        break;
+
+    }
+
+    throw libmimemail_out_of_range("metric_stage_name(): unknown stage.");
+}
+
+
+/** \brief Get the name of a counter.
+ *
+ * \param[in] counter  The counter of which the name is wanted.
+ *
+ * \return The name of the counter.
+ */
+char const * metric_counter_name(metric_counter_t counter)
+{
+    switch(counter)
+    {
+    case metric_counter_t::METRIC_COUNTER_EMAILS_SENT:
+        return "emails_sent";
+
+    case metric_counter_t::METRIC_COUNTER_EMAILS_FAILED:
+        return "emails_failed";
+
+    case metric_counter_t::METRIC_COUNTER_BYTES_SENT:
+        return "bytes_sent";
+
+    case metric_counter_t::METRIC_COUNTER_BYTES_RENDERED:
+        return "bytes_rendered";
+
+    case metric_counter_t::METRIC_COUNTER_MX_LOOKUPS:
+        return "mx_lookups";
+
+    case metric_counter_t::METRIC_COUNTER_MX_LOOKUP_FAILURES:
+        return "mx_lookup_failures";
+
+    case metric_counter_t::METRIC_COUNTER_EMAILS_SERIALIZED:
+        return "emails_serialized";
+
+    case metric_counter_t::METRIC_COUNTER_BYTES_SERIALIZED:
+        return "bytes_serialized";
+
+    case metric_counter_t::METRIC_COUNTER_EMAILS_DESERIALIZED:
+        return "emails_deserialized";
+
+    case metric_counter_t::METRIC_COUNTER_BYTES_DESERIALIZED:
+        return "bytes_deserialized";
+
+    case metric_counter_t::METRIC_COUNTER_max:
+        break;
+
+    }
+
+    throw libmimemail_out_of_range("metric_counter_name(): unknown counter.");
+}
+
+
+/** \brief Add one duration to the histogram.
+ *
+ * \param[in] nanoseconds  The duration to add.
+ */
+void latency_histogram::add(std::uint64_t nanoseconds)
+{
+    ++f_count;
+    f_total += nanoseconds;
+    f_max = std::max(f_max, nanoseconds);
+    ++f_buckets[get_bucket_index(nanoseconds)];
+}
+
+
+/** \brief Add a number of durations to one bucket.
+ *
+ * This is used to build a histogram from counters saved elsewhere. The
+ * count, total and maximum are not updated; use add_totals() for those.
+ *
+ * \exception libmimemail_out_of_range
+ * The index must be less than BUCKET_COUNT.
+ *
+ * \param[in] idx  The index of the bucket.
+ * \param[in] count  The number of durations to add to that bucket.
+ */
+void latency_histogram::add_bucket(std::size_t idx, std::uint64_t count)
+{
+    if(idx >= BUCKET_COUNT)
+    {
+        throw libmimemail_out_of_range("latency_histogram::add_bucket(): bucket index out of range.");
+    }
+    f_buckets[idx] += count;
+}
+
+
+/** \brief Add to the count, total and maximum.
+ *
+ * This is the other half of add_bucket().
+ *
+ * \param[in] count  The number of durations to add.
+ * \param[in] total  The sum of those durations in nanoseconds.
+ * \param[in] max  The longest of those durations.
+ */
+void latency_histogram::add_totals(std::uint64_t count, std::uint64_t total, std::uint64_t max)
+{
+    f_count += count;
+    f_total += total;
+    f_max = std::max(f_max, max);
+}
+
+
+/** \brief Add the durations of another histogram to this one.
+ *
+ * \param[in] rhs  The histogram to add to this one.
+ */
+void latency_histogram::merge(latency_histogram const & rhs)
+{
+    f_count += rhs.f_count;
+    f_total += rhs.f_total;
+    f_max = std::max(f_max, rhs.f_max);
+    for(std::size_t idx(0); idx < BUCKET_COUNT; ++idx)
+    {
+        f_buckets[idx] += rhs.f_buckets[idx];
+    }
+}
+
+
+std::uint64_t latency_histogram::get_count() const
+{
+    return f_count;
+}
+
+
+/** \brief Get the sum of all the durations.
+ *
+ * \return The total in nanoseconds.
+ */
+std::uint64_t latency_histogram::get_total() const
+{
+    return f_total;
+}
+
+
+std::uint64_t latency_histogram::get_max() const
+{
+    return f_max;
+}
+
+
+std::uint64_t latency_histogram::get_mean() const
+{
+    return f_count == 0 ? 0 : f_total / f_count;
+}
+
+
+/** \brief Get an approximation of a percentile.
+ *
+ * The result is the limit of the bucket in which the percentile falls,
+ * so it is at most twice the real value. It never goes over the
+ * maximum duration.
+ *
+ * \param[in] percent  The percentile, from 0.0 to 100.0.
+ *
+ * \return The duration in nanoseconds, 0 if the histogram is empty.
+ */
+std::uint64_t latency_histogram::get_percentile(double percent) const
+{
+    if(f_count == 0)
+    {
+        return 0;
+    }
+
+    double const wanted(static_cast<double>(f_count) * std::clamp(percent, 0.0, 100.0) / 100.0);
+    std::uint64_t seen(0);
+    for(std::size_t idx(0); idx < BUCKET_COUNT; ++idx)
+    {
+        seen += f_buckets[idx];
+        if(static_cast<double>(seen) >= wanted
+        && seen > 0)
+        {
+            return std::min(get_bucket_limit(idx), f_max);
+        }
+    }
+    return f_max;
+}
+
+
+std::uint64_t latency_histogram::get_bucket(std::size_t idx) const
+{
+    if(idx >= BUCKET_COUNT)
+    {
+        throw libmimemail_out_of_range("latency_histogram::get_bucket(): bucket index out of range.");
+    }
+    return f_buckets[idx];
+}
+
+
+/** \brief Get the bucket of a duration.
+ *
+ * \param[in] nanoseconds  The duration.
+ *
+ * \return The index of the bucket used to count \p nanoseconds.
+ */
+std::size_t latency_histogram::get_bucket_index(std::uint64_t nanoseconds)
+{
+    if(nanoseconds == 0)
+    {
+        return 0;
+    }
+    std::size_t const idx(64 - __builtin_clzll(nanoseconds));
+    return std::min(idx, BUCKET_COUNT - 1);
+}
+
+
+/** \brief Get the upper limit of a bucket.
+ *
+ * \param[in] idx  The index of the bucket.
+ *
+ * \return The largest duration counted in that bucket, in nanoseconds.
+ */
+std::uint64_t latency_histogram::get_bucket_limit(std::size_t idx)
+{
+    if(idx >= BUCKET_COUNT - 1)
+    {
+        return UINT64_MAX;
+    }
+    return (static_cast<std::uint64_t>(1) << idx) - 1;
+}
+
+
+latency_histogram const & metrics_snapshot::get_histogram(metric_stage_t stage) const
+{
+    std::size_t const idx(static_cast<std::size_t>(stage));
+    if(idx >= STAGE_COUNT)
+    {
+        throw libmimemail_out_of_range("metrics_snapshot::get_histogram(): unknown stage.");
+    }
+    return f_histograms[idx];
+}
+
+
+latency_histogram & metrics_snapshot::get_histogram(metric_stage_t stage)
+{
+    std::size_t const idx(static_cast<std::size_t>(stage));
+    if(idx >= STAGE_COUNT)
+    {
+        throw libmimemail_out_of_range("metrics_snapshot::get_histogram(): unknown stage.");
+    }
+    return f_histograms[idx];
+}
+
+
+std::uint64_t metrics_snapshot::get_counter(metric_counter_t counter) const
+{
+    std::size_t const idx(static_cast<std::size_t>(counter));
+    if(idx >= COUNTER_COUNT)
+    {
+        throw libmimemail_out_of_range("metrics_snapshot::get_counter(): unknown counter.");
+    }
+    return f_counters[idx];
+}
+
+
+void metrics_snapshot::add_counter(metric_counter_t counter, std::uint64_t value)
+{
+    std::size_t const idx(static_cast<std::size_t>(counter));
+    if(idx >= COUNTER_COUNT)
+    {
+        throw libmimemail_out_of_range("metrics_snapshot::add_counter(): unknown counter.");
+    }
+    f_counters[idx] += value;
+}
+
+
+/** \brief Turn the metrics on or off.
+ *
+ * The metrics are off by default. Turning them off does not clear the
+ * values already recorded; use reset_metrics() for that.
+ *
+ * \param[in] enabled  Whether the metrics get recorded.
+ */
+void set_metrics_enabled(bool enabled)
+{
+    g_metrics_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+
+/** \brief Register a function called with each latency measured.
+ *
+ * The callback is called from the thread which measured the latency,
+ * right after it was added to the histograms. It has to be thread safe
+ * if emails get sent from several threads. It is only called while the
+ * metrics are enabled.
+ *
+ * \param[in] callback  The function to call, or nullptr to remove it.
+ */
+void set_metrics_callback(metrics_callback_t callback)
+{
+    std::shared_ptr<metrics_callback_t const> c;
+    if(callback != nullptr)
+    {
+        c = std::make_shared<metrics_callback_t const>(std::move(callback));
+    }
+
+    metrics_registry & r(get_registry());
+    std::atomic_store(&r.f_callback, c);
+}
+
+
+/** \brief Get the metrics recorded so far by all the threads.
+ *
+ * A snapshot is not atomic: a thread recording while the snapshot is
+ * taken may have its latest entry counted in one value and not yet in
+ * another.
+ *
+ * \return A copy of the metrics.
+ */
+metrics_snapshot get_metrics()
+{
+    metrics_registry & r(get_registry());
+    std::lock_guard<std::mutex> lock(r.f_mutex);
+    metrics_snapshot result(r.f_exited);
+    for(auto const * t : r.f_threads)
+    {
+        add_to_snapshot(*t, result);
+    }
+    return result;
+}
+
+
+/** \brief Clear all the metrics.
+ *
+ * This is best called while no email is being sent; a value recorded
+ * at the same time may survive the reset.
+ */
+void reset_metrics()
+{
+    metrics_registry & r(get_registry());
+    std::lock_guard<std::mutex> lock(r.f_mutex);
+    r.f_exited = metrics_snapshot();
+    for(auto * t : r.f_threads)
+    {
+        for(auto & h : t->f_histograms)
+        {
+            h.f_count.store(0, std::memory_order_relaxed);
+            h.f_total.store(0, std::memory_order_relaxed);
+            h.f_max.store(0, std::memory_order_relaxed);
+            for(auto & b : h.f_buckets)
+            {
+                b.store(0, std::memory_order_relaxed);
+            }
+        }
+        for(auto & c : t->f_counters)
+        {
+            c.store(0, std::memory_order_relaxed);
+        }
+    }
+}
+
+
+/** \brief Record the latency of a stage.
+ *
+ * This is called by the metrics_timer when it stops.
+ *
+ * \param[in] stage  The stage which was measured.
+ * \param[in] nanoseconds  The time the stage took.
+ */
+void record_latency(metric_stage_t stage, std::uint64_t nanoseconds)
+{
+    std::size_t const idx(static_cast<std::size_t>(stage));
+    if(idx >= STAGE_COUNT)
+    {
+        throw libmimemail_out_of_range("record_latency(): unknown stage.");
+    }
+
+    thread_histogram & h(get_thread_metrics().f_histograms[idx]);
+    add(h.f_count, 1);
+    add(h.f_total, nanoseconds);
+    if(nanoseconds > h.f_max.load(std::memory_order_relaxed))
+    {
+        h.f_max.store(nanoseconds, std::memory_order_relaxed);
+    }
+    add(h.f_buckets[latency_histogram::get_bucket_index(nanoseconds)], 1);
+
+    std::shared_ptr<metrics_callback_t const> callback(std::atomic_load(&get_registry().f_callback));
+    if(callback != nullptr)
+    {
+        (*callback)(stage, nanoseconds);
+    }
+}
+
+
+/** \brief Add a value to a counter.
+ *
+ * Use count_metric() which does nothing when the metrics are off.
+ *
+ * \param[in] counter  The counter to increment.
+ * \param[in] value  The value to add to the counter.
+ */
+void record_counter(metric_counter_t counter, std::uint64_t value)
+{
+    std::size_t const idx(static_cast<std::size_t>(counter));
+    if(idx >= COUNTER_COUNT)
+    {
+        throw libmimemail_out_of_range("record_counter(): unknown counter.");
+    }
+
+    add(get_thread_metrics().f_counters[idx], value);
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
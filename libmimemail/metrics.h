@@ -0,0 +1,200 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <array>
+#include    <atomic>
+#include    <chrono>
+#include    <cstdint>
+#include    <functional>
+
+
+
+namespace libmimemail
+{
+
+
+
+enum class metric_stage_t
+{
+    METRIC_STAGE_SEND,                  // email::send(), render + transport
+    METRIC_STAGE_RENDER,                // mime_writer::write_email()
+    METRIC_STAGE_HTML_TO_TEXT,          // html_to_text::convert()
+    METRIC_STAGE_ADDRESS_PARSING,       // tld_email_list::parse() of headers
+    METRIC_STAGE_QUOTED_PRINTABLE,      // quoted_printable_encode()
+    METRIC_STAGE_BASE64,                // base64_encoder::encode()
+    METRIC_STAGE_SENDMAIL_START,        // starting the sendmail process
+    METRIC_STAGE_PIPE_WRITE,            // writing the message to sendmail (sendmail_connection only)
+    METRIC_STAGE_SENDMAIL_WAIT,         // waiting for sendmail to exit (includes the write when blocking)
+    METRIC_STAGE_MX_LOOKUP,             // mail_exchangers DNS query
+    METRIC_STAGE_SERIALIZE,             // email::serialize()
+    METRIC_STAGE_DESERIALIZE,           // email::deserialize()
+    METRIC_STAGE_DKIM_SIGN,             // dkim_signer::sign()
+
+    METRIC_STAGE_max
+};
+
+
+enum class metric_counter_t
+{
+    METRIC_COUNTER_EMAILS_SENT,
+    METRIC_COUNTER_EMAILS_FAILED,
+    METRIC_COUNTER_BYTES_SENT,
+    METRIC_COUNTER_BYTES_RENDERED,
+    METRIC_COUNTER_MX_LOOKUPS,
+    METRIC_COUNTER_MX_LOOKUP_FAILURES,
+    METRIC_COUNTER_EMAILS_SERIALIZED,
+    METRIC_COUNTER_BYTES_SERIALIZED,
+    METRIC_COUNTER_EMAILS_DESERIALIZED,
+    METRIC_COUNTER_BYTES_DESERIALIZED,
+
+    METRIC_COUNTER_max
+};
+
+
+char const *                metric_stage_name(metric_stage_t stage);
+char const *                metric_counter_name(metric_counter_t counter);
+
+
+class latency_histogram
+{
+public:
+    // bucket N counts durations of less than 2^N nanoseconds which did
+    // not fit in bucket N - 1; the last bucket also gets anything longer
+    //
+    static constexpr std::size_t const  BUCKET_COUNT = 40;
+
+    void                    add(std::uint64_t nanoseconds);
+    void                    add_bucket(std::size_t idx, std::uint64_t count);
+    void                    add_totals(std::uint64_t count, std::uint64_t total, std::uint64_t max);
+    void                    merge(latency_histogram const & rhs);
+
+    std::uint64_t           get_count() const;
+    std::uint64_t           get_total() const;
+    std::uint64_t           get_max() const;
+    std::uint64_t           get_mean() const;
+    std::uint64_t           get_percentile(double percent) const;
+    std::uint64_t           get_bucket(std::size_t idx) const;
+
+    static std::size_t      get_bucket_index(std::uint64_t nanoseconds);
+    static std::uint64_t    get_bucket_limit(std::size_t idx);
+
+private:
+    std::uint64_t           f_count = 0;
+    std::uint64_t           f_total = 0;
+    std::uint64_t           f_max = 0;
+    std::array<std::uint64_t, BUCKET_COUNT>
+                            f_buckets = std::array<std::uint64_t, BUCKET_COUNT>();
+};
+
+
+class metrics_snapshot
+{
+public:
+    latency_histogram const &
+                            get_histogram(metric_stage_t stage) const;
+    latency_histogram &     get_histogram(metric_stage_t stage);
+    std::uint64_t           get_counter(metric_counter_t counter) const;
+    void                    add_counter(metric_counter_t counter, std::uint64_t value);
+
+private:
+    std::array<latency_histogram, static_cast<std::size_t>(metric_stage_t::METRIC_STAGE_max)>
+                            f_histograms = std::array<latency_histogram, static_cast<std::size_t>(metric_stage_t::METRIC_STAGE_max)>();
+    std::array<std::uint64_t, static_cast<std::size_t>(metric_counter_t::METRIC_COUNTER_max)>
+                            f_counters = std::array<std::uint64_t, static_cast<std::size_t>(metric_counter_t::METRIC_COUNTER_max)>();
+};
+
+
+typedef std::function<void(metric_stage_t stage, std::uint64_t nanoseconds)>
+                            metrics_callback_t;
+
+void                        set_metrics_enabled(bool enabled);
+void                        set_metrics_callback(metrics_callback_t callback);
+metrics_snapshot            get_metrics();
+void                        reset_metrics();
+
+void                        record_latency(metric_stage_t stage, std::uint64_t nanoseconds);
+void                        record_counter(metric_counter_t counter, std::uint64_t value);
+
+
+// the flag is read on each hot path so it is not hidden behind a call
+//
+extern std::atomic<bool>    g_metrics_enabled;
+
+
+inline bool metrics_enabled()
+{
+    return g_metrics_enabled.load(std::memory_order_relaxed);
+}
+
+
+inline void count_metric(metric_counter_t counter, std::uint64_t value = 1)
+{
+    if(metrics_enabled())
+    {
+        record_counter(counter, value);
+    }
+}
+
+
+class metrics_timer
+{
+public:
+    typedef std::chrono::steady_clock   clock_t;
+
+                            metrics_timer(metric_stage_t stage)
+                                : f_stage(stage)
+                                , f_running(metrics_enabled())
+                            {
+                                if(f_running)
+                                {
+                                    f_start = clock_t::now();
+                                }
+                            }
+                            metrics_timer(metrics_timer const &) = delete;
+                            ~metrics_timer()
+                            {
+                                stop();
+                            }
+
+    metrics_timer &         operator = (metrics_timer const &) = delete;
+
+    void                    stop()
+                            {
+                                if(f_running)
+                                {
+                                    f_running = false;
+                                    record_latency(
+                                          f_stage
+                                        , std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                                    clock_t::now() - f_start).count());
+                                }
+                            }
+
+private:
+    metric_stage_t          f_stage;
+    bool                    f_running = false;
+    clock_t::time_point     f_start = clock_t::time_point();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,1633 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Parse MIME messages.
+ *
+ * The mime_parser reads a MIME message (RFC 2045, 2046 and 5322) and
+ * calls a mime_handler for each entity it finds: part_begin() once the
+ * headers of an entity were read, part_data() with the body of the
+ * entities which are not multipart, and part_end() once the entity
+ * ended.
+ *
+ * The input can be fed in chunks of any size, as read from a socket.
+ * The parser only keeps the headers of the entity being read and, at
+ * the end of a chunk, the start of a line which may be a boundary
+ * delimiter. The body data is passed to the handler as views in the
+ * chunks so a multi-megabyte attachment does not get copied or held in
+ * memory by the parser.
+ *
+ * The mime_message uses the parser to build the tree of entities of a
+ * message which is fully in memory (i.e. a memory mapped file). In that
+ * case the headers and bodies are views in the input, nothing gets
+ * copied. The bodies are decoded (quoted-printable, base64) only when
+ * mime_entity::get_body() gets called.
+ */
+
+// self
+//
+#include    "libmimemail/mime_parser.h"
+
+#include    "libmimemail/base64.h"
+#include    "libmimemail/exception.h"
+#include    "libmimemail/quoted_printable.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// snapdev
+//
+#include    <snapdev/not_used.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cctype>
+#include    <cstring>
+
+
+// C
+//
+#include    <strings.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+// the longest line which may be a boundary delimiter: "--", the
+// boundary, "--" and some transport padding
+//
+constexpr std::size_t const     MAX_DELIMITER_LENGTH = 2 + mime_parser::MAX_BOUNDARY_LENGTH + 2 + 64;
+
+
+constexpr std::string_view const    g_cr = std::string_view("\r", 1);
+
+
+bool equal_names(std::string_view const & lhs, std::string_view const & rhs)
+{
+    return lhs.length() == rhs.length()
+        && strncasecmp(lhs.data(), rhs.data(), lhs.length()) == 0;
+}
+
+
+bool is_wsp(char c)
+{
+    return c == ' ' || c == '\t';
+}
+
+
+bool is_base64(char c)
+{
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '+' || c == '/';
+}
+
+
+std::string_view trim(std::string_view s)
+{
+    while(!s.empty() && (is_wsp(s.front()) || s.front() == '\r' || s.front() == '\n'))
+    {
+        s.remove_prefix(1);
+    }
+    while(!s.empty() && (is_wsp(s.back()) || s.back() == '\r' || s.back() == '\n'))
+    {
+        s.remove_suffix(1);
+    }
+    return s;
+}
+
+
+std::string to_lower(std::string_view const & s)
+{
+    std::string result(s);
+    std::transform(
+              result.begin()
+            , result.end()
+            , result.begin()
+            , [](char c)
+              {
+                  return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+              });
+    return result;
+}
+
+
+/** \brief Split a block of headers.
+ *
+ * The lines which start with a space or a tab continue the previous
+ * header. The resulting values still include the folding (the new
+ * lines); mime_header::get_value() unfolds them.
+ *
+ * Lines which are not a valid header (no colon or spaces in the name,
+ * as the "From " line of an mbox) are ignored.
+ *
+ * \param[in] block  The headers, up to the empty line.
+ *
+ * \return The headers as views in \p block.
+ */
+mime_entity::header_vector_t parse_header_block(std::string_view const & block)
+{
+    std::vector<std::pair<std::string_view, std::string_view>> fields;
+
+    std::size_t pos(0);
+    while(pos < block.length())
+    {
+        std::size_t end(block.find('\n', pos));
+        std::size_t const next(end == std::string_view::npos ? block.length() : end + 1);
+        if(end == std::string_view::npos)
+        {
+            end = block.length();
+        }
+        if(end > pos && block[end - 1] == '\r')
+        {
+            --end;
+        }
+        std::string_view const line(block.substr(pos, end - pos));
+        pos = next;
+
+        if(line.empty())
+        {
+            continue;
+        }
+
+        if(is_wsp(line[0]))
+        {
+            if(!fields.empty())
+            {
+                std::string_view & value(fields.back().second);
+                char const * start(value.empty() ? line.data() : value.data());
+                value = std::string_view(start, line.data() + line.length() - start);
+            }
+            continue;
+        }
+
+        std::string_view::size_type const colon(line.find(':'));
+        if(colon == std::string_view::npos)
+        {
+            continue;
+        }
+        std::string_view name(line.substr(0, colon));
+        while(!name.empty() && is_wsp(name.back()))
+        {
+            name.remove_suffix(1);
+        }
+        if(name.empty()
+        || name.find_first_of(" \t") != std::string_view::npos)
+        {
+            continue;
+        }
+        std::string_view value(line.substr(colon + 1));
+        while(!value.empty() && is_wsp(value.front()))
+        {
+            value.remove_prefix(1);
+        }
+        fields.emplace_back(name, value);
+    }
+
+    mime_entity::header_vector_t headers;
+    headers.reserve(fields.size());
+    for(auto const & f : fields)
+    {
+        headers.emplace_back(f.first, f.second);
+    }
+    return headers;
+}
+
+
+
+} // no name namespace
+
+
+
+
+/////////////////
+// MIME HEADER //
+/////////////////
+
+
+/** \brief Create a header from views in the input.
+ *
+ * \param[in] name  The name of the header.
+ * \param[in] raw_value  The value as found in the input, folding included.
+ */
+mime_header::mime_header(std::string_view const & name, std::string_view const & raw_value)
+    : f_name(name)
+    , f_raw_value(raw_value)
+{
+}
+
+
+std::string_view mime_header::get_name() const
+{
+    return f_name;
+}
+
+
+/** \brief Get the value as found in the input.
+ *
+ * If the header was folded, the value includes the new line characters.
+ *
+ * \return A view of the value in the input.
+ */
+std::string_view mime_header::get_raw_value() const
+{
+    return f_raw_value;
+}
+
+
+/** \brief Get the unfolded value of this header.
+ *
+ * The new lines of folded headers get removed (RFC 5322 section 2.2.3)
+ * and the result is trimmed. Encoded words (RFC 2047) are not decoded.
+ *
+ * \return A copy of the unfolded value.
+ */
+std::string mime_header::get_value() const
+{
+    std::string result;
+    result.reserve(f_raw_value.length());
+    for(char const c : f_raw_value)
+    {
+        if(c != '\r' && c != '\n')
+        {
+            result += c;
+        }
+    }
+    return std::string(trim(result));
+}
+
+
+/** \brief Check the name of this header.
+ *
+ * \param[in] name  The name to compare with, in any case.
+ *
+ * \return true if this header is named \p name.
+ */
+bool mime_header::is(std::string_view const & name) const
+{
+    return equal_names(f_name, name);
+}
+
+
+/** \brief Get a parameter from a header value.
+ *
+ * Headers such as Content-Type and Content-Disposition have parameters
+ * after the main value:
+ *
+ * \code
+ *     Content-Type: multipart/mixed; boundary="=-abc"; charset=utf-8
+ * \endcode
+ *
+ * Quoted values get unquoted. Continuations and charsets of RFC 2231
+ * are not supported.
+ *
+ * \param[in] value  The unfolded value of the header.
+ * \param[in] name  The name of the parameter, in any case.
+ *
+ * \return The value of the parameter or an empty string.
+ */
+std::string mime_header_parameter(std::string_view const & value, std::string_view const & name)
+{
+    std::size_t pos(value.find(';'));
+    while(pos != std::string_view::npos && pos < value.length())
+    {
+        ++pos;     // skip ';'
+        while(pos < value.length() && is_wsp(value[pos]))
+        {
+            ++pos;
+        }
+        std::size_t const equal(value.find_first_of("=;", pos));
+        if(equal == std::string_view::npos
+        || value[equal] == ';')
+        {
+            pos = equal;
+            continue;
+        }
+        std::string_view const attribute(trim(value.substr(pos, equal - pos)));
+
+        std::string result;
+        pos = equal + 1;
+        while(pos < value.length() && is_wsp(value[pos]))
+        {
+            ++pos;
+        }
+        if(pos < value.length() && value[pos] == '"')
+        {
+            for(++pos; pos < value.length() && value[pos] != '"'; ++pos)
+            {
+                if(value[pos] == '\\'
+                && pos + 1 < value.length())
+                {
+                    ++pos;
+                }
+                result += value[pos];
+            }
+            pos = value.find(';', pos);
+        }
+        else
+        {
+            std::size_t const end(value.find(';', pos));
+            result = trim(value.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos));
+            pos = end;
+        }
+
+        if(equal_names(attribute, name))
+        {
+            return result;
+        }
+    }
+
+    return std::string();
+}
+
+
+
+
+/////////////////
+// MIME ENTITY //
+/////////////////
+
+
+/** \brief Create an entity from its headers.
+ *
+ * The Content-Type and Content-Transfer-Encoding get extracted from
+ * the headers.
+ *
+ * \param[in] headers  The headers of the entity.
+ * \param[in] depth  The depth of the entity, 0 for the message itself.
+ * \param[in] digest  Whether the parent is a multipart/digest, which
+ * changes the default content type to message/rfc822.
+ */
+mime_entity::mime_entity(
+          header_vector_t && headers
+        , std::size_t depth
+        , bool digest)
+    : f_headers(std::move(headers))
+    , f_depth(depth)
+{
+    std::string const content_type(get_header("Content-Type"));
+    std::string_view type(content_type);
+    std::string_view::size_type const semicolon(type.find(';'));
+    if(semicolon != std::string_view::npos)
+    {
+        type = type.substr(0, semicolon);
+    }
+    f_content_type = to_lower(trim(type));
+    if(f_content_type.empty())
+    {
+        f_content_type = digest ? "message/rfc822" : "text/plain";
+    }
+    if(f_content_type.compare(0, 10, "multipart/") == 0)
+    {
+        f_boundary = mime_header_parameter(content_type, "boundary");
+    }
+
+    f_transfer_encoding = to_lower(trim(get_header("Content-Transfer-Encoding")));
+    if(f_transfer_encoding.empty())
+    {
+        f_transfer_encoding = "7bit";
+    }
+}
+
+
+/** \brief Get the headers of the entity.
+ *
+ * The headers are views in the input. With the mime_parser, they are
+ * only available in mime_handler::part_begin() since the input may not
+ * exist anymore afterward. The mime_message keeps them.
+ *
+ * \return The headers in the order they appear in the input.
+ */
+mime_entity::header_vector_t const & mime_entity::get_headers() const
+{
+    return f_headers;
+}
+
+
+void mime_entity::clear_headers()
+{
+    f_headers.clear();
+}
+
+
+bool mime_entity::has_header(std::string_view const & name) const
+{
+    return std::any_of(
+              f_headers.begin()
+            , f_headers.end()
+            , [&name](mime_header const & h)
+              {
+                  return h.is(name);
+              });
+}
+
+
+/** \brief Get the unfolded value of a header.
+ *
+ * If the header appears more than once, the first one is returned.
+ *
+ * \param[in] name  The name of the header, in any case.
+ *
+ * \return The value of the header or an empty string.
+ */
+std::string mime_entity::get_header(std::string_view const & name) const
+{
+    for(auto const & h : f_headers)
+    {
+        if(h.is(name))
+        {
+            return h.get_value();
+        }
+    }
+    return std::string();
+}
+
+
+/** \brief Get the content type.
+ *
+ * \return The lowercase type and sub-type, without the parameters.
+ */
+std::string const & mime_entity::get_content_type() const
+{
+    return f_content_type;
+}
+
+
+std::string const & mime_entity::get_boundary() const
+{
+    return f_boundary;
+}
+
+
+/** \brief Get the content transfer encoding.
+ *
+ * \return The lowercase encoding, "7bit" by default.
+ */
+std::string const & mime_entity::get_transfer_encoding() const
+{
+    return f_transfer_encoding;
+}
+
+
+/** \brief Check whether this entity has sub-parts.
+ *
+ * A multipart entity without a boundary parameter is viewed as a leaf.
+ *
+ * \return true if the entity is multipart.
+ */
+bool mime_entity::is_multipart() const
+{
+    return !f_boundary.empty();
+}
+
+
+std::size_t mime_entity::get_depth() const
+{
+    return f_depth;
+}
+
+
+void mime_entity::set_raw_body(std::string_view const & body)
+{
+    f_raw_body = body;
+}
+
+
+/** \brief Get the body as found in the input.
+ *
+ * The new line before the boundary delimiter is not part of the body.
+ *
+ * \return A view of the body, still encoded.
+ */
+std::string_view mime_entity::get_raw_body() const
+{
+    return f_raw_body;
+}
+
+
+/** \brief Get the decoded body.
+ *
+ * The body gets decoded each time this function gets called.
+ *
+ * \return A copy of the body with the transfer encoding removed.
+ */
+std::string mime_entity::get_body() const
+{
+    mime_body_decoder decoder(f_transfer_encoding);
+    std::string result;
+    decoder.decode(f_raw_body, result);
+    decoder.finish(result);
+    return result;
+}
+
+
+mime_entity::vector_t & mime_entity::get_parts()
+{
+    return f_parts;
+}
+
+
+mime_entity::vector_t const & mime_entity::get_parts() const
+{
+    return f_parts;
+}
+
+
+/** \brief Search for an entity by content type.
+ *
+ * This entity and its sub-parts are searched depth first.
+ *
+ * \param[in] content_type  The lowercase content type to search.
+ *
+ * \return The first entity found or nullptr.
+ */
+mime_entity const * mime_entity::find_part(std::string_view const & content_type) const
+{
+    if(f_content_type == content_type)
+    {
+        return this;
+    }
+    for(auto const & p : f_parts)
+    {
+        mime_entity const * found(p.find_part(content_type));
+        if(found != nullptr)
+        {
+            return found;
+        }
+    }
+    return nullptr;
+}
+
+
+
+
+///////////////////////
+// MIME BODY DECODER //
+///////////////////////
+
+
+/** \brief Prepare a decoder for the specified transfer encoding.
+ *
+ * Encodings other than "quoted-printable" and "base64" (7bit, 8bit,
+ * binary and unknown encodings) are passed through as is.
+ *
+ * \param[in] transfer_encoding  The lowercase Content-Transfer-Encoding.
+ */
+mime_body_decoder::mime_body_decoder(std::string const & transfer_encoding)
+{
+    if(transfer_encoding == "quoted-printable")
+    {
+        f_encoding = encoding_t::ENCODING_QUOTED_PRINTABLE;
+    }
+    else if(transfer_encoding == "base64")
+    {
+        f_encoding = encoding_t::ENCODING_BASE64;
+    }
+}
+
+
+/** \brief Decode a chunk of the body.
+ *
+ * The chunks can be cut anywhere. The few characters at the end of a
+ * chunk which cannot be decoded alone (an incomplete "=XX" or base64
+ * quantum) are kept until the next call.
+ *
+ * \param[in] data  The encoded data.
+ * \param[in,out] out  The string where the decoded data gets appended.
+ */
+void mime_body_decoder::decode(std::string_view const & data, std::string & out)
+{
+    std::string_view in(data);
+    switch(f_encoding)
+    {
+    case encoding_t::ENCODING_IDENTITY:
+        out.append(in.data(), in.length());
+        break;
+
+    case encoding_t::ENCODING_QUOTED_PRINTABLE:
+        // complete a sequence cut at the end of the previous chunk
+        //
+        while(!f_carry.empty() && !in.empty())
+        {
+            f_carry += in.front();
+            in.remove_prefix(1);
+            if(f_carry.length() >= 3
+            || f_carry[1] == '\n'
+            || (f_carry[1] != '\r' && f_carry.length() == 2 && !std::isxdigit(static_cast<unsigned char>(f_carry[1]))))
+            {
+                out += quoted_printable_decode(f_carry);
+                f_carry.clear();
+            }
+        }
+        if(!in.empty())
+        {
+            std::size_t keep(0);
+            if(in.back() == '=')
+            {
+                keep = 1;
+            }
+            else if(in.length() >= 2
+                 && in[in.length() - 2] == '=')
+            {
+                keep = 2;
+            }
+            out += quoted_printable_decode(in.substr(0, in.length() - keep));
+            f_carry = in.substr(in.length() - keep);
+        }
+        break;
+
+    case encoding_t::ENCODING_BASE64:
+        if(f_padding)
+        {
+            break;
+        }
+        {
+            std::string::size_type const padding(in.find('='));
+            if(padding != std::string_view::npos)
+            {
+                // the end of the data, the rest is ignored
+                //
+                f_padding = true;
+                f_carry.append(in.data(), padding);
+                out += base64_decode(f_carry);
+                f_carry.clear();
+                break;
+            }
+
+            // only decode complete quanta of 4 characters
+            //
+            std::size_t count(0);
+            for(char const c : f_carry)
+            {
+                count += is_base64(c) ? 1 : 0;
+            }
+            std::size_t split(in.length());
+            std::size_t total(count);
+            for(char const c : in)
+            {
+                total += is_base64(c) ? 1 : 0;
+            }
+            std::size_t extra(total % 4);
+            for(; extra > 0 && split > 0; --split)
+            {
+                if(is_base64(in[split - 1]))
+                {
+                    --extra;
+                }
+            }
+            if(extra > 0)
+            {
+                // not even one complete quantum yet
+                //
+                f_carry.append(in.data(), in.length());
+            }
+            else if(f_carry.empty())
+            {
+                out += base64_decode(in.substr(0, split));
+                f_carry = in.substr(split);
+            }
+            else
+            {
+                f_carry.append(in.data(), split);
+                out += base64_decode(f_carry);
+                f_carry = in.substr(split);
+            }
+        }
+        break;
+
+    }
+}
+
+
+/** \brief Decode what remains.
+ *
+ * \param[in,out] out  The string where the decoded data gets appended.
+ */
+void mime_body_decoder::finish(std::string & out)
+{
+    if(!f_carry.empty())
+    {
+        out += f_encoding == encoding_t::ENCODING_BASE64
+                    ? base64_decode(f_carry)
+                    : quoted_printable_decode(f_carry);
+        f_carry.clear();
+    }
+}
+
+
+
+
+//////////////////
+// MIME HANDLER //
+//////////////////
+
+
+mime_handler::~mime_handler()
+{
+}
+
+
+/** \brief Called once the headers of an entity were read.
+ *
+ * \param[in] entity  The new entity.
+ *
+ * \return true to continue parsing, false to stop.
+ */
+bool mime_handler::part_begin(mime_entity const & entity)
+{
+    snapdev::NOT_USED(entity);
+    return true;
+}
+
+
+/** \brief Called with the body of an entity which is not multipart.
+ *
+ * The body of one entity may be passed in any number of calls. The
+ * data is valid only for the duration of the call.
+ *
+ * \param[in] entity  The entity this data is part of.
+ * \param[in] data  A chunk of the body, still encoded.
+ *
+ * \return true to continue parsing, false to stop.
+ */
+bool mime_handler::part_data(mime_entity const & entity, std::string_view const & data)
+{
+    snapdev::NOT_USED(entity, data);
+    return true;
+}
+
+
+/** \brief Called once an entity ended.
+ *
+ * The sub-parts of a multipart entity end before the entity itself.
+ *
+ * \param[in] entity  The entity which ended.
+ *
+ * \return true to continue parsing, false to stop.
+ */
+bool mime_handler::part_end(mime_entity const & entity)
+{
+    snapdev::NOT_USED(entity);
+    return true;
+}
+
+
+
+
+/////////////////
+// MIME PARSER //
+/////////////////
+
+
+/** \brief Initialize a parser.
+ *
+ * \param[in] handler  The handler receiving the entities; it must remain
+ * valid for the lifetime of the parser.
+ */
+mime_parser::mime_parser(mime_handler & handler)
+    : f_handler(handler)
+{
+}
+
+
+/** \brief Change the maximum size of the headers of one entity.
+ *
+ * This protects against an input which never ends its headers. The
+ * default is DEFAULT_MAX_HEADER_SIZE.
+ *
+ * \exception invalid_parameter
+ * The size cannot be zero.
+ *
+ * \param[in] size  The new maximum size in bytes.
+ */
+void mime_parser::set_max_header_size(std::size_t size)
+{
+    if(size == 0)
+    {
+        throw invalid_parameter("mime_parser::set_max_header_size(): the size cannot be zero.");
+    }
+    f_max_header_size = size;
+}
+
+
+/** \brief Parse the next chunk of the message.
+ *
+ * The data does not need to be kept once this function returns. Call
+ * finish() once the whole message was fed.
+ *
+ * \param[in] data  The next chunk of the message.
+ *
+ * \return false if parsing failed or the handler stopped it.
+ */
+bool mime_parser::feed(std::string_view const & data)
+{
+    if(f_finished)
+    {
+        throw libmimemail_logic_error("mime_parser::feed() called after finish().");
+    }
+    if(f_failed)
+    {
+        return false;
+    }
+    return process(data, false);
+}
+
+
+/** \brief Signal the end of the message.
+ *
+ * The entities which are still open get ended.
+ *
+ * \return false if parsing failed or the handler stopped it.
+ */
+bool mime_parser::finish()
+{
+    if(f_finished)
+    {
+        return !f_failed;
+    }
+    if(f_failed)
+    {
+        f_finished = true;
+        return false;
+    }
+    return process(std::string_view(), true);
+}
+
+
+/** \brief Parse a complete message.
+ *
+ * This is the same as feed() followed by finish() except that the views
+ * passed to the handler (headers and data) are all in \p data, so they
+ * remain valid as long as \p data does.
+ *
+ * \param[in] data  The whole message.
+ *
+ * \return false if parsing failed or the handler stopped it.
+ */
+bool mime_parser::parse(std::string_view const & data)
+{
+    if(f_finished)
+    {
+        throw libmimemail_logic_error("mime_parser::parse() called after finish().");
+    }
+    if(!f_frames.empty()
+    || !f_header_buffer.empty())
+    {
+        throw libmimemail_logic_error("mime_parser::parse() called after feed().");
+    }
+    f_keep_views = true;
+    return process(data, true);
+}
+
+
+bool mime_parser::has_failed() const
+{
+    return f_failed;
+}
+
+
+bool mime_parser::process(std::string_view const & data, bool last)
+{
+    char const * p(data.data());
+    char const * const end(p + data.length());
+
+    // a line cut at the end of the previous chunk which may be a
+    // boundary delimiter
+    //
+    if(!f_carry.empty())
+    {
+        char const * nl(p == end ? nullptr : static_cast<char const *>(memchr(p, '\n', end - p)));
+        std::size_t const size(nl == nullptr ? end - p : nl + 1 - p);
+        if(nl == nullptr
+        && !last
+        && f_carry.length() + size <= MAX_DELIMITER_LENGTH)
+        {
+            f_carry.append(p, size);
+            return true;
+        }
+        if(f_carry.length() + size <= MAX_DELIMITER_LENGTH + 2)
+        {
+            f_carry.append(p, size);
+            p += size;
+            std::string_view line(f_carry);
+            std::string_view eol;
+            if(nl != nullptr)
+            {
+                std::size_t const eol_size(line.length() >= 2 && line[line.length() - 2] == '\r' ? 2 : 1);
+                eol = line.substr(line.length() - eol_size);
+                line.remove_suffix(eol_size);
+            }
+            if(!process_line(line, eol))
+            {
+                return false;
+            }
+            if(!f_pending_eol.empty())
+            {
+                std::memcpy(f_eol_buffer, f_pending_eol.data(), f_pending_eol.length());
+                f_pending_eol = std::string_view(f_eol_buffer, f_pending_eol.length());
+            }
+        }
+        else
+        {
+            // too long to be a delimiter
+            //
+            if(is_leaf())
+            {
+                add_data(f_pending_eol);
+                add_data(f_carry);
+            }
+            f_pending_eol = std::string_view();
+            f_mid_line = true;
+        }
+        if(!flush_data())
+        {
+            return false;
+        }
+        f_carry.clear();
+    }
+
+    if(f_pending_cr)
+    {
+        f_pending_cr = false;
+        if(p < end
+        && *p == '\n')
+        {
+            // the "\r\n" of a long line was cut between two chunks
+            //
+            ++p;
+            f_mid_line = false;
+            f_eol_buffer[0] = '\r';
+            f_eol_buffer[1] = '\n';
+            f_pending_eol = std::string_view(f_eol_buffer, 2);
+        }
+        else if(is_leaf())
+        {
+            add_data(g_cr);
+        }
+    }
+
+    if(f_state == state_t::STATE_HEADERS)
+    {
+        f_header_start = p;
+    }
+
+    while(p < end)
+    {
+        char const * nl(static_cast<char const *>(memchr(p, '\n', end - p)));
+        if(nl == nullptr)
+        {
+            if(last)
+            {
+                if(!process_line(std::string_view(p, end - p), std::string_view()))
+                {
+                    return false;
+                }
+            }
+            else if(!process_partial_line(std::string_view(p, end - p)))
+            {
+                return false;
+            }
+            p = end;
+            break;
+        }
+
+        std::string_view line(p, nl - p);
+        std::string_view eol(nl, 1);
+        if(!line.empty()
+        && line.back() == '\r')
+        {
+            line.remove_suffix(1);
+            eol = std::string_view(nl - 1, 2);
+        }
+        p = nl + 1;
+
+        if(f_mid_line)
+        {
+            // the end of a long line, it cannot be a delimiter
+            //
+            f_mid_line = false;
+            if(f_state == state_t::STATE_BODY
+            && is_leaf())
+            {
+                add_data(line);
+                f_pending_eol = eol;
+            }
+            continue;
+        }
+
+        if(!process_line(line, eol))
+        {
+            return false;
+        }
+    }
+
+    if(!flush_data())
+    {
+        return false;
+    }
+
+    if(last)
+    {
+        return end_input(end);
+    }
+
+    if(!f_pending_eol.empty())
+    {
+        std::memcpy(f_eol_buffer, f_pending_eol.data(), f_pending_eol.length());
+        f_pending_eol = std::string_view(f_eol_buffer, f_pending_eol.length());
+    }
+    if(f_state == state_t::STATE_HEADERS)
+    {
+        return append_headers(end);
+    }
+
+    return true;
+}
+
+
+bool mime_parser::process_line(std::string_view const & line, std::string_view const & eol)
+{
+    if(f_state == state_t::STATE_HEADERS)
+    {
+        bool empty(line.empty());
+        if(empty
+        && line.data() == f_header_start
+        && !f_header_buffer.empty()
+        && f_header_buffer.back() != '\n')
+        {
+            // the line started in the previous chunk
+            //
+            std::string_view const tail(std::string_view(f_header_buffer).substr(f_header_buffer.rfind('\n') + 1));
+            empty = tail == "\r";
+        }
+        if(!empty)
+        {
+            if(f_header_start != nullptr
+            && f_header_buffer.length() + (line.data() + line.length() - f_header_start) > f_max_header_size)
+            {
+                return fail("the headers are too large");
+            }
+            return true;
+        }
+
+        // empty line, end of the headers
+        //
+        std::string_view block;
+        if(f_header_buffer.empty())
+        {
+            if(f_header_start != nullptr)
+            {
+                block = std::string_view(f_header_start, line.data() - f_header_start);
+            }
+        }
+        else
+        {
+            if(f_header_start != nullptr)
+            {
+                f_header_buffer.append(f_header_start, line.data() - f_header_start);
+            }
+            block = f_header_buffer;
+        }
+        if(!end_headers(block))
+        {
+            return false;
+        }
+        return true;
+    }
+
+    bool close(false);
+    std::size_t const idx(find_delimiter(line, close));
+    if(idx != std::string::npos)
+    {
+        // the new line before the delimiter is part of the delimiter
+        //
+        f_pending_eol = std::string_view();
+        if(!end_entities(idx + 1))
+        {
+            return false;
+        }
+        f_frames[idx].f_epilogue = close;
+        if(!close)
+        {
+            f_state = state_t::STATE_HEADERS;
+            f_header_start = eol.empty() ? nullptr : eol.data() + eol.length();
+        }
+        return true;
+    }
+
+    if(is_leaf())
+    {
+        add_data(f_pending_eol);
+        add_data(line);
+        f_pending_eol = eol;
+    }
+
+    return true;
+}
+
+
+bool mime_parser::process_partial_line(std::string_view const & line)
+{
+    if(f_state == state_t::STATE_HEADERS)
+    {
+        // append_headers() saves it
+        //
+        return true;
+    }
+
+    if(!f_mid_line
+    && may_be_delimiter(line))
+    {
+        f_carry.assign(line.data(), line.length());
+        return true;
+    }
+
+    // a "\r" at the end may be the start of the new line characters
+    //
+    std::string_view data(line);
+    f_pending_cr = data.back() == '\r';
+    if(f_pending_cr)
+    {
+        data.remove_suffix(1);
+    }
+
+    if(is_leaf())
+    {
+        if(!f_mid_line)
+        {
+            add_data(f_pending_eol);
+        }
+        add_data(data);
+    }
+    f_pending_eol = std::string_view();
+    f_mid_line = true;
+
+    return true;
+}
+
+
+/** \brief Save the headers found at the end of a chunk.
+ *
+ * \param[in] end  The end of the chunk.
+ *
+ * \return false if the headers are too large.
+ */
+bool mime_parser::append_headers(char const * end)
+{
+    if(f_header_start != nullptr)
+    {
+        std::size_t const size(end - f_header_start);
+        if(f_header_buffer.length() + size > f_max_header_size)
+        {
+            return fail("the headers are too large");
+        }
+        f_header_buffer.append(f_header_start, size);
+        f_header_start = nullptr;
+    }
+    return true;
+}
+
+
+bool mime_parser::end_headers(std::string_view const & block)
+{
+    if(f_frames.size() >= MAX_DEPTH)
+    {
+        return fail("too many levels of multipart entities");
+    }
+
+    bool const digest(!f_frames.empty()
+                    && f_frames.back().f_entity.get_content_type() == "multipart/digest");
+    frame f;
+    f.f_entity = mime_entity(parse_header_block(block), f_frames.size(), digest);
+    if(f.f_entity.get_boundary().length() > MAX_BOUNDARY_LENGTH)
+    {
+        return fail("the boundary is too long");
+    }
+    f_frames.push_back(std::move(f));
+    f_state = state_t::STATE_BODY;
+    f_mid_line = false;
+    f_pending_eol = std::string_view();
+
+    bool const result(f_handler.part_begin(f_frames.back().f_entity));
+
+    // the headers are views in the input or in f_header_buffer which
+    // may not survive this call
+    //
+    if(!f_keep_views)
+    {
+        f_frames.back().f_entity.clear_headers();
+    }
+    f_header_buffer.clear();
+    f_header_start = nullptr;
+
+    if(!result)
+    {
+        f_failed = true;
+    }
+    return result;
+}
+
+
+bool mime_parser::end_input(char const * end)
+{
+    f_finished = true;
+
+    if(!f_carry.empty())
+    {
+        std::string const line(std::move(f_carry));
+        f_carry.clear();
+        if(!process_line(line, std::string_view())
+        || !flush_data())
+        {
+            return false;
+        }
+    }
+
+    if(f_state == state_t::STATE_HEADERS)
+    {
+        // no empty line; everything left is headers and there is no body
+        //
+        std::string_view block;
+        if(f_header_buffer.empty())
+        {
+            if(f_header_start != nullptr)
+            {
+                block = std::string_view(f_header_start, end - f_header_start);
+            }
+        }
+        else
+        {
+            if(f_header_start != nullptr)
+            {
+                f_header_buffer.append(f_header_start, end - f_header_start);
+            }
+            block = f_header_buffer;
+        }
+        if(!block.empty()
+        || f_frames.empty())
+        {
+            if(!end_headers(block))
+            {
+                return false;
+            }
+        }
+    }
+
+    // without a delimiter, the last new line is part of the body
+    //
+    if(is_leaf())
+    {
+        add_data(f_pending_eol);
+    }
+    f_pending_eol = std::string_view();
+
+    return flush_data()
+        && end_entities(0);
+}
+
+
+/** \brief Check whether a line is a boundary delimiter.
+ *
+ * The innermost boundary is checked first. An outer boundary also ends
+ * the inner entities (i.e. a missing close delimiter).
+ *
+ * \param[in] line  The line without its new line characters.
+ * \param[out] close  Set to true if the line is a close delimiter.
+ *
+ * \return The index of the frame of the boundary or std::string::npos.
+ */
+std::size_t mime_parser::find_delimiter(std::string_view const & line, bool & close) const
+{
+    if(line.length() < 3
+    || line[0] != '-'
+    || line[1] != '-')
+    {
+        return std::string::npos;
+    }
+
+    for(std::size_t idx(f_frames.size()); idx > 0; )
+    {
+        --idx;
+        std::string const & boundary(f_frames[idx].f_entity.get_boundary());
+        if(boundary.empty()
+        || line.compare(2, boundary.length(), boundary) != 0)
+        {
+            continue;
+        }
+        std::string_view rest(line.substr(2 + boundary.length()));
+        close = rest.length() >= 2 && rest[0] == '-' && rest[1] == '-';
+        if(close)
+        {
+            rest.remove_prefix(2);
+        }
+        if(std::all_of(rest.begin(), rest.end(), is_wsp))
+        {
+            return idx;
+        }
+    }
+
+    return std::string::npos;
+}
+
+
+bool mime_parser::may_be_delimiter(std::string_view const & line) const
+{
+    if(line.length() > MAX_DELIMITER_LENGTH
+    || (line.length() >= 1 && line[0] != '-')
+    || (line.length() >= 2 && line[1] != '-'))
+    {
+        return false;
+    }
+    return std::any_of(
+              f_frames.begin()
+            , f_frames.end()
+            , [](frame const & f)
+              {
+                  return f.f_entity.is_multipart();
+              });
+}
+
+
+bool mime_parser::is_leaf() const
+{
+    return f_state == state_t::STATE_BODY
+        && !f_frames.empty()
+        && !f_frames.back().f_entity.is_multipart();
+}
+
+
+/** \brief Add data to the current run.
+ *
+ * Consecutive lines are contiguous in the input so they get passed to
+ * the handler in one call instead of one call per line.
+ *
+ * \param[in] data  The data to add.
+ */
+void mime_parser::add_data(std::string_view const & data)
+{
+    if(data.empty())
+    {
+        return;
+    }
+    if(f_run.empty())
+    {
+        f_run = data;
+        return;
+    }
+    if(f_run.data() + f_run.length() == data.data())
+    {
+        f_run = std::string_view(f_run.data(), f_run.length() + data.length());
+        return;
+    }
+
+    // not contiguous; flush_data() is called before any of the buffers
+    // referenced by f_run changes so only the handler can fail here
+    //
+    if(!flush_data())
+    {
+        return;
+    }
+    f_run = data;
+}
+
+
+bool mime_parser::flush_data()
+{
+    if(f_run.empty())
+    {
+        return !f_failed;
+    }
+    std::string_view const run(f_run);
+    f_run = std::string_view();
+    if(f_failed)
+    {
+        return false;
+    }
+    if(!f_handler.part_data(f_frames.back().f_entity, run))
+    {
+        f_failed = true;
+        return false;
+    }
+    return true;
+}
+
+
+/** \brief End the entities until only \p count remain.
+ *
+ * \param[in] count  The number of entities which remain open.
+ *
+ * \return false if the handler stopped the parsing.
+ */
+bool mime_parser::end_entities(std::size_t count)
+{
+    if(!flush_data())
+    {
+        return false;
+    }
+    while(f_frames.size() > count)
+    {
+        if(!f_handler.part_end(f_frames.back().f_entity))
+        {
+            f_failed = true;
+            return false;
+        }
+        f_frames.pop_back();
+    }
+    f_mid_line = false;
+    return true;
+}
+
+
+bool mime_parser::fail(std::string const & message)
+{
+    SNAP_LOG_ERROR
+        << "MIME parsing failed: "
+        << message
+        << "."
+        << SNAP_LOG_SEND;
+    f_failed = true;
+    return false;
+}
+
+
+
+
+//////////////////
+// MIME MESSAGE //
+//////////////////
+
+
+namespace
+{
+
+
+
+/** \brief Build the tree of entities of a message.
+ *
+ * The data passed to part_data() is contiguous in the input so the body
+ * of an entity is a view from the first to the last byte received.
+ */
+class message_builder
+    : public mime_handler
+{
+public:
+    message_builder(mime_entity & root)
+        : f_root(root)
+    {
+    }
+
+    virtual bool part_begin(mime_entity const & entity) override
+    {
+        if(f_stack.empty())
+        {
+            f_root = entity;
+            f_stack.push_back(&f_root);
+        }
+        else
+        {
+            // the previous siblings are done so growing the vector does
+            // not invalidate a pointer in f_stack
+            //
+            mime_entity::vector_t & parts(f_stack.back()->get_parts());
+            parts.push_back(entity);
+            f_stack.push_back(&parts.back());
+        }
+        return true;
+    }
+
+    virtual bool part_data(mime_entity const & entity, std::string_view const & data) override
+    {
+        snapdev::NOT_USED(entity);
+
+        mime_entity * e(f_stack.back());
+        std::string_view const body(e->get_raw_body());
+        if(body.empty())
+        {
+            e->set_raw_body(data);
+        }
+        else if(body.data() + body.length() == data.data())
+        {
+            e->set_raw_body(std::string_view(body.data(), body.length() + data.length()));
+        }
+        else
+        {
+            throw libmimemail_logic_error("message_builder::part_data(): the body of an entity is not contiguous.");
+        }
+        return true;
+    }
+
+    virtual bool part_end(mime_entity const & entity) override
+    {
+        snapdev::NOT_USED(entity);
+
+        f_stack.pop_back();
+        return true;
+    }
+
+private:
+    mime_entity &               f_root;
+    std::vector<mime_entity *>  f_stack = std::vector<mime_entity *>();
+};
+
+
+
+} // no name namespace
+
+
+
+/** \brief Parse a message.
+ *
+ * The entities keep views in \p data which must remain valid as long
+ * as this message is used.
+ *
+ * \param[in] data  The whole message.
+ *
+ * \return true if the message was parsed.
+ */
+bool mime_message::parse(std::string_view const & data)
+{
+    f_buffer.reset();
+    f_data = data;
+    f_root = mime_entity();
+
+    message_builder builder(f_root);
+    mime_parser parser(builder);
+    return parser.parse(data);
+}
+
+
+/** \brief Parse a message from a buffer.
+ *
+ * The buffer is kept with the message so the views remain valid. Use
+ * binary_spool_buffer::from_file() to parse a file without reading it
+ * all in memory.
+ *
+ * \exception invalid_parameter
+ * The buffer cannot be null.
+ *
+ * \param[in] buffer  The buffer with the whole message.
+ *
+ * \return true if the message was parsed.
+ */
+bool mime_message::parse(binary_spool_buffer::pointer_t buffer)
+{
+    if(buffer == nullptr)
+    {
+        throw invalid_parameter("mime_message::parse() called with a null buffer.");
+    }
+    bool const result(parse(buffer->get_data()));
+    f_buffer = buffer;
+    return result;
+}
+
+
+/** \brief Get the top entity, the message itself.
+ *
+ * \return The root of the tree of entities.
+ */
+mime_entity const & mime_message::get_root() const
+{
+    return f_root;
+}
+
+
+std::string_view mime_message::get_data() const
+{
+    return f_data;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
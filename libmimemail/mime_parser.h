@@ -0,0 +1,216 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/binary_spool.h>
+
+
+// C++
+//
+#include    <string>
+#include    <string_view>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+class mime_header
+{
+public:
+                            mime_header(std::string_view const & name, std::string_view const & raw_value);
+
+    std::string_view        get_name() const;
+    std::string_view        get_raw_value() const;
+    std::string             get_value() const;
+    bool                    is(std::string_view const & name) const;
+
+private:
+    std::string_view        f_name = std::string_view();
+    std::string_view        f_raw_value = std::string_view();
+};
+
+
+std::string                 mime_header_parameter(std::string_view const & value, std::string_view const & name);
+
+
+class mime_entity
+{
+public:
+    typedef std::vector<mime_header>    header_vector_t;
+    typedef std::vector<mime_entity>    vector_t;
+
+                            mime_entity() = default;
+                            mime_entity(
+                                  header_vector_t && headers
+                                , std::size_t depth
+                                , bool digest);
+
+    header_vector_t const & get_headers() const;
+    void                    clear_headers();
+    bool                    has_header(std::string_view const & name) const;
+    std::string             get_header(std::string_view const & name) const;
+    std::string const &     get_content_type() const;
+    std::string const &     get_boundary() const;
+    std::string const &     get_transfer_encoding() const;
+    bool                    is_multipart() const;
+    std::size_t             get_depth() const;
+
+    // only available from a mime_message
+    //
+    void                    set_raw_body(std::string_view const & body);
+    std::string_view        get_raw_body() const;
+    std::string             get_body() const;
+    vector_t &              get_parts();
+    vector_t const &        get_parts() const;
+    mime_entity const *     find_part(std::string_view const & content_type) const;
+
+private:
+    header_vector_t         f_headers = header_vector_t();
+    std::string             f_content_type = std::string();
+    std::string             f_boundary = std::string();
+    std::string             f_transfer_encoding = std::string();
+    std::size_t             f_depth = 0;
+    std::string_view        f_raw_body = std::string_view();
+    vector_t                f_parts = vector_t();
+};
+
+
+class mime_body_decoder
+{
+public:
+                            mime_body_decoder(std::string const & transfer_encoding);
+
+    void                    decode(std::string_view const & data, std::string & out);
+    void                    finish(std::string & out);
+
+private:
+    enum class encoding_t
+    {
+        ENCODING_IDENTITY,
+        ENCODING_QUOTED_PRINTABLE,
+        ENCODING_BASE64,
+    };
+
+    encoding_t              f_encoding = encoding_t::ENCODING_IDENTITY;
+    std::string             f_carry = std::string();
+    bool                    f_padding = false;
+};
+
+
+class mime_handler
+{
+public:
+    virtual                 ~mime_handler();
+
+    virtual bool            part_begin(mime_entity const & entity);
+    virtual bool            part_data(mime_entity const & entity, std::string_view const & data);
+    virtual bool            part_end(mime_entity const & entity);
+};
+
+
+class mime_parser
+{
+public:
+    static constexpr std::size_t const  DEFAULT_MAX_HEADER_SIZE = 256 * 1024;
+    static constexpr std::size_t const  MAX_DEPTH = 32;
+    static constexpr std::size_t const  MAX_BOUNDARY_LENGTH = 200;
+
+                            mime_parser(mime_handler & handler);
+                            mime_parser(mime_parser const &) = delete;
+
+    mime_parser &           operator = (mime_parser const &) = delete;
+
+    void                    set_max_header_size(std::size_t size);
+    bool                    feed(std::string_view const & data);
+    bool                    finish();
+    bool                    parse(std::string_view const & data);
+    bool                    has_failed() const;
+
+private:
+    enum class state_t
+    {
+        STATE_HEADERS,
+        STATE_BODY,
+    };
+
+    struct frame
+    {
+        mime_entity         f_entity = mime_entity();
+        bool                f_epilogue = false;
+    };
+
+    typedef std::vector<frame>  frame_vector_t;
+
+    bool                    process(std::string_view const & data, bool last);
+    bool                    process_line(std::string_view const & line, std::string_view const & eol);
+    bool                    process_partial_line(std::string_view const & line);
+    bool                    append_headers(char const * end);
+    bool                    end_headers(std::string_view const & block);
+    bool                    end_input(char const * end);
+    std::size_t             find_delimiter(std::string_view const & line, bool & close) const;
+    bool                    may_be_delimiter(std::string_view const & line) const;
+    bool                    is_leaf() const;
+    void                    add_data(std::string_view const & data);
+    bool                    flush_data();
+    bool                    end_entities(std::size_t count);
+    bool                    fail(std::string const & message);
+
+    mime_handler &          f_handler;
+    std::size_t             f_max_header_size = DEFAULT_MAX_HEADER_SIZE;
+    state_t                 f_state = state_t::STATE_HEADERS;
+    frame_vector_t          f_frames = frame_vector_t();
+    std::string             f_header_buffer = std::string();
+    char const *            f_header_start = nullptr;
+    std::string             f_carry = std::string();
+    bool                    f_mid_line = false;
+    bool                    f_pending_cr = false;
+    std::string_view        f_pending_eol = std::string_view();
+    char                    f_eol_buffer[2] = {};
+    std::string_view        f_run = std::string_view();
+    bool                    f_keep_views = false;
+    bool                    f_finished = false;
+    bool                    f_failed = false;
+};
+
+
+class mime_message
+{
+public:
+    bool                    parse(std::string_view const & data);
+    bool                    parse(binary_spool_buffer::pointer_t buffer);
+
+    mime_entity const &     get_root() const;
+    std::string_view        get_data() const;
+
+private:
+    binary_spool_buffer::pointer_t
+                            f_buffer = binary_spool_buffer::pointer_t();
+    std::string_view        f_data = std::string_view();
+    mime_entity             f_root = mime_entity();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
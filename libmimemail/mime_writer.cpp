@@ -0,0 +1,1223 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Render an email in its wire format.
+ *
+ * The mime_writer generates the headers and MIME parts of an email and
+ * sends them to a sink: a file descriptor (file, pipe, socket), a
+ * string buffer, or a callback.
+ *
+ * The message is collected as a list of iovec structures pointing
+ * directly to the email headers and attachment data so nothing gets
+ * copied until the sink writes it (with writev() in case of a file
+ * descriptor). Only the few strings generated on the fly (boundary,
+ * date, plain text version...) are kept by the writer.
+ *
+ * When a DKIM signer is attached, the body hash gets computed as the
+ * body is added and the DKIM-Signature is written before the other
+ * headers. In that case nothing can be written until the body is
+ * complete so the blocks of files encoded on the fly are kept until
+ * the end of the email.
+ */
+
+// self
+//
+#include    "libmimemail/mime_writer.h"
+
+#include    "libmimemail/base64.h"
+#include    "libmimemail/html_to_text.h"
+#include    "libmimemail/metrics.h"
+#include    "libmimemail/names.h"
+#include    "libmimemail/quoted_printable.h"
+#include    "libmimemail/version.h"
+
+
+// edhttp
+//
+#include    <edhttp/http_date.h>
+#include    <edhttp/names.h>
+#include    <edhttp/weighted_http_string.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// libtld
+//
+#include    <libtld/tld.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cstring>
+#include    <random>
+
+
+// C
+//
+#include    <errno.h>
+#include    <limits.h>
+#include    <poll.h>
+#include    <sys/socket.h>
+#include    <sys/stat.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+#ifdef IOV_MAX
+constexpr std::size_t const     MAX_IOVEC = IOV_MAX;
+#else
+constexpr std::size_t const     MAX_IOVEC = 1024;
+#endif
+
+
+/** \brief Amount of raw data encoded at once when streaming a file.
+ *
+ * Files which get encoded while written are encoded by blocks of this
+ * size so the encoded data never needs to be in memory as a whole.
+ */
+constexpr std::size_t const     STREAM_BLOCK_SIZE = 57 * 1024;
+
+
+/** \brief Copy the filename if defined.
+ *
+ * Check whether the filename is defined in the Content-Disposition
+ * or the Content-Type fields and make sure to duplicate it in
+ * both fields. This ensures that most email systems have access
+ * to the filename.
+ *
+ * The headers themselves are not modified. Instead, the field that
+ * needs to be changed is saved in \p overrides.
+ *
+ * \note
+ * The valid location of the filename is the Content-Disposition,
+ * but it has been saved in the 'name' sub-field of the Content-Type
+ * field and some tools only check that field.
+ *
+ * \param[in] attachment_headers  The headers to be checked for
+ *                                a filename.
+ * \param[out] overrides  The fields to use instead of the ones
+ *                        in \p attachment_headers.
+ */
+void copy_filename_to_content_type(header_map_t const & attachment_headers, header_map_t & overrides)
+{
+    auto const disposition(attachment_headers.find(HEADER_ID_CONTENT_DISPOSITION));
+    auto const type(attachment_headers.find(HEADER_ID_CONTENT_TYPE));
+    if(disposition == attachment_headers.end()
+    || type == attachment_headers.end())
+    {
+        return;
+    }
+
+    // both fields are defined, copy the filename as required
+    //
+    edhttp::weighted_http_string content_disposition_subfields(disposition->second);
+    edhttp::weighted_http_string content_type_subfields(type->second);
+
+    edhttp::string_part::vector_t & content_disposition_parts(content_disposition_subfields.get_parts());
+    edhttp::string_part::vector_t & content_type_parts(content_type_subfields.get_parts());
+
+    if(content_disposition_parts.size() > 0
+    && content_type_parts.size() > 0)
+    {
+        // we only use part 1 (there should not be more than one though)
+        //
+        std::string const filename(content_disposition_parts[0].get_parameter("filename"));
+        if(!filename.empty())
+        {
+            // okay, we found the filename in the Content-Disposition,
+            // copy that to the Content-Type
+            //
+            // Note: we always force the name parameter so if it was
+            //       already defined, we make sure it is the same as
+            //       in the Content-Disposition field
+            //
+            content_type_parts[0].add_parameter("name", filename);
+            overrides[HEADER_ID_CONTENT_TYPE] = content_type_subfields.to_string();
+        }
+        else
+        {
+            std::string const name(content_type_parts[0].get_parameter("name"));
+            if(!name.empty())
+            {
+                // Somehow the filename is defined in the Content-Type field
+                // but not in the Content-Disposition...
+                //
+                // copy it to the Content-Disposition too (where it should be)
+                //
+                content_disposition_parts[0].add_parameter("filename", name);
+                overrides[HEADER_ID_CONTENT_DISPOSITION] = content_disposition_subfields.to_string();
+            }
+        }
+    }
+}
+
+
+char const g_multipart_preamble[] =
+        "The following are various parts of a multipart email.\n"
+        "It is likely to include a text version (first part) that you should\n"
+        "be able to read as is.\n"
+        "It may be followed by HTML and then various attachments.\n"
+        "Please consider installing a MIME capable client to read this email.\n"
+        "\n";
+
+
+char const g_branding[] =
+        "X-Generated-By: Snap! Websites C++ v" LIBMIMEMAIL_VERSION_STRING " (https://snapwebsites.org/)\n"
+        "X-Mailer: Snap! Websites C++ v" LIBMIMEMAIL_VERSION_STRING " (https://snapwebsites.org/)\n";
+
+
+
+/** \brief Check whether data can be sent as is with 8BITMIME.
+ *
+ * RFC 6152 allows any octet except NUL in an 8bit body as long as the
+ * lines end with CRLF (a CR by itself is not allowed) and are at most
+ * 998 octets long, not counting the CRLF.
+ *
+ * \param[in] data  The data to check.
+ *
+ * \return true if \p data can be sent with an "8bit" transfer encoding.
+ */
+bool is_8bit_safe(std::string_view const & data)
+{
+    std::size_t line_length(0);
+    char const * s(data.data());
+    char const * const end(s + data.length());
+    for(; s < end; ++s)
+    {
+        switch(*s)
+        {
+        case '\0':
+            return false;
+
+        case '\r':
+            if(s + 1 >= end
+            || s[1] != '\n')
+            {
+                return false;
+            }
+            break;
+
+        case '\n':
+            line_length = 0;
+            break;
+
+        default:
+            ++line_length;
+            if(line_length > 998)
+            {
+                return false;
+            }
+            break;
+
+        }
+    }
+    return true;
+}
+
+
+
+}
+// no name namespace
+
+
+
+
+///////////////
+// MIME SINK //
+///////////////
+
+
+/** \brief Clean up the sink.
+ *
+ * This function is here primarily to have a clean virtual table.
+ */
+mime_sink::~mime_sink()
+{
+}
+
+
+
+
+//////////////////
+// FD MIME SINK //
+//////////////////
+
+
+/** \brief Initialize a sink writing to a file descriptor.
+ *
+ * The file descriptor can be a file, a pipe, or a socket. It is not
+ * closed by the sink.
+ *
+ * When \p fd is a socket, the data is sent with sendmsg() and the
+ * MSG_NOSIGNAL flag so a closed connection does not raise SIGPIPE.
+ *
+ * \param[in] fd  The file descriptor to write to.
+ */
+fd_mime_sink::fd_mime_sink(int fd)
+    : f_fd(fd)
+{
+    struct stat st;
+    f_is_socket = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+}
+
+
+/** \brief Write the buffers to the file descriptor.
+ *
+ * This function loops until all the data was written. A non-blocking
+ * file descriptor is waited on with poll().
+ *
+ * \param[in] iov  The array of buffers to write.
+ * \param[in] count  The number of buffers in \p iov.
+ *
+ * \return true if all the data was written.
+ */
+bool fd_mime_sink::write(iovec const * iov, int count)
+{
+    std::vector<iovec> v(iov, iov + count);
+    std::size_t idx(0);
+    while(idx < v.size())
+    {
+        std::size_t const n(std::min(v.size() - idx, MAX_IOVEC));
+        ssize_t r(-1);
+        if(f_is_socket)
+        {
+            msghdr msg = {};
+            msg.msg_iov = v.data() + idx;
+            msg.msg_iovlen = n;
+            r = sendmsg(f_fd, &msg, MSG_NOSIGNAL);
+        }
+        else
+        {
+            r = writev(f_fd, v.data() + idx, static_cast<int>(n));
+        }
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN
+            || errno == EWOULDBLOCK)
+            {
+                pollfd fd = {};
+                fd.fd = f_fd;
+                fd.events = POLLOUT;
+                poll(&fd, 1, -1);
+                continue;
+            }
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "writing email to file descriptor "
+                << f_fd
+                << " failed: "
+                << strerror(e)
+                << SNAP_LOG_SEND;
+            return false;
+        }
+
+        // skip what was written, the last buffer may be partially written
+        //
+        std::size_t left(r);
+        while(idx < v.size()
+           && left >= v[idx].iov_len)
+        {
+            left -= v[idx].iov_len;
+            ++idx;
+        }
+        if(left > 0)
+        {
+            v[idx].iov_base = static_cast<char *>(v[idx].iov_base) + left;
+            v[idx].iov_len -= left;
+        }
+    }
+
+    return true;
+}
+
+
+
+
+//////////////////////
+// BUFFER MIME SINK //
+//////////////////////
+
+
+/** \brief Initialize a sink appending to a string.
+ *
+ * \param[in] buffer  The string where the data gets appended.
+ */
+buffer_mime_sink::buffer_mime_sink(std::string & buffer)
+    : f_buffer(buffer)
+{
+}
+
+
+/** \brief Append the buffers to the string.
+ *
+ * \param[in] iov  The array of buffers to append.
+ * \param[in] count  The number of buffers in \p iov.
+ *
+ * \return Always true.
+ */
+bool buffer_mime_sink::write(iovec const * iov, int count)
+{
+    std::size_t size(f_buffer.length());
+    for(int idx(0); idx < count; ++idx)
+    {
+        size += iov[idx].iov_len;
+    }
+    f_buffer.reserve(size);
+
+    for(int idx(0); idx < count; ++idx)
+    {
+        f_buffer.append(static_cast<char const *>(iov[idx].iov_base), iov[idx].iov_len);
+    }
+
+    return true;
+}
+
+
+
+
+////////////////////////
+// CALLBACK MIME SINK //
+////////////////////////
+
+
+/** \brief Initialize a sink calling a function with the data.
+ *
+ * \exception missing_parameter
+ * The callback cannot be nullptr.
+ *
+ * \param[in] callback  The function called with each buffer.
+ */
+callback_mime_sink::callback_mime_sink(callback_t callback)
+    : f_callback(callback)
+{
+    if(f_callback == nullptr)
+    {
+        throw missing_parameter("callback_mime_sink(): the callback cannot be nullptr.");
+    }
+}
+
+
+/** \brief Call the callback with each buffer.
+ *
+ * \param[in] iov  The array of buffers.
+ * \param[in] count  The number of buffers in \p iov.
+ *
+ * \return false if the callback returns false.
+ */
+bool callback_mime_sink::write(iovec const * iov, int count)
+{
+    for(int idx(0); idx < count; ++idx)
+    {
+        if(!f_callback(static_cast<char const *>(iov[idx].iov_base), iov[idx].iov_len))
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+
+
+/////////////////
+// MIME WRITER //
+/////////////////
+
+
+/** \brief Initialize a MIME writer.
+ *
+ * The sink must remain valid for the lifetime of the writer.
+ *
+ * The writer signs the emails with the default DKIM signer, if one
+ * was defined with set_default_dkim_signer().
+ *
+ * \param[in] sink  Where the emails get written.
+ */
+mime_writer::mime_writer(mime_sink & sink)
+    : f_sink(sink)
+    , f_dkim_signer(get_default_dkim_signer())
+{
+}
+
+
+/** \brief Change the DKIM signer of this writer.
+ *
+ * \param[in] signer  The signer to use or nullptr to not sign the emails.
+ */
+void mime_writer::set_dkim_signer(dkim_signer::pointer_t signer)
+{
+    f_dkim_signer = signer;
+}
+
+
+dkim_signer::pointer_t mime_writer::get_dkim_signer() const
+{
+    return f_dkim_signer;
+}
+
+
+/** \brief Allow parts to be written with an 8bit transfer encoding.
+ *
+ * When the transport negotiated 8BITMIME with the server (see
+ * transport::supports_8bitmime()), the parts which would otherwise be
+ * quoted-printable encoded can be written as is. That saves the
+ * encoding pass and the size expansion of quoted-printable (the
+ * "=XX" of each non-ASCII byte and the soft line breaks).
+ *
+ * A part only gets written as is if its data has no NUL, no CR by
+ * itself, and no line longer than 998 octets. Otherwise it still gets
+ * quoted-printable encoded. Base64 parts do not change.
+ *
+ * By default this is false since the email may end up going through
+ * a server which does not support 8BITMIME.
+ *
+ * \param[in] allow  Whether parts can be written with "8bit".
+ */
+void mime_writer::set_8bit(bool allow)
+{
+    f_8bit = allow;
+}
+
+
+bool mime_writer::get_8bit() const
+{
+    return f_8bit;
+}
+
+
+/** \brief Write an email without keeping its envelope.
+ *
+ * \param[in] e  The email to write.
+ *
+ * \return true if the sink accepted all the data.
+ */
+bool mime_writer::write_email(email const & e)
+{
+    envelope env;
+    return write_email(e, env);
+}
+
+
+/** \brief Write an email in its wire format.
+ *
+ * This function generates the envelope (sender and recipients) and writes
+ * the message itself (headers and body) to the sink. The message does not
+ * include any end of message marker such as the "." of SMTP.
+ *
+ * The recipients are all the addresses found in the To, Cc, and Bcc
+ * headers. The message is the same for all of them.
+ *
+ * \exception missing_parameter
+ * If the From header or the destination email only are missing or
+ * the email has no attachment (no body), this exception is raised.
+ *
+ * \exception invalid_parameter
+ * If the From, To, Cc, or Bcc email addresses cannot be parsed, this
+ * exception is raised.
+ *
+ * \param[in] e  The email to write.
+ * \param[out] env  The envelope to be used by the transport.
+ *
+ * \return true if the sink accepted all the data.
+ */
+bool mime_writer::write_email(email const & e, envelope & env)
+{
+    metrics_timer render_timer(metric_stage_t::METRIC_STAGE_RENDER);
+    std::size_t const start_bytes(f_bytes_written);
+
+    f_failed = false;
+    f_body_hash.reset();
+    f_hold = f_dkim_signer != nullptr;
+
+    // verify that the `From` and `To` headers are defined
+    //
+    std::string const from(e.get_header(HEADER_ID_FROM));
+    std::string const to(e.get_header(HEADER_ID_TO));
+
+    if(from.empty()
+    || to.empty())
+    {
+        throw missing_parameter("mime_writer::write_email() called without a From or a To header field defined. Make sure you call the set_from() and set_header() functions appropriately.");
+    }
+
+    // verify that we have at least one attachment
+    // (the body is an attachment)
+    //
+    int const max_attachments(e.get_attachment_count());
+    if(max_attachments < 1)
+    {
+        throw missing_parameter("mime_writer::write_email() called without at least one attachment (body).");
+    }
+
+    // we want to transform the body from HTML to text ahead of time
+    //
+    attachment const & body_attachment(e.get_attachment(0));
+
+    // TODO: verify that the body is indeed HTML!
+    //       although html_to_text works against plain text but that is a waste
+    //
+    //       also, we should offer a way for the person creating an email
+    //       to specify both: a plain text body and an HTML body
+    //
+    std::string plain_text;
+    std::string const body_mime_type(body_attachment.get_header(HEADER_ID_CONTENT_TYPE));
+
+    // TODO: this test is wrong as it would match things like "text/html-special"
+    //
+    if(body_mime_type.substr(0, 9) == "text/html")
+    {
+        // TODO: support other encoding, err if not supported
+        //
+        // the attachment keeps the data as given to
+        // quoted_printable_encode_and_set_data() so in most cases no
+        // decoding is necessary; if the user built the body with the
+        // encoding already in place, it gets decoded (once) here
+        //
+        plain_text = html_to_text::convert(body_attachment.get_raw_data());
+    }
+
+    // convert the "from" email address in a TLD email address so we can use
+    // the f_email_only version for the command line "sender" parameter
+    //
+    metrics_timer parse_timer(metric_stage_t::METRIC_STAGE_ADDRESS_PARSING);
+    tld_email_list from_list;
+    if(from_list.parse(from, 0) != TLD_RESULT_SUCCESS)
+    {
+        throw invalid_parameter(
+                  "mime_writer::write_email() called with invalid sender email address: \""
+                + from
+                + "\" (parsing failed).");
+    }
+    tld_email_list::tld_email_t s;
+    if(!from_list.next(s))
+    {
+        throw invalid_parameter(
+                  "mime_writer::write_email() called with invalid sender email address: \""
+                + from
+                + "\" (no email returned).");
+    }
+    parse_timer.stop();
+
+    // the envelope is what the transport uses (i.e. the MAIL FROM:
+    // and RCPT TO: of SMTP); all the addresses of the To, Cc, and Bcc
+    // become recipients so the email gets rendered and sent only once
+    //
+    env = envelope();
+    env.set_sender(s.f_email_only);
+    for(auto const id : {
+              HEADER_ID_TO
+            , HEADER_ID_CC
+            , HEADER_ID_BCC })
+    {
+        std::string const addresses(e.get_header(id));
+        if(!addresses.empty()
+        && !env.add_recipients(addresses))
+        {
+            throw invalid_parameter(
+                      std::string("mime_writer::write_email() called with invalid destination email address in ")
+                    + std::string(get_header_name(id))
+                    + ": \""
+                    + addresses
+                    + "\" (parsing failed).");
+        }
+    }
+    if(env.get_recipients().empty())
+    {
+        throw invalid_parameter(
+                  "mime_writer::write_email() called with invalid destination email address: \""
+                + to
+                + "\" (no email returned).");
+    }
+
+    // the headers of the email are written as is except for the few
+    // fields we add or change here
+    //
+    header_map_t const & headers(e.get_all_headers());
+    header_map_t overrides;
+    bool const body_only(max_attachments == 1 && plain_text.empty());
+    bool const raw_body(use_8bit(body_attachment));
+    std::string boundary;
+    if(body_only)
+    {
+        // if the body is by itself, then its encoding needs to be transported
+        // to the main set of headers
+        //
+        if(raw_body)
+        {
+            overrides[HEADER_ID_CONTENT_TRANSFER_ENCODING]
+                                = g_name_libmimemail_email_8bit;
+        }
+        else if(body_attachment.get_header(HEADER_ID_CONTENT_TRANSFER_ENCODING)
+                                == edhttp::g_name_edhttp_param_quoted_printable)
+        {
+            overrides[HEADER_ID_CONTENT_TRANSFER_ENCODING]
+                                = edhttp::g_name_edhttp_param_quoted_printable;
+        }
+    }
+    else
+    {
+        // boundary      := 0*69<bchars> bcharsnospace
+        // bchars        := bcharsnospace / " "
+        // bcharsnospace := DIGIT / ALPHA / "'" / "(" / ")" /
+        //                  "+" / "_" / "," / "-" / "." /
+        //                  "/" / ":" / "=" / "?"
+        //
+        // Note: we generate boundaries without special characters
+        //       (and especially no spaces or dashes) to make it simpler
+        //
+        // Note: the boundary starts wity "=S" which is not a valid
+        //       quoted-printable sequence of characters (on purpose)
+        //
+        char const allowed[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"; //'()+_,./:=?";
+        boundary.reserve(15 + 20);
+        boundary = "=Snap.Websites=";
+        for(int i(0); i < 20; ++i)
+        {
+            // this is just for boundaries, it just needs to not match
+            // anything in the emails; the generator is per thread so
+            // emails can be rendered in parallel
+            //
+            thread_local std::mt19937 generator(std::random_device{}());
+            int const c(static_cast<int>(generator() % (sizeof(allowed) - 1)));
+            boundary += allowed[c];
+        }
+        overrides[HEADER_ID_CONTENT_TYPE] = "multipart/mixed;\n  boundary=\"" + boundary + "\"";
+        overrides[HEADER_ID_MIME_VERSION] = "1.0";
+    }
+
+    // setup the "Date: ..." field if not already defined
+    //
+    if(headers.find(HEADER_ID_DATE) == headers.end())
+    {
+        // the date must be specified in English only which prevents us from
+        // using the strftime()
+        //
+        overrides[HEADER_ID_DATE] = edhttp::date_to_string(time(nullptr), edhttp::date_format_t::DATE_FORMAT_EMAIL);
+    }
+
+    // the keys let the bounce processing find the email which bounced
+    // (the DSN includes the headers of the original message)
+    //
+    if(!e.get_site_key().empty()
+    && headers.find(HEADER_ID_X_SITE_KEY) == headers.end())
+    {
+        overrides[HEADER_ID_X_SITE_KEY] = e.get_site_key();
+    }
+    if(!e.get_email_key().empty()
+    && headers.find(HEADER_ID_X_EMAIL_KEY) == headers.end())
+    {
+        overrides[HEADER_ID_X_EMAIL_KEY] = e.get_email_key();
+    }
+
+    // setup a default "Content-Language: ..." because in general
+    // that makes things work better
+    //
+    if(headers.find(HEADER_ID_CONTENT_LANGUAGE) == headers.end())
+    {
+        overrides[HEADER_ID_CONTENT_LANGUAGE] = "en-us";
+    }
+
+    // TODO: the header values need to be encoded to be valid in an
+    //       email; if some characters appear that need encoding, we
+    //       should err (we probably want to capture those in the
+    //       add_header() though)
+    //
+    add_headers(headers, overrides);
+
+    // XXX: allow administrators to change the `branding` flag
+    //
+    if(e.get_branding())
+    {
+        add(g_branding, sizeof(g_branding) - 1);
+    }
+
+    // end the headers
+    //
+    add("\n");
+
+    // the body hash gets computed as the body is added
+    //
+    std::size_t const header_iov(f_iov.size());
+    if(f_dkim_signer != nullptr)
+    {
+        f_body_hash = std::make_unique<dkim_body_hash>();
+    }
+
+    if(body_only)
+    {
+        // in this case we only have one entry, probably HTML, and thus we
+        // can avoid the multi-part headers and attachments
+        //
+        add_data(body_attachment, raw_body);
+        add("\n");
+    }
+    else
+    {
+        // TBD: should we make this text changeable by client?
+        //
+        add(g_multipart_preamble, sizeof(g_multipart_preamble) - 1);
+
+        add_copy("--" + boundary + "\n");
+        std::string const & boundary_line(f_strings.back());
+
+        int i(0);
+        if(!plain_text.empty())
+        {
+            // if we have plain text then we have alternatives
+            //
+            add(boundary_line);
+            add(edhttp::g_name_edhttp_field_content_type);
+            add(": ");
+            add(edhttp::g_name_edhttp_param_multipart_alternative);
+            add_copy(";\n  boundary=\"" + boundary + ".msg\"\n\n");
+
+            add_copy("--" + boundary + ".msg\n");
+            std::string const & alternative_line(f_strings.back());
+            bool const raw_text(f_8bit && is_8bit_safe(plain_text));
+            add(edhttp::g_name_edhttp_field_content_type);
+            add(": text/plain; charset=\"utf-8\"\n");
+            add(edhttp::g_name_edhttp_field_content_transfer_encoding);
+            add(": ");
+            add(raw_text
+                    ? g_name_libmimemail_email_8bit
+                    : edhttp::g_name_edhttp_param_quoted_printable);
+            add("\n");
+            add(edhttp::g_name_edhttp_field_content_description);
+            add(": Mail message body\n\n");
+            if(raw_text)
+            {
+                add_copy(std::move(plain_text));
+                if(!f_strings.back().empty()
+                && f_strings.back().back() != '\n')
+                {
+                    add("\n");
+                }
+            }
+            else
+            {
+                add_copy(quoted_printable_encode(
+                                  plain_text
+                                , edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD));
+            }
+            add("\n");
+
+            // at this time, this if() should always be true
+            //
+            if(i < max_attachments)
+            {
+                // now include the HTML
+                //
+                add(alternative_line);
+                header_map_t body_overrides;
+                if(raw_body)
+                {
+                    body_overrides[HEADER_ID_CONTENT_TRANSFER_ENCODING]
+                                        = g_name_libmimemail_email_8bit;
+                }
+                add_headers(body_attachment.get_all_headers(), body_overrides);
+
+                // one empty line to end the headers
+                //
+                add("\n");
+
+                // here the data in body_attachment is already encoded
+                // (unless we can send it as is)
+                //
+                std::string_view const data(raw_body
+                            ? body_attachment.get_payload()->get_raw_data_view()
+                            : body_attachment.get_data_view());
+                add(data);
+                if(!data.empty()
+                && data.back() != '\n')
+                {
+                    add("\n");
+                }
+                add_copy("--" + boundary + ".msg--\n\n");
+
+                // we used "attachment" 0, so print the others starting at 1
+                //
+                i = 1;
+            }
+        }
+
+        // send the remaining attachments (possibly attachment 0 if
+        // we did not have plain text)
+        //
+        for(; i < max_attachments; ++i)
+        {
+            // work on this attachment
+            //
+            attachment const & a(e.get_attachment(i));
+
+            // send the boundary
+            //
+            add(boundary_line);
+
+            // send the headers for that attachment
+            //
+            // the filename gets defined in both the Content-Disposition
+            // and the Content-Type
+            //
+            bool const raw(use_8bit(a));
+            header_map_t attachment_overrides;
+            copy_filename_to_content_type(a.get_all_headers(), attachment_overrides);
+            if(raw)
+            {
+                attachment_overrides[HEADER_ID_CONTENT_TRANSFER_ENCODING]
+                                    = g_name_libmimemail_email_8bit;
+            }
+            add_headers(a.get_all_headers(), attachment_overrides);
+
+            // one empty line to end the headers
+            //
+            add("\n");
+
+            add_data(a, raw);
+            add("\n");
+        }
+
+        // last boundary to end them all
+        //
+        add_copy("--" + boundary + "--\n");
+    }
+
+    // end the message (the transport adds the end of message marker,
+    // if any, such as the "." of sendmail and SMTP)
+    //
+    add("\n");
+
+    if(f_dkim_signer != nullptr)
+    {
+        // the body is complete, the signature goes first
+        //
+        std::string signature(f_dkim_signer->sign(
+                  f_iov.data()
+                , static_cast<int>(header_iov)
+                , f_body_hash->finish()));
+        f_body_hash.reset();
+        f_hold = false;
+        if(signature.empty())
+        {
+            f_iov.clear();
+            f_strings.clear();
+            return false;
+        }
+        f_strings.push_back(std::move(signature));
+        iovec v;
+        v.iov_base = const_cast<char *>(f_strings.back().data());
+        v.iov_len = f_strings.back().length();
+        f_iov.insert(f_iov.begin(), v);
+    }
+
+    bool const result(flush());
+    count_metric(metric_counter_t::METRIC_COUNTER_BYTES_RENDERED, f_bytes_written - start_bytes);
+    return result;
+}
+
+
+/** \brief Get the total number of bytes given to the sink.
+ *
+ * \return The number of bytes written so far.
+ */
+std::size_t mime_writer::get_bytes_written() const
+{
+    return f_bytes_written;
+}
+
+
+/** \brief Add a buffer to the output.
+ *
+ * The buffer is not copied. It has to remain valid until the next flush().
+ *
+ * \param[in] data  The data to add.
+ * \param[in] size  The size of \p data.
+ */
+void mime_writer::add(char const * data, std::size_t size)
+{
+    if(size == 0)
+    {
+        return;
+    }
+
+    if(f_body_hash != nullptr)
+    {
+        f_body_hash->add(data, size);
+    }
+
+    if(f_iov.size() >= MAX_IOVEC)
+    {
+        // flushing releases the strings, but the caller may still
+        // reference a few of these (i.e. the boundary line) so we
+        // only write the iovecs here
+        //
+        write_iov();
+    }
+
+    iovec v;
+    v.iov_base = const_cast<char *>(data);
+    v.iov_len = size;
+    f_iov.push_back(v);
+}
+
+
+void mime_writer::add(char const * data)
+{
+    add(data, strlen(data));
+}
+
+
+void mime_writer::add(std::string const & data)
+{
+    add(data.data(), data.length());
+}
+
+
+void mime_writer::add(std::string_view const & data)
+{
+    add(data.data(), data.length());
+}
+
+
+/** \brief Add the data of an attachment.
+ *
+ * In most cases, the data is already encoded and gets added as is. When
+ * the attachment is a file to be base64 encoded, the file gets encoded
+ * by blocks, each block being written to the sink before the next one
+ * gets encoded.
+ *
+ * When \p raw is true, the data is added without its transfer encoding
+ * (see use_8bit()).
+ *
+ * \param[in] a  The attachment whose data is to be added.
+ * \param[in] raw  Whether to add the data before encoding.
+ */
+void mime_writer::add_data(attachment const & a, bool raw)
+{
+    attachment_payload::pointer_t const payload(a.get_payload());
+    if(raw)
+    {
+        add(payload->get_raw_data_view());
+        return;
+    }
+
+    if(payload == nullptr
+    || !payload->is_raw_file()
+    || payload->get_encoding() != content_encoding_t::CONTENT_ENCODING_BASE64)
+    {
+        // here the data is already encoded
+        //
+        add(a.get_data_view());
+        return;
+    }
+
+    std::string_view const raw_data(payload->get_raw_data_view());
+    base64_encoder encoder;
+    for(std::size_t pos(0); pos < raw_data.length(); pos += STREAM_BLOCK_SIZE)
+    {
+        encoder.add_input(raw_data.substr(pos, STREAM_BLOCK_SIZE));
+        if(f_hold)
+        {
+            // the block cannot be written before the signature
+            //
+            add_copy(std::move(encoder.get_output()));
+        }
+        else
+        {
+            add(encoder.get_output());
+            write_iov();
+        }
+        encoder.get_output().clear();
+    }
+    encoder.finish();
+    add_copy(std::move(encoder.get_output()));
+}
+
+
+/** \brief Check whether an attachment can be written as is.
+ *
+ * When 8bit is allowed (see set_8bit()), a quoted-printable part gets
+ * written before encoding if its data is valid in an 8bit body. For
+ * payloads created from the raw data (i.e. with
+ * attachment::quoted_printable_encode_and_set_data()), this means the
+ * quoted-printable version never gets computed.
+ *
+ * \param[in] a  The attachment to check.
+ *
+ * \return true if the data of \p a can be written with "8bit".
+ */
+bool mime_writer::use_8bit(attachment const & a) const
+{
+    if(!f_8bit)
+    {
+        return false;
+    }
+
+    attachment_payload::pointer_t const payload(a.get_payload());
+    return payload != nullptr
+        && payload->get_encoding() == content_encoding_t::CONTENT_ENCODING_QUOTED_PRINTABLE
+        && is_8bit_safe(payload->get_raw_data_view());
+}
+
+
+/** \brief Add a string generated by the writer.
+ *
+ * The string is kept by the writer until the end of the email.
+ *
+ * \param[in] data  The data to add.
+ */
+void mime_writer::add_copy(std::string && data)
+{
+    f_strings.push_back(std::move(data));
+    add(f_strings.back());
+}
+
+
+void mime_writer::add_header(
+      snapdev::case_insensitive_string const & name
+    , std::string const & value)
+{
+    add(name.data(), name.length());
+    add(": ");
+    add(value);
+    add("\n");
+}
+
+
+/** \brief Add a set of headers.
+ *
+ * The \p overrides replace or complement the \p headers. The result is
+ * the same as if the overrides had been copied in the headers, without
+ * having to copy the headers: a replaced header keeps its position and
+ * the new headers get written last, in the order they were added.
+ *
+ * The Bcc header is never written. Its addresses only appear in the
+ * envelope, this is what makes those recipients blind.
+ *
+ * The overrides are generally temporary so they get copied.
+ *
+ * \param[in] headers  The headers to write.
+ * \param[in] overrides  The header fields to write instead.
+ */
+void mime_writer::add_headers(header_map_t const & headers, header_map_t const & overrides)
+{
+    for(auto h(headers.begin()); h != headers.end(); ++h)
+    {
+        header_id_t const id(headers.get_id(h));
+        if(id == HEADER_ID_BCC)
+        {
+            continue;
+        }
+
+        auto const o(id == HEADER_ID_UNKNOWN
+                        ? overrides.find(h->first)
+                        : overrides.find(id));
+        if(o == overrides.end())
+        {
+            add_header(h->first, h->second);
+        }
+        else
+        {
+            add_copy(snapdev::to_string(h->first) + ": " + o->second + "\n");
+        }
+    }
+
+    for(auto o(overrides.begin()); o != overrides.end(); ++o)
+    {
+        header_id_t const id(overrides.get_id(o));
+        if((id == HEADER_ID_UNKNOWN
+                ? headers.find(o->first)
+                : headers.find(id)) == headers.end())
+        {
+            add_copy(snapdev::to_string(o->first) + ": " + o->second + "\n");
+        }
+    }
+}
+
+
+/** \brief Send the collected buffers to the sink.
+ *
+ * \return true if no errors happened while writing this email.
+ */
+bool mime_writer::flush()
+{
+    write_iov();
+    f_strings.clear();
+
+    return !f_failed;
+}
+
+
+/** \brief Write the buffers added so far to the sink.
+ *
+ * Contrary to flush(), this function does not release the strings
+ * created by the writer.
+ *
+ * While the writer waits on the DKIM signature, the buffers are kept
+ * and this function does nothing.
+ */
+void mime_writer::write_iov()
+{
+    if(f_iov.empty()
+    || f_hold)
+    {
+        return;
+    }
+
+    for(std::size_t pos(0); pos < f_iov.size() && !f_failed; pos += MAX_IOVEC)
+    {
+        std::size_t const count(std::min(f_iov.size() - pos, MAX_IOVEC));
+        if(!f_sink.write(f_iov.data() + pos, static_cast<int>(count)))
+        {
+            f_failed = true;
+        }
+    }
+    for(auto const & v : f_iov)
+    {
+        f_bytes_written += v.iov_len;
+    }
+    f_iov.clear();
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
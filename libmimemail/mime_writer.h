@@ -0,0 +1,145 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/dkim.h>
+#include    <libmimemail/email.h>
+
+
+// C++
+//
+#include    <deque>
+#include    <functional>
+#include    <memory>
+#include    <string_view>
+
+
+// C
+//
+#include    <sys/uio.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class mime_sink
+{
+public:
+    typedef std::shared_ptr<mime_sink>      pointer_t;
+
+    virtual                 ~mime_sink();
+
+    virtual bool            write(iovec const * iov, int count) = 0;
+};
+
+
+class fd_mime_sink
+    : public mime_sink
+{
+public:
+                            fd_mime_sink(int fd);
+
+    virtual bool            write(iovec const * iov, int count) override;
+
+private:
+    int                     f_fd = -1;
+    bool                    f_is_socket = false;
+};
+
+
+class buffer_mime_sink
+    : public mime_sink
+{
+public:
+                            buffer_mime_sink(std::string & buffer);
+
+    virtual bool            write(iovec const * iov, int count) override;
+
+private:
+    std::string &           f_buffer;
+};
+
+
+class callback_mime_sink
+    : public mime_sink
+{
+public:
+    typedef std::function<bool(char const * data, std::size_t size)>   callback_t;
+
+                            callback_mime_sink(callback_t callback);
+
+    virtual bool            write(iovec const * iov, int count) override;
+
+private:
+    callback_t              f_callback = callback_t();
+};
+
+
+class mime_writer
+{
+public:
+                            mime_writer(mime_sink & sink);
+                            mime_writer(mime_writer const &) = delete;
+
+    mime_writer &           operator = (mime_writer const &) = delete;
+
+    void                    set_dkim_signer(dkim_signer::pointer_t signer);
+    dkim_signer::pointer_t  get_dkim_signer() const;
+    void                    set_8bit(bool allow);
+    bool                    get_8bit() const;
+
+    bool                    write_email(email const & e, envelope & env);
+    bool                    write_email(email const & e);
+    std::size_t             get_bytes_written() const;
+
+private:
+    void                    add(char const * data, std::size_t size);
+    void                    add(char const * data);
+    void                    add(std::string const & data);
+    void                    add(std::string_view const & data);
+    void                    add_copy(std::string && data);
+    void                    add_data(attachment const & a, bool raw);
+    bool                    use_8bit(attachment const & a) const;
+    void                    add_header(
+                                  snapdev::case_insensitive_string const & name
+                                , std::string const & value);
+    void                    add_headers(header_map_t const & headers, header_map_t const & overrides);
+    bool                    flush();
+    void                    write_iov();
+
+    mime_sink &             f_sink;
+    std::vector<iovec>      f_iov = std::vector<iovec>();
+    std::deque<std::string> f_strings = std::deque<std::string>();
+    std::size_t             f_bytes_written = 0;
+    bool                    f_failed = false;
+    dkim_signer::pointer_t  f_dkim_signer = dkim_signer::pointer_t();
+    std::unique_ptr<dkim_body_hash>
+                            f_body_hash = std::unique_ptr<dkim_body_hash>();
+    bool                    f_hold = false;
+    bool                    f_8bit = false;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,504 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Process wide cache of MX lookups.
+ *
+ * Mail senders look up the same few domains over and over. This cache
+ * keeps the mail_exchangers found for each domain until the TTL of the
+ * DNS answer expires.
+ *
+ * The cache is read-mostly: a hit only takes a shared lock. When several
+ * threads look up the same domain at the same time, only the first one
+ * queries the DNS; the others wait on its result.
+ */
+
+// self
+//
+#include    "libmimemail/mx_cache.h"
+
+#include    "libmimemail/exception.h"
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cctype>
+#include    <mutex>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Initialize the cache.
+ *
+ * The cache is a singleton, use get_instance() to access it.
+ */
+mx_cache::mx_cache()
+{
+}
+
+
+/** \brief Retrieve the process wide MX cache.
+ *
+ * \return A reference to the MX cache.
+ */
+mx_cache & mx_cache::get_instance()
+{
+    static mx_cache cache;
+    return cache;
+}
+
+
+/** \brief Enable or disable the cache.
+ *
+ * When disabled, lookup() always queries the DNS and does not save the
+ * results. Entries already in the cache are kept.
+ *
+ * \param[in] enabled  Whether the cache is used.
+ */
+void mx_cache::set_enabled(bool enabled)
+{
+    f_enabled = enabled;
+}
+
+
+/** \brief Check whether the cache is enabled.
+ *
+ * \return true if lookup() uses the cache.
+ */
+bool mx_cache::is_enabled() const
+{
+    return f_enabled;
+}
+
+
+/** \brief Set the minimum time a positive result is kept.
+ *
+ * Some domains use very small TTLs. This sets a floor so we do not
+ * query those over and over.
+ *
+ * \param[in] ttl  The minimum TTL in seconds.
+ */
+void mx_cache::set_min_ttl(std::uint32_t ttl)
+{
+    f_min_ttl = ttl;
+}
+
+
+/** \brief Set the maximum time a positive result is kept.
+ *
+ * \param[in] ttl  The maximum TTL in seconds.
+ */
+void mx_cache::set_max_ttl(std::uint32_t ttl)
+{
+    f_max_ttl = ttl;
+}
+
+
+/** \brief Set the maximum time a negative result is kept.
+ *
+ * Negative results (i.e. is_negative() returns true: NXDOMAIN, NODATA
+ * or a null MX) are kept for the negative TTL of the SOA, limited to
+ * this value. When the DNS did not give us a TTL, this value is used
+ * as is.
+ *
+ * \param[in] ttl  The negative TTL in seconds.
+ */
+void mx_cache::set_negative_ttl(std::uint32_t ttl)
+{
+    f_negative_ttl = ttl;
+}
+
+
+/** \brief Set the time a failed query is kept.
+ *
+ * When a query fails for a transient reason (server failure, time out,
+ * invalid answer, etc.) the result is only kept for this many seconds.
+ * This prevents a burst of emails to the same domain from hammering
+ * the DNS while still retrying soon. Use 0 to not cache such failures.
+ *
+ * \param[in] ttl  The failure TTL in seconds.
+ */
+void mx_cache::set_failure_ttl(std::uint32_t ttl)
+{
+    f_failure_ttl = ttl;
+}
+
+
+/** \brief Set the maximum number of entries in the cache.
+ *
+ * \exception invalid_parameter
+ * The size must be at least 1.
+ *
+ * \param[in] size  The maximum number of domains to keep.
+ */
+void mx_cache::set_max_size(std::size_t size)
+{
+    if(size == 0)
+    {
+        throw invalid_parameter("mx_cache::set_max_size(): the size must be at least 1.");
+    }
+    f_max_size = size;
+}
+
+
+/** \brief Retrieve the mail exchangers of a domain.
+ *
+ * If the domain is in the cache and did not yet expire, the cached
+ * result is returned. If another thread is already querying that domain,
+ * this function waits for that result. Otherwise the DNS gets queried
+ * and the result saved in the cache.
+ *
+ * \param[in] domain  The domain to look up.
+ *
+ * \return The mail exchangers of \p domain.
+ */
+mail_exchangers::pointer_t mx_cache::lookup(std::string const & domain)
+{
+    if(!f_enabled)
+    {
+        ++f_misses;
+        return mail_exchangers::query(domain);
+    }
+
+    std::string const key(get_key(domain));
+    clock_t::time_point const now(clock_t::now());
+
+    // fast path, the entry exists
+    //
+    {
+        std::shared_lock<std::shared_mutex> lock(f_mutex);
+        auto it(f_entries.find(key));
+        if(it != f_entries.end()
+        && it->second.f_expires > now)
+        {
+            future_t result(it->second.f_result);
+            lock.unlock();
+
+            if(result.wait_for(std::chrono::seconds(0)) == std::future_status::ready)
+            {
+                ++f_hits;
+            }
+            else
+            {
+                // a pending entry has an f_expires of time_point::max()
+                //
+                ++f_coalesced;
+            }
+            return result.get();
+        }
+    }
+
+    std::promise<mail_exchangers::pointer_t> promise;
+    std::uint64_t id(0);
+    {
+        std::unique_lock<std::shared_mutex> lock(f_mutex);
+
+        // another thread may have added the entry in between
+        //
+        auto it(f_entries.find(key));
+        if(it != f_entries.end()
+        && it->second.f_expires > now)
+        {
+            future_t result(it->second.f_result);
+            lock.unlock();
+            ++f_coalesced;
+            return result.get();
+        }
+
+        if(it == f_entries.end())
+        {
+            make_room(now);
+        }
+
+        entry & e(f_entries[key]);
+        e.f_result = promise.get_future().share();
+        e.f_expires = clock_t::time_point::max();
+        e.f_id = ++f_next_id;
+        id = e.f_id;
+    }
+
+    ++f_misses;
+
+    mail_exchangers::pointer_t result;
+    try
+    {
+        result = mail_exchangers::query(domain);
+    }
+    catch(...)
+    {
+        // do not keep a failed entry, the next lookup will try again
+        //
+        promise.set_exception(std::current_exception());
+        {
+            std::unique_lock<std::shared_mutex> lock(f_mutex);
+            auto it(f_entries.find(key));
+            if(it != f_entries.end()
+            && it->second.f_id == id)
+            {
+                f_entries.erase(it);
+            }
+        }
+        throw;
+    }
+
+    promise.set_value(result);
+
+    {
+        std::unique_lock<std::shared_mutex> lock(f_mutex);
+        auto it(f_entries.find(key));
+        if(it != f_entries.end()
+        && it->second.f_id == id)   // the cache may have been cleared meanwhile
+        {
+            it->second.f_expires = clock_t::now() + std::chrono::seconds(get_cache_ttl(*result));
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Search the cache without querying the DNS.
+ *
+ * This function returns the cached mail exchangers of \p domain if
+ * available. It does not wait for pending queries.
+ *
+ * \param[in] domain  The domain to search.
+ *
+ * \return The cached mail exchangers or nullptr.
+ */
+mail_exchangers::pointer_t mx_cache::find(std::string const & domain)
+{
+    if(!f_enabled)
+    {
+        return mail_exchangers::pointer_t();
+    }
+
+    std::string const key(get_key(domain));
+    clock_t::time_point const now(clock_t::now());
+
+    future_t result;
+    {
+        std::shared_lock<std::shared_mutex> lock(f_mutex);
+        auto it(f_entries.find(key));
+        if(it == f_entries.end()
+        || it->second.f_expires <= now
+        || it->second.f_expires == clock_t::time_point::max())
+        {
+            return mail_exchangers::pointer_t();
+        }
+        result = it->second.f_result;
+    }
+
+    ++f_hits;
+    return result.get();
+}
+
+
+/** \brief Save the result of a query made outside of the cache.
+ *
+ * The asynchronous resolver (see mx_resolver) queries the DNS itself
+ * and saves its results here. An entry pending on a lookup() is not
+ * replaced.
+ *
+ * \param[in] domain  The domain that was queried.
+ * \param[in] mx  The mail exchangers of \p domain.
+ */
+void mx_cache::store(std::string const & domain, mail_exchangers::pointer_t mx)
+{
+    if(!f_enabled
+    || mx == nullptr)
+    {
+        return;
+    }
+
+    std::string const key(get_key(domain));
+    clock_t::time_point const now(clock_t::now());
+
+    std::promise<mail_exchangers::pointer_t> promise;
+    promise.set_value(mx);
+
+    std::unique_lock<std::shared_mutex> lock(f_mutex);
+    auto it(f_entries.find(key));
+    if(it == f_entries.end())
+    {
+        make_room(now);
+    }
+    else if(it->second.f_expires == clock_t::time_point::max())
+    {
+        return;
+    }
+    entry & e(f_entries[key]);
+    e.f_result = promise.get_future().share();
+    e.f_expires = now + std::chrono::seconds(get_cache_ttl(*mx));
+    e.f_id = ++f_next_id;
+}
+
+
+/** \brief Remove all the entries from the cache.
+ *
+ * Threads waiting on a pending query still get their result.
+ */
+void mx_cache::clear()
+{
+    std::unique_lock<std::shared_mutex> lock(f_mutex);
+    f_entries.clear();
+}
+
+
+/** \brief Retrieve the cache statistics.
+ *
+ * \return The number of hits, misses, coalesced lookups, and the current
+ * size of the cache.
+ */
+mx_cache_statistics mx_cache::get_statistics() const
+{
+    mx_cache_statistics stats;
+    stats.f_hits = f_hits;
+    stats.f_misses = f_misses;
+    stats.f_coalesced = f_coalesced;
+    {
+        std::shared_lock<std::shared_mutex> lock(f_mutex);
+        stats.f_size = f_entries.size();
+    }
+    return stats;
+}
+
+
+/** \brief Reset the hit, miss, and coalesced counters to zero.
+ */
+void mx_cache::reset_statistics()
+{
+    f_hits = 0;
+    f_misses = 0;
+    f_coalesced = 0;
+}
+
+
+/** \brief Transform a domain name in a cache key.
+ *
+ * \param[in] domain  The domain name.
+ *
+ * \return The domain in lowercase.
+ */
+std::string mx_cache::get_key(std::string const & domain)
+{
+    std::string key(domain);
+    std::transform(
+              key.begin()
+            , key.end()
+            , key.begin()
+            , [](char c) { return std::tolower(static_cast<unsigned char>(c)); });
+    return key;
+}
+
+
+/** \brief Compute the number of seconds to keep a result.
+ *
+ * \param[in] mx  The result of the DNS query.
+ *
+ * \return The number of seconds to keep \p mx in the cache.
+ */
+std::uint32_t mx_cache::get_cache_ttl(mail_exchangers const & mx) const
+{
+    std::uint32_t const ttl(mx.get_ttl());
+    if(!mx.domain_found())
+    {
+        if(!mx.is_negative())
+        {
+            // transient failure, do not remember it for long
+            //
+            return f_failure_ttl;
+        }
+
+        std::uint32_t const negative_ttl(f_negative_ttl);
+        if(ttl == 0)
+        {
+            return negative_ttl;
+        }
+        return std::min(ttl, negative_ttl);
+    }
+
+    std::uint32_t const min_ttl(f_min_ttl);
+    std::uint32_t const max_ttl(std::max(min_ttl, static_cast<std::uint32_t>(f_max_ttl)));
+    return std::clamp(ttl, min_ttl, max_ttl);
+}
+
+
+/** \brief Make room for one more entry.
+ *
+ * The function first removes the expired entries. If the cache is still
+ * full, the entries which expire the soonest get removed.
+ *
+ * \note
+ * The caller must hold the unique lock.
+ *
+ * \param[in] now  The current time.
+ */
+void mx_cache::make_room(clock_t::time_point now)
+{
+    std::size_t const max_size(f_max_size);
+    if(f_entries.size() < max_size)
+    {
+        return;
+    }
+
+    for(auto it(f_entries.begin()); it != f_entries.end(); )
+    {
+        if(it->second.f_expires <= now)
+        {
+            it = f_entries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    while(f_entries.size() >= max_size)
+    {
+        auto oldest(std::min_element(
+                  f_entries.begin()
+                , f_entries.end()
+                , [](auto const & a, auto const & b)
+                {
+                    return a.second.f_expires < b.second.f_expires;
+                }));
+        if(oldest->second.f_expires == clock_t::time_point::max())
+        {
+            // only pending entries left, those cannot be removed
+            //
+            break;
+        }
+        f_entries.erase(oldest);
+    }
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
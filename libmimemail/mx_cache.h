@@ -0,0 +1,125 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/mail_exchanger.h>
+
+
+// C++
+//
+#include    <atomic>
+#include    <chrono>
+#include    <future>
+#include    <map>
+#include    <shared_mutex>
+
+
+
+namespace libmimemail
+{
+
+
+
+struct mx_cache_statistics
+{
+    std::uint64_t           f_hits = 0;         // found a valid entry
+    std::uint64_t           f_misses = 0;       // had to query the DNS
+    std::uint64_t           f_coalesced = 0;    // waited on another thread's query
+    std::size_t             f_size = 0;         // number of entries
+};
+
+
+class mx_cache
+{
+public:
+    static constexpr std::uint32_t const    DEFAULT_MIN_TTL = 60;           // 1 minute
+    static constexpr std::uint32_t const    DEFAULT_MAX_TTL = 86400;        // 1 day
+    static constexpr std::uint32_t const    DEFAULT_NEGATIVE_TTL = 300;     // 5 minutes
+    static constexpr std::uint32_t const    DEFAULT_FAILURE_TTL = 5;        // 5 seconds
+    static constexpr std::size_t const      DEFAULT_MAX_SIZE = 10000;
+
+                            mx_cache(mx_cache const &) = delete;
+    mx_cache &              operator = (mx_cache const &) = delete;
+
+    static mx_cache &       get_instance();
+
+    void                    set_enabled(bool enabled);
+    bool                    is_enabled() const;
+    void                    set_min_ttl(std::uint32_t ttl);
+    void                    set_max_ttl(std::uint32_t ttl);
+    void                    set_negative_ttl(std::uint32_t ttl);
+    void                    set_failure_ttl(std::uint32_t ttl);
+    void                    set_max_size(std::size_t size);
+
+    mail_exchangers::pointer_t
+                            lookup(std::string const & domain);
+    mail_exchangers::pointer_t
+                            find(std::string const & domain);
+    void                    store(std::string const & domain, mail_exchangers::pointer_t mx);
+    void                    clear();
+    mx_cache_statistics     get_statistics() const;
+    void                    reset_statistics();
+
+private:
+    typedef std::chrono::steady_clock                   clock_t;
+    typedef std::shared_future<mail_exchangers::pointer_t>
+                                                        future_t;
+
+    struct entry
+    {
+        future_t                f_result = future_t();
+        clock_t::time_point     f_expires = clock_t::time_point::max();
+        std::uint64_t           f_id = 0;
+    };
+    typedef std::map<std::string, entry>                entry_map_t;
+
+                            mx_cache();
+
+    static std::string      get_key(std::string const & domain);
+    std::uint32_t           get_cache_ttl(mail_exchangers const & mx) const;
+    void                    make_room(clock_t::time_point now);
+
+    mutable std::shared_mutex
+                            f_mutex = std::shared_mutex();
+    entry_map_t             f_entries = entry_map_t();
+    std::uint64_t           f_next_id = 0;
+    std::atomic<bool>       f_enabled = true;
+    std::atomic<std::uint32_t>
+                            f_min_ttl = DEFAULT_MIN_TTL;
+    std::atomic<std::uint32_t>
+                            f_max_ttl = DEFAULT_MAX_TTL;
+    std::atomic<std::uint32_t>
+                            f_negative_ttl = DEFAULT_NEGATIVE_TTL;
+    std::atomic<std::uint32_t>
+                            f_failure_ttl = DEFAULT_FAILURE_TTL;
+    std::atomic<std::size_t>
+                            f_max_size = DEFAULT_MAX_SIZE;
+    std::atomic<std::uint64_t>
+                            f_hits = 0;
+    std::atomic<std::uint64_t>
+                            f_misses = 0;
+    std::atomic<std::uint64_t>
+                            f_coalesced = 0;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
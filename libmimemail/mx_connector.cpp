@@ -0,0 +1,750 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Connect to the best available mail exchanger of a domain.
+ *
+ * Trying the mail exchangers one at a time means a dead or slow primary
+ * MX costs a full connect timeout before we fall back to the next one,
+ * and that for each message sent to that domain.
+ *
+ * The mx_connector instead races the connections to all the hosts of
+ * the same priority. The attempts are staggered (a new attempt starts
+ * every 250ms or as soon as one fails) and the IPv6 and IPv4 addresses
+ * of each host are interleaved as described in RFC 8305 (Happy Eyeballs
+ * version 2). The first connection to succeed wins and the others get
+ * closed. The next priority is only tried if all the hosts of the
+ * current priority failed.
+ *
+ * The connector also remembers which hosts failed with a circuit
+ * breaker. A host which failed is skipped (its circuit is open) for a
+ * while. Once that time elapsed, one connection is attempted again (the
+ * circuit is half-open). If that works, the host is healthy again (the
+ * circuit is closed). If not, the host gets skipped for twice as long,
+ * up to a maximum. This way one bad MX does not stall the queue of all
+ * the emails going to that domain.
+ *
+ * The connector is process wide so all the transports share the same
+ * view of which hosts are healthy.
+ */
+
+// self
+//
+#include    "libmimemail/mx_connector.h"
+
+#include    "libmimemail/exception.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// C
+//
+#include    <errno.h>
+#include    <netdb.h>
+#include    <poll.h>
+#include    <string.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief One address to which a connection can be attempted.
+ */
+struct address_t
+{
+    std::size_t             f_host = 0;
+    int                     f_family = AF_UNSPEC;
+    sockaddr_storage        f_address = sockaddr_storage();
+    socklen_t               f_length = 0;
+};
+
+
+/** \brief A connection in progress.
+ */
+struct attempt_t
+{
+    int                     f_socket = -1;
+    std::size_t             f_address = 0;
+};
+
+
+
+} // no name namespace
+
+
+
+/** \brief Initialize the connector.
+ *
+ * The connector is a singleton, use get_instance() to access it.
+ */
+mx_connector::mx_connector()
+{
+}
+
+
+/** \brief Retrieve the process wide connector.
+ *
+ * \return A reference to the connector.
+ */
+mx_connector & mx_connector::get_instance()
+{
+    static mx_connector connector;
+    return connector;
+}
+
+
+/** \brief Set the delay between two connection attempts.
+ *
+ * When a connection attempt does not succeed or fail within this delay,
+ * the next address gets tried in parallel. RFC 8305 recommends 250ms.
+ *
+ * \exception invalid_parameter
+ * The delay must be positive.
+ *
+ * \param[in] ms  The delay in milliseconds.
+ */
+void mx_connector::set_attempt_delay(int ms)
+{
+    if(ms <= 0)
+    {
+        throw invalid_parameter("mx_connector::set_attempt_delay(): the delay must be positive.");
+    }
+    f_attempt_delay = ms;
+}
+
+
+int mx_connector::get_attempt_delay() const
+{
+    return f_attempt_delay;
+}
+
+
+/** \brief Set the time allowed to connect to the hosts of one priority.
+ *
+ * All the attempts to the hosts of one priority have to succeed within
+ * this time. Hosts still not connected by then are considered unhealthy.
+ *
+ * \exception invalid_parameter
+ * The timeout must be positive.
+ *
+ * \param[in] seconds  The timeout in seconds.
+ */
+void mx_connector::set_timeout(int seconds)
+{
+    if(seconds <= 0)
+    {
+        throw invalid_parameter("mx_connector::set_timeout(): the timeout must be positive.");
+    }
+    f_timeout = seconds;
+}
+
+
+int mx_connector::get_timeout() const
+{
+    return f_timeout;
+}
+
+
+/** \brief Set the number of failures before a host gets skipped.
+ *
+ * \exception invalid_parameter
+ * The threshold must be at least 1.
+ *
+ * \param[in] threshold  The number of consecutive failures which open
+ * the circuit of a host.
+ */
+void mx_connector::set_failure_threshold(std::size_t threshold)
+{
+    if(threshold == 0)
+    {
+        throw invalid_parameter("mx_connector::set_failure_threshold(): the threshold must be at least 1.");
+    }
+    f_failure_threshold = threshold;
+}
+
+
+std::size_t mx_connector::get_failure_threshold() const
+{
+    return f_failure_threshold;
+}
+
+
+/** \brief Set how long an unhealthy host gets skipped.
+ *
+ * The first time the circuit of a host opens, it stays open for
+ * \p seconds. Each time the trial connection fails, that duration
+ * doubles, up to \p max_seconds.
+ *
+ * \exception invalid_parameter
+ * The durations must be positive and \p max_seconds cannot be smaller
+ * than \p seconds.
+ *
+ * \param[in] seconds  The initial duration in seconds.
+ * \param[in] max_seconds  The maximum duration in seconds.
+ */
+void mx_connector::set_open_duration(int seconds, int max_seconds)
+{
+    if(seconds <= 0
+    || max_seconds < seconds)
+    {
+        throw invalid_parameter("mx_connector::set_open_duration(): the durations must be positive and the maximum at least as large as the initial duration.");
+    }
+    f_open_duration = seconds;
+    f_max_open_duration = max_seconds;
+}
+
+
+/** \brief Connect to one of the mail exchangers.
+ *
+ * The exchangers are tried by priority. The connections to all the
+ * healthy hosts of the same priority are raced and the first one to
+ * connect wins. Hosts with an open circuit and the hosts listed in
+ * \p exclude are skipped.
+ *
+ * The returned socket is non-blocking and connected at the TCP level.
+ * The caller is expected to verify that the server works (i.e. that it
+ * greets us with a 220) and then call report_success() or
+ * report_failure() with the name saved in \p host.
+ *
+ * \param[in] exchangers  The mail exchangers of the domain.
+ * \param[in] port  The port to connect to.
+ * \param[out] host  The name of the host the socket is connected to.
+ * \param[in] exclude  Hosts which should not be tried.
+ *
+ * \return The connected socket or -1 if no host could be reached.
+ */
+int mx_connector::connect(
+      mail_exchanger::mail_exchange_vector_t const & exchangers
+    , int port
+    , std::string & host
+    , host_set_t const & exclude)
+{
+    host.clear();
+
+    mail_exchanger::mail_exchange_vector_t mx(exchangers);
+    std::stable_sort(mx.begin(), mx.end());
+
+    std::size_t idx(0);
+    while(idx < mx.size())
+    {
+        int const priority(mx[idx].get_priority());
+        std::vector<std::string> hosts;
+        for(; idx < mx.size() && mx[idx].get_priority() == priority; ++idx)
+        {
+            std::string const name(mx[idx].get_domain());
+            if(exclude.find(name) == exclude.end()
+            && std::find(hosts.begin(), hosts.end(), name) == hosts.end()
+            && acquire(name, port))
+            {
+                hosts.push_back(name);
+            }
+        }
+        if(hosts.empty())
+        {
+            continue;
+        }
+
+        int const s(race(hosts, port, host));
+        if(s != -1)
+        {
+            return s;
+        }
+    }
+
+    return -1;
+}
+
+
+/** \brief Get the circuit breaker state of a host.
+ *
+ * \param[in] host  The name of the host.
+ * \param[in] port  The port of the host.
+ *
+ * \return The state of the circuit of that host.
+ */
+circuit_state_t mx_connector::get_state(std::string const & host, int port) const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    auto const it(f_health.find(get_key(host, port)));
+    if(it == f_health.end()
+    || it->second.f_failures < f_failure_threshold)
+    {
+        return circuit_state_t::CIRCUIT_STATE_CLOSED;
+    }
+    if(it->second.f_trial
+    || clock_t::now() < it->second.f_open_until)
+    {
+        return circuit_state_t::CIRCUIT_STATE_OPEN;
+    }
+    return circuit_state_t::CIRCUIT_STATE_HALF_OPEN;
+}
+
+
+/** \brief Mark a host as healthy.
+ *
+ * This closes the circuit of the host.
+ *
+ * \param[in] host  The name of the host.
+ * \param[in] port  The port of the host.
+ */
+void mx_connector::report_success(std::string const & host, int port)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_health.erase(get_key(host, port));
+}
+
+
+/** \brief Mark a host as unhealthy.
+ *
+ * Once the host failed enough times in a row (see
+ * set_failure_threshold()), its circuit opens and the host gets skipped
+ * for a while (see set_open_duration()). If the host was being tried
+ * again (half-open circuit), it gets skipped for twice as long as the
+ * previous time.
+ *
+ * \param[in] host  The name of the host.
+ * \param[in] port  The port of the host.
+ */
+void mx_connector::report_failure(std::string const & host, int port)
+{
+    clock_t::duration duration;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+
+        health & h(f_health[get_key(host, port)]);
+        ++h.f_failures;
+        h.f_trial = false;
+        if(h.f_failures < f_failure_threshold)
+        {
+            return;
+        }
+
+        clock_t::duration const max_duration(std::chrono::seconds(f_max_open_duration.load()));
+        if(h.f_open_duration == clock_t::duration())
+        {
+            h.f_open_duration = std::chrono::seconds(f_open_duration.load());
+        }
+        else
+        {
+            h.f_open_duration *= 2;
+        }
+        if(h.f_open_duration > max_duration)
+        {
+            h.f_open_duration = max_duration;
+        }
+        h.f_open_until = clock_t::now() + h.f_open_duration;
+        duration = h.f_open_duration;
+    }
+
+    SNAP_LOG_WARNING
+        << "SMTP server "
+        << host
+        << ":"
+        << port
+        << " is unhealthy, it will be skipped for "
+        << std::chrono::duration_cast<std::chrono::seconds>(duration).count()
+        << " seconds."
+        << SNAP_LOG_SEND;
+}
+
+
+/** \brief Forget about the health of all the hosts.
+ *
+ * All the circuits get closed.
+ */
+void mx_connector::reset()
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_health.clear();
+}
+
+
+std::string mx_connector::get_key(std::string const & host, int port)
+{
+    std::string key(host);
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    key += ':';
+    key += std::to_string(port);
+    return key;
+}
+
+
+/** \brief Check whether a host can be tried.
+ *
+ * A host with a closed circuit can always be tried. A host with an open
+ * circuit is skipped until its time is up. Then only one caller gets to
+ * try it while the others keep skipping it until that trial is over
+ * (see report_success(), report_failure(), and release()).
+ *
+ * \param[in] host  The name of the host.
+ * \param[in] port  The port of the host.
+ *
+ * \return true if a connection to the host can be attempted.
+ */
+bool mx_connector::acquire(std::string const & host, int port)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    auto it(f_health.find(get_key(host, port)));
+    if(it == f_health.end()
+    || it->second.f_failures < f_failure_threshold)
+    {
+        return true;
+    }
+    if(it->second.f_trial
+    || clock_t::now() < it->second.f_open_until)
+    {
+        return false;
+    }
+    it->second.f_trial = true;
+    return true;
+}
+
+
+/** \brief Give up on a host without knowing whether it works.
+ *
+ * This happens when another host won the race before we got a result
+ * for this host. If this was the trial of a half-open circuit, another
+ * caller can try again.
+ *
+ * \param[in] host  The name of the host.
+ * \param[in] port  The port of the host.
+ */
+void mx_connector::release(std::string const & host, int port)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    auto it(f_health.find(get_key(host, port)));
+    if(it != f_health.end())
+    {
+        it->second.f_trial = false;
+    }
+}
+
+
+/** \brief Race the connections to a set of hosts.
+ *
+ * The addresses of each host are interleaved by family (IPv6, IPv4,
+ * IPv6, ... in the order returned by getaddrinfo()) and the hosts are
+ * interleaved with each other. A connection to the next address starts
+ * every attempt delay or as soon as an attempt fails.
+ *
+ * All the \p hosts must have been acquired. Each one gets reported as a
+ * failure or released, except the winner.
+ *
+ * \param[in] hosts  The hosts to connect to.
+ * \param[in] port  The port to connect to.
+ * \param[out] host  The host of the winning connection.
+ *
+ * \return The connected socket or -1.
+ */
+int mx_connector::race(std::vector<std::string> const & hosts, int port, std::string & host)
+{
+    // resolve the hosts
+    //
+    std::vector<std::vector<address_t>> per_host(hosts.size());
+    std::string const service(std::to_string(port));
+    for(std::size_t idx(0); idx < hosts.size(); ++idx)
+    {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+
+        addrinfo * addresses(nullptr);
+        int const r(getaddrinfo(hosts[idx].c_str(), service.c_str(), &hints, &addresses));
+        if(r != 0)
+        {
+            SNAP_LOG_ERROR
+                << "could not resolve SMTP server \""
+                << hosts[idx]
+                << "\": "
+                << gai_strerror(r)
+                << SNAP_LOG_SEND;
+            continue;
+        }
+
+        // interleave the families, starting with the preferred one
+        //
+        std::vector<address_t> first;
+        std::vector<address_t> second;
+        for(addrinfo * a(addresses); a != nullptr; a = a->ai_next)
+        {
+            if(a->ai_addrlen > sizeof(sockaddr_storage))
+            {
+                continue;
+            }
+            address_t address;
+            address.f_host = idx;
+            address.f_family = a->ai_family;
+            memcpy(&address.f_address, a->ai_addr, a->ai_addrlen);
+            address.f_length = a->ai_addrlen;
+            if(first.empty()
+            || first[0].f_family == a->ai_family)
+            {
+                first.push_back(address);
+            }
+            else
+            {
+                second.push_back(address);
+            }
+        }
+        freeaddrinfo(addresses);
+
+        for(std::size_t i(0); i < first.size() || i < second.size(); ++i)
+        {
+            if(i < first.size())
+            {
+                per_host[idx].push_back(first[i]);
+            }
+            if(i < second.size())
+            {
+                per_host[idx].push_back(second[i]);
+            }
+        }
+    }
+
+    // interleave the hosts
+    //
+    std::vector<address_t> addresses;
+    std::vector<std::size_t> remaining(hosts.size(), 0);
+    for(std::size_t i(0);; ++i)
+    {
+        bool found(false);
+        for(std::size_t idx(0); idx < hosts.size(); ++idx)
+        {
+            if(i < per_host[idx].size())
+            {
+                addresses.push_back(per_host[idx][i]);
+                ++remaining[idx];
+                found = true;
+            }
+        }
+        if(!found)
+        {
+            break;
+        }
+    }
+
+    // race the connections
+    //
+    std::vector<bool> tried(hosts.size(), false);
+    std::vector<attempt_t> pending;
+    int winner(-1);
+    std::size_t winner_host(0);
+    std::size_t next(0);
+    std::chrono::milliseconds const delay(f_attempt_delay);
+    clock_t::time_point const deadline(clock_t::now() + std::chrono::seconds(f_timeout));
+    clock_t::time_point next_start(clock_t::now());
+    while(winner == -1)
+    {
+        clock_t::time_point now(clock_t::now());
+        if(now >= deadline)
+        {
+            break;
+        }
+
+        // start the next attempt
+        //
+        if(next < addresses.size()
+        && (pending.empty() || now >= next_start))
+        {
+            address_t const & a(addresses[next]);
+            attempt_t attempt;
+            attempt.f_address = next;
+            ++next;
+            tried[a.f_host] = true;
+            next_start = now + delay;
+
+            attempt.f_socket = socket(a.f_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+            if(attempt.f_socket != -1)
+            {
+                if(::connect(attempt.f_socket, reinterpret_cast<sockaddr const *>(&a.f_address), a.f_length) == 0)
+                {
+                    winner = attempt.f_socket;
+                    winner_host = a.f_host;
+                    break;
+                }
+                if(errno == EINPROGRESS)
+                {
+                    pending.push_back(attempt);
+                    continue;
+                }
+                ::close(attempt.f_socket);
+            }
+
+            // failed immediately, try the next address right away
+            //
+            --remaining[a.f_host];
+            next_start = now;
+            continue;
+        }
+
+        if(pending.empty())
+        {
+            // all the attempts failed
+            //
+            break;
+        }
+
+        // wait for one of the pending attempts to finish or for the
+        // time to start the next one
+        //
+        clock_t::time_point const until(next < addresses.size()
+                                            ? std::min(next_start, deadline)
+                                            : deadline);
+        int const timeout(static_cast<int>(std::max<long>(
+                    0
+                  , std::chrono::duration_cast<std::chrono::milliseconds>(until - now).count())));
+        std::vector<pollfd> fds(pending.size());
+        for(std::size_t idx(0); idx < pending.size(); ++idx)
+        {
+            fds[idx].fd = pending[idx].f_socket;
+            fds[idx].events = POLLOUT;
+        }
+        int const r(poll(fds.data(), fds.size(), timeout));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "poll() failed while connecting to SMTP servers (errno: "
+                << e
+                << ", "
+                << strerror(e)
+                << ")."
+                << SNAP_LOG_SEND;
+            break;
+        }
+
+        // check the attempts in the order they were started so the
+        // earliest one wins when several connected at the same time
+        //
+        std::vector<attempt_t> still_pending;
+        for(std::size_t idx(0); idx < fds.size(); ++idx)
+        {
+            if(fds[idx].revents == 0)
+            {
+                still_pending.push_back(pending[idx]);
+                continue;
+            }
+
+            std::size_t const h(addresses[pending[idx].f_address].f_host);
+            int error(0);
+            socklen_t len(sizeof(error));
+            bool const connected(getsockopt(pending[idx].f_socket, SOL_SOCKET, SO_ERROR, &error, &len) == 0
+                              && error == 0);
+            if(connected
+            && winner == -1)
+            {
+                winner = pending[idx].f_socket;
+                winner_host = h;
+                continue;
+            }
+
+            // a connection which succeeded but lost the race does not
+            // count as a failure of its host
+            //
+            ::close(pending[idx].f_socket);
+            if(!connected)
+            {
+                --remaining[h];
+                next_start = clock_t::now();
+            }
+        }
+        pending.swap(still_pending);
+    }
+
+    for(auto const & attempt : pending)
+    {
+        ::close(attempt.f_socket);
+    }
+
+    // update the health of the hosts: when there is a winner, only the
+    // hosts of which all the addresses failed are unhealthy; otherwise
+    // all the hosts we tried are
+    //
+    for(std::size_t idx(0); idx < hosts.size(); ++idx)
+    {
+        if(winner != -1
+        && idx == winner_host)
+        {
+            host = hosts[idx];
+        }
+        else if(tried[idx]
+             && (winner == -1 || remaining[idx] == 0))
+        {
+            report_failure(hosts[idx], port);
+        }
+        else if(per_host[idx].empty())
+        {
+            // could not even be resolved
+            //
+            report_failure(hosts[idx], port);
+        }
+        else
+        {
+            release(hosts[idx], port);
+        }
+    }
+
+    if(winner == -1)
+    {
+        SNAP_LOG_ERROR
+            << "could not connect to any of the "
+            << hosts.size()
+            << " SMTP server(s) tried on port "
+            << port
+            << "."
+            << SNAP_LOG_SEND;
+    }
+
+    return winner;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,117 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/mail_exchanger.h>
+
+
+// C++
+//
+#include    <atomic>
+#include    <chrono>
+#include    <map>
+#include    <mutex>
+#include    <set>
+#include    <string>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+enum class circuit_state_t
+{
+    CIRCUIT_STATE_CLOSED,           // healthy, connections are attempted
+    CIRCUIT_STATE_OPEN,             // unhealthy, the host is skipped
+    CIRCUIT_STATE_HALF_OPEN         // one trial connection is allowed
+};
+
+
+class mx_connector
+{
+public:
+    typedef std::set<std::string>           host_set_t;
+
+    static constexpr int const              DEFAULT_ATTEMPT_DELAY = 250;        // in ms (RFC 8305)
+    static constexpr int const              DEFAULT_TIMEOUT = 30;               // in seconds
+    static constexpr std::size_t const      DEFAULT_FAILURE_THRESHOLD = 1;
+    static constexpr int const              DEFAULT_OPEN_DURATION = 60;         // in seconds
+    static constexpr int const              DEFAULT_MAX_OPEN_DURATION = 3600;   // in seconds
+
+                            mx_connector(mx_connector const &) = delete;
+    mx_connector &          operator = (mx_connector const &) = delete;
+
+    static mx_connector &   get_instance();
+
+    void                    set_attempt_delay(int ms);
+    int                     get_attempt_delay() const;
+    void                    set_timeout(int seconds);
+    int                     get_timeout() const;
+    void                    set_failure_threshold(std::size_t threshold);
+    std::size_t             get_failure_threshold() const;
+    void                    set_open_duration(int seconds, int max_seconds = DEFAULT_MAX_OPEN_DURATION);
+
+    int                     connect(
+                                  mail_exchanger::mail_exchange_vector_t const & exchangers
+                                , int port
+                                , std::string & host
+                                , host_set_t const & exclude = host_set_t());
+
+    circuit_state_t         get_state(std::string const & host, int port) const;
+    void                    report_success(std::string const & host, int port);
+    void                    report_failure(std::string const & host, int port);
+    void                    reset();
+
+private:
+    typedef std::chrono::steady_clock       clock_t;
+
+    struct health
+    {
+        std::size_t             f_failures = 0;
+        clock_t::time_point     f_open_until = clock_t::time_point();
+        clock_t::duration       f_open_duration = clock_t::duration();
+        bool                    f_trial = false;
+    };
+    typedef std::map<std::string, health>   health_map_t;
+
+                            mx_connector();
+
+    static std::string      get_key(std::string const & host, int port);
+    bool                    acquire(std::string const & host, int port);
+    void                    release(std::string const & host, int port);
+    int                     race(std::vector<std::string> const & hosts, int port, std::string & host);
+
+    mutable std::mutex      f_mutex = std::mutex();
+    health_map_t            f_health = health_map_t();
+    std::atomic<int>        f_attempt_delay = DEFAULT_ATTEMPT_DELAY;
+    std::atomic<int>        f_timeout = DEFAULT_TIMEOUT;
+    std::atomic<std::size_t>
+                            f_failure_threshold = DEFAULT_FAILURE_THRESHOLD;
+    std::atomic<int>        f_open_duration = DEFAULT_OPEN_DURATION;
+    std::atomic<int>        f_max_open_duration = DEFAULT_MAX_OPEN_DURATION;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
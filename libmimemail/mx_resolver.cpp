@@ -0,0 +1,882 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Resolve the MX records of many domains in parallel.
+ *
+ * The mail_exchangers constructor blocks until the DNS answers. When
+ * many domains have to be resolved (i.e. warming up the MX cache before
+ * a campaign), the mx_resolver sends all the queries over one UDP socket
+ * and processes the answers as they arrive.
+ *
+ * The resolver can be used with its own run() loop or added to an
+ * event loop through get_socket(), process_read(), process_timeout(),
+ * and get_timeout_delay() (see mx_resolver_connection for the
+ * ed::communicator version).
+ *
+ * The rare answers which do not fit in a UDP packet are queried again
+ * over TCP. Those connections are also non-blocking. They are grouped
+ * with the UDP socket in an epoll so the event loop only has to watch
+ * one file descriptor.
+ */
+
+// self
+//
+#include    "libmimemail/mx_resolver.h"
+
+#include    "libmimemail/exception.h"
+#include    "libmimemail/mx_cache.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <cstring>
+#include    <iterator>
+
+
+// C
+//
+#include    <errno.h>
+#include    <netinet/in.h>
+#include    <poll.h>
+#include    <sys/epoll.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+constexpr std::uint16_t const   DNS_FLAG_TC = 0x0200;
+
+
+
+bool same_address(sockaddr_storage const & a, sockaddr_storage const & b)
+{
+    if(a.ss_family != b.ss_family)
+    {
+        return false;
+    }
+
+    if(a.ss_family == AF_INET)
+    {
+        sockaddr_in const & a4(reinterpret_cast<sockaddr_in const &>(a));
+        sockaddr_in const & b4(reinterpret_cast<sockaddr_in const &>(b));
+        return a4.sin_port == b4.sin_port
+            && a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+    }
+
+    sockaddr_in6 const & a6(reinterpret_cast<sockaddr_in6 const &>(a));
+    sockaddr_in6 const & b6(reinterpret_cast<sockaddr_in6 const &>(b));
+    return a6.sin6_port == b6.sin6_port
+        && memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+}
+
+
+
+}
+// no name namespace
+
+
+
+/** \brief Initialize the resolver.
+ *
+ * The name servers, time out, and number of attempts are copied from
+ * \p settings.
+ *
+ * Only the name servers of the same family as the first valid one are
+ * used so all the queries go through one socket.
+ *
+ * \param[in] settings  The DNS resolver settings to use.
+ */
+mx_resolver::mx_resolver(dns_resolver const & settings)
+    : f_settings(settings)
+{
+    open_socket();
+}
+
+
+/** \brief Clean up the resolver.
+ *
+ * The callbacks of domains not yet resolved are not called.
+ */
+mx_resolver::~mx_resolver()
+{
+    if(f_epoll != -1)
+    {
+        ::close(f_epoll);
+    }
+    if(f_socket != -1)
+    {
+        ::close(f_socket);
+    }
+}
+
+
+/** \brief Set the maximum number of queries sent at once.
+ *
+ * Domains added once that many queries are pending wait for some of
+ * the answers to arrive.
+ *
+ * \exception invalid_parameter
+ * The maximum must be at least 1.
+ *
+ * \param[in] max  The maximum number of queries in flight.
+ */
+void mx_resolver::set_max_in_flight(std::size_t max)
+{
+    if(max == 0)
+    {
+        throw invalid_parameter("mx_resolver::set_max_in_flight(): the maximum must be at least 1.");
+    }
+    f_max_in_flight = max;
+}
+
+
+/** \brief Add a domain to resolve.
+ *
+ * The \p callback gets called once the MX records of \p domain are known.
+ * If the domain is invalid or already cached, the callback is called
+ * immediately, before this function returns.
+ *
+ * Several domains leading to the same query (i.e. "m2osw.com" and
+ * "mail.m2osw.com") share one query.
+ *
+ * \param[in] domain  The domain to resolve.
+ * \param[in] callback  The function called with the result.
+ */
+void mx_resolver::add_domain(
+      std::string const & domain
+    , mail_exchangers::resolve_callback_t callback)
+{
+    if(callback == nullptr)
+    {
+        throw missing_parameter("mx_resolver::add_domain(): a callback is required.");
+    }
+
+    mail_exchangers::pointer_t mx(mx_cache::get_instance().find(domain));
+    if(mx != nullptr)
+    {
+        callback(domain, mx);
+        return;
+    }
+
+    std::string full_domain;
+    if(!mail_exchangers::get_query_domain(domain, full_domain))
+    {
+        dns_mx_response response;
+        response.set_status(dns_status_t::DNS_STATUS_INVALID);
+        callback(domain, mail_exchangers::from_response(domain, response));
+        return;
+    }
+
+    auto it(f_requests.find(full_domain));
+    if(it != f_requests.end())
+    {
+        it->second.emplace_back(domain, callback);
+        return;
+    }
+
+    f_requests[full_domain].emplace_back(domain, callback);
+    f_waiting.push_back(full_domain);
+    start_queries();
+}
+
+
+/** \brief Get the socket used to wait for the answers.
+ *
+ * To use the resolver in your own event loop, poll this socket for
+ * input and call process_read() when it is readable.
+ *
+ * This is an epoll file descriptor which becomes readable whenever the
+ * UDP socket or one of the TCP connections is ready.
+ *
+ * \return The socket or -1 if it could not be created.
+ */
+int mx_resolver::get_socket() const
+{
+    return f_epoll;
+}
+
+
+/** \brief Read the answers available on the socket.
+ *
+ * This function reads all the datagrams currently available and moves
+ * the TCP queries forward. Answers which do not match a pending query
+ * are ignored.
+ *
+ * This function never blocks.
+ */
+void mx_resolver::process_read()
+{
+    if(f_epoll == -1)
+    {
+        return;
+    }
+
+    epoll_event events[16];
+    for(;;)
+    {
+        int const r(epoll_wait(f_epoll, events, std::size(events), 0));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        for(int idx(0); idx < r; ++idx)
+        {
+            if(events[idx].data.u64 == 0)
+            {
+                read_udp();
+            }
+            else
+            {
+                process_tcp(events[idx].data.u64);
+            }
+        }
+        if(r < static_cast<int>(std::size(events)))
+        {
+            break;
+        }
+    }
+
+    start_queries();
+}
+
+
+void mx_resolver::read_udp()
+{
+    std::vector<std::uint8_t> answer(65536);
+    for(;;)
+    {
+        sockaddr_storage from = {};
+        socklen_t from_len(sizeof(from));
+        ssize_t const r(recvfrom(
+                  f_socket
+                , answer.data()
+                , answer.size()
+                , 0
+                , reinterpret_cast<sockaddr *>(&from)
+                , &from_len));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if(r < 12)
+        {
+            continue;
+        }
+
+        std::uint16_t const id((answer[0] << 8) | answer[1]);
+        auto it(f_queries.find(id));
+        if(it == f_queries.end()
+        || !same_address(from, f_servers[it->second.f_server]))
+        {
+            continue;
+        }
+        query const q(it->second);
+        f_queries.erase(it);
+
+        if(((answer[2] << 8) & DNS_FLAG_TC) != 0)
+        {
+            // rare for MX records; ask the same server over TCP
+            //
+            start_tcp(q, id);
+            continue;
+        }
+
+        process_answer(q, id, answer.data(), r);
+    }
+}
+
+
+/** \brief Handle queries which did not receive an answer in time.
+ *
+ * Each query is sent to the next name server. Once all the name servers
+ * were tried the number of attempts times, the domain is reported as
+ * not found.
+ */
+void mx_resolver::process_timeout()
+{
+    clock_t::time_point const now(clock_t::now());
+
+    std::vector<query> expired;
+    for(auto it(f_queries.begin()); it != f_queries.end(); )
+    {
+        if(it->second.f_deadline <= now)
+        {
+            expired.push_back(it->second);
+            it = f_queries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    for(auto it(f_tcp_queries.begin()); it != f_tcp_queries.end(); )
+    {
+        if(it->second.f_query.f_deadline <= now)
+        {
+            expired.push_back(it->second.f_query);
+            it = f_tcp_queries.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
+    for(auto const & q : expired)
+    {
+        retry(q);
+    }
+
+    start_queries();
+}
+
+
+/** \brief Get the delay until process_timeout() needs to be called.
+ *
+ * \return The delay in microseconds or -1 if no query is pending.
+ */
+std::int64_t mx_resolver::get_timeout_delay() const
+{
+    if(f_queries.empty()
+    && f_tcp_queries.empty())
+    {
+        return -1;
+    }
+
+    clock_t::time_point deadline(clock_t::time_point::max());
+    for(auto const & q : f_queries)
+    {
+        deadline = std::min(deadline, q.second.f_deadline);
+    }
+    for(auto const & t : f_tcp_queries)
+    {
+        deadline = std::min(deadline, t.second.f_query.f_deadline);
+    }
+
+    std::int64_t const delay(std::chrono::duration_cast<std::chrono::microseconds>(deadline - clock_t::now()).count());
+    return delay < 0 ? 0 : delay;
+}
+
+
+/** \brief Check whether all the domains were resolved.
+ *
+ * \return true when no callback is still waiting for its result.
+ */
+bool mx_resolver::is_done() const
+{
+    return f_requests.empty();
+}
+
+
+/** \brief Process the queries until all the domains are resolved.
+ *
+ * This function blocks. It is useful when you do not otherwise have
+ * an event loop, for example, to warm up the MX cache.
+ */
+void mx_resolver::run()
+{
+    while(!is_done())
+    {
+        std::int64_t const delay(get_timeout_delay());
+        pollfd fd = {};
+        fd.fd = f_epoll;
+        fd.events = POLLIN;
+        int const r(poll(&fd, 1, delay < 0 ? -1 : static_cast<int>((delay + 999) / 1000)));
+        if(r < 0
+        && errno != EINTR)
+        {
+            int const e(errno);
+            SNAP_LOG_ERROR
+                << "poll() failed while resolving MX records: "
+                << strerror(e)
+                << SNAP_LOG_SEND;
+            break;
+        }
+        if(r > 0)
+        {
+            process_read();
+        }
+        process_timeout();
+    }
+}
+
+
+bool mx_resolver::open_socket()
+{
+    int family(AF_UNSPEC);
+    for(auto const & ns : f_settings.get_nameservers())
+    {
+        sockaddr_storage addr;
+        socklen_t len(0);
+        if(!dns_resolver::make_address(ns, addr, len))
+        {
+            SNAP_LOG_WARNING
+                << "ignoring invalid name server address \""
+                << ns
+                << "\"."
+                << SNAP_LOG_SEND;
+            continue;
+        }
+        if(family == AF_UNSPEC)
+        {
+            family = addr.ss_family;
+        }
+        if(addr.ss_family == family)
+        {
+            f_servers.push_back(addr);
+            f_server_sizes.push_back(len);
+        }
+    }
+
+    if(f_servers.empty())
+    {
+        SNAP_LOG_ERROR
+            << "no valid name server to resolve MX records."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    f_socket = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(f_socket == -1)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create the DNS socket: "
+            << strerror(e)
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    f_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if(f_epoll == -1)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not create the DNS epoll: "
+            << strerror(e)
+            << SNAP_LOG_SEND;
+        ::close(f_socket);
+        f_socket = -1;
+        return false;
+    }
+
+    // the UDP socket is identified by 0 in the events (see start_tcp())
+    //
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    if(epoll_ctl(f_epoll, EPOLL_CTL_ADD, f_socket, &event) != 0)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not add the DNS socket to the epoll: "
+            << strerror(e)
+            << SNAP_LOG_SEND;
+        ::close(f_epoll);
+        f_epoll = -1;
+        ::close(f_socket);
+        f_socket = -1;
+        return false;
+    }
+
+    return true;
+}
+
+
+void mx_resolver::start_queries()
+{
+    while(f_queries.size() + f_tcp_queries.size() < f_max_in_flight
+       && !f_waiting.empty())
+    {
+        query q;
+        q.f_full_domain = f_waiting.front();
+        f_waiting.pop_front();
+
+        if(f_socket == -1)
+        {
+            dns_mx_response response;
+            response.set_status(dns_status_t::DNS_STATUS_TIMEOUT);
+            complete(q.f_full_domain, mail_exchangers::from_response(q.f_full_domain, response));
+            continue;
+        }
+
+        send_query(q);
+    }
+}
+
+
+bool mx_resolver::send_query(query & q)
+{
+    std::uint16_t const id(get_unused_id());
+    std::string const packet(dns_resolver::build_query(id, q.f_full_domain, dns_resolver::DNS_TYPE_MX));
+    ssize_t const r(sendto(
+              f_socket
+            , packet.data()
+            , packet.length()
+            , 0
+            , reinterpret_cast<sockaddr const *>(&f_servers[q.f_server])
+            , f_server_sizes[q.f_server]));
+    if(r != static_cast<ssize_t>(packet.length()))
+    {
+        retry(q);
+        return false;
+    }
+
+    q.f_deadline = clock_t::now() + std::chrono::seconds(f_settings.get_timeout());
+    f_queries[id] = q;
+    return true;
+}
+
+
+/** \brief Send a query again over TCP.
+ *
+ * This function is called when the UDP answer of a name server was
+ * truncated. It connects to the same name server over TCP without
+ * waiting. The query is sent once the connection is established and
+ * the answer is read as it arrives (see process_tcp()).
+ *
+ * \param[in] q  The query which answer was truncated.
+ * \param[in] id  The DNS identifier of the query.
+ */
+void mx_resolver::start_tcp(query const & q, std::uint16_t id)
+{
+    tcp_query t;
+    t.f_query = q;
+    t.f_query.f_deadline = clock_t::now() + std::chrono::seconds(f_settings.get_timeout());
+    t.f_id = id;
+    t.f_serial = ++f_tcp_serial;
+
+    sockaddr_storage const & addr(f_servers[q.f_server]);
+    t.f_socket.reset(socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    if(t.f_socket.get() == -1)
+    {
+        retry(q);
+        return;
+    }
+
+    if(connect(t.f_socket.get(), reinterpret_cast<sockaddr const *>(&addr), f_server_sizes[q.f_server]) == 0)
+    {
+        t.f_connected = true;
+    }
+    else if(errno != EINPROGRESS)
+    {
+        retry(q);
+        return;
+    }
+
+    // over TCP, the message is preceeded by its size
+    //
+    std::string const packet(dns_resolver::build_query(id, q.f_full_domain, dns_resolver::DNS_TYPE_MX));
+    t.f_output += static_cast<char>(packet.length() >> 8);
+    t.f_output += static_cast<char>(packet.length());
+    t.f_output += packet;
+
+    // read the size first
+    //
+    t.f_input.resize(2);
+
+    // the events are identified by a serial number instead of the socket
+    // because a socket closed while handling an event can be reused by a
+    // new TCP query before the next event of the same batch is handled
+    //
+    epoll_event event = {};
+    event.events = EPOLLOUT;
+    event.data.u64 = t.f_serial;
+    if(epoll_ctl(f_epoll, EPOLL_CTL_ADD, t.f_socket.get(), &event) != 0)
+    {
+        retry(q);
+        return;
+    }
+
+    std::uint64_t const serial(t.f_serial);
+    f_tcp_queries[serial] = std::move(t);
+}
+
+
+/** \brief Move a TCP query forward.
+ *
+ * This function is called when the TCP connection of the query with
+ * \p serial is ready. It sends the query and then reads the answer.
+ * Once the whole answer arrived, it gets processed like a UDP answer.
+ *
+ * On an error, the query is retried with the next name server.
+ *
+ * \param[in] serial  The serial number of the TCP query.
+ */
+void mx_resolver::process_tcp(std::uint64_t serial)
+{
+    auto it(f_tcp_queries.find(serial));
+    if(it == f_tcp_queries.end())
+    {
+        return;
+    }
+    tcp_query & t(it->second);
+
+    if(t.f_sent < t.f_output.length())
+    {
+        if(send_tcp(t))
+        {
+            if(t.f_sent < t.f_output.length())
+            {
+                return;
+            }
+
+            // query sent, now wait for the answer
+            //
+            epoll_event event = {};
+            event.events = EPOLLIN;
+            event.data.u64 = serial;
+            if(epoll_ctl(f_epoll, EPOLL_CTL_MOD, t.f_socket.get(), &event) == 0)
+            {
+                return;
+            }
+        }
+    }
+    else if(receive_tcp(t))
+    {
+        if(t.f_received < t.f_input.size())
+        {
+            return;
+        }
+
+        query const q(t.f_query);
+        std::uint16_t const id(t.f_id);
+        std::vector<std::uint8_t> const answer(std::move(t.f_input));
+        f_tcp_queries.erase(it);
+        process_answer(q, id, answer.data() + 2, answer.size() - 2);
+        return;
+    }
+
+    // the socket gets closed and removed from the epoll by erase()
+    //
+    query const q(t.f_query);
+    f_tcp_queries.erase(it);
+    retry(q);
+}
+
+
+/** \brief Send the TCP query.
+ *
+ * \param[in,out] t  The TCP query.
+ *
+ * \return false if the connection failed.
+ */
+bool mx_resolver::send_tcp(tcp_query & t)
+{
+    if(!t.f_connected)
+    {
+        int error(0);
+        socklen_t error_len(sizeof(error));
+        if(getsockopt(t.f_socket.get(), SOL_SOCKET, SO_ERROR, &error, &error_len) != 0
+        || error != 0)
+        {
+            return false;
+        }
+        t.f_connected = true;
+    }
+
+    while(t.f_sent < t.f_output.length())
+    {
+        ssize_t const r(send(
+                  t.f_socket.get()
+                , t.f_output.data() + t.f_sent
+                , t.f_output.length() - t.f_sent
+                , MSG_NOSIGNAL));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+        t.f_sent += r;
+    }
+
+    return true;
+}
+
+
+/** \brief Read the available bytes of the TCP answer.
+ *
+ * The answer is preceeded by its size on two bytes. Once those are
+ * read, the input buffer grows to receive the rest of the answer.
+ *
+ * \param[in,out] t  The TCP query.
+ *
+ * \return false if the connection failed or was closed too soon.
+ */
+bool mx_resolver::receive_tcp(tcp_query & t)
+{
+    while(t.f_received < t.f_input.size())
+    {
+        ssize_t const r(recv(
+                  t.f_socket.get()
+                , t.f_input.data() + t.f_received
+                , t.f_input.size() - t.f_received
+                , 0));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN;
+        }
+        if(r == 0)
+        {
+            return false;
+        }
+        t.f_received += r;
+
+        if(t.f_received == 2
+        && t.f_input.size() == 2)
+        {
+            std::size_t const size((t.f_input[0] << 8) | t.f_input[1]);
+            if(size < 12)
+            {
+                return false;
+            }
+            t.f_input.resize(2 + size);
+        }
+    }
+
+    return true;
+}
+
+
+/** \brief Handle a complete answer.
+ *
+ * When the answer is invalid or the server failed, the query is sent to
+ * the next name server. Otherwise the domain is resolved.
+ *
+ * \param[in] q  The query which was answered.
+ * \param[in] id  The DNS identifier of the query.
+ * \param[in] answer  The answer.
+ * \param[in] size  The size of the answer in bytes.
+ */
+void mx_resolver::process_answer(
+      query const & q
+    , std::uint16_t id
+    , std::uint8_t const * answer
+    , std::size_t size)
+{
+    dns_mx_response response;
+    if(!dns_resolver::parse_mx_response(answer, size, id, response)
+    || response.get_status() == dns_status_t::DNS_STATUS_SERVER_FAILURE)
+    {
+        retry(q);
+        return;
+    }
+
+    complete(q.f_full_domain, mail_exchangers::from_response(q.f_full_domain, response));
+}
+
+
+void mx_resolver::retry(query q)
+{
+    ++q.f_server;
+    if(q.f_server >= f_servers.size())
+    {
+        q.f_server = 0;
+        ++q.f_attempt;
+        if(q.f_attempt >= f_settings.get_attempts())
+        {
+            SNAP_LOG_DEBUG
+                << "MX query for \""
+                << q.f_full_domain
+                << "\" timed out."
+                << SNAP_LOG_SEND;
+
+            dns_mx_response response;
+            response.set_status(dns_status_t::DNS_STATUS_TIMEOUT);
+            complete(q.f_full_domain, mail_exchangers::from_response(q.f_full_domain, response));
+            return;
+        }
+    }
+
+    send_query(q);
+}
+
+
+void mx_resolver::complete(std::string const & full_domain, mail_exchangers::pointer_t mx)
+{
+    auto it(f_requests.find(full_domain));
+    if(it == f_requests.end())
+    {
+        return;
+    }
+
+    // the callbacks may add more domains, so detach the request first
+    //
+    std::vector<waiter_t> waiters;
+    waiters.swap(it->second);
+    f_requests.erase(it);
+
+    for(auto const & w : waiters)
+    {
+        mx_cache::get_instance().store(w.first, mx);
+        w.second(w.first, mx);
+    }
+}
+
+
+std::uint16_t mx_resolver::get_unused_id() const
+{
+    for(;;)
+    {
+        std::uint16_t const id(generate_dns_query_id());
+        if(f_queries.find(id) == f_queries.end())
+        {
+            return id;
+        }
+    }
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
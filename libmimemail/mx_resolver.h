@@ -0,0 +1,136 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/dns_resolver.h>
+
+
+// snapdev
+//
+#include    <snapdev/raii_generic_deleter.h>
+
+
+// C++
+//
+#include    <chrono>
+#include    <deque>
+#include    <map>
+
+
+
+namespace libmimemail
+{
+
+
+
+class mx_resolver
+{
+public:
+    typedef std::shared_ptr<mx_resolver>    pointer_t;
+
+    static constexpr std::size_t const      DEFAULT_MAX_IN_FLIGHT = 256;
+
+                            mx_resolver(dns_resolver const & settings = dns_resolver());
+                            mx_resolver(mx_resolver const &) = delete;
+    virtual                 ~mx_resolver();
+
+    mx_resolver &           operator = (mx_resolver const &) = delete;
+
+    void                    set_max_in_flight(std::size_t max);
+    void                    add_domain(
+                                  std::string const & domain
+                                , mail_exchangers::resolve_callback_t callback);
+
+    // event loop interface
+    //
+    int                     get_socket() const;
+    void                    process_read();
+    void                    process_timeout();
+    std::int64_t            get_timeout_delay() const;
+    bool                    is_done() const;
+    void                    run();
+
+private:
+    typedef std::chrono::steady_clock       clock_t;
+
+    typedef std::pair<std::string, mail_exchangers::resolve_callback_t>
+                                            waiter_t;           // domain as specified by the caller
+    typedef std::map<std::string, std::vector<waiter_t>>
+                                            request_map_t;      // by full domain
+
+    struct query
+    {
+        std::string                 f_full_domain = std::string();
+        std::size_t                 f_server = 0;
+        int                         f_attempt = 0;
+        clock_t::time_point         f_deadline = clock_t::time_point();
+    };
+    typedef std::map<std::uint16_t, query>  query_map_t;        // by DNS identifier
+
+    struct tcp_query
+    {
+        query                       f_query = query();
+        std::uint16_t               f_id = 0;
+        std::uint64_t               f_serial = 0;
+        snapdev::raii_fd_t          f_socket = snapdev::raii_fd_t();
+        bool                        f_connected = false;
+        std::string                 f_output = std::string();
+        std::size_t                 f_sent = 0;
+        std::vector<std::uint8_t>   f_input = std::vector<std::uint8_t>();
+        std::size_t                 f_received = 0;
+    };
+    typedef std::map<std::uint64_t, tcp_query>
+                                            tcp_query_map_t;    // by serial number
+
+    bool                    open_socket();
+    void                    start_queries();
+    bool                    send_query(query & q);
+    void                    read_udp();
+    void                    start_tcp(query const & q, std::uint16_t id);
+    void                    process_tcp(std::uint64_t serial);
+    bool                    send_tcp(tcp_query & t);
+    bool                    receive_tcp(tcp_query & t);
+    void                    process_answer(
+                                  query const & q
+                                , std::uint16_t id
+                                , std::uint8_t const * answer
+                                , std::size_t size);
+    void                    retry(query q);
+    void                    complete(std::string const & full_domain, mail_exchangers::pointer_t mx);
+    std::uint16_t           get_unused_id() const;
+
+    dns_resolver            f_settings;
+    std::vector<sockaddr_storage>
+                            f_servers = std::vector<sockaddr_storage>();
+    std::vector<socklen_t>  f_server_sizes = std::vector<socklen_t>();
+    int                     f_socket = -1;
+    int                     f_epoll = -1;
+    std::size_t             f_max_in_flight = DEFAULT_MAX_IN_FLIGHT;
+    request_map_t           f_requests = request_map_t();
+    std::deque<std::string> f_waiting = std::deque<std::string>();
+    query_map_t             f_queries = query_map_t();
+    tcp_query_map_t         f_tcp_queries = tcp_query_map_t();
+    std::uint64_t           f_tcp_serial = 0;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
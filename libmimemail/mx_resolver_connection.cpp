@@ -0,0 +1,157 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Run the MX resolver from the ed::communicator.
+ *
+ * This connection wraps an mx_resolver so MX queries can be processed
+ * by the event dispatcher loop along the other connections of a daemon:
+ *
+ * \code
+ *     libmimemail::mx_resolver_connection::pointer_t mx(
+ *             std::make_shared<libmimemail::mx_resolver_connection>());
+ *     ed::communicator::instance()->add_connection(mx);
+ *     for(auto const & d : domains)
+ *     {
+ *         mx->add_domain(d, [](std::string const & domain, libmimemail::mail_exchangers::pointer_t result)
+ *             {
+ *                 ...
+ *             });
+ *     }
+ * \endcode
+ */
+
+// self
+//
+#include    "libmimemail/mx_resolver_connection.h"
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Initialize the connection.
+ *
+ * \param[in] settings  The DNS resolver settings to use.
+ */
+mx_resolver_connection::mx_resolver_connection(dns_resolver const & settings)
+    : f_resolver(settings)
+{
+    set_name("mx_resolver_connection");
+}
+
+
+/** \brief Access the resolver.
+ *
+ * \return A reference to the resolver handled by this connection.
+ */
+mx_resolver & mx_resolver_connection::get_resolver()
+{
+    return f_resolver;
+}
+
+
+/** \brief Add a domain to resolve.
+ *
+ * See mx_resolver::add_domain() for details.
+ *
+ * \param[in] domain  The domain to resolve.
+ * \param[in] callback  The function called with the result.
+ */
+void mx_resolver_connection::add_domain(
+      std::string const & domain
+    , mail_exchangers::resolve_callback_t callback)
+{
+    f_resolver.add_domain(domain, callback);
+    update_timeout();
+}
+
+
+/** \brief Set a function called each time all the domains are resolved.
+ *
+ * The callback is called after an answer or time out leaves the resolver
+ * without pending domains.
+ *
+ * \param[in] callback  The function to call.
+ */
+void mx_resolver_connection::set_done_callback(done_callback_t callback)
+{
+    f_done_callback = callback;
+}
+
+
+bool mx_resolver_connection::is_reader() const
+{
+    return true;
+}
+
+
+int mx_resolver_connection::get_socket() const
+{
+    return f_resolver.get_socket();
+}
+
+
+void mx_resolver_connection::process_read()
+{
+    f_resolver.process_read();
+    update_timeout();
+    check_done();
+}
+
+
+void mx_resolver_connection::process_timeout()
+{
+    f_resolver.process_timeout();
+    update_timeout();
+    check_done();
+}
+
+
+void mx_resolver_connection::update_timeout()
+{
+    std::int64_t const delay(f_resolver.get_timeout_delay());
+    set_timeout_delay(delay < 0 ? -1 : std::max(delay, static_cast<std::int64_t>(1)));
+}
+
+
+void mx_resolver_connection::check_done()
+{
+    if(f_resolver.is_done()
+    && f_done_callback != nullptr)
+    {
+        f_done_callback();
+    }
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,69 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/mx_resolver.h>
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/connection.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class mx_resolver_connection
+    : public ed::connection
+{
+public:
+    typedef std::shared_ptr<mx_resolver_connection> pointer_t;
+    typedef std::function<void()>                   done_callback_t;
+
+                            mx_resolver_connection(dns_resolver const & settings = dns_resolver());
+
+    mx_resolver &           get_resolver();
+    void                    add_domain(
+                                  std::string const & domain
+                                , mail_exchangers::resolve_callback_t callback);
+    void                    set_done_callback(done_callback_t callback);
+
+    // ed::connection implementation
+    //
+    virtual bool            is_reader() const override;
+    virtual int             get_socket() const override;
+    virtual void            process_read() override;
+    virtual void            process_timeout() override;
+
+private:
+    void                    update_timeout();
+    void                    check_done();
+
+    mx_resolver             f_resolver;
+    done_callback_t         f_done_callback = done_callback_t();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,547 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Quoted-printable Content-Transfer-Encoding.
+ *
+ * Most of the text we send (HTML bodies, plain text alternatives) is
+ * ASCII with the occasional character that needs to be escaped. This
+ * encoder searches for the next byte needing special care 16 or 32
+ * bytes at a time and copies the clean runs in between in bulk, only
+ * splitting them to insert soft line breaks.
+ *
+ * The search kernel is selected at runtime (AVX2 or SSE2 on x86, NEON
+ * on aarch64, scalar otherwise). The kernels only locate bytes, all the
+ * encoding decisions are taken by the same code whatever the kernel, so
+ * the output does not depend on the CPU.
+ *
+ * The encoder supports the edhttp::QUOTED_PRINTABLE_FLAG_... flags:
+ *
+ * \li BINARY -- CR and LF are encoded instead of being viewed as line ends
+ * \li EDBIC -- characters not safe in EBCDIC get encoded too
+ * \li LFONLY -- output lines end with "\n" instead of "\r\n"
+ * \li NO_LONE_PERIOD -- a line with just a period gets it encoded
+ */
+
+// self
+//
+#include    "libmimemail/quoted_printable.h"
+
+#include    "libmimemail/metrics.h"
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cstring>
+
+
+// C
+//
+#if defined(__x86_64__) || defined(__i386__)
+#include    <immintrin.h>
+#define LIBMIMEMAIL_QP_X86
+#elif defined(__aarch64__)
+#include    <arm_neon.h>
+#define LIBMIMEMAIL_QP_NEON
+#endif
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief Maximum number of characters on an output line.
+ *
+ * RFC 2045 limits lines to 76 characters. We keep one for the '=' of
+ * the soft line break.
+ */
+constexpr std::size_t const MAX_LINE_LENGTH = 75;
+
+
+char const g_hex[] = "0123456789ABCDEF";
+
+
+/** \brief The characters which are not safe in EBCDIC.
+ *
+ * These get encoded when the QUOTED_PRINTABLE_FLAG_EDBIC flag is set.
+ */
+char const g_edbic[] = "!\"#$@[\\]^`{|}~";
+
+
+/** \brief Check whether a byte has to go through the encoder slow path.
+ *
+ * Spaces and tabs are not special here; they only need to be encoded
+ * at the end of a line which the encoder checks when it ends a line.
+ *
+ * \param[in] c  The byte to check.
+ * \param[in] edbic  Whether the EBCDIC unsafe characters are special.
+ *
+ * \return true if \p c is special.
+ */
+inline bool is_special(unsigned char c, bool edbic)
+{
+    if(c < 0x20)
+    {
+        return c != '\t';
+    }
+    if(c > 0x7E || c == '=')
+    {
+        return true;
+    }
+    return edbic && c != '\0' && strchr(g_edbic, c) != nullptr;
+}
+
+
+/** \brief A kernel searching for the next special byte.
+ *
+ * \return The offset of the first special byte or \p size if none.
+ */
+typedef std::size_t (*find_special_t)(
+          unsigned char const * s
+        , std::size_t size
+        , bool edbic);
+
+
+std::size_t scalar_find_special(
+      unsigned char const * s
+    , std::size_t size
+    , bool edbic)
+{
+    for(std::size_t i(0); i < size; ++i)
+    {
+        if(is_special(s[i], edbic))
+        {
+            return i;
+        }
+    }
+    return size;
+}
+
+
+#ifdef LIBMIMEMAIL_QP_X86
+__attribute__((target("sse2")))
+inline int sse2_special_mask(__m128i x, bool edbic)
+{
+    // unsigned compares are done as signed compares with the top bit flipped
+    //
+    __m128i const flipped(_mm_xor_si128(x, _mm_set1_epi8(static_cast<char>(0x80))));
+    __m128i const control(_mm_andnot_si128(
+              _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))
+            , _mm_cmpgt_epi8(_mm_set1_epi8(static_cast<char>(0x20 ^ 0x80)), flipped)));
+    __m128i const high(_mm_cmpgt_epi8(flipped, _mm_set1_epi8(static_cast<char>(0x7E ^ 0x80))));
+    __m128i m(_mm_or_si128(
+              _mm_or_si128(control, high)
+            , _mm_cmpeq_epi8(x, _mm_set1_epi8('='))));
+    if(edbic)
+    {
+        for(char const * e(g_edbic); *e != '\0'; ++e)
+        {
+            m = _mm_or_si128(m, _mm_cmpeq_epi8(x, _mm_set1_epi8(*e)));
+        }
+    }
+    return _mm_movemask_epi8(m);
+}
+
+
+__attribute__((target("sse2")))
+std::size_t sse2_find_special(
+      unsigned char const * s
+    , std::size_t size
+    , bool edbic)
+{
+    std::size_t i(0);
+    for(; i + 16 <= size; i += 16)
+    {
+        int const mask(sse2_special_mask(
+                  _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i))
+                , edbic));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scalar_find_special(s + i, size - i, edbic);
+}
+
+
+__attribute__((target("avx2")))
+std::size_t avx2_find_special(
+      unsigned char const * s
+    , std::size_t size
+    , bool edbic)
+{
+    std::size_t i(0);
+    for(; i + 32 <= size; i += 32)
+    {
+        __m256i const x(_mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i)));
+        __m256i const flipped(_mm256_xor_si256(x, _mm256_set1_epi8(static_cast<char>(0x80))));
+        __m256i const control(_mm256_andnot_si256(
+                  _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))
+                , _mm256_cmpgt_epi8(_mm256_set1_epi8(static_cast<char>(0x20 ^ 0x80)), flipped)));
+        __m256i const high(_mm256_cmpgt_epi8(flipped, _mm256_set1_epi8(static_cast<char>(0x7E ^ 0x80))));
+        __m256i m(_mm256_or_si256(
+                  _mm256_or_si256(control, high)
+                , _mm256_cmpeq_epi8(x, _mm256_set1_epi8('='))));
+        if(edbic)
+        {
+            for(char const * e(g_edbic); *e != '\0'; ++e)
+            {
+                m = _mm256_or_si256(m, _mm256_cmpeq_epi8(x, _mm256_set1_epi8(*e)));
+            }
+        }
+        unsigned int const mask(_mm256_movemask_epi8(m));
+        if(mask != 0)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + sse2_find_special(s + i, size - i, edbic);
+}
+#endif
+
+
+#ifdef LIBMIMEMAIL_QP_NEON
+std::size_t neon_find_special(
+      unsigned char const * s
+    , std::size_t size
+    , bool edbic)
+{
+    std::size_t i(0);
+    for(; i + 16 <= size; i += 16)
+    {
+        uint8x16_t const x(vld1q_u8(s + i));
+        uint8x16_t m(vbicq_u8(
+                  vcltq_u8(x, vdupq_n_u8(0x20))
+                , vceqq_u8(x, vdupq_n_u8('\t'))));
+        m = vorrq_u8(m, vcgtq_u8(x, vdupq_n_u8(0x7E)));
+        m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8('=')));
+        if(edbic)
+        {
+            for(char const * e(g_edbic); *e != '\0'; ++e)
+            {
+                m = vorrq_u8(m, vceqq_u8(x, vdupq_n_u8(*e)));
+            }
+        }
+        if(vmaxvq_u8(m) != 0)
+        {
+            // NEON has no movemask, find the byte in this block
+            //
+            return i + scalar_find_special(s + i, 16, edbic);
+        }
+    }
+    return i + scalar_find_special(s + i, size - i, edbic);
+}
+#endif
+
+
+struct kernel_info
+{
+    find_special_t  f_find_special = nullptr;
+    char const *    f_name = nullptr;
+};
+
+
+kernel_info select_kernel()
+{
+#ifdef LIBMIMEMAIL_QP_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+    {
+        return kernel_info{ avx2_find_special, "avx2" };
+    }
+    if(__builtin_cpu_supports("sse2"))
+    {
+        return kernel_info{ sse2_find_special, "sse2" };
+    }
+#endif
+#ifdef LIBMIMEMAIL_QP_NEON
+    return kernel_info{ neon_find_special, "neon" };
+#else
+    return kernel_info{ scalar_find_special, "scalar" };
+#endif
+}
+
+
+kernel_info const & get_kernel()
+{
+    static kernel_info const kernel(select_kernel());
+    return kernel;
+}
+
+
+class encoder
+{
+public:
+    encoder(std::string & out, int flags)
+        : f_out(out)
+        , f_flags(flags)
+        , f_newline((flags & edhttp::QUOTED_PRINTABLE_FLAG_LFONLY) != 0 ? "\n" : "\r\n")
+    {
+    }
+
+    void encode(unsigned char const * s, std::size_t size)
+    {
+        find_special_t const find_special(get_kernel().f_find_special);
+        bool const edbic((f_flags & edhttp::QUOTED_PRINTABLE_FLAG_EDBIC) != 0);
+        bool const binary((f_flags & edhttp::QUOTED_PRINTABLE_FLAG_BINARY) != 0);
+
+        std::size_t i(0);
+        while(i < size)
+        {
+            std::size_t const j(i + find_special(s + i, size - i, edbic));
+            add_run(reinterpret_cast<char const *>(s + i), j - i);
+            if(j >= size)
+            {
+                break;
+            }
+
+            unsigned char const c(s[j]);
+            if(!binary && c == '\n')
+            {
+                hard_break();
+                i = j + 1;
+            }
+            else if(!binary
+                 && c == '\r'
+                 && j + 1 < size
+                 && s[j + 1] == '\n')
+            {
+                hard_break();
+                i = j + 2;
+            }
+            else
+            {
+                add_hex(c);
+                i = j + 1;
+            }
+        }
+        end_line();
+    }
+
+private:
+    void add_run(char const * s, std::size_t size)
+    {
+        while(size > 0)
+        {
+            if(f_line >= MAX_LINE_LENGTH)
+            {
+                soft_break();
+            }
+            std::size_t const count(std::min(size, MAX_LINE_LENGTH - f_line));
+            f_out.append(s, count);
+            f_line += count;
+            s += count;
+            size -= count;
+        }
+    }
+
+    void add_hex(unsigned char c)
+    {
+        if(f_line + 3 > MAX_LINE_LENGTH)
+        {
+            soft_break();
+        }
+        f_out += '=';
+        f_out += g_hex[c >> 4];
+        f_out += g_hex[c & 15];
+        f_line += 3;
+    }
+
+    void soft_break()
+    {
+        f_out += '=';
+        f_out += f_newline;
+        f_line = 0;
+    }
+
+    void hard_break()
+    {
+        end_line();
+        f_out += f_newline;
+        f_line = 0;
+    }
+
+    /** \brief Fix the end of the current line.
+     *
+     * The clean runs are copied as is, so the last character of the
+     * line may have to be encoded: a space or a tab at the end of a
+     * line could be removed by a mail server and a line with just a
+     * period ends the message when sent to sendmail or SMTP.
+     */
+    void end_line()
+    {
+        if(f_line == 0)
+        {
+            return;
+        }
+
+        unsigned char const c(f_out.back());
+        if(c == ' '
+        || c == '\t'
+        || (c == '.'
+            && f_line == 1
+            && (f_flags & edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD) != 0))
+        {
+            f_out.pop_back();
+            --f_line;
+            add_hex(c);
+        }
+    }
+
+    std::string &           f_out;
+    int                     f_flags = 0;
+    char const *            f_newline = nullptr;
+    std::size_t             f_line = 0;
+};
+
+
+inline int hex_value(char c)
+{
+    if(c >= '0' && c <= '9')
+    {
+        return c - '0';
+    }
+    if(c >= 'A' && c <= 'F')
+    {
+        return c - 'A' + 10;
+    }
+    if(c >= 'a' && c <= 'f')
+    {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Encode data using the quoted-printable encoding.
+ *
+ * The output lines are at most 76 characters. Line ends found in the
+ * input are kept as line ends (unless the BINARY flag is set); they are
+ * output as "\r\n" unless the LFONLY flag is set.
+ *
+ * \param[in] input  The data to encode.
+ * \param[in] flags  A set of edhttp::QUOTED_PRINTABLE_FLAG_... flags.
+ *
+ * \return The encoded data.
+ */
+std::string quoted_printable_encode(std::string_view const & input, int flags)
+{
+    metrics_timer timer(metric_stage_t::METRIC_STAGE_QUOTED_PRINTABLE);
+
+    std::string result;
+    result.reserve(input.length() + input.length() / 16);
+
+    encoder e(result, flags);
+    e.encode(reinterpret_cast<unsigned char const *>(input.data()), input.length());
+
+    return result;
+}
+
+
+/** \brief Decode quoted-printable data.
+ *
+ * Soft line breaks get removed and "=XX" sequences get replaced by the
+ * byte they represent. An '=' which is not followed by a valid sequence
+ * is kept as is.
+ *
+ * The runs between '=' characters are copied in bulk, the search of
+ * the next '=' being done with memchr().
+ *
+ * \param[in] input  The data to decode.
+ *
+ * \return The decoded data.
+ */
+std::string quoted_printable_decode(std::string_view const & input)
+{
+    std::string result;
+    result.reserve(input.length());
+
+    char const * s(input.data());
+    std::size_t const size(input.length());
+    std::size_t i(0);
+    while(i < size)
+    {
+        char const * eq(static_cast<char const *>(memchr(s + i, '=', size - i)));
+        if(eq == nullptr)
+        {
+            result.append(s + i, size - i);
+            break;
+        }
+        std::size_t const j(eq - s);
+        result.append(s + i, j - i);
+
+        if(j + 1 < size
+        && s[j + 1] == '\n')
+        {
+            i = j + 2;
+        }
+        else if(j + 2 < size
+             && s[j + 1] == '\r'
+             && s[j + 2] == '\n')
+        {
+            i = j + 3;
+        }
+        else if(j + 2 < size
+             && hex_value(s[j + 1]) >= 0
+             && hex_value(s[j + 2]) >= 0)
+        {
+            result += static_cast<char>(hex_value(s[j + 1]) * 16 + hex_value(s[j + 2]));
+            i = j + 3;
+        }
+        else
+        {
+            result += '=';
+            i = j + 1;
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Get the name of the search kernel in use.
+ *
+ * \return One of "avx2", "sse2", "neon", or "scalar".
+ */
+char const * quoted_printable_kernel_name()
+{
+    return get_kernel().f_name;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,46 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// edhttp
+//
+#include    <edhttp/quoted_printable.h>
+
+
+// C++
+//
+#include    <string>
+#include    <string_view>
+
+
+
+namespace libmimemail
+{
+
+
+
+// the flags are the edhttp::QUOTED_PRINTABLE_FLAG_... flags
+//
+std::string                 quoted_printable_encode(std::string_view const & input, int flags = 0);
+std::string                 quoted_printable_decode(std::string_view const & input);
+char const *                quoted_printable_kernel_name();
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,565 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Pipe an email to sendmail from the ed::communicator.
+ *
+ * The sendmail_transport::send_message() function blocks until the
+ * sendmail command exits. This connection does the same work without
+ * blocking: the message gets written to sendmail as its input becomes
+ * writable and the exit of the process is detected with a pidfd. One
+ * thread can therefore have many emails in flight:
+ *
+ * \code
+ *     libmimemail::sendmail_connection::pointer_t c(
+ *             std::make_shared<libmimemail::sendmail_connection>(
+ *                       "sendmail"
+ *                     , env
+ *                     , std::move(message)
+ *                     , [](libmimemail::send_result const & result)
+ *                     {
+ *                         ...
+ *                     }));
+ *     if(c->start())
+ *     {
+ *         ed::communicator::instance()->add_connection(c);
+ *     }
+ * \endcode
+ *
+ * The connection removes itself from the communicator once the callback
+ * was called.
+ *
+ * On kernels without pidfd support, the exit of the process is checked
+ * every 100ms once the message was written.
+ */
+
+// self
+//
+#include    "libmimemail/sendmail_connection.h"
+
+#include    "libmimemail/exception.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cstring>
+
+
+// C
+//
+#include    <fcntl.h>
+#include    <signal.h>
+#include    <spawn.h>
+#include    <sys/socket.h>
+#include    <sys/syscall.h>
+#include    <sys/wait.h>
+#include    <sysexits.h>
+#include    <time.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+extern char ** environ;
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+constexpr std::int64_t const    CHILD_POLL_DELAY = 100'000;     // 100ms in microseconds
+
+
+std::int64_t now()
+{
+    timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return static_cast<std::int64_t>(t.tv_sec) * 1'000'000 + t.tv_nsec / 1'000;
+}
+
+
+/** \brief Convert the exit code of sendmail to a send status.
+ *
+ * The sendmail exit codes are defined in sysexits.h. Only the codes
+ * which say that the email itself is wrong are considered permanent.
+ *
+ * \param[in] code  The exit code of sendmail.
+ *
+ * \return The corresponding send status.
+ */
+send_status_t exit_code_to_status(int code)
+{
+    switch(code)
+    {
+    case EX_OK:
+        return send_status_t::SEND_STATUS_SENT;
+
+    case EX_USAGE:
+    case EX_DATAERR:
+    case EX_NOUSER:
+    case EX_NOHOST:
+    case EX_NOPERM:
+        return send_status_t::SEND_STATUS_PERMANENT_FAILURE;
+
+    default:
+        return send_status_t::SEND_STATUS_TEMPORARY_FAILURE;
+
+    }
+}
+
+
+
+} // no name namespace
+
+
+
+/** \brief Prepare the submission of one email to sendmail.
+ *
+ * The process does not get started until start() is called.
+ *
+ * \param[in] command  The sendmail command (see sendmail_transport::set_command()).
+ * \param[in] env  The envelope with the sender and recipients.
+ * \param[in] message  The message, moved in the connection.
+ * \param[in] callback  The function called once sendmail exited.
+ */
+sendmail_connection::sendmail_connection(
+          std::string const & command
+        , envelope const & env
+        , std::string && message
+        , send_result::callback_t callback)
+    : f_command(command)
+    , f_message(std::move(message))
+    , f_callback(callback)
+{
+    set_name("sendmail_connection");
+
+    f_arguments.push_back(f_command);
+    f_arguments.push_back("-f");
+    f_arguments.push_back(env.get_sender());
+    f_arguments.insert(
+              f_arguments.end()
+            , env.get_recipients().begin()
+            , env.get_recipients().end());
+
+    // end the message with a lone period like the blocking version
+    //
+    f_message += ".\n";
+}
+
+
+/** \brief Clean up the connection.
+ *
+ * If sendmail is still running, it gets killed. This happens if the
+ * connection is destroyed before it is done.
+ */
+sendmail_connection::~sendmail_connection()
+{
+    if(f_input != -1)
+    {
+        close(f_input);
+    }
+    if(f_pidfd != -1)
+    {
+        close(f_pidfd);
+    }
+    if(f_pid != -1)
+    {
+        kill(f_pid, SIGKILL);
+        waitpid(f_pid, nullptr, 0);
+    }
+}
+
+
+/** \brief Start the sendmail process.
+ *
+ * The input of sendmail is a UNIX socket so writing to it after sendmail
+ * exited does not raise a SIGPIPE.
+ *
+ * \param[in] timeout  The maximum number of seconds sendmail is given to
+ * accept the email.
+ *
+ * \return true if the process started; false otherwise, in which case
+ * the callback was already called.
+ */
+bool sendmail_connection::start(int timeout)
+{
+    if(f_pid != -1
+    || f_done)
+    {
+        throw libmimemail_logic_error("sendmail_connection::start() called more than once.");
+    }
+
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) != 0)
+    {
+        int const e(errno);
+        fail(std::string("could not create the sendmail input socket: ") + strerror(e));
+        return false;
+    }
+
+    std::vector<char *> argv;
+    argv.reserve(f_arguments.size() + 1);
+    for(auto & a : f_arguments)
+    {
+        argv.push_back(const_cast<char *>(a.c_str()));
+    }
+    argv.push_back(nullptr);
+
+    // the dup2() clears the close-on-exec flag of the child stdin
+    //
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDIN_FILENO);
+    int const r(posix_spawnp(
+              &f_pid
+            , f_command.c_str()
+            , &actions
+            , nullptr
+            , argv.data()
+            , environ));
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if(r != 0)
+    {
+        close(fds[0]);
+        f_pid = -1;
+        fail("could not start \"" + f_command + "\": " + strerror(r));
+        return false;
+    }
+
+    f_input = fds[0];
+    fcntl(f_input, F_SETFL, fcntl(f_input, F_GETFL) | O_NONBLOCK);
+
+#ifdef SYS_pidfd_open
+    f_pidfd = static_cast<int>(syscall(SYS_pidfd_open, f_pid, 0));
+#endif
+
+    f_deadline = now() + static_cast<std::int64_t>(timeout) * 1'000'000;
+    update_timeout();
+
+    SNAP_LOG_TRACE
+        << "started \""
+        << f_command
+        << "\" (pid "
+        << f_pid
+        << ") for one email."
+        << SNAP_LOG_SEND;
+
+    return true;
+}
+
+
+/** \brief Check whether the email was handled.
+ *
+ * \return true once the callback was called.
+ */
+bool sendmail_connection::is_done() const
+{
+    return f_done;
+}
+
+
+bool sendmail_connection::is_reader() const
+{
+    return f_input == -1 && f_pidfd != -1;
+}
+
+
+bool sendmail_connection::is_writer() const
+{
+    return f_input != -1;
+}
+
+
+int sendmail_connection::get_socket() const
+{
+    return f_input != -1 ? f_input : f_pidfd;
+}
+
+
+/** \brief The pidfd is readable, sendmail exited.
+ */
+void sendmail_connection::process_read()
+{
+    check_child();
+}
+
+
+/** \brief Write as much of the message as the socket accepts.
+ *
+ * The METRIC_STAGE_PIPE_WRITE stage measures the time from the first
+ * write to the moment sendmail accepted the last byte of the message.
+ */
+void sendmail_connection::process_write()
+{
+    if(f_written == 0
+    && !f_write_timed
+    && metrics_enabled())
+    {
+        f_write_timed = true;
+        f_write_start = metrics_timer::clock_t::now();
+    }
+
+    while(f_written < f_message.length())
+    {
+        ssize_t const r(send(
+                  f_input
+                , f_message.data() + f_written
+                , f_message.length() - f_written
+                , MSG_NOSIGNAL | MSG_DONTWAIT));
+        if(r < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno == EAGAIN
+            || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+
+            // sendmail closed its input, its exit code tells us why
+            //
+            close_input();
+            check_child();
+            return;
+        }
+        f_written += r;
+    }
+
+    if(f_write_timed)
+    {
+        f_write_timed = false;
+        record_latency(
+              metric_stage_t::METRIC_STAGE_PIPE_WRITE
+            , std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        metrics_timer::clock_t::now() - f_write_start).count());
+    }
+
+    // release the message and send EOF to sendmail
+    //
+    f_message = std::string();
+    close_input();
+    check_child();
+}
+
+
+void sendmail_connection::process_timeout()
+{
+    if(now() >= f_deadline)
+    {
+        fail("sendmail did not accept the email in time.");
+        return;
+    }
+    check_child();
+}
+
+
+void sendmail_connection::process_error()
+{
+    process_hup();
+}
+
+
+void sendmail_connection::process_hup()
+{
+    if(f_input != -1)
+    {
+        close_input();
+    }
+    check_child();
+}
+
+
+void sendmail_connection::process_invalid()
+{
+    fail("invalid sendmail connection socket.");
+}
+
+
+void sendmail_connection::close_input()
+{
+    close(f_input);
+    f_input = -1;
+    update_timeout();
+}
+
+
+/** \brief Check whether sendmail exited.
+ *
+ * If the process exited, the callback gets called with the status
+ * matching the exit code.
+ */
+void sendmail_connection::check_child()
+{
+    if(f_done
+    || f_pid == -1)
+    {
+        return;
+    }
+
+    int status(0);
+    pid_t const r(waitpid(f_pid, &status, WNOHANG));
+    if(r == 0)
+    {
+        update_timeout();
+        return;
+    }
+    if(r < 0)
+    {
+        int const e(errno);
+        f_pid = -1;
+        fail(std::string("could not get the sendmail exit code: ") + strerror(e));
+        return;
+    }
+    f_pid = -1;
+
+    send_result result;
+    if(WIFEXITED(status))
+    {
+        result.set_exit_code(WEXITSTATUS(status));
+        result.set_status(exit_code_to_status(WEXITSTATUS(status)));
+        if(WEXITSTATUS(status) != 0)
+        {
+            result.set_error(
+                      "\""
+                    + f_command
+                    + "\" exited with code "
+                    + std::to_string(WEXITSTATUS(status))
+                    + ".");
+        }
+    }
+    else
+    {
+        result.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        result.set_error(
+                  "\""
+                + f_command
+                + "\" was terminated by signal "
+                + std::to_string(WTERMSIG(status))
+                + ".");
+    }
+    if(result.get_status() == send_status_t::SEND_STATUS_SENT
+    && f_input != -1)
+    {
+        // sendmail exited with 0 before reading the whole message
+        //
+        result.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        result.set_error("sendmail exited before reading the whole email.");
+    }
+    done(result);
+}
+
+
+void sendmail_connection::done(send_result const & result)
+{
+    if(f_done)
+    {
+        return;
+    }
+    f_done = true;
+
+    if(f_input != -1)
+    {
+        close(f_input);
+        f_input = -1;
+    }
+    if(f_pidfd != -1)
+    {
+        close(f_pidfd);
+        f_pidfd = -1;
+    }
+    set_timeout_delay(-1);
+
+    if(!result.get_error().empty())
+    {
+        SNAP_LOG_ERROR
+            << result.get_error()
+            << SNAP_LOG_SEND;
+    }
+
+    // keep this connection alive until the callback returns
+    //
+    ed::connection::pointer_t keep(weak_from_this().lock());
+    remove_from_communicator();
+
+    send_result::callback_t callback;
+    std::swap(callback, f_callback);
+    if(callback != nullptr)
+    {
+        callback(result);
+    }
+}
+
+
+void sendmail_connection::fail(std::string const & error)
+{
+    if(f_pid != -1)
+    {
+        kill(f_pid, SIGKILL);
+        waitpid(f_pid, nullptr, 0);
+        f_pid = -1;
+    }
+
+    send_result result;
+    result.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+    result.set_error(error);
+    done(result);
+}
+
+
+void sendmail_connection::update_timeout()
+{
+    if(f_done)
+    {
+        return;
+    }
+
+    std::int64_t delay(std::max(f_deadline - now(), static_cast<std::int64_t>(1)));
+    if(f_input == -1
+    && f_pidfd == -1)
+    {
+        // no pidfd, poll the process
+        //
+        delay = std::min(delay, CHILD_POLL_DELAY);
+    }
+    set_timeout_delay(delay);
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
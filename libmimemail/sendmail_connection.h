@@ -0,0 +1,100 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/metrics.h>
+#include    <libmimemail/transport.h>
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/connection.h>
+
+
+// C
+//
+#include    <sys/types.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+class sendmail_connection
+    : public ed::connection
+{
+public:
+    typedef std::shared_ptr<sendmail_connection>    pointer_t;
+
+    static constexpr int const      DEFAULT_TIMEOUT = 5 * 60;   // in seconds
+
+                            sendmail_connection(
+                                  std::string const & command
+                                , envelope const & env
+                                , std::string && message
+                                , send_result::callback_t callback);
+                            sendmail_connection(sendmail_connection const &) = delete;
+    virtual                 ~sendmail_connection() override;
+
+    sendmail_connection &   operator = (sendmail_connection const &) = delete;
+
+    bool                    start(int timeout = DEFAULT_TIMEOUT);
+    bool                    is_done() const;
+
+    // ed::connection implementation
+    //
+    virtual bool            is_reader() const override;
+    virtual bool            is_writer() const override;
+    virtual int             get_socket() const override;
+    virtual void            process_read() override;
+    virtual void            process_write() override;
+    virtual void            process_timeout() override;
+    virtual void            process_error() override;
+    virtual void            process_hup() override;
+    virtual void            process_invalid() override;
+
+private:
+    void                    close_input();
+    void                    check_child();
+    void                    done(send_result const & result);
+    void                    fail(std::string const & error);
+    void                    update_timeout();
+
+    std::string             f_command = std::string();
+    string_list_t           f_arguments = string_list_t();
+    std::string             f_message = std::string();
+    std::size_t             f_written = 0;
+    bool                    f_write_timed = false;
+    metrics_timer::clock_t::time_point
+                            f_write_start = metrics_timer::clock_t::time_point();
+    send_result::callback_t f_callback = send_result::callback_t();
+    pid_t                   f_pid = -1;
+    int                     f_input = -1;
+    int                     f_pidfd = -1;
+    std::int64_t            f_deadline = 0;
+    bool                    f_done = false;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
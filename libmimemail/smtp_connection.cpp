@@ -0,0 +1,1924 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Implementation of an SMTP/ESMTP client connection.
+ *
+ * The smtp_connection class is used to send emails directly to an SMTP
+ * server (a relay or the MX of the destination domain) instead of going
+ * through the `sendmail` command line tool.
+ *
+ * The connection is expected to stay open between messages so one
+ * connection can be used to send many emails. The class supports the
+ * STARTTLS and PIPELINING extensions and uses RSET between messages.
+ */
+
+// self
+//
+#include    "libmimemail/smtp_connection.h"
+
+#include    "libmimemail/exception.h"
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// OpenSSL
+//
+#include    <openssl/err.h>
+#include    <openssl/ssl.h>
+#include    <openssl/x509v3.h>
+
+
+// C++
+//
+#include    <algorithm>
+#include    <cctype>
+
+
+// C
+//
+#include    <errno.h>
+#include    <fcntl.h>
+#include    <netdb.h>
+#include    <poll.h>
+#include    <string.h>
+#include    <sys/socket.h>
+#include    <unistd.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+/** \brief Retrieve the last OpenSSL error as a string.
+ *
+ * This function empties the OpenSSL error queue and returns the messages
+ * in one string so they can be logged.
+ *
+ * \return The OpenSSL errors separated by semi-colons.
+ */
+std::string get_ssl_errors()
+{
+    std::string result;
+    for(;;)
+    {
+        unsigned long const e(ERR_get_error());
+        if(e == 0)
+        {
+            break;
+        }
+        char buf[256];
+        ERR_error_string_n(e, buf, sizeof(buf));
+        if(!result.empty())
+        {
+            result += "; ";
+        }
+        result += buf;
+    }
+    return result;
+}
+
+
+
+}
+// no name namespace
+
+
+
+
+////////////////
+// SMTP REPLY //
+////////////////
+
+
+/** \brief Initialize an empty SMTP reply.
+ *
+ * A reply has a code of 0 until it gets set by the connection when
+ * reading a reply from the server.
+ */
+smtp_reply::smtp_reply()
+{
+}
+
+
+/** \brief Set the 3 digit code of this reply.
+ *
+ * \param[in] code  The SMTP reply code (i.e. 250).
+ */
+void smtp_reply::set_code(int code)
+{
+    f_code = code;
+}
+
+
+/** \brief Retrieve the reply code.
+ *
+ * \return The 3 digit SMTP reply code or 0 if no reply was read.
+ */
+int smtp_reply::get_code() const
+{
+    return f_code;
+}
+
+
+/** \brief Add one line of text to the reply.
+ *
+ * Replies can span multiple lines. Each line is saved without the
+ * code and separator.
+ *
+ * \param[in] line  The text of one line of the reply.
+ */
+void smtp_reply::add_line(std::string const & line)
+{
+    f_lines.push_back(line);
+}
+
+
+/** \brief Retrieve the lines of text found in this reply.
+ *
+ * \return A reference to the list of lines.
+ */
+string_list_t const & smtp_reply::get_lines() const
+{
+    return f_lines;
+}
+
+
+/** \brief Get the text of the reply as one string.
+ *
+ * This is mainly used for logs. The lines are separated by a space.
+ *
+ * \return The code and text of the reply.
+ */
+std::string smtp_reply::get_text() const
+{
+    std::string result(std::to_string(f_code));
+    for(auto const & l : f_lines)
+    {
+        result += ' ';
+        result += l;
+    }
+    return result;
+}
+
+
+/** \brief Check whether the reply is a positive completion (2xx).
+ *
+ * \return true if the code is between 200 and 299.
+ */
+bool smtp_reply::is_positive() const
+{
+    return f_code >= 200 && f_code < 300;
+}
+
+
+/** \brief Check whether the reply is a positive intermediate (3xx).
+ *
+ * \return true if the code is between 300 and 399.
+ */
+bool smtp_reply::is_intermediate() const
+{
+    return f_code >= 300 && f_code < 400;
+}
+
+
+/** \brief Check whether the reply is a transient failure (4xx).
+ *
+ * In this case the message can be sent again later.
+ *
+ * \return true if the code is between 400 and 499.
+ */
+bool smtp_reply::is_transient_failure() const
+{
+    return f_code >= 400 && f_code < 500;
+}
+
+
+/** \brief Check whether the reply is a permanent failure (5xx).
+ *
+ * \return true if the code is between 500 and 599.
+ */
+bool smtp_reply::is_permanent_failure() const
+{
+    return f_code >= 500 && f_code < 600;
+}
+
+
+
+
+//////////////////////
+// SMTP TRANSACTION //
+//////////////////////
+
+
+/** \brief Initialize a transaction.
+ *
+ * A transaction represents one message to be sent to a set of
+ * recipients. The object does not copy the parameters, it keeps a
+ * pointer to them so they have to remain valid as long as the
+ * transaction is in use.
+ *
+ * \param[in] sender  The envelope sender.
+ * \param[in] recipients  The envelope recipients.
+ * \param[in] message  The message to send.
+ */
+smtp_transaction::smtp_transaction(
+          std::string const & sender
+        , string_list_t const & recipients
+        , std::string const & message)
+    : f_sender(&sender)
+    , f_recipients(&recipients)
+    , f_message(&message)
+{
+}
+
+
+/** \brief Retrieve the envelope sender.
+ *
+ * \return A reference to the sender email address.
+ */
+std::string const & smtp_transaction::get_sender() const
+{
+    return *f_sender;
+}
+
+
+/** \brief Retrieve the envelope recipients.
+ *
+ * \return A reference to the list of recipients.
+ */
+string_list_t const & smtp_transaction::get_recipients() const
+{
+    return *f_recipients;
+}
+
+
+/** \brief Retrieve the message.
+ *
+ * \return A reference to the message.
+ */
+std::string const & smtp_transaction::get_message() const
+{
+    return *f_message;
+}
+
+
+/** \brief Change the status of this transaction.
+ *
+ * \param[in] status  The new status.
+ */
+void smtp_transaction::set_status(send_status_t status)
+{
+    f_status = status;
+}
+
+
+/** \brief Retrieve the status of this transaction.
+ *
+ * The status is SEND_STATUS_NOT_SENT until the transaction is attempted.
+ *
+ * \return The current status.
+ */
+send_status_t smtp_transaction::get_status() const
+{
+    return f_status;
+}
+
+
+/** \brief Save the list of recipients the server refused.
+ *
+ * \param[in] recipients  The list of rejected recipients.
+ */
+void smtp_transaction::set_rejected_recipients(string_list_t const & recipients)
+{
+    f_rejected_recipients = recipients;
+}
+
+
+/** \brief Retrieve the list of recipients the server refused.
+ *
+ * \return A reference to the list of rejected recipients.
+ */
+string_list_t const & smtp_transaction::get_rejected_recipients() const
+{
+    return f_rejected_recipients;
+}
+
+
+/** \brief Save the reply which ended this transaction.
+ *
+ * \param[in] reply  The last reply of this transaction.
+ */
+void smtp_transaction::set_reply(smtp_reply const & reply)
+{
+    f_reply = reply;
+}
+
+
+/** \brief Retrieve the reply which ended this transaction.
+ *
+ * \return The reply to the data or the reply of the failing command.
+ */
+smtp_reply const & smtp_transaction::get_reply() const
+{
+    return f_reply;
+}
+
+
+
+
+/////////////////////
+// SMTP CONNECTION //
+/////////////////////
+
+
+/** \brief Initialize an SMTP connection.
+ *
+ * The constructor only saves the parameters. The connection is not
+ * opened until you call the connect() function. This gives you a chance
+ * to call the various set_...() functions first.
+ *
+ * \param[in] host  The name or IP address of the SMTP server.
+ * \param[in] port  The port to connect to, 25 by default.
+ */
+smtp_connection::smtp_connection(std::string const & host, int port)
+    : f_host(host)
+    , f_port(port)
+{
+    if(f_host.empty())
+    {
+        throw invalid_parameter("smtp_connection::smtp_connection(): the host name cannot be empty.");
+    }
+    if(f_port <= 0 || f_port > 65535)
+    {
+        throw invalid_parameter(
+                  "smtp_connection::smtp_connection(): invalid port "
+                + std::to_string(f_port)
+                + ".");
+    }
+}
+
+
+/** \brief Close the connection.
+ *
+ * If the connection is still open, send a QUIT and then close the socket.
+ */
+smtp_connection::~smtp_connection()
+{
+    quit();
+    if(f_ssl_ctx != nullptr)
+    {
+        SSL_CTX_free(f_ssl_ctx);
+    }
+}
+
+
+/** \brief Define the name sent with the EHLO/HELO command.
+ *
+ * By default the name of the computer (gethostname()) is used.
+ *
+ * \param[in] helo_name  The name of this client.
+ */
+void smtp_connection::set_helo_name(std::string const & helo_name)
+{
+    f_helo_name = helo_name;
+}
+
+
+/** \brief Define whether STARTTLS is to be used.
+ *
+ * By default the connection is opportunistic: if the server offers
+ * STARTTLS, the connection gets encrypted. Otherwise the email is sent
+ * in clear.
+ *
+ * \param[in] mode  The new TLS mode.
+ */
+void smtp_connection::set_tls_mode(tls_mode_t mode)
+{
+    f_tls_mode = mode;
+}
+
+
+/** \brief Whether the server certificate has to be verified.
+ *
+ * When sending to an MX server, most servers present a certificate
+ * which does not match the MX name so the verification is off by
+ * default. When using your own relay, you probably want to turn this
+ * flag on.
+ *
+ * \param[in] verify  Whether to verify the certificate.
+ */
+void smtp_connection::set_verify_certificate(bool verify)
+{
+    f_verify_certificate = verify;
+}
+
+
+/** \brief Set the timeout used for each network operation.
+ *
+ * \param[in] seconds  The number of seconds to wait on each network
+ * operation before giving up.
+ */
+void smtp_connection::set_timeout(int seconds)
+{
+    if(seconds <= 0)
+    {
+        throw invalid_parameter("smtp_connection::set_timeout(): the timeout must be positive.");
+    }
+    f_timeout = seconds;
+}
+
+
+/** \brief Retrieve the host this connection is connected to.
+ *
+ * \return The host name as defined in the constructor.
+ */
+std::string const & smtp_connection::get_host() const
+{
+    return f_host;
+}
+
+
+/** \brief Retrieve the port of this connection.
+ *
+ * \return The port as defined in the constructor.
+ */
+int smtp_connection::get_port() const
+{
+    return f_port;
+}
+
+
+/** \brief Connect to the SMTP server.
+ *
+ * This function opens the socket, reads the greeting, sends the EHLO
+ * and, if possible and requested, starts TLS.
+ *
+ * \return true if the connection is ready to accept transactions.
+ */
+bool smtp_connection::connect()
+{
+    if(is_connected())
+    {
+        return true;
+    }
+
+    if(!open_socket())
+    {
+        return false;
+    }
+
+    return start_session();
+}
+
+
+/** \brief Use an already connected socket.
+ *
+ * This function is used when the TCP connection was established by
+ * someone else, i.e. the mx_connector which races the connections to
+ * the mail exchangers of a domain. It takes ownership of \p socket,
+ * then reads the greeting, sends the EHLO and, if possible and
+ * requested, starts TLS as connect() does.
+ *
+ * The socket gets closed if anything fails.
+ *
+ * \exception invalid_parameter
+ * The \p socket cannot be -1.
+ *
+ * \exception libmimemail_logic_error
+ * The connection cannot already be open.
+ *
+ * \param[in] socket  A connected TCP socket to the SMTP server.
+ *
+ * \return true if the connection is ready to accept transactions.
+ */
+bool smtp_connection::connect(int socket)
+{
+    if(socket == -1)
+    {
+        throw invalid_parameter("smtp_connection::connect(): the socket cannot be -1.");
+    }
+    if(is_connected())
+    {
+        throw libmimemail_logic_error("smtp_connection::connect(): the connection is already open.");
+    }
+
+    f_socket = socket;
+
+    // our I/O functions expect a non-blocking socket
+    //
+    int const flags(fcntl(f_socket, F_GETFL));
+    if(flags == -1
+    || fcntl(f_socket, F_SETFL, flags | O_NONBLOCK) == -1)
+    {
+        int const e(errno);
+        SNAP_LOG_ERROR
+            << "could not make the socket to SMTP server "
+            << f_host
+            << " non-blocking (errno: "
+            << e
+            << ", "
+            << strerror(e)
+            << ")."
+            << SNAP_LOG_SEND;
+        close();
+        return false;
+    }
+
+    return start_session();
+}
+
+
+/** \brief Check whether the connection is currently open.
+ *
+ * \return true if the socket is open.
+ */
+bool smtp_connection::is_connected() const
+{
+    return f_socket != -1;
+}
+
+
+/** \brief Check whether the connection is encrypted.
+ *
+ * \return true if STARTTLS was successfully negotiated.
+ */
+bool smtp_connection::is_secure() const
+{
+    return f_ssl != nullptr;
+}
+
+
+/** \brief Check whether the server advertised a given extension.
+ *
+ * The \p name is the keyword as found in the EHLO reply such as
+ * "PIPELINING" or "STARTTLS". It is expected to be in uppercase.
+ *
+ * \param[in] name  The name of the extension.
+ *
+ * \return true if the server supports that extension.
+ */
+bool smtp_connection::has_capability(std::string const & name) const
+{
+    return f_capabilities.find(name) != f_capabilities.end();
+}
+
+
+/** \brief Get the parameters of an extension.
+ *
+ * Some extensions include parameters such as the SIZE extension which
+ * includes the maximum size of a message.
+ *
+ * \param[in] name  The name of the extension.
+ *
+ * \return The parameters or an empty string.
+ */
+std::string smtp_connection::get_capability_parameters(std::string const & name) const
+{
+    for(auto const & l : f_capability_lines)
+    {
+        if(l.length() > name.length()
+        && strncasecmp(l.c_str(), name.c_str(), name.length()) == 0
+        && l[name.length()] == ' ')
+        {
+            return l.substr(name.length() + 1);
+        }
+    }
+    return std::string();
+}
+
+
+/** \brief Send the RSET command.
+ *
+ * This command cancels the current transaction, if any.
+ *
+ * \return true if the server accepted the command.
+ */
+bool smtp_connection::reset()
+{
+    smtp_reply reply;
+    if(!command("RSET\r\n", reply)
+    || !reply.is_positive())
+    {
+        return false;
+    }
+    f_need_reset = false;
+    return true;
+}
+
+
+/** \brief Send the NOOP command.
+ *
+ * This can be used to verify that an idle connection is still valid.
+ *
+ * \return true if the server replied positively.
+ */
+bool smtp_connection::noop()
+{
+    smtp_reply reply;
+    return command("NOOP\r\n", reply) && reply.is_positive();
+}
+
+
+/** \brief Send QUIT and close the connection.
+ *
+ * The function does nothing if the connection is not open.
+ */
+void smtp_connection::quit()
+{
+    if(is_connected())
+    {
+        smtp_reply reply;
+        command("QUIT\r\n", reply);
+        close();
+    }
+}
+
+
+/** \brief Close the connection without sending QUIT.
+ *
+ * This is used whenever an error occurs.
+ */
+void smtp_connection::close()
+{
+    if(f_ssl != nullptr)
+    {
+        SSL_free(f_ssl);
+        f_ssl = nullptr;
+    }
+    if(f_socket != -1)
+    {
+        ::close(f_socket);
+        f_socket = -1;
+    }
+    f_input.clear();
+}
+
+
+/** \brief Send one message.
+ *
+ * This function runs one complete SMTP transaction:
+ *
+ * \li RSET, if the previous transaction was not completed or when the
+ *     server supports PIPELINING (it costs nothing in that case);
+ * \li MAIL FROM
+ * \li RCPT TO, once per recipient
+ * \li DATA and then the message
+ *
+ * When the server supports PIPELINING, the commands are all sent at once
+ * and the replies are read afterward. This means one round trip instead
+ * of one per command.
+ *
+ * The \p message is expected to be a complete message: headers, an empty
+ * line, and the body. Lines can end with "\n" only. This function takes
+ * care of converting those to "\r\n" and of the dot-stuffing.
+ *
+ * \param[in] sender  The envelope sender (email address only).
+ * \param[in] recipients  The envelope recipients (email addresses only).
+ * \param[in] message  The message to be sent.
+ * \param[out] rejected_recipients  If not nullptr, receives the list of
+ * recipients that the server refused.
+ *
+ * \return true if the server accepted the message for at least one
+ * recipient.
+ *
+ * \sa send_transactions()
+ */
+bool smtp_connection::send_message(
+      std::string const & sender
+    , string_list_t const & recipients
+    , std::string const & message
+    , string_list_t * rejected_recipients)
+{
+    smtp_transaction::vector_t transactions;
+    transactions.emplace_back(sender, recipients, message);
+    send_transactions(transactions);
+
+    if(rejected_recipients != nullptr)
+    {
+        string_list_t const & rejected(transactions[0].get_rejected_recipients());
+        rejected_recipients->insert(rejected_recipients->end(), rejected.begin(), rejected.end());
+    }
+
+    send_status_t const status(transactions[0].get_status());
+    return status == send_status_t::SEND_STATUS_SENT
+        || status == send_status_t::SEND_STATUS_PARTIAL;
+}
+
+
+/** \brief Send many messages through this connection.
+ *
+ * This function sends all the \p transactions one after the other. The
+ * status of each transaction is updated accordingly.
+ *
+ * When the server supports PIPELINING, the envelope of the next message
+ * (MAIL FROM, RCPT TO, and DATA) is sent along the data of the current
+ * message. This means each message costs a single round trip instead of
+ * two (or more without PIPELINING).
+ *
+ * When the server also supports CHUNKING, the messages get sent with
+ * BDAT instead of DATA (see send_chunked_transactions()).
+ *
+ * If the connection is lost, the transactions which were not yet sent
+ * keep the SEND_STATUS_NOT_SENT status so they can be sent again through
+ * another connection. A transaction for which the data was sent but
+ * the final reply did not make it gets a SEND_STATUS_TEMPORARY_FAILURE
+ * since we cannot know whether the server accepted it or not.
+ *
+ * \param[in,out] transactions  The transactions to send.
+ */
+void smtp_connection::send_transactions(smtp_transaction::vector_t & transactions)
+{
+    for(auto const & t : transactions)
+    {
+        if(t.get_recipients().empty())
+        {
+            throw missing_parameter("smtp_connection::send_transactions(): called with a transaction without any recipients.");
+        }
+    }
+
+    if(transactions.empty()
+    || !is_connected())
+    {
+        return;
+    }
+
+    if(!has_capability("PIPELINING"))
+    {
+        for(auto & t : transactions)
+        {
+            send_transaction(t);
+            if(!is_connected())
+            {
+                break;
+            }
+        }
+        return;
+    }
+
+    if(has_capability("CHUNKING"))
+    {
+        send_chunked_transactions(transactions);
+        return;
+    }
+
+    // on a reused connection, the RSET is also a way to verify that the
+    // connection is still valid; with PIPELINING it costs nothing
+    //
+    bool reset(f_need_reset || f_message_count > 0);
+    std::string out;
+    append_envelope(out, transactions[0], reset);
+    if(!write_data(out))
+    {
+        return;
+    }
+
+    std::size_t const max(transactions.size());
+    for(std::size_t idx(0); idx < max; ++idx)
+    {
+        smtp_transaction & t(transactions[idx]);
+
+        f_need_reset = true;
+        bool data_mode(false);
+        if(!read_envelope_replies(t, reset, data_mode))
+        {
+            return;
+        }
+
+        out.clear();
+        bool const send_body(data_mode && t.get_status() == send_status_t::SEND_STATUS_NOT_SENT);
+        if(send_body)
+        {
+            stuff_message(out, t.get_message());
+        }
+        else if(data_mode)
+        {
+            // the server accepted DATA anyway, send an empty message
+            // so we get out of the DATA state
+            //
+            out += ".\r\n";
+        }
+
+        // once the DATA is over, the transaction is over whether it
+        // worked or not; otherwise we have to send an RSET
+        //
+        reset = !data_mode;
+        if(idx + 1 < max)
+        {
+            append_envelope(out, transactions[idx + 1], reset);
+        }
+
+        if(!out.empty()
+        && !write_data(out))
+        {
+            if(send_body)
+            {
+                t.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+            }
+            return;
+        }
+
+        if(send_body)
+        {
+            if(!read_data_reply(t))
+            {
+                return;
+            }
+        }
+        else if(data_mode)
+        {
+            smtp_reply reply;
+            if(!read_reply(reply))
+            {
+                return;
+            }
+            f_need_reset = false;
+        }
+    }
+}
+
+
+/** \brief Send many messages with PIPELINING and CHUNKING.
+ *
+ * With BDAT, the whole transaction (RSET, MAIL FROM, RCPT TO, and BDAT
+ * with the message) gets sent at once and there is no intermediate
+ * reply to wait for. So each message costs a single round trip and the
+ * message does not need to be dot-stuffed.
+ *
+ * If the server refuses the sender or all the recipients, it still reads
+ * the data and replies to BDAT with an error, which we ignore since the
+ * transaction already has its failure status.
+ *
+ * \param[in,out] transactions  The transactions to send.
+ */
+void smtp_connection::send_chunked_transactions(smtp_transaction::vector_t & transactions)
+{
+    // on a reused connection, the RSET is also a way to verify that the
+    // connection is still valid; with PIPELINING it costs nothing
+    //
+    bool reset(f_need_reset || f_message_count > 0);
+    std::string out;
+    for(auto & t : transactions)
+    {
+        out.clear();
+        append_envelope(out, t, reset);
+        if(!write_data(out))
+        {
+            // we do not know how much of the message the server got
+            //
+            t.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+            return;
+        }
+
+        f_need_reset = true;
+        bool data_mode(false);
+        if(!read_envelope_replies(t, reset, data_mode))
+        {
+            if(t.get_status() == send_status_t::SEND_STATUS_NOT_SENT)
+            {
+                t.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+            }
+            return;
+        }
+
+        if(t.get_status() == send_status_t::SEND_STATUS_NOT_SENT)
+        {
+            if(!read_data_reply(t))
+            {
+                return;
+            }
+        }
+        else
+        {
+            smtp_reply reply;
+            if(!read_reply(reply))
+            {
+                return;
+            }
+        }
+
+        if(!is_connected())
+        {
+            return;
+        }
+        reset = f_need_reset;
+    }
+}
+
+
+/** \brief Get the number of messages sent through this connection.
+ *
+ * This counter is reset each time the connection is opened anew.
+ *
+ * \return The number of successful transactions on this connection.
+ */
+std::size_t smtp_connection::get_message_count() const
+{
+    return f_message_count;
+}
+
+
+/** \brief Retrieve the last reply read from the server.
+ *
+ * This is useful to get the exact error when send_message() fails.
+ *
+ * \return A reference to the last reply.
+ */
+smtp_reply const & smtp_connection::get_last_reply() const
+{
+    return f_last_reply;
+}
+
+
+bool smtp_connection::open_socket()
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+
+    addrinfo * addresses(nullptr);
+    std::string const port(std::to_string(f_port));
+    int const r(getaddrinfo(f_host.c_str(), port.c_str(), &hints, &addresses));
+    if(r != 0)
+    {
+        SNAP_LOG_ERROR
+            << "could not resolve SMTP server \""
+            << f_host
+            << "\": "
+            << gai_strerror(r)
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    for(addrinfo * a(addresses); a != nullptr; a = a->ai_next)
+    {
+        f_socket = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+        if(f_socket == -1)
+        {
+            continue;
+        }
+        if(::connect(f_socket, a->ai_addr, a->ai_addrlen) == 0)
+        {
+            break;
+        }
+        if(errno == EINPROGRESS
+        && wait_for(POLLOUT))
+        {
+            int error(0);
+            socklen_t len(sizeof(error));
+            if(getsockopt(f_socket, SOL_SOCKET, SO_ERROR, &error, &len) == 0
+            && error == 0)
+            {
+                break;
+            }
+        }
+        ::close(f_socket);
+        f_socket = -1;
+    }
+
+    freeaddrinfo(addresses);
+
+    if(f_socket == -1)
+    {
+        SNAP_LOG_ERROR
+            << "could not connect to SMTP server \""
+            << f_host
+            << ":"
+            << f_port
+            << "\"."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    return true;
+}
+
+
+bool smtp_connection::start_session()
+{
+    f_input.clear();
+    f_capabilities.clear();
+    f_capability_lines.clear();
+    f_need_reset = false;
+    f_message_count = 0;
+
+    if(!greet()
+    || !hello()
+    || !start_tls())
+    {
+        close();
+        return false;
+    }
+
+    return true;
+}
+
+
+bool smtp_connection::greet()
+{
+    smtp_reply reply;
+    if(!read_reply(reply))
+    {
+        return false;
+    }
+    if(reply.get_code() != 220)
+    {
+        SNAP_LOG_ERROR
+            << "SMTP server "
+            << f_host
+            << " greeted us with: "
+            << reply.get_text()
+            << SNAP_LOG_SEND;
+        return false;
+    }
+    return true;
+}
+
+
+bool smtp_connection::hello()
+{
+    if(f_helo_name.empty())
+    {
+        char name[256];
+        if(gethostname(name, sizeof(name)) != 0)
+        {
+            strcpy(name, "localhost");
+        }
+        name[sizeof(name) - 1] = '\0';
+        f_helo_name = name;
+    }
+
+    f_capabilities.clear();
+    f_capability_lines.clear();
+
+    smtp_reply reply;
+    if(!command("EHLO " + f_helo_name + "\r\n", reply))
+    {
+        return false;
+    }
+    if(reply.is_positive())
+    {
+        // the first line is the server name & greeting, the following
+        // lines are the extensions
+        //
+        string_list_t const & lines(reply.get_lines());
+        for(std::size_t idx(1); idx < lines.size(); ++idx)
+        {
+            std::string keyword(lines[idx].substr(0, lines[idx].find(' ')));
+            for(auto & c : keyword)
+            {
+                c = std::toupper(static_cast<unsigned char>(c));
+            }
+            f_capabilities.insert(keyword);
+            f_capability_lines.push_back(lines[idx]);
+        }
+        return true;
+    }
+
+    // old server, try HELO instead (no extensions available)
+    //
+    if(!command("HELO " + f_helo_name + "\r\n", reply))
+    {
+        return false;
+    }
+    return reply.is_positive();
+}
+
+
+bool smtp_connection::start_tls()
+{
+    if(f_tls_mode == tls_mode_t::TLS_MODE_NONE)
+    {
+        return true;
+    }
+    if(!has_capability("STARTTLS"))
+    {
+        if(f_tls_mode == tls_mode_t::TLS_MODE_REQUIRED)
+        {
+            SNAP_LOG_ERROR
+                << "SMTP server "
+                << f_host
+                << " does not offer STARTTLS which is required."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        return true;
+    }
+
+    smtp_reply reply;
+    if(!command("STARTTLS\r\n", reply))
+    {
+        return false;
+    }
+    if(reply.get_code() != 220)
+    {
+        return f_tls_mode != tls_mode_t::TLS_MODE_REQUIRED;
+    }
+
+    if(f_ssl_ctx == nullptr)
+    {
+        f_ssl_ctx = SSL_CTX_new(TLS_client_method());
+        if(f_ssl_ctx == nullptr)
+        {
+            SNAP_LOG_ERROR
+                << "could not create the OpenSSL context: "
+                << get_ssl_errors()
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        SSL_CTX_set_min_proto_version(f_ssl_ctx, TLS1_2_VERSION);
+        if(f_verify_certificate)
+        {
+            SSL_CTX_set_default_verify_paths(f_ssl_ctx);
+        }
+    }
+
+    f_ssl = SSL_new(f_ssl_ctx);
+    if(f_ssl == nullptr)
+    {
+        return false;
+    }
+    SSL_set_fd(f_ssl, f_socket);
+    SSL_set_tlsext_host_name(f_ssl, f_host.c_str());
+    if(f_verify_certificate)
+    {
+        SSL_set_verify(f_ssl, SSL_VERIFY_PEER, nullptr);
+        SSL_set1_host(f_ssl, f_host.c_str());
+    }
+
+    for(;;)
+    {
+        int const r(SSL_connect(f_ssl));
+        if(r == 1)
+        {
+            break;
+        }
+        int const e(SSL_get_error(f_ssl, r));
+        if(e == SSL_ERROR_WANT_READ)
+        {
+            if(!wait_for(POLLIN))
+            {
+                return false;
+            }
+        }
+        else if(e == SSL_ERROR_WANT_WRITE)
+        {
+            if(!wait_for(POLLOUT))
+            {
+                return false;
+            }
+        }
+        else
+        {
+            SNAP_LOG_ERROR
+                << "TLS handshake with SMTP server "
+                << f_host
+                << " failed: "
+                << get_ssl_errors()
+                << SNAP_LOG_SEND;
+            return false;
+        }
+    }
+
+    // the extensions may differ once the connection is secure
+    //
+    return hello();
+}
+
+
+bool smtp_connection::wait_for(short events)
+{
+    pollfd fd = {};
+    fd.fd = f_socket;
+    fd.events = events;
+    for(;;)
+    {
+        int const r(poll(&fd, 1, f_timeout * 1000));
+        if(r > 0)
+        {
+            return (fd.revents & (events | POLLHUP)) != 0;
+        }
+        if(r == 0)
+        {
+            SNAP_LOG_ERROR
+                << "SMTP connection to "
+                << f_host
+                << " timed out."
+                << SNAP_LOG_SEND;
+            return false;
+        }
+        if(errno != EINTR)
+        {
+            return false;
+        }
+    }
+}
+
+
+bool smtp_connection::write_data(char const * data, std::size_t size)
+{
+    while(size > 0)
+    {
+        ssize_t written(0);
+        if(f_ssl != nullptr)
+        {
+            int const r(SSL_write(f_ssl, data, static_cast<int>(std::min(size, static_cast<std::size_t>(1024 * 1024)))));
+            if(r <= 0)
+            {
+                int const e(SSL_get_error(f_ssl, r));
+                if(e == SSL_ERROR_WANT_WRITE)
+                {
+                    if(!wait_for(POLLOUT))
+                    {
+                        close();
+                        return false;
+                    }
+                    continue;
+                }
+                if(e == SSL_ERROR_WANT_READ)
+                {
+                    if(!wait_for(POLLIN))
+                    {
+                        close();
+                        return false;
+                    }
+                    continue;
+                }
+                SNAP_LOG_ERROR
+                    << "TLS write to SMTP server "
+                    << f_host
+                    << " failed: "
+                    << get_ssl_errors()
+                    << SNAP_LOG_SEND;
+                close();
+                return false;
+            }
+            written = r;
+        }
+        else
+        {
+            written = ::send(f_socket, data, size, MSG_NOSIGNAL);
+            if(written < 0)
+            {
+                if(errno == EAGAIN
+                || errno == EWOULDBLOCK)
+                {
+                    if(!wait_for(POLLOUT))
+                    {
+                        close();
+                        return false;
+                    }
+                    continue;
+                }
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                int const e(errno);
+                SNAP_LOG_ERROR
+                    << "write to SMTP server "
+                    << f_host
+                    << " failed: "
+                    << strerror(e)
+                    << SNAP_LOG_SEND;
+                close();
+                return false;
+            }
+        }
+        data += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+
+bool smtp_connection::write_data(std::string const & data)
+{
+    return write_data(data.data(), data.length());
+}
+
+
+bool smtp_connection::read_line(std::string & line)
+{
+    for(;;)
+    {
+        std::string::size_type const pos(f_input.find('\n'));
+        if(pos != std::string::npos)
+        {
+            std::string::size_type end(pos);
+            if(end > 0 && f_input[end - 1] == '\r')
+            {
+                --end;
+            }
+            line = f_input.substr(0, end);
+            f_input.erase(0, pos + 1);
+            return true;
+        }
+
+        if(!is_connected())
+        {
+            return false;
+        }
+
+        char buf[4096];
+        ssize_t r(0);
+        if(f_ssl != nullptr)
+        {
+            int const sr(SSL_read(f_ssl, buf, sizeof(buf)));
+            if(sr <= 0)
+            {
+                int const e(SSL_get_error(f_ssl, sr));
+                if(e == SSL_ERROR_WANT_READ)
+                {
+                    if(!wait_for(POLLIN))
+                    {
+                        close();
+                        return false;
+                    }
+                    continue;
+                }
+                if(e == SSL_ERROR_WANT_WRITE)
+                {
+                    if(!wait_for(POLLOUT))
+                    {
+                        close();
+                        return false;
+                    }
+                    continue;
+                }
+                close();
+                return false;
+            }
+            r = sr;
+        }
+        else
+        {
+            r = recv(f_socket, buf, sizeof(buf), 0);
+            if(r < 0)
+            {
+                if(errno == EAGAIN
+                || errno == EWOULDBLOCK)
+                {
+                    if(!wait_for(POLLIN))
+                    {
+                        close();
+                        return false;
+                    }
+                    continue;
+                }
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                close();
+                return false;
+            }
+            if(r == 0)
+            {
+                // server closed the connection
+                //
+                close();
+                return false;
+            }
+        }
+        f_input.append(buf, r);
+    }
+}
+
+
+bool smtp_connection::read_reply(smtp_reply & reply)
+{
+    reply = smtp_reply();
+    for(;;)
+    {
+        std::string line;
+        if(!read_line(line))
+        {
+            f_last_reply = reply;
+            return false;
+        }
+        if(line.length() < 3
+        || !std::isdigit(static_cast<unsigned char>(line[0]))
+        || !std::isdigit(static_cast<unsigned char>(line[1]))
+        || !std::isdigit(static_cast<unsigned char>(line[2])))
+        {
+            SNAP_LOG_ERROR
+                << "SMTP server "
+                << f_host
+                << " sent an invalid reply line: \""
+                << line
+                << "\"."
+                << SNAP_LOG_SEND;
+            close();
+            f_last_reply = reply;
+            return false;
+        }
+        reply.set_code((line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0'));
+        reply.add_line(line.length() > 4 ? line.substr(4) : std::string());
+        if(line.length() == 3
+        || line[3] != '-')
+        {
+            break;
+        }
+    }
+
+    if(reply.get_code() == 421)
+    {
+        // service not available, the server is closing the connection
+        //
+        close();
+    }
+
+    f_last_reply = reply;
+    return true;
+}
+
+
+bool smtp_connection::command(std::string const & cmd, smtp_reply & reply)
+{
+    return write_data(cmd) && read_reply(reply);
+}
+
+
+void smtp_connection::send_transaction(smtp_transaction & t)
+{
+    smtp_reply reply;
+    if(f_need_reset)
+    {
+        if(!command("RSET\r\n", reply))
+        {
+            return;
+        }
+    }
+
+    f_need_reset = true;
+
+    if(!command(get_mail_from(t), reply))
+    {
+        return;
+    }
+    if(!reply.is_positive())
+    {
+        log_refused_sender(t.get_sender(), reply);
+        t.set_reply(reply);
+        t.set_status(failure_status(reply));
+        return;
+    }
+
+    string_list_t rejected;
+    std::size_t accepted(0);
+    smtp_reply failure;
+    for(auto const & r : t.get_recipients())
+    {
+        if(!command("RCPT TO:<" + r + ">\r\n", reply))
+        {
+            return;
+        }
+        if(reply.is_positive())
+        {
+            ++accepted;
+        }
+        else
+        {
+            rejected.push_back(r);
+            failure = reply;
+        }
+    }
+    t.set_rejected_recipients(rejected);
+    if(accepted == 0)
+    {
+        t.set_reply(failure);
+        t.set_status(failure_status(failure));
+        return;
+    }
+
+    std::string out;
+    if(has_capability("CHUNKING"))
+    {
+        // with BDAT the data follows the command, there is no
+        // intermediate reply
+        //
+        append_data_command(out, t);
+    }
+    else
+    {
+        if(!command("DATA\r\n", reply))
+        {
+            return;
+        }
+        if(!reply.is_intermediate())
+        {
+            t.set_reply(reply);
+            t.set_status(failure_status(reply));
+            return;
+        }
+
+        stuff_message(out, t.get_message());
+    }
+    if(!write_data(out))
+    {
+        t.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        return;
+    }
+
+    read_data_reply(t);
+}
+
+
+std::string smtp_connection::get_mail_from(smtp_transaction const & t) const
+{
+    std::string mail_from("MAIL FROM:<" + t.get_sender() + ">");
+    if(has_capability("SIZE"))
+    {
+        // the size of the message as sent, once the line endings are
+        // converted and, without BDAT, the periods doubled; RFC 1870
+        // accepts a value which is a little too large, not too small
+        //
+        mail_from += " SIZE=";
+        mail_from += std::to_string(stuffed_size(t.get_message(), !has_capability("CHUNKING")));
+    }
+
+    // the message may have been rendered with "8bit" parts; declaring
+    // it is harmless when it did not
+    //
+    if(has_capability("8BITMIME"))
+    {
+        mail_from += " BODY=8BITMIME";
+    }
+
+    // internationalized addresses require SMTPUTF8 (RFC 6531)
+    //
+    if(has_capability("SMTPUTF8"))
+    {
+        bool utf8(!is_ascii(t.get_sender()));
+        for(auto const & r : t.get_recipients())
+        {
+            if(utf8)
+            {
+                break;
+            }
+            utf8 = !is_ascii(r);
+        }
+        if(utf8)
+        {
+            mail_from += " SMTPUTF8";
+        }
+    }
+
+    mail_from += "\r\n";
+    return mail_from;
+}
+
+
+void smtp_connection::append_envelope(std::string & out, smtp_transaction const & t, bool reset) const
+{
+    if(reset)
+    {
+        out += "RSET\r\n";
+    }
+    out += get_mail_from(t);
+    for(auto const & r : t.get_recipients())
+    {
+        out += "RCPT TO:<";
+        out += r;
+        out += ">\r\n";
+    }
+    append_data_command(out, t);
+}
+
+
+/** \brief Append the command used to send the message.
+ *
+ * Without CHUNKING, this is the DATA command. The message gets sent
+ * once the server replied with 354.
+ *
+ * With CHUNKING (RFC 3030), the message gets sent right after a
+ * "BDAT <size> LAST" command. The size tells the server where the
+ * message ends so there is no need for dot-stuffing nor for the
+ * final "." line. The server replies only once, after the data.
+ *
+ * \param[in,out] out  The buffer where the command is appended.
+ * \param[in] t  The transaction being sent.
+ */
+void smtp_connection::append_data_command(std::string & out, smtp_transaction const & t) const
+{
+    if(!has_capability("CHUNKING"))
+    {
+        out += "DATA\r\n";
+        return;
+    }
+
+    // the size is computed first so the message gets converted directly
+    // in the output buffer
+    //
+    out += "BDAT ";
+    out += std::to_string(stuffed_size(t.get_message(), false));
+    out += " LAST\r\n";
+    stuff_message(out, t.get_message(), false);
+}
+
+
+bool smtp_connection::read_envelope_replies(smtp_transaction & t, bool reset, bool & data_mode)
+{
+    data_mode = false;
+
+    smtp_reply reply;
+    if(reset)
+    {
+        if(!read_reply(reply))
+        {
+            return false;
+        }
+    }
+
+    if(!read_reply(reply))
+    {
+        return false;
+    }
+    bool const mail_accepted(reply.is_positive());
+    if(!mail_accepted)
+    {
+        log_refused_sender(t.get_sender(), reply);
+        t.set_reply(reply);
+        t.set_status(failure_status(reply));
+    }
+
+    string_list_t rejected;
+    std::size_t accepted(0);
+    smtp_reply failure;
+    for(auto const & r : t.get_recipients())
+    {
+        if(!read_reply(reply))
+        {
+            return false;
+        }
+        if(reply.is_positive())
+        {
+            ++accepted;
+        }
+        else
+        {
+            rejected.push_back(r);
+            failure = reply;
+        }
+    }
+    if(mail_accepted)
+    {
+        t.set_rejected_recipients(rejected);
+        if(accepted == 0)
+        {
+            t.set_reply(failure);
+            t.set_status(failure_status(failure));
+        }
+    }
+
+    if(has_capability("CHUNKING"))
+    {
+        // the reply to BDAT comes after the data, see read_data_reply()
+        //
+        return true;
+    }
+
+    if(!read_reply(reply))
+    {
+        return false;
+    }
+    data_mode = reply.is_intermediate();
+    if(!data_mode
+    && t.get_status() == send_status_t::SEND_STATUS_NOT_SENT)
+    {
+        t.set_reply(reply);
+        t.set_status(failure_status(reply));
+    }
+
+    return true;
+}
+
+
+bool smtp_connection::read_data_reply(smtp_transaction & t)
+{
+    smtp_reply reply;
+    if(!read_reply(reply))
+    {
+        // we do not know whether the server got the message
+        //
+        t.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        return false;
+    }
+
+    // whatever the reply, the transaction is over
+    //
+    f_need_reset = false;
+
+    t.set_reply(reply);
+    if(!reply.is_positive())
+    {
+        SNAP_LOG_ERROR
+            << "SMTP server "
+            << f_host
+            << " refused message: "
+            << reply.get_text()
+            << SNAP_LOG_SEND;
+        t.set_status(failure_status(reply));
+        return true;
+    }
+
+    ++f_message_count;
+    t.set_status(t.get_rejected_recipients().empty()
+                    ? send_status_t::SEND_STATUS_SENT
+                    : send_status_t::SEND_STATUS_PARTIAL);
+
+    return true;
+}
+
+
+void smtp_connection::log_refused_sender(std::string const & sender, smtp_reply const & reply) const
+{
+    SNAP_LOG_ERROR
+        << "SMTP server "
+        << f_host
+        << " refused sender <"
+        << sender
+        << ">: "
+        << reply.get_text()
+        << SNAP_LOG_SEND;
+}
+
+
+send_status_t smtp_connection::failure_status(smtp_reply const & reply)
+{
+    return reply.is_transient_failure()
+                ? send_status_t::SEND_STATUS_TEMPORARY_FAILURE
+                : send_status_t::SEND_STATUS_PERMANENT_FAILURE;
+}
+
+
+/** \brief Transform a message so it can be sent after the DATA command.
+ *
+ * SMTP requires lines to end with "\r\n" and any line starting with a
+ * period to have that period doubled. The end of the message is marked
+ * with a line with a single period.
+ *
+ * With BDAT, the size of the message is known by the server so the
+ * \p dot_stuffing parameter is set to false. Then only the line
+ * endings get converted.
+ *
+ * \param[in,out] out  The buffer where the transformed message is appended.
+ * \param[in] message  The message to transform.
+ * \param[in] dot_stuffing  Whether to double periods and add the final
+ * period.
+ */
+void smtp_connection::stuff_message(std::string & out, std::string const & message, bool dot_stuffing)
+{
+    out.reserve(out.length() + message.length() + message.length() / 50 + 5);
+
+    bool start_of_line(true);
+    char const * s(message.data());
+    char const * const end(s + message.length());
+    for(; s < end; ++s)
+    {
+        if(start_of_line && *s == '.' && dot_stuffing)
+        {
+            out += '.';
+        }
+        if(*s == '\n')
+        {
+            out += "\r\n";
+            start_of_line = true;
+        }
+        else if(*s == '\r' && s + 1 < end && s[1] == '\n')
+        {
+            out += "\r\n";
+            ++s;
+            start_of_line = true;
+        }
+        else
+        {
+            out += *s;
+            start_of_line = false;
+        }
+    }
+    if(!start_of_line)
+    {
+        out += "\r\n";
+    }
+    if(dot_stuffing)
+    {
+        out += ".\r\n";
+    }
+}
+
+
+/** \brief Compute the size of a message once transformed.
+ *
+ * This function returns the number of bytes stuff_message() appends
+ * for \p message without doing the transformation: each "\n" not
+ * preceded by "\r" gains one byte, the last line gets a "\r\n" if
+ * missing, and with \p dot_stuffing, each line starting with a period
+ * gains one byte and the final ".\r\n" is added.
+ *
+ * \param[in] message  The message to transform.
+ * \param[in] dot_stuffing  Whether periods get doubled and the final
+ * period added.
+ *
+ * \return The size of the transformed message.
+ */
+std::size_t smtp_connection::stuffed_size(std::string const & message, bool dot_stuffing)
+{
+    std::size_t size(message.length());
+    if(message.empty())
+    {
+        return dot_stuffing ? size + 3 : size;
+    }
+
+    char const * const start(message.data());
+    char const * const end(start + message.length());
+    if(dot_stuffing && *start == '.')
+    {
+        ++size;
+    }
+    for(char const * s(start);; ++s)
+    {
+        s = static_cast<char const *>(memchr(s, '\n', end - s));
+        if(s == nullptr)
+        {
+            break;
+        }
+        if(s == start
+        || s[-1] != '\r')
+        {
+            ++size;
+        }
+        if(dot_stuffing
+        && s + 1 < end
+        && s[1] == '.')
+        {
+            ++size;
+        }
+    }
+    if(end[-1] != '\n')
+    {
+        size += 2;
+    }
+    if(dot_stuffing)
+    {
+        size += 3;
+    }
+    return size;
+}
+
+
+/** \brief Check whether a string only includes ASCII characters.
+ *
+ * \param[in] s  The string to check.
+ *
+ * \return true if no byte of \p s has its bit 7 set.
+ */
+bool smtp_connection::is_ascii(std::string const & s)
+{
+    for(auto const c : s)
+    {
+        if((static_cast<unsigned char>(c) & 0x80) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,211 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <memory>
+#include    <set>
+#include    <string>
+#include    <vector>
+
+
+
+// OpenSSL
+//
+typedef struct ssl_st       SSL;
+typedef struct ssl_ctx_st   SSL_CTX;
+
+
+
+namespace libmimemail
+{
+
+
+
+typedef std::vector<std::string>        string_list_t;
+
+
+enum class tls_mode_t
+{
+    TLS_MODE_NONE,              // never use STARTTLS
+    TLS_MODE_OPPORTUNISTIC,     // use STARTTLS when offered
+    TLS_MODE_REQUIRED           // fail if STARTTLS is not offered
+};
+
+
+class smtp_reply
+{
+public:
+                            smtp_reply();
+
+    void                    set_code(int code);
+    int                     get_code() const;
+    void                    add_line(std::string const & line);
+    string_list_t const &   get_lines() const;
+    std::string             get_text() const;
+
+    bool                    is_positive() const;
+    bool                    is_intermediate() const;
+    bool                    is_transient_failure() const;
+    bool                    is_permanent_failure() const;
+
+private:
+    int                     f_code = 0;
+    string_list_t           f_lines = string_list_t();
+};
+
+
+enum class send_status_t
+{
+    SEND_STATUS_NOT_SENT,               // not attempted (yet)
+    SEND_STATUS_SENT,                   // accepted for all recipients
+    SEND_STATUS_PARTIAL,                // accepted for some recipients
+    SEND_STATUS_TEMPORARY_FAILURE,      // 4xx, try again later
+    SEND_STATUS_PERMANENT_FAILURE,      // 5xx, do not try again
+    SEND_STATUS_INVALID                 // the email could not be rendered
+};
+
+typedef std::vector<send_status_t>      send_status_vector_t;
+
+
+class smtp_transaction
+{
+public:
+    typedef std::vector<smtp_transaction>   vector_t;
+
+                            smtp_transaction(
+                                  std::string const & sender
+                                , string_list_t const & recipients
+                                , std::string const & message);
+
+    std::string const &     get_sender() const;
+    string_list_t const &   get_recipients() const;
+    std::string const &     get_message() const;
+
+    void                    set_status(send_status_t status);
+    send_status_t           get_status() const;
+    void                    set_rejected_recipients(string_list_t const & recipients);
+    string_list_t const &   get_rejected_recipients() const;
+    void                    set_reply(smtp_reply const & reply);
+    smtp_reply const &      get_reply() const;
+
+private:
+    std::string const *     f_sender = nullptr;
+    string_list_t const *   f_recipients = nullptr;
+    std::string const *     f_message = nullptr;
+    send_status_t           f_status = send_status_t::SEND_STATUS_NOT_SENT;
+    string_list_t           f_rejected_recipients = string_list_t();
+    smtp_reply              f_reply = smtp_reply();
+};
+
+
+class smtp_connection
+{
+public:
+    typedef std::shared_ptr<smtp_connection>    pointer_t;
+
+    static constexpr int const  SMTP_DEFAULT_PORT = 25;
+    static constexpr int const  SMTP_DEFAULT_TIMEOUT = 60; // in seconds
+
+                            smtp_connection(std::string const & host, int port = SMTP_DEFAULT_PORT);
+                            smtp_connection(smtp_connection const &) = delete;
+    virtual                 ~smtp_connection();
+
+    smtp_connection &       operator = (smtp_connection const &) = delete;
+
+    // setup (call before connect())
+    //
+    void                    set_helo_name(std::string const & helo_name);
+    void                    set_tls_mode(tls_mode_t mode);
+    void                    set_verify_certificate(bool verify);
+    void                    set_timeout(int seconds);
+
+    std::string const &     get_host() const;
+    int                     get_port() const;
+
+    // session
+    //
+    bool                    connect();
+    bool                    connect(int socket);
+    bool                    is_connected() const;
+    bool                    is_secure() const;
+    bool                    has_capability(std::string const & name) const;
+    std::string             get_capability_parameters(std::string const & name) const;
+    bool                    reset();
+    bool                    noop();
+    void                    quit();
+    void                    close();
+
+    // transactions
+    //
+    bool                    send_message(
+                                  std::string const & sender
+                                , string_list_t const & recipients
+                                , std::string const & message
+                                , string_list_t * rejected_recipients = nullptr);
+    void                    send_transactions(smtp_transaction::vector_t & transactions);
+    std::size_t             get_message_count() const;
+    smtp_reply const &      get_last_reply() const;
+
+private:
+    bool                    open_socket();
+    bool                    start_session();
+    bool                    greet();
+    bool                    hello();
+    bool                    start_tls();
+    bool                    wait_for(short events);
+    bool                    write_data(char const * data, std::size_t size);
+    bool                    write_data(std::string const & data);
+    bool                    read_line(std::string & line);
+    bool                    read_reply(smtp_reply & reply);
+    bool                    command(std::string const & cmd, smtp_reply & reply);
+    void                    send_transaction(smtp_transaction & t);
+    std::string             get_mail_from(smtp_transaction const & t) const;
+    void                    append_envelope(std::string & out, smtp_transaction const & t, bool reset) const;
+    void                    append_data_command(std::string & out, smtp_transaction const & t) const;
+    void                    send_chunked_transactions(smtp_transaction::vector_t & transactions);
+    bool                    read_envelope_replies(smtp_transaction & t, bool reset, bool & data_mode);
+    bool                    read_data_reply(smtp_transaction & t);
+    void                    log_refused_sender(std::string const & sender, smtp_reply const & reply) const;
+    static send_status_t    failure_status(smtp_reply const & reply);
+    static void             stuff_message(std::string & out, std::string const & message, bool dot_stuffing = true);
+    static std::size_t      stuffed_size(std::string const & message, bool dot_stuffing = true);
+    static bool             is_ascii(std::string const & s);
+
+    std::string             f_host = std::string();
+    int                     f_port = SMTP_DEFAULT_PORT;
+    std::string             f_helo_name = std::string();
+    tls_mode_t              f_tls_mode = tls_mode_t::TLS_MODE_OPPORTUNISTIC;
+    bool                    f_verify_certificate = false;
+    int                     f_timeout = SMTP_DEFAULT_TIMEOUT;
+    int                     f_socket = -1;
+    SSL_CTX *               f_ssl_ctx = nullptr;
+    SSL *                   f_ssl = nullptr;
+    std::string             f_input = std::string();
+    std::set<std::string>   f_capabilities = std::set<std::string>();
+    string_list_t           f_capability_lines = string_list_t();
+    bool                    f_need_reset = false;
+    std::size_t             f_message_count = 0;
+    smtp_reply              f_last_reply = smtp_reply();
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
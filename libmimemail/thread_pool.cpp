@@ -0,0 +1,278 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief A pool of threads processing ranges of items.
+ *
+ * render_parallel() spreads many independent emails between threads
+ * and process_bounces() does the same with bounce messages. Starting
+ * new threads on each call costs more than rendering or parsing a small
+ * batch, so the threads are started once and kept in this pool.
+ *
+ * A parallel_for() splits the items in one range per thread. A thread
+ * which is done with its range steals the remaining items of the other
+ * ranges, so the work is balanced even when some items take much longer
+ * than others. The calling thread is one of the threads, which means a
+ * parallel_for() completes even if all the threads of the pool are busy
+ * with another call, and a function can itself call parallel_for().
+ */
+
+// self
+//
+#include    "libmimemail/thread_pool.h"
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+/** \brief Initialize the pool.
+ *
+ * The threads get started on the first parallel_for() which needs them.
+ */
+thread_pool::thread_pool()
+{
+}
+
+
+/** \brief Stop the threads of the pool.
+ */
+thread_pool::~thread_pool()
+{
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        f_stopping = true;
+    }
+    f_job_cond.notify_all();
+    for(auto & t : f_threads)
+    {
+        t.join();
+    }
+}
+
+
+/** \brief Retrieve the process wide pool.
+ *
+ * \return A reference to the pool.
+ */
+thread_pool & thread_pool::get_instance()
+{
+    static thread_pool pool;
+    return pool;
+}
+
+
+/** \brief Call \p func once for each index from 0 to \p count - 1.
+ *
+ * The indexes are spread between \p threads threads, the calling thread
+ * being one of them. The pool starts more threads when it has less than
+ * \p threads - 1 of them; they are kept for the next calls.
+ *
+ * An exception stops all the threads working on this call and gets
+ * rethrown once they are all done.
+ *
+ * \param[in] count  The number of items to process.
+ * \param[in] threads  The number of threads, 0 means one per core.
+ * \param[in] func  The function processing one item.
+ */
+void thread_pool::parallel_for(
+      std::size_t count
+    , std::size_t threads
+    , work_t const & func)
+{
+    if(count == 0)
+    {
+        return;
+    }
+
+    if(threads == 0)
+    {
+        threads = std::max(1U, std::thread::hardware_concurrency());
+    }
+    threads = std::min(threads, count);
+
+    if(threads == 1)
+    {
+        for(std::size_t idx(0); idx < count; ++idx)
+        {
+            func(idx);
+        }
+        return;
+    }
+
+    job::pointer_t j(std::make_shared<job>());
+    j->f_func = &func;
+    j->f_ranges = std::vector<work_range>(threads);
+    for(std::size_t idx(0); idx < threads; ++idx)
+    {
+        j->f_ranges[idx].f_next = count * idx / threads;
+        j->f_ranges[idx].f_end = count * (idx + 1) / threads;
+    }
+
+    // the calling thread is participant 0
+    //
+    j->f_joined = 1;
+    j->f_active = 1;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        start_threads(threads - 1);
+        f_jobs.push_back(j);
+    }
+    f_job_cond.notify_all();
+
+    run(*j, 0);
+
+    // once all the items are taken, no other thread may join; then wait
+    // for the ones which joined since they use func
+    //
+    {
+        std::unique_lock<std::mutex> lock(f_mutex);
+        auto const it(std::find(f_jobs.begin(), f_jobs.end(), j));
+        if(it != f_jobs.end())
+        {
+            f_jobs.erase(it);
+        }
+        --j->f_active;
+        f_done_cond.wait(lock, [&j]() { return j->f_active == 0; });
+    }
+
+    if(j->f_exception != nullptr)
+    {
+        std::rethrow_exception(j->f_exception);
+    }
+}
+
+
+/** \brief Get the number of threads started by the pool.
+ *
+ * \return The number of threads, not including the callers.
+ */
+std::size_t thread_pool::get_thread_count() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_threads.size();
+}
+
+
+/** \brief Make sure the pool has at least \p count threads.
+ *
+ * The caller must hold f_mutex.
+ *
+ * \param[in] count  The number of threads needed.
+ */
+void thread_pool::start_threads(std::size_t count)
+{
+    while(f_threads.size() < count)
+    {
+        f_threads.emplace_back(&thread_pool::worker, this);
+    }
+}
+
+
+/** \brief The loop of the threads of the pool.
+ *
+ * A thread joins the oldest call to parallel_for() which still needs
+ * threads.
+ */
+void thread_pool::worker()
+{
+    for(;;)
+    {
+        job::pointer_t j;
+        std::size_t id(0);
+        {
+            std::unique_lock<std::mutex> lock(f_mutex);
+            f_job_cond.wait(lock, [this]() { return f_stopping || !f_jobs.empty(); });
+            if(f_stopping)
+            {
+                return;
+            }
+            j = f_jobs.front();
+            id = j->f_joined++;
+            ++j->f_active;
+            if(j->f_joined >= j->f_ranges.size())
+            {
+                f_jobs.pop_front();
+            }
+        }
+
+        run(*j, id);
+
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+            --j->f_active;
+        }
+        f_done_cond.notify_all();
+    }
+}
+
+
+/** \brief Process the items of a job.
+ *
+ * The thread starts with its own range, then steals from the others.
+ *
+ * \param[in] j  The job to work on.
+ * \param[in] id  The participant number of this thread.
+ */
+void thread_pool::run(job & j, std::size_t id)
+{
+    try
+    {
+        std::size_t const max(j.f_ranges.size());
+        for(std::size_t r(0); r < max && !j.f_stop; ++r)
+        {
+            work_range & range(j.f_ranges[(id + r) % max]);
+            for(;;)
+            {
+                std::size_t const index(range.f_next.fetch_add(1));
+                if(index >= range.f_end
+                || j.f_stop)
+                {
+                    break;
+                }
+                (*j.f_func)(index);
+            }
+        }
+    }
+    catch(...)
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        if(j.f_exception == nullptr)
+        {
+            j.f_exception = std::current_exception();
+        }
+        j.f_stop = true;
+    }
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,99 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// C++
+//
+#include    <atomic>
+#include    <condition_variable>
+#include    <deque>
+#include    <exception>
+#include    <functional>
+#include    <memory>
+#include    <mutex>
+#include    <thread>
+#include    <vector>
+
+
+
+namespace libmimemail
+{
+
+
+
+class thread_pool
+{
+public:
+    typedef std::function<void(std::size_t index)>  work_t;
+
+                            thread_pool(thread_pool const &) = delete;
+                            ~thread_pool();
+
+    thread_pool &           operator = (thread_pool const &) = delete;
+
+    static thread_pool &    get_instance();
+
+    void                    parallel_for(
+                                  std::size_t count
+                                , std::size_t threads
+                                , work_t const & func);
+    std::size_t             get_thread_count() const;
+
+private:
+    // the share of the items of one thread; the next index is taken with
+    // an atomic increment so the other threads can steal from the range
+    //
+    struct work_range
+    {
+        alignas(64) std::atomic<std::size_t>
+                                f_next = 0;
+        std::size_t             f_end = 0;
+    };
+
+    struct job
+    {
+        typedef std::shared_ptr<job>    pointer_t;
+
+        work_t const *          f_func = nullptr;
+        std::vector<work_range> f_ranges = std::vector<work_range>();
+        std::size_t             f_joined = 0;
+        std::size_t             f_active = 0;
+        std::atomic<bool>       f_stop = false;
+        std::exception_ptr      f_exception = std::exception_ptr();
+    };
+
+                            thread_pool();
+
+    void                    start_threads(std::size_t count);
+    void                    worker();
+    void                    run(job & j, std::size_t id);
+
+    mutable std::mutex      f_mutex = std::mutex();
+    std::condition_variable f_job_cond = std::condition_variable();
+    std::condition_variable f_done_cond = std::condition_variable();
+    std::deque<job::pointer_t>
+                            f_jobs = std::deque<job::pointer_t>();
+    std::vector<std::thread>
+                            f_threads = std::vector<std::thread>();
+    bool                    f_stopping = false;
+};
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
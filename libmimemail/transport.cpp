@@ -0,0 +1,1178 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Transports used to hand emails over to a mail server.
+ *
+ * The email::send() function renders the email and then gives it to a
+ * transport. Two transports are offered:
+ *
+ * \li sendmail_transport -- the original implementation which runs the
+ *     `sendmail` command once per email;
+ * \li smtp_transport -- a native SMTP client which keeps connections
+ *     open between emails.
+ *
+ * The default transport is the sendmail_transport. Use the
+ * set_default_transport() function to change it.
+ */
+
+// self
+//
+#include    "libmimemail/transport.h"
+
+#include    "libmimemail/exception.h"
+#include    "libmimemail/mail_exchanger.h"
+#include    "libmimemail/metrics.h"
+#include    "libmimemail/mx_connector.h"
+#include    "libmimemail/sendmail_connection.h"
+
+
+// eventdispatcher
+//
+#include    <eventdispatcher/communicator.h>
+
+
+// cppprocess
+//
+#include    <cppprocess/io_data_pipe.h>
+#include    <cppprocess/process.h>
+
+
+// snaplogger
+//
+#include    <snaplogger/message.h>
+
+
+// libtld
+//
+#include    <libtld/tld.h>
+
+
+// C++
+//
+#include    <algorithm>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace libmimemail
+{
+
+
+
+namespace
+{
+
+
+
+std::mutex              g_default_transport_mutex;
+transport::pointer_t    g_default_transport = transport::pointer_t();
+
+
+
+}
+// no name namespace
+
+
+
+
+//////////////
+// ENVELOPE //
+//////////////
+
+
+/** \brief Set the envelope sender.
+ *
+ * This is the address used with the `MAIL FROM:` command (or the `-f`
+ * of sendmail). It is the address that receives bounces.
+ *
+ * \param[in] sender  The email address only (no name, no angle brackets).
+ */
+void envelope::set_sender(std::string const & sender)
+{
+    f_sender = sender;
+}
+
+
+/** \brief Retrieve the envelope sender.
+ *
+ * \return The email address of the sender.
+ */
+std::string const & envelope::get_sender() const
+{
+    return f_sender;
+}
+
+
+/** \brief Add one recipient to the envelope.
+ *
+ * A recipient already in the envelope is not added a second time so
+ * an address found in the To and the Cc receives the email only once.
+ *
+ * \param[in] recipient  The email address only (no name, no angle brackets).
+ */
+void envelope::add_recipient(std::string const & recipient)
+{
+    if(std::find(f_recipients.begin(), f_recipients.end(), recipient) == f_recipients.end())
+    {
+        f_recipients.push_back(recipient);
+    }
+}
+
+
+/** \brief Add all the recipients of a list of addresses.
+ *
+ * The \p addresses parameter is the value of an address header such
+ * as the To, Cc, or Bcc. Each of its email addresses is added to the
+ * envelope. Groups without addresses (i.e. "undisclosed-recipients:;")
+ * do not add anything.
+ *
+ * \param[in] addresses  The list of names and email addresses.
+ *
+ * \return false if \p addresses could not be parsed.
+ */
+bool envelope::add_recipients(std::string const & addresses)
+{
+    metrics_timer parse_timer(metric_stage_t::METRIC_STAGE_ADDRESS_PARSING);
+
+    tld_email_list list;
+    if(list.parse(addresses, 0) != TLD_RESULT_SUCCESS)
+    {
+        return false;
+    }
+
+    tld_email_list::tld_email_t m;
+    while(list.next(m))
+    {
+        if(!m.f_email_only.empty())
+        {
+            add_recipient(m.f_email_only);
+        }
+    }
+
+    return true;
+}
+
+
+/** \brief Retrieve the list of recipients.
+ *
+ * \return A reference to the list of recipients.
+ */
+string_list_t const & envelope::get_recipients() const
+{
+    return f_recipients;
+}
+
+
+
+
+////////////////////
+// RENDERED EMAIL //
+////////////////////
+
+
+/** \brief Initialize an empty rendered email.
+ *
+ * The email::render() function is expected to be used to fill the
+ * envelope and message of this object.
+ */
+rendered_email::rendered_email()
+{
+}
+
+
+/** \brief Initialize a rendered email.
+ *
+ * \param[in] env  The envelope of the email.
+ * \param[in] message  The rendered message.
+ */
+rendered_email::rendered_email(envelope const & env, std::string const & message)
+    : f_envelope(env)
+    , f_message(message)
+{
+}
+
+
+/** \brief Retrieve the envelope.
+ *
+ * \return A reference to the envelope.
+ */
+envelope & rendered_email::get_envelope()
+{
+    return f_envelope;
+}
+
+
+/** \brief Retrieve the envelope.
+ *
+ * \return A constant reference to the envelope.
+ */
+envelope const & rendered_email::get_envelope() const
+{
+    return f_envelope;
+}
+
+
+/** \brief Retrieve the message.
+ *
+ * \return A reference to the message.
+ */
+std::string & rendered_email::get_message()
+{
+    return f_message;
+}
+
+
+/** \brief Retrieve the message.
+ *
+ * \return A constant reference to the message.
+ */
+std::string const & rendered_email::get_message() const
+{
+    return f_message;
+}
+
+
+
+
+/////////////////
+// SEND RESULT //
+/////////////////
+
+
+/** \brief Set the status of the send.
+ *
+ * \param[in] status  The new status.
+ */
+void send_result::set_status(send_status_t status)
+{
+    f_status = status;
+}
+
+
+/** \brief Get the status of the send.
+ *
+ * \return The status, SEND_STATUS_SENT on success.
+ */
+send_status_t send_result::get_status() const
+{
+    return f_status;
+}
+
+
+/** \brief Set the exit code of the sendmail process.
+ *
+ * \param[in] code  The exit code.
+ */
+void send_result::set_exit_code(int code)
+{
+    f_exit_code = code;
+}
+
+
+/** \brief Get the exit code of the sendmail process.
+ *
+ * \return The exit code or -1 if the transport does not run a process
+ * or the process did not exit normally.
+ */
+int send_result::get_exit_code() const
+{
+    return f_exit_code;
+}
+
+
+/** \brief Set a message describing why the send failed.
+ *
+ * \param[in] error  The error message.
+ */
+void send_result::set_error(std::string const & error)
+{
+    f_error = error;
+}
+
+
+/** \brief Get the error message.
+ *
+ * \return The error message, empty on success.
+ */
+std::string const & send_result::get_error() const
+{
+    return f_error;
+}
+
+
+
+
+///////////////
+// TRANSPORT //
+///////////////
+
+
+/** \brief Clean up the transport.
+ *
+ * This function is here primarily to have a clean virtual table.
+ */
+transport::~transport()
+{
+}
+
+
+/** \brief Send a message without waiting for the result.
+ *
+ * The default implementation calls send_message() and then \p callback
+ * before returning, so it does block. Transports which can do better
+ * (i.e. the sendmail_transport) override this function.
+ *
+ * \param[in] env  The envelope with the sender and recipients.
+ * \param[in] message  The message to send.
+ * \param[in] callback  The function called with the result.
+ */
+void transport::send_message_async(
+      envelope const & env
+    , std::string && message
+    , send_result::callback_t callback)
+{
+    send_result result;
+    if(send_message(env, message))
+    {
+        result.set_status(send_status_t::SEND_STATUS_SENT);
+    }
+    else
+    {
+        result.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        result.set_error("the transport did not accept the email.");
+    }
+    if(callback != nullptr)
+    {
+        callback(result);
+    }
+}
+
+
+/** \brief Send many emails at once.
+ *
+ * The default implementation calls send_message() once per email.
+ * A transport which can do better (i.e. the smtp_transport) overrides
+ * this function.
+ *
+ * Since the default implementation does not know why a message failed,
+ * a failure is reported as SEND_STATUS_TEMPORARY_FAILURE.
+ *
+ * \param[in] emails  The emails to send.
+ *
+ * \return The status of each email, in the same order as \p emails.
+ */
+send_status_vector_t transport::send_messages(rendered_email::vector_t const & emails)
+{
+    send_status_vector_t result;
+    result.reserve(emails.size());
+    for(auto const & e : emails)
+    {
+        result.push_back(send_message(e.get_envelope(), e.get_message())
+                    ? send_status_t::SEND_STATUS_SENT
+                    : send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+    }
+    return result;
+}
+
+
+/** \brief Check whether messages can include 8 bit data.
+ *
+ * When this function returns true, the emails get rendered with their
+ * text parts as is (the "8bit" transfer encoding) instead of encoding
+ * them with quoted-printable. See mime_writer::set_8bit().
+ *
+ * The default implementation returns false since the transport does
+ * not know which server will receive the messages.
+ *
+ * \note
+ * The message gets rendered before the transport connects to the
+ * server which receives it, so the EHLO capabilities of that one
+ * connection cannot be used. Only email::send() and email::send_async()
+ * call this function. The email_batch and the email_template render
+ * their messages without a transport and never use "8bit".
+ *
+ * \return true if the messages can include 8 bit data.
+ */
+bool transport::supports_8bitmime()
+{
+    return false;
+}
+
+
+
+
+////////////////////////
+// SENDMAIL TRANSPORT //
+////////////////////////
+
+
+/** \brief Change the command used to send emails.
+ *
+ * By default, the transport runs `sendmail`. This can be changed to
+ * any command line tool which accepts the same command line options
+ * (i.e. `-f \<sender>` followed by the recipients).
+ *
+ * \param[in] command  The name or path to the command.
+ */
+void sendmail_transport::set_command(std::string const & command)
+{
+    if(command.empty())
+    {
+        throw invalid_parameter("sendmail_transport::set_command(): the command cannot be empty.");
+    }
+    f_command = command;
+}
+
+
+/** \brief Retrieve the command used to send emails.
+ *
+ * \return The name of the command, "sendmail" by default.
+ */
+std::string const & sendmail_transport::get_command() const
+{
+    return f_command;
+}
+
+
+/** \brief Send the message by piping it to sendmail.
+ *
+ * This function starts the sendmail command and sends the message to
+ * its input. The function blocks until sendmail exits.
+ *
+ * \param[in] env  The envelope with the sender and recipients.
+ * \param[in] message  The message to send.
+ *
+ * \return true if sendmail exited with 0.
+ */
+bool sendmail_transport::send_message(envelope const & env, std::string const & message)
+{
+    cppprocess::process p("sendmail");
+    p.set_command(f_command);
+    p.add_argument("-f");
+    p.add_argument(env.get_sender());
+    for(auto const & r : env.get_recipients())
+    {
+        p.add_argument(r);
+    }
+    SNAP_LOG_TRACE
+        << "sendmail command: ["
+        << p.get_command_line()
+        << "]"
+        << SNAP_LOG_SEND;
+
+    cppprocess::io_data_pipe::pointer_t in(std::make_shared<cppprocess::io_data_pipe>());
+    p.set_input_io(in);
+
+    metrics_timer start_timer(metric_stage_t::METRIC_STAGE_SENDMAIL_START);
+    int const start_status(p.start());
+    start_timer.stop();
+    if(start_status != 0)
+    {
+        SNAP_LOG_ERROR
+            << "could not start process \""
+            << p.get_name()
+            << "\" (command line: "
+            << p.get_command_line()
+            << ")."
+            << SNAP_LOG_SEND;
+        return false;
+    }
+
+    // send the message and end it with a lone period; add_input() only
+    // buffers the data, it gets written while wait() runs so here the
+    // write is part of METRIC_STAGE_SENDMAIL_WAIT
+    //
+    in->add_input(message);
+    in->add_input(".\n");
+
+    // see send_message_async() for a version which does not block
+    //
+    metrics_timer wait_timer(metric_stage_t::METRIC_STAGE_SENDMAIL_WAIT);
+    return p.wait() == 0;
+}
+
+
+/** \brief Pipe the message to sendmail from the ed::communicator.
+ *
+ * This function starts sendmail and adds a sendmail_connection to the
+ * ed::communicator. The message gets written as sendmail reads it and
+ * \p callback is called once sendmail exited, from the communicator
+ * run() loop. If sendmail cannot be started, \p callback is called
+ * before this function returns.
+ *
+ * \param[in] env  The envelope with the sender and recipients.
+ * \param[in] message  The message to send.
+ * \param[in] callback  The function called with the result.
+ */
+void sendmail_transport::send_message_async(
+      envelope const & env
+    , std::string && message
+    , send_result::callback_t callback)
+{
+    sendmail_connection::pointer_t c(std::make_shared<sendmail_connection>(
+              f_command
+            , env
+            , std::move(message)
+            , callback));
+    if(c->start())
+    {
+        ed::communicator::instance()->add_connection(c);
+    }
+}
+
+
+
+
+////////////////////
+// SMTP TRANSPORT //
+////////////////////
+
+
+/** \brief Close all the idle connections.
+ *
+ * The transport sends QUIT to all the servers it is still connected to.
+ */
+smtp_transport::~smtp_transport()
+{
+    close_connections();
+}
+
+
+/** \brief Send all the emails through this relay.
+ *
+ * By default, the transport sends the emails directly to the MX of the
+ * destination domain. If you have a relay (i.e. your own postfix), then
+ * use this function to send all the emails to that relay instead.
+ *
+ * To go back to sending directly to the MX, call this function with an
+ * empty \p host.
+ *
+ * \param[in] host  The name or IP address of the relay.
+ * \param[in] port  The port of the relay.
+ */
+void smtp_transport::set_relay(std::string const & host, int port)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_relay = host;
+    f_relay_port = port;
+    f_relay_checked = false;
+    f_relay_8bitmime = false;
+}
+
+
+/** \brief Retrieve the relay.
+ *
+ * \return The name of the relay or an empty string.
+ */
+std::string smtp_transport::get_relay() const
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    return f_relay;
+}
+
+
+/** \brief Define the name used with EHLO.
+ *
+ * \param[in] helo_name  The name of this client.
+ */
+void smtp_transport::set_helo_name(std::string const & helo_name)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_helo_name = helo_name;
+}
+
+
+/** \brief Define whether STARTTLS gets used.
+ *
+ * \param[in] mode  The TLS mode to use with new connections.
+ *
+ * \sa smtp_connection::set_tls_mode()
+ */
+void smtp_transport::set_tls_mode(tls_mode_t mode)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_tls_mode = mode;
+}
+
+
+/** \brief Define whether the server certificates get verified.
+ *
+ * \param[in] verify  Whether to verify certificates of new connections.
+ *
+ * \sa smtp_connection::set_verify_certificate()
+ */
+void smtp_transport::set_verify_certificate(bool verify)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_verify_certificate = verify;
+}
+
+
+/** \brief Define the network timeout of new connections.
+ *
+ * \param[in] seconds  The timeout in seconds.
+ *
+ * \sa smtp_connection::set_timeout()
+ */
+void smtp_transport::set_timeout(int seconds)
+{
+    if(seconds <= 0)
+    {
+        throw invalid_parameter("smtp_transport::set_timeout(): the timeout must be positive.");
+    }
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_timeout = seconds;
+}
+
+
+/** \brief Maximum number of idle connections kept per server.
+ *
+ * Once a message was sent, the connection is kept for the next message
+ * unless that many connections to the same server are already idle.
+ *
+ * \param[in] max  The maximum number of idle connections per server.
+ */
+void smtp_transport::set_max_idle_connections(std::size_t max)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_max_idle_connections = max;
+}
+
+
+/** \brief Maximum number of messages sent through one connection.
+ *
+ * Many servers limit the number of messages per connection. Once this
+ * number is reached, the connection gets closed and a new one is opened.
+ *
+ * \param[in] max  The maximum number of messages per connection.
+ */
+void smtp_transport::set_max_messages_per_connection(std::size_t max)
+{
+    if(max == 0)
+    {
+        throw invalid_parameter("smtp_transport::set_max_messages_per_connection(): the maximum cannot be zero.");
+    }
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_max_messages_per_connection = max;
+}
+
+
+/** \brief Send a message through SMTP.
+ *
+ * When a relay is defined, the message is sent to that relay once with
+ * all the recipients. Otherwise the recipients are grouped by domain and
+ * the message is sent once per domain to its MX.
+ *
+ * \param[in] env  The envelope with the sender and recipients.
+ * \param[in] message  The message to send.
+ *
+ * \return true if all the recipients were accepted by their server.
+ */
+bool smtp_transport::send_message(envelope const & env, std::string const & message)
+{
+    message_ref_vector_t messages;
+    messages.emplace_back(&env, &message);
+    return send_grouped(messages)[0] == send_status_t::SEND_STATUS_SENT;
+}
+
+
+/** \brief Send many messages through SMTP.
+ *
+ * The messages are grouped by destination (the relay or the domain of
+ * each recipient) and each group is sent through one connection. When
+ * the server supports PIPELINING, the envelope of one message is sent
+ * along the data of the previous message, so each message costs a single
+ * round trip.
+ *
+ * \param[in] emails  The emails to send.
+ *
+ * \return The status of each email, in the same order as \p emails.
+ */
+send_status_vector_t smtp_transport::send_messages(rendered_email::vector_t const & emails)
+{
+    message_ref_vector_t messages;
+    messages.reserve(emails.size());
+    for(auto const & e : emails)
+    {
+        messages.emplace_back(&e.get_envelope(), &e.get_message());
+    }
+    return send_grouped(messages);
+}
+
+
+/** \brief Check whether the relay supports 8BITMIME.
+ *
+ * The messages can only include 8 bit data if the server receiving
+ * them advertises 8BITMIME. This is only known when all the messages
+ * go to one relay (see set_relay()). When sending directly to the MX
+ * of each domain, this function returns false: the capabilities depend
+ * on the MX selected once the message is already rendered, and a
+ * message rendered with "8bit" for an MX without 8BITMIME could not be
+ * sent as is.
+ *
+ * The first call connects to the relay to get its capabilities. The
+ * connection is then kept idle so it gets used to send the messages.
+ * The result is cached until the relay changes.
+ *
+ * \return true if the relay advertises 8BITMIME.
+ */
+bool smtp_transport::supports_8bitmime()
+{
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        if(f_relay.empty())
+        {
+            return false;
+        }
+        if(f_relay_checked)
+        {
+            return f_relay_8bitmime;
+        }
+    }
+
+    bool reused(false);
+    smtp_connection::pointer_t c(acquire_connection(std::string(), reused));
+    if(c == nullptr)
+    {
+        // try again next time, the message will not be sent now anyway
+        //
+        return false;
+    }
+    bool const result(c->has_capability("8BITMIME"));
+    release_connection(c);
+
+    std::lock_guard<std::mutex> lock(f_mutex);
+    f_relay_checked = true;
+    f_relay_8bitmime = result;
+    return result;
+}
+
+
+/** \brief Close all the idle connections.
+ *
+ * This function sends QUIT to all the idle connections and forgets
+ * about them.
+ */
+void smtp_transport::close_connections()
+{
+    connection_map_t idle;
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        idle.swap(f_idle_connections);
+    }
+    for(auto & host : idle)
+    {
+        for(auto & c : host.second)
+        {
+            c->quit();
+        }
+    }
+}
+
+
+/** \brief Get a connection to send emails to \p domain.
+ *
+ * If an idle connection to one of the servers of \p domain exists, it
+ * gets reused. Otherwise a new connection is created with the
+ * mx_connector: the connections to the mail exchangers of the same
+ * priority are raced and unhealthy exchangers are skipped, so a dead
+ * primary MX does not cost a full timeout for each message.
+ *
+ * A server which accepts the TCP connection but then fails the SMTP
+ * greeting, EHLO, or STARTTLS is also reported as unhealthy and the
+ * next exchanger gets tried.
+ *
+ * \param[in] domain  The domain of the recipients or an empty string
+ * when a relay is used.
+ * \param[out] reused  Set to true if the connection was idle.
+ *
+ * \return A connection or nullptr if no server could be reached.
+ */
+smtp_connection::pointer_t smtp_transport::acquire_connection(std::string const & domain, bool & reused)
+{
+    reused = false;
+
+    int port(smtp_connection::SMTP_DEFAULT_PORT);
+    mail_exchanger::mail_exchange_vector_t exchangers;
+    if(domain.empty())
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        exchangers.emplace_back(0, f_relay);
+        port = f_relay_port;
+    }
+    else
+    {
+        exchangers = get_mail_exchangers(domain);
+    }
+
+    for(auto const & mx : exchangers)
+    {
+        smtp_connection::pointer_t c(get_idle_connection(mx.get_domain(), port));
+        if(c != nullptr)
+        {
+            reused = true;
+            return c;
+        }
+    }
+
+    mx_connector & connector(mx_connector::get_instance());
+    mx_connector::host_set_t failed;
+    for(;;)
+    {
+        std::string host;
+        int const s(connector.connect(exchangers, port, host, failed));
+        if(s == -1)
+        {
+            return smtp_connection::pointer_t();
+        }
+
+        smtp_connection::pointer_t c(std::make_shared<smtp_connection>(host, port));
+        {
+            std::lock_guard<std::mutex> lock(f_mutex);
+            c->set_helo_name(f_helo_name);
+            c->set_tls_mode(f_tls_mode);
+            c->set_verify_certificate(f_verify_certificate);
+            c->set_timeout(f_timeout);
+        }
+        if(c->connect(s))
+        {
+            connector.report_success(host, port);
+            return c;
+        }
+        connector.report_failure(host, port);
+        failed.insert(host);
+    }
+}
+
+
+/** \brief Return a connection to the pool of idle connections.
+ *
+ * If the connection is still valid and the pool is not full, the
+ * connection is kept for the next message. Otherwise it gets closed.
+ *
+ * \param[in] c  The connection to release.
+ */
+void smtp_transport::release_connection(smtp_connection::pointer_t c)
+{
+    if(c == nullptr
+    || !c->is_connected())
+    {
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(f_mutex);
+        if(c->get_message_count() < f_max_messages_per_connection)
+        {
+            std::string const key(c->get_host() + ':' + std::to_string(c->get_port()));
+            auto & idle(f_idle_connections[key]);
+            if(idle.size() < f_max_idle_connections)
+            {
+                idle.push_back(c);
+                return;
+            }
+        }
+    }
+
+    c->quit();
+}
+
+
+/** \brief Send messages grouped by destination.
+ *
+ * Each message is sent once per destination domain (or once to the relay)
+ * with the recipients of that domain. The statuses of each part are then
+ * merged in one status per message.
+ *
+ * \param[in] messages  The messages to send.
+ *
+ * \return The status of each message.
+ */
+send_status_vector_t smtp_transport::send_grouped(message_ref_vector_t const & messages)
+{
+    bool const use_relay(!get_relay().empty());
+
+    // domain -> message index -> recipients in that domain
+    //
+    // (the std::map nodes do not move so the transactions can keep
+    // pointers to the lists of recipients)
+    //
+    std::map<std::string, std::map<std::size_t, string_list_t>> domains;
+    std::size_t const max(messages.size());
+    for(std::size_t idx(0); idx < max; ++idx)
+    {
+        string_list_t const & recipients(messages[idx].first->get_recipients());
+        if(recipients.empty())
+        {
+            throw missing_parameter("smtp_transport::send_messages(): called with a message without any recipients.");
+        }
+        for(auto const & r : recipients)
+        {
+            std::string domain;
+            if(!use_relay)
+            {
+                std::string::size_type const pos(r.rfind('@'));
+                if(pos == std::string::npos)
+                {
+                    throw invalid_parameter(
+                              "smtp_transport::send_messages(): recipient \""
+                            + r
+                            + "\" has no domain.");
+                }
+                domain = r.substr(pos + 1);
+            }
+            domains[domain][idx].push_back(r);
+        }
+    }
+
+    send_status_vector_t result(max, send_status_t::SEND_STATUS_NOT_SENT);
+    std::vector<bool> seen(max, false);
+    for(auto const & d : domains)
+    {
+        smtp_transaction::vector_t transactions;
+        transactions.reserve(d.second.size());
+        for(auto const & m : d.second)
+        {
+            transactions.emplace_back(
+                      messages[m.first].first->get_sender()
+                    , m.second
+                    , *messages[m.first].second);
+        }
+
+        send_to_domain(d.first, transactions);
+
+        std::size_t t(0);
+        for(auto const & m : d.second)
+        {
+            send_status_t const status(transactions[t].get_status());
+            ++t;
+            if(!seen[m.first])
+            {
+                seen[m.first] = true;
+                result[m.first] = status;
+            }
+            else
+            {
+                result[m.first] = merge_status(result[m.first], status);
+            }
+        }
+    }
+
+    return result;
+}
+
+
+/** \brief Send transactions to the servers of one domain.
+ *
+ * The function acquires a connection and sends all the transactions.
+ * If the connection gets lost before all the transactions were sent
+ * (i.e. an idle connection was closed by the server or the server limits
+ * the number of messages per connection), the function opens a new
+ * connection and sends the remaining transactions.
+ *
+ * Transactions which could not be sent at all end up with the
+ * SEND_STATUS_TEMPORARY_FAILURE status.
+ *
+ * \param[in] domain  The domain or an empty string for the relay.
+ * \param[in,out] transactions  The transactions to send.
+ */
+void smtp_transport::send_to_domain(
+      std::string const & domain
+    , smtp_transaction::vector_t & transactions)
+{
+    for(;;)
+    {
+        std::vector<std::size_t> positions;
+        smtp_transaction::vector_t pending;
+        for(std::size_t idx(0); idx < transactions.size(); ++idx)
+        {
+            if(transactions[idx].get_status() == send_status_t::SEND_STATUS_NOT_SENT)
+            {
+                positions.push_back(idx);
+                pending.push_back(transactions[idx]);
+            }
+        }
+        if(pending.empty())
+        {
+            return;
+        }
+
+        bool reused(false);
+        smtp_connection::pointer_t c(acquire_connection(domain, reused));
+        if(c == nullptr)
+        {
+            SNAP_LOG_ERROR
+                << "could not connect to any SMTP server for \""
+                << (domain.empty() ? get_relay() : domain)
+                << "\"."
+                << SNAP_LOG_SEND;
+            break;
+        }
+
+        c->send_transactions(pending);
+        release_connection(c);
+
+        std::size_t processed(0);
+        for(std::size_t idx(0); idx < pending.size(); ++idx)
+        {
+            if(pending[idx].get_status() != send_status_t::SEND_STATUS_NOT_SENT)
+            {
+                ++processed;
+            }
+            transactions[positions[idx]] = pending[idx];
+        }
+
+        // a new connection which could not send anything is not going to
+        // work better if we try again
+        //
+        if(processed == 0
+        && !reused)
+        {
+            break;
+        }
+    }
+
+    for(auto & t : transactions)
+    {
+        if(t.get_status() == send_status_t::SEND_STATUS_NOT_SENT)
+        {
+            t.set_status(send_status_t::SEND_STATUS_TEMPORARY_FAILURE);
+        }
+    }
+}
+
+
+/** \brief Merge the status of two parts of one message.
+ *
+ * When a message gets sent to multiple domains, each domain returns its
+ * own status. This function merges two of those statuses.
+ *
+ * \param[in] a  The first status.
+ * \param[in] b  The second status.
+ *
+ * \return The merged status.
+ */
+send_status_t smtp_transport::merge_status(send_status_t a, send_status_t b)
+{
+    if(a == b)
+    {
+        return a;
+    }
+
+    bool const a_sent(a == send_status_t::SEND_STATUS_SENT || a == send_status_t::SEND_STATUS_PARTIAL);
+    bool const b_sent(b == send_status_t::SEND_STATUS_SENT || b == send_status_t::SEND_STATUS_PARTIAL);
+    if(a_sent || b_sent)
+    {
+        return send_status_t::SEND_STATUS_PARTIAL;
+    }
+
+    // both failed, if either can be retried, then the message can be retried
+    //
+    return send_status_t::SEND_STATUS_TEMPORARY_FAILURE;
+}
+
+
+smtp_connection::pointer_t smtp_transport::get_idle_connection(std::string const & host, int port)
+{
+    std::lock_guard<std::mutex> lock(f_mutex);
+
+    auto it(f_idle_connections.find(host + ':' + std::to_string(port)));
+    if(it == f_idle_connections.end()
+    || it->second.empty())
+    {
+        return smtp_connection::pointer_t();
+    }
+
+    smtp_connection::pointer_t c(it->second.back());
+    it->second.pop_back();
+    return c;
+}
+
+
+mail_exchanger::mail_exchange_vector_t smtp_transport::get_mail_exchangers(std::string const & domain) const
+{
+    mail_exchangers const exchangers(domain);
+    if(!exchangers.domain_found())
+    {
+        return mail_exchanger::mail_exchange_vector_t();
+    }
+
+    mail_exchanger::mail_exchange_vector_t mx(exchangers.get_mail_exchangers());
+    std::stable_sort(mx.begin(), mx.end());
+
+    if(mx.empty())
+    {
+        // no MX, use the implicit MX (RFC 5321 section 5.1)
+        //
+        mx.emplace_back(0, domain);
+    }
+
+    return mx;
+}
+
+
+
+
+/** \brief Retrieve the default transport.
+ *
+ * The email::send() function without a transport parameter uses this
+ * transport. By default this is a sendmail_transport.
+ *
+ * \return The default transport.
+ */
+transport::pointer_t get_default_transport()
+{
+    std::lock_guard<std::mutex> lock(g_default_transport_mutex);
+    if(g_default_transport == nullptr)
+    {
+        g_default_transport = std::make_shared<sendmail_transport>();
+    }
+    return g_default_transport;
+}
+
+
+/** \brief Change the default transport.
+ *
+ * If you want all the emails to be sent using SMTP, create an
+ * smtp_transport and call this function with it:
+ *
+ * \code
+ *     libmimemail::smtp_transport::pointer_t smtp(std::make_shared<libmimemail::smtp_transport>());
+ *     smtp->set_relay("mail.example.com");
+ *     libmimemail::set_default_transport(smtp);
+ * \endcode
+ *
+ * Setting the transport to nullptr restores the sendmail transport.
+ *
+ * \param[in] t  The new default transport.
+ */
+void set_default_transport(transport::pointer_t t)
+{
+    std::lock_guard<std::mutex> lock(g_default_transport_mutex);
+    g_default_transport = t;
+}
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,200 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// self
+//
+#include    <libmimemail/mail_exchanger.h>
+#include    <libmimemail/smtp_connection.h>
+
+
+// C++
+//
+#include    <functional>
+#include    <map>
+#include    <mutex>
+
+
+
+namespace libmimemail
+{
+
+
+
+class envelope
+{
+public:
+    void                    set_sender(std::string const & sender);
+    std::string const &     get_sender() const;
+    void                    add_recipient(std::string const & recipient);
+    bool                    add_recipients(std::string const & addresses);
+    string_list_t const &   get_recipients() const;
+
+private:
+    std::string             f_sender = std::string();
+    string_list_t           f_recipients = string_list_t();
+};
+
+
+class rendered_email
+{
+public:
+    typedef std::vector<rendered_email>     vector_t;
+
+                            rendered_email();
+                            rendered_email(envelope const & env, std::string const & message);
+
+    envelope &              get_envelope();
+    envelope const &        get_envelope() const;
+    std::string &           get_message();
+    std::string const &     get_message() const;
+
+private:
+    envelope                f_envelope = envelope();
+    std::string             f_message = std::string();
+};
+
+
+class send_result
+{
+public:
+    typedef std::function<void(send_result const & result)>     callback_t;
+
+    void                    set_status(send_status_t status);
+    send_status_t           get_status() const;
+    void                    set_exit_code(int code);
+    int                     get_exit_code() const;
+    void                    set_error(std::string const & error);
+    std::string const &     get_error() const;
+
+private:
+    send_status_t           f_status = send_status_t::SEND_STATUS_NOT_SENT;
+    int                     f_exit_code = -1;
+    std::string             f_error = std::string();
+};
+
+
+class transport
+{
+public:
+    typedef std::shared_ptr<transport>      pointer_t;
+
+    virtual                 ~transport();
+
+    virtual bool            send_message(envelope const & env, std::string const & message) = 0;
+    virtual void            send_message_async(
+                                  envelope const & env
+                                , std::string && message
+                                , send_result::callback_t callback);
+    virtual send_status_vector_t
+                            send_messages(rendered_email::vector_t const & emails);
+    virtual bool            supports_8bitmime();
+};
+
+
+class sendmail_transport
+    : public transport
+{
+public:
+    typedef std::shared_ptr<sendmail_transport>     pointer_t;
+
+    void                    set_command(std::string const & command);
+    std::string const &     get_command() const;
+
+    virtual bool            send_message(envelope const & env, std::string const & message) override;
+    virtual void            send_message_async(
+                                  envelope const & env
+                                , std::string && message
+                                , send_result::callback_t callback) override;
+
+private:
+    std::string             f_command = std::string("sendmail");
+};
+
+
+class smtp_transport
+    : public transport
+{
+public:
+    typedef std::shared_ptr<smtp_transport>         pointer_t;
+
+    static constexpr std::size_t const  DEFAULT_MAX_IDLE_CONNECTIONS = 4;
+    static constexpr std::size_t const  DEFAULT_MAX_MESSAGES_PER_CONNECTION = 1000;
+
+    virtual                 ~smtp_transport() override;
+
+    void                    set_relay(std::string const & host, int port = smtp_connection::SMTP_DEFAULT_PORT);
+    std::string             get_relay() const;
+    void                    set_helo_name(std::string const & helo_name);
+    void                    set_tls_mode(tls_mode_t mode);
+    void                    set_verify_certificate(bool verify);
+    void                    set_timeout(int seconds);
+    void                    set_max_idle_connections(std::size_t max);
+    void                    set_max_messages_per_connection(std::size_t max);
+
+    virtual bool            send_message(envelope const & env, std::string const & message) override;
+    virtual send_status_vector_t
+                            send_messages(rendered_email::vector_t const & emails) override;
+    virtual bool            supports_8bitmime() override;
+
+    void                    close_connections();
+
+protected:
+    smtp_connection::pointer_t
+                            acquire_connection(std::string const & domain, bool & reused);
+    void                    release_connection(smtp_connection::pointer_t c);
+    void                    send_to_domain(
+                                  std::string const & domain
+                                , smtp_transaction::vector_t & transactions);
+
+private:
+    typedef std::map<std::string, std::vector<smtp_connection::pointer_t>>  connection_map_t;
+
+    typedef std::pair<envelope const *, std::string const *>    message_ref_t;
+    typedef std::vector<message_ref_t>                          message_ref_vector_t;
+
+    send_status_vector_t    send_grouped(message_ref_vector_t const & messages);
+    static send_status_t    merge_status(send_status_t a, send_status_t b);
+
+    smtp_connection::pointer_t
+                            get_idle_connection(std::string const & host, int port);
+    mail_exchanger::mail_exchange_vector_t
+                            get_mail_exchangers(std::string const & domain) const;
+
+    mutable std::mutex      f_mutex = std::mutex();
+    std::string             f_relay = std::string();
+    int                     f_relay_port = smtp_connection::SMTP_DEFAULT_PORT;
+    std::string             f_helo_name = std::string();
+    tls_mode_t              f_tls_mode = tls_mode_t::TLS_MODE_OPPORTUNISTIC;
+    bool                    f_verify_certificate = false;
+    int                     f_timeout = smtp_connection::SMTP_DEFAULT_TIMEOUT;
+    std::size_t             f_max_idle_connections = DEFAULT_MAX_IDLE_CONNECTIONS;
+    std::size_t             f_max_messages_per_connection = DEFAULT_MAX_MESSAGES_PER_CONNECTION;
+    connection_map_t        f_idle_connections = connection_map_t();
+    bool                    f_relay_checked = false;
+    bool                    f_relay_8bitmime = false;
+};
+
+
+transport::pointer_t        get_default_transport();
+void                        set_default_transport(transport::pointer_t t);
+
+
+
+} // namespace libmimemail
+// vim: ts=4 sw=4 et
@@ -0,0 +1,278 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Verify that render_parallel() gives the same result as render().
+ *
+ * The emails are rendered serially with email::render() and then all at
+ * once on the thread pool. The messages have to be the same byte for
+ * byte except for the multipart boundaries which are random and must
+ * all be different.
+ */
+
+// self
+//
+#include    "catch_main.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/email_batch.h>
+
+
+// C++
+//
+#include    <atomic>
+#include    <set>
+#include    <thread>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace
+{
+
+
+
+constexpr std::size_t const         g_email_count = 200;
+
+// the boundaries are this introducer followed by 20 random characters
+//
+constexpr char const                g_boundary_introducer[] = "=Snap.Websites=";
+constexpr std::size_t const         g_boundary_length = sizeof(g_boundary_introducer) - 1 + 20;
+constexpr char const                g_boundary_placeholder[] = "=Snap.Websites=--boundary--";
+
+
+// the emails are all different and about one in three has attachments
+// so the message is a multipart; the Date and the modification dates are
+// set so the rendering does not depend on the clock
+//
+std::vector<libmimemail::email> make_emails()
+{
+    std::vector<libmimemail::email> emails;
+    emails.reserve(g_email_count);
+    for(std::size_t idx(0); idx < g_email_count; ++idx)
+    {
+        std::string const n(std::to_string(idx));
+
+        libmimemail::email e;
+        e.set_from("Newsletter <news@example.com>");
+        e.set_to("User " + n + " <user" + n + "@example.org>");
+        e.set_subject("Message #" + n);
+        e.add_header("Date", "Wed, 14 Oct 2026 08:00:00 +0000");
+        e.set_email_key("key-" + n);
+
+        libmimemail::attachment body;
+        body.quoted_printable_encode_and_set_data(
+                  "<html><body><p>Hello user #" + n + ",</p>"
+                  "<p>" + std::string(idx * 7 % 300, 'x') + " = caf\xC3\xA9</p>"
+                  "</body></html>"
+                , "text/html");
+        e.set_body_attachment(body);
+
+        for(std::size_t a(0); a < idx % 3; ++a)
+        {
+            libmimemail::attachment attachment;
+            attachment.base64_encode_and_set_data(
+                      std::string(100 + idx * 13 % 1000, static_cast<char>('A' + a))
+                    , "application/octet-stream");
+            attachment.set_content_disposition(
+                      "file-" + n + "-" + std::to_string(a) + ".bin"
+                    , 1600000000);
+            e.add_attachment(attachment);
+        }
+
+        emails.push_back(e);
+    }
+    return emails;
+}
+
+
+// replace the boundary with a placeholder so two renderings of the same
+// email can be compared; the boundary is returned in \p boundary or the
+// empty string if the message is not a multipart
+//
+std::string normalize(std::string message, std::string & boundary)
+{
+    boundary.clear();
+    std::string::size_type pos(message.find(g_boundary_introducer));
+    if(pos == std::string::npos)
+    {
+        return message;
+    }
+    boundary = message.substr(pos, g_boundary_length);
+
+    std::string::size_type const placeholder_length(sizeof(g_boundary_placeholder) - 1);
+    while(pos != std::string::npos)
+    {
+        message.replace(pos, boundary.length(), g_boundary_placeholder);
+        pos = message.find(boundary, pos + placeholder_length);
+    }
+    return message;
+}
+
+
+struct serial_rendering
+{
+    std::vector<libmimemail::envelope>  f_envelopes = std::vector<libmimemail::envelope>();
+    std::vector<std::string>            f_messages = std::vector<std::string>();
+};
+
+
+serial_rendering render_serially(std::vector<libmimemail::email> const & emails)
+{
+    serial_rendering result;
+    result.f_envelopes.resize(emails.size());
+    result.f_messages.resize(emails.size());
+    for(std::size_t idx(0); idx < emails.size(); ++idx)
+    {
+        std::string message;
+        emails[idx].render(result.f_envelopes[idx], message);
+        std::string boundary;
+        result.f_messages[idx] = normalize(message, boundary);
+    }
+    return result;
+}
+
+
+// render the emails with render_parallel(), check the result against the
+// serial rendering and add the boundaries to \p boundaries
+//
+void check_parallel(
+      std::vector<libmimemail::email> const & emails
+    , serial_rendering const & expected
+    , std::size_t threads
+    , std::vector<std::string> & boundaries)
+{
+    std::vector<std::string> messages(emails.size());
+    std::vector<std::atomic<int>> calls(emails.size());
+    std::vector<libmimemail::envelope> const envelopes(libmimemail::render_parallel(
+              emails
+            , [&messages, &calls](std::size_t index)
+            {
+                ++calls[index];
+                return std::make_shared<libmimemail::buffer_mime_sink>(messages[index]);
+            }
+            , threads));
+
+    CATCH_REQUIRE(envelopes.size() == emails.size());
+    for(std::size_t idx(0); idx < emails.size(); ++idx)
+    {
+        CATCH_REQUIRE(calls[idx] == 1);
+        CATCH_REQUIRE(envelopes[idx].get_sender() == expected.f_envelopes[idx].get_sender());
+        CATCH_REQUIRE(envelopes[idx].get_recipients() == expected.f_envelopes[idx].get_recipients());
+
+        std::string boundary;
+        CATCH_REQUIRE(normalize(messages[idx], boundary) == expected.f_messages[idx]);
+        if(!boundary.empty())
+        {
+            boundaries.push_back(boundary);
+        }
+    }
+}
+
+
+
+} // no name namespace
+
+
+
+CATCH_TEST_CASE("email_render_parallel", "[email][thread]")
+{
+    CATCH_START_SECTION("email_render_parallel: same output as the serial rendering")
+    {
+        std::vector<libmimemail::email> const emails(make_emails());
+        serial_rendering const expected(render_serially(emails));
+        for(auto const & m : expected.f_messages)
+        {
+            CATCH_REQUIRE_FALSE(m.empty());
+        }
+
+        std::vector<std::string> boundaries;
+        for(std::size_t const threads : { 1, 2, 4, 8, 0 })
+        {
+            check_parallel(emails, expected, threads, boundaries);
+        }
+
+        CATCH_REQUIRE_FALSE(boundaries.empty());
+        std::set<std::string> const unique(boundaries.begin(), boundaries.end());
+        CATCH_REQUIRE(unique.size() == boundaries.size());
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("email_render_parallel: concurrent calls share the thread pool")
+    {
+        constexpr std::size_t const callers = 4;
+
+        std::vector<libmimemail::email> const emails(make_emails());
+        serial_rendering const expected(render_serially(emails));
+
+        // Catch2 is not thread safe so the callers only render and the
+        // results get checked once they are all done
+        //
+        std::vector<std::vector<std::string>> messages(callers);
+        std::vector<std::vector<libmimemail::envelope>> envelopes(callers);
+        std::vector<std::thread> threads;
+        for(std::size_t c(0); c < callers; ++c)
+        {
+            messages[c].resize(emails.size());
+            threads.emplace_back([&emails, &messages, &envelopes, c]()
+                {
+                    envelopes[c] = libmimemail::render_parallel(
+                              emails
+                            , [&messages, c](std::size_t index)
+                            {
+                                return std::make_shared<libmimemail::buffer_mime_sink>(messages[c][index]);
+                            }
+                            , 4);
+                });
+        }
+        for(auto & t : threads)
+        {
+            t.join();
+        }
+
+        std::vector<std::string> boundaries;
+        for(std::size_t c(0); c < callers; ++c)
+        {
+            CATCH_REQUIRE(envelopes[c].size() == emails.size());
+            for(std::size_t idx(0); idx < emails.size(); ++idx)
+            {
+                CATCH_REQUIRE(envelopes[c][idx].get_recipients() == expected.f_envelopes[idx].get_recipients());
+
+                std::string boundary;
+                CATCH_REQUIRE(normalize(messages[c][idx], boundary) == expected.f_messages[idx]);
+                if(!boundary.empty())
+                {
+                    boundaries.push_back(boundary);
+                }
+            }
+        }
+
+        std::set<std::string> const unique(boundaries.begin(), boundaries.end());
+        CATCH_REQUIRE(unique.size() == boundaries.size());
+    }
+    CATCH_END_SECTION()
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,60 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Entry point of the libmimemail unit tests.
+ *
+ * The tests are compiled in one executable, `unittest`, which ctest runs
+ * with no arguments. Run it with `--help` to see how to select tests.
+ */
+
+// self
+//
+#define CATCH_CONFIG_RUNNER
+#include    "catch_main.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/version.h>
+
+
+// libexcept
+//
+#include    <libexcept/exception.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+int main(int argc, char * argv[])
+{
+    return SNAP_CATCH2_NAMESPACE::snap_catch2_main(
+              "libmimemail"
+            , LIBMIMEMAIL_VERSION_STRING
+            , argc
+            , argv
+            , []() { libexcept::set_collect_stack(libexcept::collect_stack_t::COLLECT_STACK_NO); }
+        );
+}
+
+
+// vim: ts=4 sw=4 et
@@ -0,0 +1,37 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+#pragma once
+
+// catch2
+//
+#include    <catch2/snapcatch2.hpp>
+
+
+// C++
+//
+#include    <string>
+
+
+
+namespace SNAP_CATCH2_NAMESPACE
+{
+
+
+
+} // namespace SNAP_CATCH2_NAMESPACE
+// vim: ts=4 sw=4 et
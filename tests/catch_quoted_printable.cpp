@@ -0,0 +1,244 @@
+// Copyright (c) 2011-2022  Made to Order Software Corp.  All Rights Reserved.
+//
+// https://snapwebsites.org/project/libmimemail
+// contact@m2osw.com
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <https://www.gnu.org/licenses/>.
+
+/** \file
+ * \brief Verify the quoted-printable encoder against the edhttp one.
+ *
+ * The libmimemail encoder copies clean runs of bytes as is and fixes
+ * the end of each line afterward. These tests go through the cases
+ * that need special handling and check that the output is exactly the
+ * same as the output of edhttp::quoted_printable_encode(), that no line
+ * is longer than 76 characters, and that decoding gives back the input.
+ */
+
+// self
+//
+#include    "catch_main.h"
+
+
+// libmimemail
+//
+#include    <libmimemail/quoted_printable.h>
+
+
+// last include
+//
+#include    <snapdev/poison.h>
+
+
+
+namespace
+{
+
+
+
+int const g_flags[] =
+{
+    0,
+    edhttp::QUOTED_PRINTABLE_FLAG_LFONLY,
+    edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD,
+    edhttp::QUOTED_PRINTABLE_FLAG_LFONLY | edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD,
+};
+
+
+// the encoder outputs all the line ends, "\n" or "\r\n", as \p newline
+//
+std::string convert_newlines(std::string const & input, std::string const & newline)
+{
+    std::string result;
+    for(std::string::size_type idx(0); idx < input.length(); ++idx)
+    {
+        if(input[idx] == '\n')
+        {
+            result += newline;
+        }
+        else if(input[idx] == '\r'
+             && idx + 1 < input.length()
+             && input[idx + 1] == '\n')
+        {
+            result += newline;
+            ++idx;
+        }
+        else
+        {
+            result += input[idx];
+        }
+    }
+    return result;
+}
+
+
+void check_encode(std::string const & input, int flags)
+{
+    CATCH_INFO("input: \"" << input << "\", flags: " << flags);
+
+    std::string const encoded(libmimemail::quoted_printable_encode(input, flags));
+    CATCH_REQUIRE(encoded == edhttp::quoted_printable_encode(input, flags));
+
+    std::string const newline((flags & edhttp::QUOTED_PRINTABLE_FLAG_LFONLY) != 0 ? "\n" : "\r\n");
+    std::string::size_type start(0);
+    for(;;)
+    {
+        std::string::size_type const end(encoded.find(newline, start));
+        std::string const line(encoded.substr(start, end - start));
+        CATCH_REQUIRE(line.length() <= 76);
+        if(!line.empty())
+        {
+            CATCH_REQUIRE(line.back() != ' ');
+            CATCH_REQUIRE(line.back() != '\t');
+            if((flags & edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD) != 0)
+            {
+                CATCH_REQUIRE(line != ".");
+            }
+        }
+        if(end == std::string::npos)
+        {
+            break;
+        }
+        start = end + newline.length();
+    }
+
+    CATCH_REQUIRE(libmimemail::quoted_printable_decode(encoded) == convert_newlines(input, newline));
+}
+
+
+void check_encode(std::string const & input)
+{
+    for(int const flags : g_flags)
+    {
+        check_encode(input, flags);
+    }
+}
+
+
+
+} // no name namespace
+
+
+
+CATCH_TEST_CASE("quoted_printable_encode", "[encoding]")
+{
+    CATCH_START_SECTION("quoted_printable_encode: space or tab before a line end")
+    {
+        for(char const * const end : { "", "\n", "\r\n" })
+        {
+            check_encode(std::string("abc ") + end);
+            check_encode(std::string("abc\t") + end);
+            check_encode(std::string("abc \t ") + end + "def");
+            check_encode(std::string(" ") + end);
+            check_encode(std::string("\t") + end + "\t" + end);
+
+            // the encoded space does not fit on the line anymore
+            //
+            check_encode(std::string(73, 'a') + " " + end);
+            check_encode(std::string(74, 'a') + " " + end);
+            check_encode(std::string(75, 'a') + "\t" + end);
+        }
+
+        // the spaces in the middle of a line stay as is
+        //
+        CATCH_REQUIRE(libmimemail::quoted_printable_encode("a b\tc", 0) == "a b\tc");
+        CATCH_REQUIRE(libmimemail::quoted_printable_encode("a \nb", edhttp::QUOTED_PRINTABLE_FLAG_LFONLY) == "a=20\nb");
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("quoted_printable_encode: a line with just a period")
+    {
+        for(char const * const end : { "", "\n", "\r\n" })
+        {
+            check_encode(std::string(".") + end);
+            check_encode(std::string("a") + end + "." + end + "b");
+            check_encode(std::string("..") + end);
+            check_encode(std::string(". ") + end);
+            check_encode(std::string(" .") + end);
+
+            // the period lands alone on the line after a soft line break
+            //
+            check_encode(std::string(75, 'a') + "." + end);
+        }
+
+        CATCH_REQUIRE(libmimemail::quoted_printable_encode("a\n.\nb", edhttp::QUOTED_PRINTABLE_FLAG_LFONLY) == "a\n.\nb");
+        CATCH_REQUIRE(libmimemail::quoted_printable_encode(
+                  "a\n.\nb"
+                , edhttp::QUOTED_PRINTABLE_FLAG_LFONLY | edhttp::QUOTED_PRINTABLE_FLAG_NO_LONE_PERIOD) == "a\n=2E\nb");
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("quoted_printable_encode: lines of 75 and 76 characters")
+    {
+        for(std::size_t length(74); length <= 77; ++length)
+        {
+            for(char const * const end : { "", "\n", "\r\n" })
+            {
+                check_encode(std::string(length, 'a') + end);
+                check_encode(std::string(length, 'a') + end + std::string(length, 'b'));
+                check_encode(std::string(length - 1, 'a') + "=" + end);
+                check_encode(std::string(length - 2, 'a') + "\xE9" + "b" + end);
+            }
+        }
+        check_encode(std::string(75 * 4, 'a'));
+        check_encode(std::string(76 * 4, 'a'));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("quoted_printable_encode: '=' at the SIMD block boundaries")
+    {
+        // the kernels look at 16 (SSE2, NEON) or 32 (AVX2) bytes at a time
+        //
+        for(std::size_t offset(0); offset <= 66; ++offset)
+        {
+            check_encode(std::string(offset, 'a') + "=" + std::string(80, 'b'));
+            check_encode(std::string(offset, 'a') + "==" + std::string(80, 'b'));
+            check_encode(std::string(offset, 'a') + "=");
+        }
+        check_encode(std::string(100, '='));
+    }
+    CATCH_END_SECTION()
+
+    CATCH_START_SECTION("quoted_printable_encode: CRLF and LF line ends")
+    {
+        check_encode("a\r\nb\nc");
+        check_encode("a\nb\r\nc\r\n");
+        check_encode("a\rb");
+        check_encode("a\r\r\nb");
+        check_encode("a\n\rb");
+        check_encode("\r");
+        check_encode("\r\n\r\n\n\n");
+        check_encode(std::string(74, 'a') + "\r\n" + std::string(74, 'b') + "\n");
+
+        // both line ends give the same output
+        //
+        for(int const flags : g_flags)
+        {
+            CATCH_REQUIRE(libmimemail::quoted_printable_encode("a \r\nb.\r\n.\r\n", flags)
+                       == libmimemail::quoted_printable_encode("a \nb.\n.\n", flags));
+        }
+
+        // with BINARY the line ends are data
+        //
+        std::string const binary("a\r\nb\nc\r");
+        std::string const encoded(libmimemail::quoted_printable_encode(binary, edhttp::QUOTED_PRINTABLE_FLAG_BINARY));
+        CATCH_REQUIRE(encoded == edhttp::quoted_printable_encode(binary, edhttp::QUOTED_PRINTABLE_FLAG_BINARY));
+        CATCH_REQUIRE(encoded == "a=0D=0Ab=0Ac=0D");
+        CATCH_REQUIRE(libmimemail::quoted_printable_decode(encoded) == binary);
+    }
+    CATCH_END_SECTION()
+}
+
+
+// vim: ts=4 sw=4 et